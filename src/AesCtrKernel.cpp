@@ -0,0 +1,284 @@
+#include "AesCtrKernel.h"
+
+#include <openssl/evp.h>
+
+#include <boost/log/trivial.hpp>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+constexpr uint64_t CTRS_PER_BLOCK = BLOCK_SIZE / 16;
+
+#if defined(__x86_64__)
+__attribute__((target("aes,sse4.1"))) __m128i expand_step_1(__m128i key,
+                                                            __m128i assist) {
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+__attribute__((target("aes,sse4.1"))) __m128i expand_step_2(__m128i prev,
+                                                            __m128i key) {
+    const auto assist =
+        _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0x00), 0xaa);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+// AES-256 key schedule, 15 round keys
+__attribute__((target("aes,sse4.1"))) void expand_key(const uint8_t* key,
+                                                      uint8_t* round_keys) {
+    auto rk = reinterpret_cast<__m128i*>(round_keys);
+    auto k1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key));
+    auto k2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(key + 16));
+    rk[0] = k1;
+    rk[1] = k2;
+    // the rcon operand of aeskeygenassist must be an immediate
+    k1 = expand_step_1(k1, _mm_aeskeygenassist_si128(k2, 0x01));
+    k2 = expand_step_2(k1, k2);
+    rk[2] = k1;
+    rk[3] = k2;
+    k1 = expand_step_1(k1, _mm_aeskeygenassist_si128(k2, 0x02));
+    k2 = expand_step_2(k1, k2);
+    rk[4] = k1;
+    rk[5] = k2;
+    k1 = expand_step_1(k1, _mm_aeskeygenassist_si128(k2, 0x04));
+    k2 = expand_step_2(k1, k2);
+    rk[6] = k1;
+    rk[7] = k2;
+    k1 = expand_step_1(k1, _mm_aeskeygenassist_si128(k2, 0x08));
+    k2 = expand_step_2(k1, k2);
+    rk[8] = k1;
+    rk[9] = k2;
+    k1 = expand_step_1(k1, _mm_aeskeygenassist_si128(k2, 0x10));
+    k2 = expand_step_2(k1, k2);
+    rk[10] = k1;
+    rk[11] = k2;
+    k1 = expand_step_1(k1, _mm_aeskeygenassist_si128(k2, 0x20));
+    k2 = expand_step_2(k1, k2);
+    rk[12] = k1;
+    rk[13] = k2;
+    rk[14] = expand_step_1(k1, _mm_aeskeygenassist_si128(k2, 0x40));
+}
+
+// 8 counter blocks in flight, enough to cover the aesenc latency
+__attribute__((target("aes,sse4.1"))) void crypt_aesni(
+    const uint8_t* round_keys, uint64_t nonce, const uint8_t* const* in,
+    uint8_t* const* out, const uint64_t* block_nos, size_t n) {
+    constexpr int LANES = 8;
+    __m128i rk[15];
+    for (int r = 0; r < 15; r++) {
+        rk[r] = _mm_load_si128(
+            reinterpret_cast<const __m128i*>(round_keys + r * 16));
+    }
+    // counters are kept little endian in the high half and byte swapped into
+    // the big endian layout of the counter block
+    const auto bswap_high = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 7, 6,
+                                         5, 4, 3, 2, 1, 0);
+    const auto one = _mm_set_epi64x(1, 0);
+
+    for (size_t b = 0; b < n; b++) {
+        auto ctr = _mm_set_epi64x(
+            static_cast<long long>(block_nos[b] * CTRS_PER_BLOCK),
+            static_cast<long long>(nonce));
+        for (uint64_t i = 0; i < CTRS_PER_BLOCK; i += LANES) {
+            __m128i s[LANES];
+#pragma GCC unroll 8
+            for (int l = 0; l < LANES; l++) {
+                s[l] = _mm_xor_si128(_mm_shuffle_epi8(ctr, bswap_high), rk[0]);
+                ctr = _mm_add_epi64(ctr, one);
+            }
+#pragma GCC unroll 13
+            for (int r = 1; r < 14; r++) {
+#pragma GCC unroll 8
+                for (int l = 0; l < LANES; l++) {
+                    s[l] = _mm_aesenc_si128(s[l], rk[r]);
+                }
+            }
+            const auto src = reinterpret_cast<const __m128i*>(in[b]) + i;
+            const auto dst = reinterpret_cast<__m128i*>(out[b]) + i;
+#pragma GCC unroll 8
+            for (int l = 0; l < LANES; l++) {
+                s[l] = _mm_aesenclast_si128(s[l], rk[14]);
+                _mm_storeu_si128(dst + l,
+                                 _mm_xor_si128(_mm_loadu_si128(src + l), s[l]));
+            }
+        }
+    }
+}
+
+// 4 counter blocks per zmm register, 4 registers in flight
+__attribute__((target("vaes,avx512f,avx512bw"))) void crypt_vaes(
+    const uint8_t* round_keys, uint64_t nonce, const uint8_t* const* in,
+    uint8_t* const* out, const uint64_t* block_nos, size_t n) {
+    constexpr int VECS = 4;
+    constexpr int LANES = VECS * 4;
+    __m512i rk[15];
+    for (int r = 0; r < 15; r++) {
+        rk[r] = _mm512_broadcast_i32x4(_mm_load_si128(
+            reinterpret_cast<const __m128i*>(round_keys + r * 16)));
+    }
+    const auto bswap_high = _mm512_broadcast_i32x4(_mm_set_epi8(
+        8, 9, 10, 11, 12, 13, 14, 15, 7, 6, 5, 4, 3, 2, 1, 0));
+    const auto lane_offsets = _mm512_set_epi64(3, 0, 2, 0, 1, 0, 0, 0);
+    const auto four = _mm512_set_epi64(4, 0, 4, 0, 4, 0, 4, 0);
+
+    for (size_t b = 0; b < n; b++) {
+        auto ctr = _mm512_add_epi64(
+            _mm512_broadcast_i32x4(_mm_set_epi64x(
+                static_cast<long long>(block_nos[b] * CTRS_PER_BLOCK),
+                static_cast<long long>(nonce))),
+            lane_offsets);
+        for (uint64_t i = 0; i < CTRS_PER_BLOCK; i += LANES) {
+            __m512i s[VECS];
+#pragma GCC unroll 4
+            for (int v = 0; v < VECS; v++) {
+                s[v] = _mm512_xor_si512(_mm512_shuffle_epi8(ctr, bswap_high),
+                                        rk[0]);
+                ctr = _mm512_add_epi64(ctr, four);
+            }
+#pragma GCC unroll 13
+            for (int r = 1; r < 14; r++) {
+#pragma GCC unroll 4
+                for (int v = 0; v < VECS; v++) {
+                    s[v] = _mm512_aesenc_epi128(s[v], rk[r]);
+                }
+            }
+            const auto src = in[b] + i * 16;
+            const auto dst = out[b] + i * 16;
+#pragma GCC unroll 4
+            for (int v = 0; v < VECS; v++) {
+                s[v] = _mm512_aesenclast_epi128(s[v], rk[14]);
+                _mm512_storeu_si512(
+                    dst + v * 64,
+                    _mm512_xor_si512(_mm512_loadu_si512(src + v * 64), s[v]));
+            }
+        }
+    }
+}
+#endif
+}  // namespace
+
+AesCtrKernel::AesCtrKernel(const std::array<uint8_t, KEY_SIZE>& key,
+                           const std::array<uint8_t, USER_IV_SIZE>& nonce,
+                           Impl impl)
+    : key(key), nonce(nonce), impl(impl) {
+    if (!supported(impl)) {
+        BOOST_LOG_TRIVIAL(warning)
+            << name(impl) << " AES kernel not supported on this CPU"
+            << std::endl;
+        this->impl = PORTABLE;
+    }
+#if defined(__x86_64__)
+    if (this->impl != PORTABLE) {
+        expand_key(key.data(), round_keys.data());
+    }
+#endif
+}
+
+void AesCtrKernel::crypt(const uint8_t* const* in, uint8_t* const* out,
+                         const uint64_t* block_nos, size_t n) const {
+#if defined(__x86_64__)
+    uint64_t iv;
+    static_assert(sizeof(iv) == USER_IV_SIZE);
+    memcpy(&iv, nonce.data(), sizeof(iv));
+    switch (impl) {
+        case VAES:
+            crypt_vaes(round_keys.data(), iv, in, out, block_nos, n);
+            return;
+        case AESNI:
+            crypt_aesni(round_keys.data(), iv, in, out, block_nos, n);
+            return;
+        case PORTABLE:
+            break;
+    }
+#endif
+    crypt_portable(in, out, block_nos, n);
+}
+
+void AesCtrKernel::crypt_portable(const uint8_t* const* in,
+                                  uint8_t* const* out,
+                                  const uint64_t* block_nos, size_t n) const {
+    auto ctx = EVP_CIPHER_CTX_new();
+    if (ctx == nullptr ||
+        1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), nullptr, key.data(),
+                                nullptr)) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Failed to initialize encryption" << std::endl;
+        EVP_CIPHER_CTX_free(ctx);
+        throw std::runtime_error("Failed to initialize encryption");
+    }
+
+    // consecutive blocks of one extent take a single EVP call
+    for (size_t b = 0, run = 1; b < n; b += run) {
+        for (run = 1; b + run < n && block_nos[b + run] == block_nos[b] + run &&
+                      in[b + run] == in[b] + run * BLOCK_SIZE &&
+                      out[b + run] == out[b] + run * BLOCK_SIZE;
+             run++) {
+        }
+
+        // nonce || big endian counter of the first 16 byte block
+        std::array<uint8_t, 16> iv{};
+        std::copy(nonce.begin(), nonce.end(), iv.begin());
+        const auto ctr = block_nos[b] * CTRS_PER_BLOCK;
+        for (size_t i = 0; i < sizeof(ctr); i++) {
+            iv[15 - i] = ctr >> (i * 8) & 0xFF;
+        }
+
+        int out_len = 0;
+        if (1 != EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr,
+                                    iv.data()) ||
+            1 != EVP_EncryptUpdate(ctx, out[b], &out_len, in[b],
+                                   static_cast<int>(run * BLOCK_SIZE))) {
+            BOOST_LOG_TRIVIAL(error) << "Failed to encrypt update" << std::endl;
+        }
+        BOOST_ASSERT_MSG(out_len == static_cast<int>(run * BLOCK_SIZE),
+                         "Encrypted size must be equal to the input size");
+    }
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+AesCtrKernel::Impl AesCtrKernel::detect() {
+    if (supported(VAES)) return VAES;
+    if (supported(AESNI)) return AESNI;
+    return PORTABLE;
+}
+
+bool AesCtrKernel::supported(Impl impl) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    const bool aesni = __builtin_cpu_supports("aes") &&
+                       __builtin_cpu_supports("sse4.1");
+    switch (impl) {
+        case VAES:
+            return aesni && __builtin_cpu_supports("vaes") &&
+                   __builtin_cpu_supports("avx512f") &&
+                   __builtin_cpu_supports("avx512bw");
+        case AESNI:
+            return aesni;
+        case PORTABLE:
+            return true;
+    }
+#endif
+    return impl == PORTABLE;
+}
+
+const char* AesCtrKernel::name(Impl impl) {
+    switch (impl) {
+        case VAES:
+            return "VAES/AVX-512";
+        case AESNI:
+            return "AES-NI";
+        case PORTABLE:
+            return "portable";
+    }
+    return "unknown";
+}
@@ -0,0 +1,42 @@
+#ifndef AES_CTR_KERNEL_H
+#define AES_CTR_KERNEL_H
+
+#include <array>
+#include <cstdint>
+
+#include "consts.h"
+
+// AES-256-CTR over whole blocks. Block b uses the counter stream
+// nonce || be64(b * BLOCK_SIZE / 16), the same as one EVP call per block, but
+// a batch of blocks shares one key schedule and the SIMD kernels keep many
+// counter blocks in flight across block boundaries.
+class AesCtrKernel {
+   public:
+    enum Impl { PORTABLE, AESNI, VAES };
+
+   private:
+    std::array<uint8_t, KEY_SIZE> key;
+    std::array<uint8_t, USER_IV_SIZE> nonce;
+    alignas(64) std::array<uint8_t, 15 * 16> round_keys{};
+    Impl impl;
+
+    void crypt_portable(const uint8_t* const* in, uint8_t* const* out,
+                        const uint64_t* block_nos, size_t n) const;
+
+   public:
+    AesCtrKernel(const std::array<uint8_t, KEY_SIZE>& key,
+                 const std::array<uint8_t, USER_IV_SIZE>& nonce,
+                 Impl impl = detect());
+    // xor the key stream of each block_nos[i] into in[i], writing out[i].
+    // Encryption and decryption are the same operation, in may equal out
+    void crypt(const uint8_t* const* in, uint8_t* const* out,
+               const uint64_t* block_nos, size_t n) const;
+    Impl get_impl() const { return impl; }
+
+    // fastest implementation supported by this CPU
+    static Impl detect();
+    static bool supported(Impl impl);
+    static const char* name(Impl impl);
+};
+
+#endif
@@ -1,16 +1,85 @@
 #include "AsyncOperationQueue.h"
 
+#include <boost/format.hpp>
 #include <boost/log/trivial.hpp>
+#include <thread>
+
+AsyncOperationQueue::AsyncOperationQueue(const Config& config)
+    : queue(config.queue_size),
+      filled_slots(0),
+      empty_slots((long)config.queue_size),
+      cap(config.queue_size),
+      policy(config.overflow_policy),
+      overflow_timeout(config.overflow_timeout_ms),
+      throttle_target(config.queue_size * config.throttle_target / 100),
+      spilled(config.n_blocks) {}
 
 void AsyncOperationQueue::push(const std::shared_ptr<WriteOperation>& op) {
-    empty_slots.acquire();
+    if (op->barrier) {
+        empty_slots.acquire();
+        queue.push(op);
+        filled_slots.release();
+        return;
+    }
+    switch (policy) {
+        case OverflowPolicy::BLOCK:
+            empty_slots.acquire();
+            break;
+        case OverflowPolicy::BLOCK_TIMEOUT:
+            // only the first write waits, the rest spill until we catch up
+            if (spilling.load()) {
+                spill(op);
+                return;
+            }
+            if (!empty_slots.try_acquire_for(overflow_timeout)) {
+                BOOST_LOG_TRIVIAL(warning)
+                    << boost::format(
+                           "Replication queue full for %1%ms, backup is "
+                           "falling behind") %
+                           overflow_timeout.count()
+                    << std::endl;
+                spill(op);
+                return;
+            }
+            break;
+        case OverflowPolicy::THROTTLE:
+            throttle();
+            [[fallthrough]];
+        case OverflowPolicy::SPILL:
+            if (!empty_slots.try_acquire()) {
+                spill(op);
+                return;
+            }
+            break;
+    }
     queue.push(op);
     filled_slots.release();
 }
 
-std::optional<std::shared_ptr<WriteOperation>> AsyncOperationQueue::pop() {
-    if (!filled_slots.try_acquire_for(std::chrono::seconds(1)))
-        return std::nullopt;
+std::optional<std::shared_ptr<WriteOperation>> AsyncOperationQueue::pop(
+    bool wait) {
+    // queued operations first, then whatever was spilled while we were behind,
+    // which was written before a barrier at the front
+    const bool spilled_first = spilled.count() > 0 &&
+                               queue.read_available() > 0 &&
+                               queue.front()->barrier;
+    if (spilled_first || !filled_slots.try_acquire()) {
+        in_progress++;
+        if (const auto range = spilled.pop_range(SPILL_RANGE_MAX)) {
+            if (spilled.count() == 0 && spilling.exchange(false)) {
+                BOOST_LOG_TRIVIAL(info)
+                    << "Replication caught up with spilled blocks"
+                    << std::endl;
+            }
+            return std::make_shared<WriteOperation>(range->first,
+                                                    range->second);
+        }
+        done();
+        if (!wait || !filled_slots.try_acquire_for(std::chrono::seconds(1)))
+            return std::nullopt;
+    }
+    // counted before it leaves the queue, so idle() never misses it
+    in_progress++;
     if (queue.empty()) {
         BOOST_LOG_TRIVIAL(fatal) << "nothing in the queue" << std::endl;
     }
@@ -18,4 +87,45 @@ std::optional<std::shared_ptr<WriteOperation>> AsyncOperationQueue::pop() {
     queue.pop();
     empty_slots.release();
     return op;
-}
\ No newline at end of file
+}
+
+void AsyncOperationQueue::done() {
+    {
+        std::lock_guard guard(idle_lock);
+        in_progress--;
+    }
+    idle_changed.notify_all();
+}
+
+// the queue only becomes idle in done(), as every operation is counted in
+// progress before it leaves the queue or the bitmap
+void AsyncOperationQueue::wait_idle() {
+    std::unique_lock guard(idle_lock);
+    idle_changed.wait(guard, [this] { return idle(); });
+}
+
+bool AsyncOperationQueue::idle() const {
+    return queue.write_available() == cap && spilled.count() == 0 &&
+           in_progress.load() == 0;
+}
+
+void AsyncOperationQueue::spill(const std::shared_ptr<WriteOperation>& op) {
+    if (!spilling.exchange(true)) {
+        BOOST_LOG_TRIVIAL(warning)
+            << "Replication queue full, spilling writes to dirty bitmap"
+            << std::endl;
+    }
+    spilled.set_range(op->block_no_start, op->block_no_end);
+}
+
+void AsyncOperationQueue::throttle() {
+    // delay grows linearly from 0 at the target depth to the max delay at a
+    // full queue, so the backlog settles around the target instead of the cap
+    const auto depth = cap - queue.write_available();
+    if (depth <= throttle_target || cap <= throttle_target) {
+        return;
+    }
+    const auto delay = THROTTLE_MAX_DELAY_US * (depth - throttle_target) /
+                       (cap - throttle_target);
+    std::this_thread::sleep_for(std::chrono::microseconds(delay));
+}
@@ -1,33 +1,69 @@
 #ifndef ASYNC_OPERATION_QUEUE_H
 #define ASYNC_OPERATION_QUEUE_H
+#include <atomic>
 #include <boost/lockfree/spsc_queue.hpp>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <queue>
 #include <semaphore>
 #include <vector>
 
+#include "BlockBitmap.h"
 #include "consts.h"
+#include "types.h"
 
 struct WriteOperation {
     uint64_t block_no_start;
     uint64_t block_no_end;
+    uint64_t trace_id = 0;  // NBD request, while tracing
+    uint64_t queued = 0;  // ns, while tracing
+    // no blocks, ends an epoch: every write before it is replicated first
+    bool barrier = false;
+    // the bytes written, whole blocks if length is 0
+    uint64_t offset = 0;
+    uint32_t length = 0;
 };
 
 typedef boost::lockfree::spsc_queue<std::shared_ptr<WriteOperation>>
     OperationQueue;
 
+// Queue between the NBD writer and the backup daemon. When the queue is full
+// the overflow policy decides whether the writer waits or the operation is
+// spilled into a dirty block bitmap that the daemon drains once it catches up.
+// A barrier always waits for a slot and comes out after the spilled blocks.
 class AsyncOperationQueue {
     OperationQueue queue;
     std::counting_semaphore<SPSC_SIZE> filled_slots;
     std::counting_semaphore<SPSC_SIZE> empty_slots;
     size_t cap;
 
+    OverflowPolicy policy;
+    std::chrono::milliseconds overflow_timeout;
+    size_t throttle_target;
+    BlockBitmap spilled;
+    std::atomic<bool> spilling{false};
+    std::atomic<int> in_progress{0};  // popped, not done yet
+    std::mutex idle_lock;
+    std::condition_variable idle_changed;  // the last operation is done
+
+    void spill(const std::shared_ptr<WriteOperation>& op);
+    void throttle();
+
    public:
-    explicit AsyncOperationQueue(size_t size)
-        : filled_slots(0), empty_slots((long)size), queue(size), cap(size) {}
+    explicit AsyncOperationQueue(const Config& config);
     void push(const std::shared_ptr<WriteOperation>& op);
-    std::optional<std::shared_ptr<WriteOperation>> pop();
+    // waits up to a second for an operation unless wait is false
+    std::optional<std::shared_ptr<WriteOperation>> pop(bool wait = true);
+    // the consumer finished one of the operations it popped
+    void done();
+    // whether every pushed operation is done, called by the producer
+    bool idle() const;
+    // until every pushed operation is done, called by the producer
+    void wait_idle();
+    // number of blocks waiting in the spill bitmap
+    uint64_t spilled_blocks() const { return spilled.count(); }
 };
 
 #endif
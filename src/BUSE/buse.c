@@ -86,6 +86,13 @@ static int write_all(int fd, char* buf, size_t count) {
 }
 
 /* Signal handler to gracefully disconnect from nbd kernel driver. */
+/* Handle of the request the operations are called for. */
+static __thread u_int64_t current_handle;
+
+u_int64_t buse_request_handle(void) { return current_handle; }
+
+void buse_set_request_handle(u_int64_t handle) { current_handle = handle; }
+
 static int nbd_dev_to_disconnect = -1;
 static void disconnect_nbd(int signal) {
     (void)signal;
@@ -126,6 +133,7 @@ static int serve_nbd(int sk, const struct buse_operations* aop,
     while ((bytes_read = read(sk, &request, sizeof(request))) > 0) {
         assert(bytes_read == sizeof(request));
         memcpy(reply.handle, request.handle, sizeof(reply.handle));
+        memcpy(&current_handle, request.handle, sizeof(current_handle));
         reply.error = htonl(0);
 
         len = ntohl(request.len);
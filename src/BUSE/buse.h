@@ -24,6 +24,12 @@ struct buse_operations {
 int buse_main(const char *dev_file, const struct buse_operations *bop,
               void *userdata);
 
+/* The NBD handle of the request being served, for tracing. */
+u_int64_t buse_request_handle(void);
+
+/* Set by front ends other than buse_main before calling the operations. */
+void buse_set_request_handle(u_int64_t handle);
+
 #ifdef __cplusplus
 }
 #endif
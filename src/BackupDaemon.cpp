@@ -4,62 +4,258 @@
 
 #include <boost/format.hpp>
 #include <boost/log/trivial.hpp>
+#include <algorithm>
+#include <climits>
+#include <optional>
 #include <thread>
 
 #include "AsyncOperationQueue.h"
-#include "BackupServer.grpc.pb.h"
+#include "Extent.h"
+#include "Trace.h"
+#include "UringFile.h"
 
-using grpc::ClientContext;
-using grpc::ClientWriter;
+namespace {
+// extents of one batch to read from the local file
+template <typename E>
+struct LocalBatch {
+    const WriteOperation *op;
+    uint64_t start;
+    std::vector<typename E::Data> extents;
+    // set if only these bytes of the only extent are sent
+    uint32_t offset = 0;
+    uint32_t length = 0;
+};
+
+// encrypt a batch read from the local file and hand it to the replicas
+template <typename E>
+void replicate(LocalBatch<E> &local, EncryptionManager &emgr,
+               ReplicaSet &replicas, FingerprintCache *fingerprints) {
+    const auto &op = *local.op;
+    const auto batch_start = local.start;
+    const auto n = local.extents.size();
+    auto &extents = local.extents;
+
+    // skip rewrites of content the server already has
+    std::vector<uint64_t> extent_nos;
+    std::vector<Fingerprint> fps;
+    for (uint64_t i = 0; i < n; i++) {
+        const auto extent_no = batch_start + i;
+        if (fingerprints != nullptr) {
+            const auto fp = fingerprints->compute(extents[i]);
+            if (fingerprints->matches(extent_no, fp)) {
+                BOOST_LOG_TRIVIAL(debug)
+                    << "Extent " << extent_no << " unchanged, skipped"
+                    << std::endl;
+                continue;
+            }
+            fps.push_back(fp);
+        }
+        if (extent_nos.size() != i) {
+            extents[extent_nos.size()] = extents[i];
+        }
+        extent_nos.push_back(extent_no);
+    }
+    extents.resize(extent_nos.size());
+    if (extent_nos.empty()) {
+        return;
+    }
+
+    // encrypt the batch in place, of a partial extent only the blocks sent
+    {
+        Trace::Span span(Trace::ENCRYPT, op.trace_id, batch_start * E::blocks,
+                         n * E::blocks);
+        if (local.length > 0) {
+            emgr.crypt_range(extents[0], extent_nos[0], local.offset,
+                             local.length);
+        } else {
+            emgr.crypt_extents(extents, extent_nos);
+        }
+    }
+
+    // a replica that cannot take the batch resends the extents from the
+    // local file, so they end up on every server either way
+    if (fingerprints != nullptr) {
+        for (size_t i = 0; i < extent_nos.size(); i++) {
+            fingerprints->store(extent_nos[i], fps[i]);
+        }
+    }
+    const auto encrypted =
+        std::make_shared<std::vector<typename E::Data>>(std::move(extents));
+    replicas.send({.extent_nos = std::move(extent_nos),
+                   .data = encrypted->front().data(),
+                   .owner = encrypted,
+                   .trace_id = op.trace_id,
+                   .offset = local.offset,
+                   .length = local.length});
+}
+
+// extents covering the blocks of one or more operations
+struct ExtentRange {
+    uint64_t first;
+    uint64_t last;
+    const WriteOperation *op;  // the first one, for tracing
+    // bytes the operations wrote, end is 0 if one wrote whole blocks
+    uint64_t start;
+    uint64_t end;
+};
+
+// replicate the extents covering the blocks of ops, all of one epoch
+template <typename E>
+void replicate(const std::vector<std::shared_ptr<WriteOperation>> &ops,
+               int img_fd, UringFile *io, EncryptionManager &emgr,
+               ReplicaSet &replicas, FingerprintCache *fingerprints) {
+    // the extents are read after all of the writes, so overlapping and
+    // adjacent ones are read and sent once
+    std::vector<ExtentRange> ranges;
+    for (const auto &op : ops) {
+        ranges.push_back({op->block_no_start / E::blocks,
+                          op->block_no_end / E::blocks, op.get(), op->offset,
+                          op->length > 0 ? op->offset + op->length : 0});
+    }
+    std::stable_sort(ranges.begin(), ranges.end(),
+                     [](const ExtentRange &a, const ExtentRange &b) {
+                         return a.first < b.first;
+                     });
+    std::vector<ExtentRange> merged;
+    for (const auto &range : ranges) {
+        if (!merged.empty() && range.first <= merged.back().last + 1) {
+            auto &back = merged.back();
+            back.last = std::max(back.last, range.last);
+            back.start = std::min(back.start, range.start);
+            back.end = back.end != 0 && range.end != 0
+                           ? std::max(back.end, range.end)
+                           : 0;
+        } else {
+            merged.push_back(range);
+        }
+    }
+
+    // writes within one extent send the bytes they wrote, CTR mode encrypts
+    // them the same without the rest of the extent
+    std::vector<LocalBatch<E>> batches;
+    for (const auto &range : merged) {
+        const auto base = range.first * E::size;
+        const bool partial =
+            replicas.partial() && range.first == range.last &&
+            range.end != 0 && range.end - range.start < E::size;
+        for (auto batch_start = range.first; batch_start <= range.last;
+             batch_start += E::batch) {
+            const auto n =
+                std::min<uint64_t>(E::batch, range.last - batch_start + 1);
+            batches.push_back(
+                {.op = range.op,
+                 .start = batch_start,
+                 .extents = std::vector<typename E::Data>(n),
+                 .offset = partial ? static_cast<uint32_t>(range.start - base)
+                                   : 0,
+                 .length = partial
+                               ? static_cast<uint32_t>(range.end - range.start)
+                               : 0});
+        }
+    }
+
+    // io_uring reads all batches at once, adjacent ones in one vectored read
+    std::vector<iovec> iovs(batches.size());
+    std::vector<size_t> reads(batches.size());
+    if (io != nullptr) {
+        for (size_t i = 0; i < batches.size();) {
+            auto j = i;
+            do {
+                iovs[j] = {batches[j].extents.data(),
+                           batches[j].extents.size() * E::size};
+                j++;
+            } while (j < batches.size() && j - i < IOV_MAX &&
+                     batches[j].start ==
+                         batches[j - 1].start + batches[j - 1].extents.size());
+            const auto read = io->readv(&iovs[i], static_cast<int>(j - i),
+                                        batches[i].start * E::size);
+            std::fill(reads.begin() + i, reads.begin() + j, read);
+            i = j;
+        }
+        io->submit();
+    }
+
+    for (size_t i = 0; i < batches.size(); i++) {
+        auto &batch = batches[i];
+        if (const auto err =
+                io != nullptr
+                    ? io->result(reads[i])
+                    : pread(img_fd, batch.extents.data(),
+                            batch.extents.size() * E::size,
+                            static_cast<long int>(batch.start * E::size));
+            err < 0) {
+            BOOST_LOG_TRIVIAL(error) << "Daemon pread failed" << std::endl;
+            continue;
+        }
+        replicate(batch, emgr, replicas, fingerprints);
+    }
+}
+}  // namespace
 
 void BackupDaemon::start(const std::shared_ptr<AsyncOperationQueue> &queue,
                          const int img_fd, EncryptionManager &emgr,
-                         const std::unique_ptr<Backup::Stub> &client_stub,
-                         const StopFlag &stop) {
+                         ReplicaSet &replicas, uint64_t extent_size,
+                         FingerprintCache *fingerprints, const StopFlag &stop,
+                         IoEngine io_engine) {
     BOOST_LOG_TRIVIAL(info) << "Daemon starts!" << std::endl;
 
-    WriteBlockResponse resp;
-    ClientContext context;
-    std::unique_ptr<ClientWriter<WriteBlockRequest>> writer(
-        client_stub->WriteBlock(&context, &resp));
-
+    std::optional<UringFile> io;
+    if (io_engine == IoEngine::IO_URING) {
+        io.emplace(img_fd);
+    }
+    std::vector<std::shared_ptr<WriteOperation>> ops;
     while (!stop.load()) {
-        const auto op = queue->pop().value_or(nullptr);
+        auto op = queue->pop().value_or(nullptr);
         if (!op) {
             continue;
         }
+        // everything queued up to the next barrier is read together, with
+        // io_uring in one submission
+        ops.clear();
+        while (op && !op->barrier) {
+            ops.push_back(op);
+            op = ops.size() < DAEMON_BATCH_OPS
+                     ? queue->pop(false).value_or(nullptr)
+                     : nullptr;
+        }
 
-        BOOST_LOG_TRIVIAL(debug)
-            << boost::format(
-                   "Daemon recvs write operation, "
-                   "block_no_start: %1%, block_no_end: %2%") %
-                   op->block_no_start % op->block_no_end
-            << std::endl;
-
-        for (auto block_no = op->block_no_start; block_no <= op->block_no_end;
-             block_no++) {
-            WriteBlockRequest req;
-            req.set_block_no(block_no);
-            std::array<uint8_t, BLOCK_SIZE> buf{};
-            if (const auto err =
-                    pread(img_fd, buf.data(), BLOCK_SIZE,
-                          static_cast<long int>(block_no * BLOCK_SIZE));
-                err < 0) {
-                BOOST_LOG_TRIVIAL(error) << "Daemon pread failed" << std::endl;
-                continue;
+        for (const auto &op : ops) {
+            if (op->queued != 0 && Trace::on()) {
+                Trace::record({.start = op->queued,
+                               .end = Trace::now(),
+                               .id = op->trace_id,
+                               .block = op->block_no_start,
+                               .n_blocks = static_cast<uint32_t>(
+                                   op->block_no_end - op->block_no_start + 1),
+                               .stage = Trace::QUEUED});
             }
+            BOOST_LOG_TRIVIAL(debug)
+                << boost::format(
+                       "Daemon recvs write operation, "
+                       "block_no_start: %1%, block_no_end: %2%") %
+                       op->block_no_start % op->block_no_end
+                << std::endl;
+        }
 
-            // encrypt block
-            auto encrypted_buf = emgr.encrypt_block(buf, block_no);
-
-            req.set_data(encrypted_buf.data(), BLOCK_SIZE);
-
-            if (!writer->Write(req)) {
-                BOOST_LOG_TRIVIAL(error)
-                    << "Daemon RPC stream closed, failed to write" << std::endl;
-                continue;
-            }
+        if (!ops.empty()) {
+            with_extent(extent_size, [&](auto extent) {
+                replicate<decltype(extent)>(ops, img_fd, io ? &*io : nullptr,
+                                            emgr, replicas, fingerprints);
+            });
+        }
+        for (size_t i = 0; i < ops.size(); i++) {
+            queue->done();
+        }
+        if (op) {
+            replicas.barrier();
+            queue->done();
         }
     }
+    if (fingerprints != nullptr) {
+        BOOST_LOG_TRIVIAL(info)
+            << boost::format("Daemon skipped %1% of %2% unchanged extents") %
+                   fingerprints->skipped() % fingerprints->checked()
+            << std::endl;
+    }
     close(img_fd);
 }
@@ -5,17 +5,19 @@
 #include <memory>
 
 #include "AsyncOperationQueue.h"
-#include "BackupServer.grpc.pb.h"
 #include "EncryptionManager.h"
-
-typedef std::atomic<bool> StopFlag;
+#include "FingerprintCache.h"
+#include "ReplicaSet.h"
 
 class BackupDaemon {
    public:
+    // encrypts whole extents of extent_size around every queued write and
+    // hands them to the replicas, the writes between two barriers together
     static void start(const std::shared_ptr<AsyncOperationQueue>& queue,
                       int img_fd, EncryptionManager& emgr,
-                      const std::unique_ptr<Backup::Stub>& client_stub,
-                      const StopFlag& stop);
+                      ReplicaSet& replicas, uint64_t extent_size,
+                      FingerprintCache* fingerprints, const StopFlag& stop,
+                      IoEngine io_engine = IoEngine::SYNC_IO);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,112 @@
+#include "BackupImage.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <boost/log/trivial.hpp>
+
+#include "LogImage.h"
+
+FlatImage::~FlatImage() {
+    retired.emplace_back(mapped, mapped_bytes);
+    for (const auto &[addr, bytes] : retired) {
+        if (addr != nullptr) munmap(addr, bytes);
+    }
+    if (fd != -1) close(fd);
+}
+
+void FlatImage::remap() {
+    const auto bytes = size();
+    if (bytes == mapped_bytes) {
+        return;
+    }
+    void *addr = bytes == 0 ? MAP_FAILED
+                            : mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd,
+                                   0);
+    if (addr == MAP_FAILED) {
+        BOOST_LOG_TRIVIAL(warning)
+            << "Cannot map encrypted backup img, reading with pread"
+            << std::endl;
+        return;
+    }
+    retired.emplace_back(mapped, mapped_bytes);
+    mapped = static_cast<char *>(addr);
+    mapped_bytes = bytes;
+}
+
+bool FlatImage::open(uint64_t extent_size) {
+    this->extent_size = extent_size;
+    fd = ::open(path.c_str(), O_RDWR);
+    if (fd == -1) {
+        return false;
+    }
+    remap();
+    return true;
+}
+
+bool FlatImage::setup(uint64_t size, uint64_t extent_size) {
+    if (fd == -1) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+    }
+    if (fd == -1) {
+        BOOST_LOG_TRIVIAL(fatal)
+            << "Cannot open encrypted backup img" << std::endl;
+        return false;
+    }
+    if (0 != ftruncate(fd, static_cast<long>(size))) {
+        BOOST_LOG_TRIVIAL(fatal)
+            << "Cannot truncate encrypted backup img" << std::endl;
+        return false;
+    }
+    this->extent_size = extent_size;
+    remap();
+    return true;
+}
+
+uint64_t FlatImage::size() const { return lseek(fd, 0, SEEK_END); }
+
+bool FlatImage::read(uint64_t extent_no, char *buf) const {
+    return pread(fd, buf, extent_size,
+                 static_cast<long>(extent_no * extent_size)) >= 0;
+}
+
+bool FlatImage::write(uint64_t extent_no, const char *buf) {
+    return pwrite(fd, buf, extent_size,
+                  static_cast<long>(extent_no * extent_size)) >= 0;
+}
+
+bool FlatImage::patch(uint64_t extent_no, const char *buf, uint32_t offset,
+                      uint32_t length) {
+    return pwrite(fd, buf, length,
+                  static_cast<long>(extent_no * extent_size + offset)) >= 0;
+}
+
+bool FlatImage::sync() { return fdatasync(fd) == 0; }
+
+const char *FlatImage::map(uint64_t extent_no) const {
+    // past the end the pages would fault, pread reports it instead
+    if (mapped == nullptr || (extent_no + 1) * extent_size > mapped_bytes) {
+        return nullptr;
+    }
+    return mapped + extent_no * extent_size;
+}
+
+void FlatImage::will_read(uint64_t extent_no, uint64_t n_extents) const {
+    const auto from = extent_no * extent_size;
+    if (mapped == nullptr || from >= mapped_bytes) {
+        return;
+    }
+    // madvise wants a page aligned start
+    const auto start = from & ~static_cast<uint64_t>(sysconf(_SC_PAGESIZE) - 1);
+    const auto end = std::min(from + n_extents * extent_size, mapped_bytes);
+    madvise(mapped + start, end - start, MADV_WILLNEED);
+}
+
+std::unique_ptr<BackupImage> make_image(StorageEngine engine,
+                                        const std::string &path) {
+    if (engine == StorageEngine::LOG_STRUCTURED) {
+        return std::make_unique<LogImage>(path + ".log");
+    }
+    return std::make_unique<FlatImage>(path);
+}
@@ -0,0 +1,67 @@
+#ifndef BACKUP_IMAGE_H
+#define BACKUP_IMAGE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "types.h"
+
+// Where a backup server keeps the encrypted extents of its volume. Reads and
+// writes are whole extents, a patch rewrites bytes within one. A write is
+// durable once a later sync returned.
+// Extents never written read as zeros.
+class BackupImage {
+   public:
+    virtual ~BackupImage() = default;
+    // open an image set up before, false if there is none
+    virtual bool open(uint64_t extent_size) = 0;
+    // create the image or change its geometry, extents below the new size
+    // are kept while the extent size stays the same
+    virtual bool setup(uint64_t size, uint64_t extent_size) = 0;
+    virtual uint64_t size() const = 0;
+    virtual bool read(uint64_t extent_no, char *buf) const = 0;
+    virtual bool write(uint64_t extent_no, const char *buf) = 0;
+    // write length bytes of buf at offset within the extent
+    virtual bool patch(uint64_t extent_no, const char *buf, uint32_t offset,
+                       uint32_t length) = 0;
+    virtual bool sync() = 0;
+    // the extent in mapped pages, nullptr if it is not mapped
+    virtual const char *map(uint64_t extent_no) const { return nullptr; }
+    // hint that n_extents from extent_no on are read soon
+    virtual void will_read(uint64_t extent_no, uint64_t n_extents) const {}
+};
+
+// The volume as one file, extent n at n * extent_size. The file is mapped
+// read only, so reads copy straight out of the page cache. Mappings replaced
+// by a setup stay valid until the image is closed.
+class FlatImage : public BackupImage {
+    std::string path;
+    int fd = -1;
+    uint64_t extent_size = BLOCK_SIZE;
+    char *mapped = nullptr;
+    uint64_t mapped_bytes = 0;
+    std::vector<std::pair<char *, uint64_t>> retired;
+
+    void remap();
+
+   public:
+    explicit FlatImage(std::string path) : path(std::move(path)) {}
+    ~FlatImage() override;
+    bool open(uint64_t extent_size) override;
+    bool setup(uint64_t size, uint64_t extent_size) override;
+    uint64_t size() const override;
+    bool read(uint64_t extent_no, char *buf) const override;
+    bool write(uint64_t extent_no, const char *buf) override;
+    bool patch(uint64_t extent_no, const char *buf, uint32_t offset,
+               uint32_t length) override;
+    bool sync() override;
+    const char *map(uint64_t extent_no) const override;
+    void will_read(uint64_t extent_no, uint64_t n_extents) const override;
+};
+
+std::unique_ptr<BackupImage> make_image(StorageEngine engine,
+                                        const std::string &path);
+
+#endif
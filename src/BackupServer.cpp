@@ -8,85 +8,330 @@
 #include <boost/log/sources/severity_logger.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/log/utility/setup.hpp>
+#include <boost/program_options.hpp>
 #include <boost/thread/thread.hpp>
+#include <deque>
 #include <iostream>
 #include <memory>
+#include <thread>
 
+#include "BackupImage.h"
 #include "BackupServer.grpc.pb.h"
+#include "EpochJournal.h"
+#include "Extent.h"
+#include "GroupCommit.h"
+#include "ShmTransport.h"
+#include "SnapshotStore.h"
+#include "Topology.h"
+#include "VolumeMetadata.h"
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/strings/str_format.h"
 #include "consts.h"
+#include "types.h"
+
+namespace po = boost::program_options;
 
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
 using grpc::ServerReader;
+using grpc::ServerReaderInterface;
 using grpc::ServerReaderWriter;
+using grpc::ServerReaderWriterInterface;
 using grpc::Status;
 
 class BackupServiceImpl final : public Backup::Service {
-    int encrypted_fd = -1;
+    std::unique_ptr<BackupImage> image;
+    bool ready = false;  // the image is set up
     const char* filepath;
+    SnapshotStore snapshots;
+    uint64_t snapshot_retention;
+    VolumeMetadata volume;
+    GroupCommit commit;
+    EpochJournal journal;
+
+    // write size bytes at offset of an extent to the image, false with the
+    // reason if it failed
+    bool write_extent(uint64_t extent_no, const char* data, uint32_t offset,
+                      size_t size, std::string& message);
 
    public:
-    explicit BackupServiceImpl(const char* filepath) : filepath(filepath) {
-        encrypted_fd = open(filepath, O_RDWR);
-        if (encrypted_fd == -1) {
+    BackupServiceImpl(const char* filepath, StorageEngine engine,
+                      uint64_t snapshot_retention,
+                      std::chrono::milliseconds sync_interval,
+                      uint64_t sync_bytes)
+        : image(make_image(engine, filepath)),
+          filepath(filepath),
+          snapshots(filepath),
+          snapshot_retention(snapshot_retention),
+          commit([this] { return image->sync(); }, sync_interval,
+                 sync_bytes),
+          journal(
+              std::string(filepath) + ".epochs",
+              [this](uint64_t extent_no, const char* data, uint32_t offset,
+                     uint32_t length) {
+                  std::string message;
+                  return write_extent(extent_no, data, offset, length,
+                                      message);
+              },
+              [this] { return image->sync(); }) {
+        const bool has_metadata =
+            volume.load(VolumeMetadata::path_for(filepath));
+        ready = image->open(volume.extent_size);
+        if (!ready) {
+            volume = {};
             BOOST_LOG_TRIVIAL(info)
                 << "File not setup, waiting for setup request" << std::endl;
+        } else if (!has_metadata) {
+            volume.size = image->size();
+        }
+        snapshots.set_extent_size(volume.extent_size);
+        // complete the epochs a crash interrupted
+        if (ready && !journal.open(volume.extent_size)) {
+            throw std::runtime_error("Cannot open the epoch journal");
         }
     }
 
     Status Setup(ServerContext* context, const SetupRequest* request,
                  SetupResponse* response) override;
 
+    Status GetVolume(ServerContext* context, const GetVolumeRequest* request,
+                     GetVolumeResponse* response) override;
+
     Status WriteBlock(ServerContext* context,
                       ServerReader<WriteBlockRequest>* reader,
-                      WriteBlockResponse* response) override;
+                      WriteBlockResponse* response) override {
+        return WriteBlock(reader, response);
+    }
+
+    Status ReplicateBlocks(
+        ServerContext* context,
+        ServerReaderWriter<WriteAck, WriteBlockRequest>* stream) override {
+        return ReplicateBlocks(stream);
+    }
 
     Status ReadBlock(ServerContext* context,
                      ServerReaderWriter<ReadBlockResponse, ReadBlockRequest>*
-                         stream) override;
+                         stream) override {
+        return ReadBlock(stream);
+    }
+
+    // the streaming calls on the streams of any transport
+    Status WriteBlock(ServerReaderInterface<WriteBlockRequest>* reader,
+                      WriteBlockResponse* response);
+
+    Status ReplicateBlocks(
+        ServerReaderWriterInterface<WriteAck, WriteBlockRequest>* stream);
+
+    Status ReadBlock(
+        ServerReaderWriterInterface<ReadBlockResponse, ReadBlockRequest>*
+            stream);
+
+    Status CreateSnapshot(ServerContext* context,
+                          const CreateSnapshotRequest* request,
+                          CreateSnapshotResponse* response) override;
+
+    Status ListSnapshots(ServerContext* context,
+                         const ListSnapshotsRequest* request,
+                         ListSnapshotsResponse* response) override;
+
+    Status DeleteSnapshot(ServerContext* context,
+                          const DeleteSnapshotRequest* request,
+                          DeleteSnapshotResponse* response) override;
 };
 
-void usage() {
-    std::cout << "Usage: BackupServer [-v] [file]" << std::endl;
-    exit(1);
+ServerConfig parse_options(int argc, char** argv) {
+    po::options_description desc("Usage: BackupServer [options] [file]");
+    desc.add_options()("help", "produce help message");
+    desc.add_options()("verbose,v", "verbose");
+    desc.add_options()("file", po::value<std::string>(),
+                       "encrypted backup image path");
+    desc.add_options()("port", po::value<uint16_t>(), "listening port");
+    desc.add_options()("unix_socket", po::value<std::string>(),
+                       "also serve gRPC on this Unix socket, for clients "
+                       "on this host using unix:///path");
+    desc.add_options()("shm_socket", po::value<std::string>(),
+                       "also serve clients on this host over shared memory, "
+                       "set up on this Unix socket, see shm:///path");
+    desc.add_options()("snapshot_interval", po::value<uint64_t>(),
+                       "take a snapshot every N seconds, 0 to disable");
+    desc.add_options()("snapshot_retention", po::value<uint64_t>(),
+                       "number of snapshots to keep, 0 to keep all");
+    desc.add_options()("sync_interval", po::value<uint64_t>(),
+                       "longest time(in ms) a write waits for the sync that "
+                       "makes it durable");
+    desc.add_options()("sync_bytes", po::value<uint64_t>(),
+                       "sync once this much(in KB) was written since the "
+                       "last sync, 0 to only sync by time");
+    desc.add_options()(
+        "engine",
+        po::value<std::string>()->notifier([](const std::string& value) {
+            if (!parse_storage_engine(value)) {
+                throw po::validation_error(
+                    po::validation_error::invalid_option_value);
+            }
+        }),
+        "how the image is stored: flat | log\n"
+        "log: append writes to segment files, for disks slow at random "
+        "writes\n");
+    desc.add_options()(
+        "io_cpus",
+        po::value<std::string>()->notifier([](const std::string& value) {
+            if (!Topology::parse_cpus(value)) {
+                throw po::validation_error(
+                    po::validation_error::invalid_option_value);
+            }
+        }),
+        "cores of every server thread, as in 0-3,8, best on the node of "
+        "the network card and the disk");
+    po::positional_options_description positional;
+    positional.add("file", 1);
+
+    po::variables_map vm;
+    po::store(po::command_line_parser(argc, argv)
+                  .options(desc)
+                  .positional(positional)
+                  .run(),
+              vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cout << desc << "\n";
+        exit(0);
+    }
+
+    ServerConfig config;
+    if (vm.count("verbose")) {
+        config.verbose = true;
+    }
+    if (vm.count("file")) {
+        config.file = vm["file"].as<std::string>();
+    }
+    if (vm.count("port")) {
+        config.port = vm["port"].as<uint16_t>();
+    }
+    if (vm.count("unix_socket")) {
+        config.unix_socket = vm["unix_socket"].as<std::string>();
+    }
+    if (vm.count("shm_socket")) {
+        config.shm_socket = vm["shm_socket"].as<std::string>();
+    }
+    if (vm.count("snapshot_interval")) {
+        config.snapshot_interval = vm["snapshot_interval"].as<uint64_t>();
+    }
+    if (vm.count("snapshot_retention")) {
+        config.snapshot_retention = vm["snapshot_retention"].as<uint64_t>();
+    }
+    if (vm.count("sync_interval")) {
+        config.sync_interval_ms = vm["sync_interval"].as<uint64_t>();
+    }
+    if (vm.count("sync_bytes")) {
+        config.sync_bytes = vm["sync_bytes"].as<uint64_t>() * 1024;
+    }
+    if (vm.count("engine")) {
+        config.engine = *parse_storage_engine(vm["engine"].as<std::string>());
+    }
+    if (vm.count("io_cpus")) {
+        config.io_cpus = *Topology::parse_cpus(vm["io_cpus"].as<std::string>());
+    }
+    return config;
+}
+
+// the same service over the shared memory transport
+void serve_shm(ShmServer& shm, BackupServiceImpl& service) {
+    shm.unary<SetupRequest, SetupResponse>(
+        ShmMethod::SETUP, [&](auto request, auto response) {
+            return service.Setup(nullptr, request, response);
+        });
+    shm.unary<GetVolumeRequest, GetVolumeResponse>(
+        ShmMethod::GET_VOLUME, [&](auto request, auto response) {
+            return service.GetVolume(nullptr, request, response);
+        });
+    shm.client_stream<WriteBlockRequest, WriteBlockResponse>(
+        ShmMethod::WRITE_BLOCK, [&](auto reader, auto response) {
+            return service.WriteBlock(reader, response);
+        });
+    shm.bidi_stream<WriteAck, WriteBlockRequest>(
+        ShmMethod::REPLICATE_BLOCKS,
+        [&](auto stream) { return service.ReplicateBlocks(stream); });
+    shm.bidi_stream<ReadBlockResponse, ReadBlockRequest>(
+        ShmMethod::READ_BLOCK,
+        [&](auto stream) { return service.ReadBlock(stream); });
+    shm.unary<CreateSnapshotRequest, CreateSnapshotResponse>(
+        ShmMethod::CREATE_SNAPSHOT, [&](auto request, auto response) {
+            return service.CreateSnapshot(nullptr, request, response);
+        });
+    shm.unary<ListSnapshotsRequest, ListSnapshotsResponse>(
+        ShmMethod::LIST_SNAPSHOTS, [&](auto request, auto response) {
+            return service.ListSnapshots(nullptr, request, response);
+        });
+    shm.unary<DeleteSnapshotRequest, DeleteSnapshotResponse>(
+        ShmMethod::DELETE_SNAPSHOT, [&](auto request, auto response) {
+            return service.DeleteSnapshot(nullptr, request, response);
+        });
 }
 
 int main(int argc, char** argv) {
     boost::log::add_console_log(std::cout,
                                 boost::log::keywords::format = ">> %Message%");
 
-    // extract path from argument
-    const char* file = nullptr;
-    if (argc > 3) {
-        usage();
-        exit(EXIT_FAILURE);
-    } else if (argc == 3) {
-        file = argv[2];
-    } else if (argc == 2) {
+    const auto config = parse_options(argc, argv);
+    if (!config.verbose) {
         boost::log::core::get()->set_filter(boost::log::trivial::severity >=
                                             boost::log::trivial::info);
-        file = argv[1];
-    } else {
-        boost::log::core::get()->set_filter(boost::log::trivial::severity >=
-                                            boost::log::trivial::info);
-        file = ENCRYPTED_IMG;
     }
 
     BOOST_LOG_TRIVIAL(info) << "SeCloud backup server starts!" << std::endl;
-    const std::string server_address = absl::StrFormat("0.0.0.0:%d", 8080);
-    BackupServiceImpl service(file);
+    // before any thread starts, gRPC and the sync threads inherit it
+    Topology::pin(config.io_cpus);
+    const std::string server_address =
+        absl::StrFormat("0.0.0.0:%d", config.port);
+    BackupServiceImpl service(
+        config.file.c_str(), config.engine, config.snapshot_retention,
+        std::chrono::milliseconds(config.sync_interval_ms), config.sync_bytes);
+
+    // periodic snapshots
+    if (config.snapshot_interval > 0) {
+        std::thread([&service, interval = config.snapshot_interval] {
+            while (true) {
+                std::this_thread::sleep_for(std::chrono::seconds(interval));
+                CreateSnapshotRequest req;
+                CreateSnapshotResponse resp;
+                service.CreateSnapshot(nullptr, &req, &resp);
+                if (!resp.success()) {
+                    BOOST_LOG_TRIVIAL(error)
+                        << "Periodic snapshot failed: " << resp.message()
+                        << std::endl;
+                }
+            }
+        }).detach();
+    }
 
     grpc::EnableDefaultHealthCheckService(true);
     grpc::reflection::InitProtoReflectionServerBuilderPlugin();
     ServerBuilder builder;
     builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
+    if (!config.unix_socket.empty()) {
+        builder.AddListeningPort("unix://" + config.unix_socket,
+                                 grpc::InsecureServerCredentials());
+    }
     builder.RegisterService(&service);
     const std::unique_ptr server(builder.BuildAndStart());
     std::cout << "Server listening on " << server_address << std::endl;
+    if (!config.unix_socket.empty()) {
+        std::cout << "Server listening on unix://" << config.unix_socket
+                  << std::endl;
+    }
+
+    std::unique_ptr<ShmServer> shm;
+    if (!config.shm_socket.empty()) {
+        shm = std::make_unique<ShmServer>(config.shm_socket);
+        serve_shm(*shm, service);
+        std::thread([&shm] { shm->run(); }).detach();
+        std::cout << "Server listening on shm://" << config.shm_socket
+                  << std::endl;
+    }
     server->Wait();
 }
 
@@ -96,19 +341,59 @@ Status BackupServiceImpl::Setup(ServerContext* context,
     BOOST_LOG_TRIVIAL(info)
         << "Setting up file, size: " << request->size() << std::endl;
 
-    encrypted_fd = open(filepath, O_RDWR | O_CREAT, 0666);
-    if (encrypted_fd == -1) {
-        BOOST_LOG_TRIVIAL(fatal)
-            << "Cannot open encrypted backup img" << std::endl;
+    const auto cipher = request->cipher().empty()
+                            ? CipherType::AES_256_CTR
+                            : parse_cipher(request->cipher());
+    if (!cipher) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Unknown cipher: " << request->cipher() << std::endl;
         response->set_success(false);
-        response->set_message("Cannot open encrypted backup img");
+        response->set_message("Unknown cipher");
         return grpc::Status::OK;
     }
-    if (0 != ftruncate(encrypted_fd, request->size())) {
-        BOOST_LOG_TRIVIAL(fatal)
-            << "Cannot truncate encrypted backup img" << std::endl;
+    const auto extent_size =
+        request->extent_size() == 0 ? BLOCK_SIZE : request->extent_size();
+    const bool sharded = request->data_shards() > 0;
+    if (!(sharded ? valid_shard_size(extent_size)
+                  : valid_extent_size(extent_size)) ||
+        request->size() % extent_size != 0) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Unsupported extent size: " << extent_size << std::endl;
         response->set_success(false);
-        response->set_message("Cannot truncate encrypted backup img");
+        response->set_message("Unsupported extent size");
+        return grpc::Status::OK;
+    }
+    if (sharded &&
+        request->shard() >= request->data_shards() + request->parity_shards()) {
+        response->set_success(false);
+        response->set_message("Shard out of range");
+        return grpc::Status::OK;
+    }
+    // snapshot slots are kept in extents of the old size
+    if (extent_size != volume.extent_size && !snapshots.empty()) {
+        response->set_success(false);
+        response->set_message(
+            "Cannot change the extent size while snapshots exist");
+        return grpc::Status::OK;
+    }
+
+    if (!image->setup(request->size(), extent_size) ||
+        !journal.reset(extent_size)) {
+        response->set_success(false);
+        response->set_message("Cannot set up encrypted backup img");
+        return grpc::Status::OK;
+    }
+    ready = true;
+    volume = {.size = request->size(),
+              .cipher = *cipher,
+              .extent_size = extent_size,
+              .data_shards = request->data_shards(),
+              .parity_shards = request->parity_shards(),
+              .shard = request->shard()};
+    snapshots.set_extent_size(extent_size);
+    if (!volume.save(VolumeMetadata::path_for(filepath))) {
+        response->set_success(false);
+        response->set_message("Cannot save volume metadata");
         return grpc::Status::OK;
     }
 
@@ -116,10 +401,62 @@ Status BackupServiceImpl::Setup(ServerContext* context,
     return grpc::Status::OK;
 }
 
-Status BackupServiceImpl::WriteBlock(ServerContext* context,
-                                     ServerReader<WriteBlockRequest>* reader,
-                                     WriteBlockResponse* response) {
-    if (encrypted_fd == -1) {
+Status BackupServiceImpl::GetVolume(ServerContext* context,
+                                    const GetVolumeRequest* request,
+                                    GetVolumeResponse* response) {
+    if (!ready) {
+        response->set_success(false);
+        response->set_message("File not setup");
+        return Status::OK;
+    }
+    response->set_success(true);
+    response->set_size(volume.size);
+    response->set_cipher(cipher_name(volume.cipher));
+    response->set_extent_size(volume.extent_size);
+    response->set_data_shards(volume.data_shards);
+    response->set_parity_shards(volume.parity_shards);
+    response->set_shard(volume.shard);
+    return Status::OK;
+}
+
+bool BackupServiceImpl::write_extent(uint64_t extent_no, const char* data,
+                                     uint32_t offset, size_t size,
+                                     std::string& message) {
+    BOOST_LOG_TRIVIAL(debug)
+        << "Writing block " << extent_no << " with data size: " << size
+        << std::endl;
+
+    if (size == 0 || offset + size > volume.extent_size) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Write of " << size << " bytes at " << offset
+            << ", extent size is " << volume.extent_size << std::endl;
+        message = "Write is not within one extent";
+        return false;
+    }
+
+    const auto guard = snapshots.write_guard();
+    if (!snapshots.preserve(*image, extent_no)) {
+        message = "Snapshot copy-on-write failed";
+        return false;
+    }
+
+    if (!(size == volume.extent_size
+              ? image->write(extent_no, data)
+              : image->patch(extent_no, data, offset,
+                             static_cast<uint32_t>(size)))) {
+        BOOST_LOG_TRIVIAL(error) << "Write failed" << std::endl;
+        message = "Write failed";
+        return false;
+    }
+
+    BOOST_LOG_TRIVIAL(debug) << "Write succeeded" << std::endl;
+    return true;
+}
+
+Status BackupServiceImpl::WriteBlock(
+    ServerReaderInterface<WriteBlockRequest>* reader,
+    WriteBlockResponse* response) {
+    if (!ready) {
         BOOST_LOG_TRIVIAL(fatal) << "File not setup" << std::endl;
         response->set_success(false);
         response->set_message("File not setup");
@@ -127,37 +464,162 @@ Status BackupServiceImpl::WriteBlock(ServerContext* context,
     }
 
     WriteBlockRequest request;
+    uint64_t ticket = 0;
     while (reader->Read(&request)) {
-        BOOST_LOG_TRIVIAL(debug)
-            << "Writing block " << request.block_no()
-            << " with data size: " << request.data().size() << std::endl;
-
-        const auto offset = request.block_no() * BLOCK_SIZE;
-        if (const auto bytes_write =
-                pwrite(encrypted_fd, request.data().data(),
-                       request.data().size(), static_cast<long>(offset));
-            bytes_write < 0) {
-            BOOST_LOG_TRIVIAL(error) << "Write failed" << std::endl;
+        if (std::string message;
+            !write_extent(request.block_no(), request.data().data(),
+                          request.offset(), request.data().size(), message)) {
             response->set_success(false);
-            response->set_message("Write failed");
+            response->set_message(message);
             return Status::OK;
         }
-
-        BOOST_LOG_TRIVIAL(debug) << "Write succeeded" << std::endl;
+        ticket = commit.wrote(request.data().size());
     }
 
+    // the client may count everything up to here as backed up
+    if (ticket > 0 &&
+        commit.wait(ticket - 1, std::chrono::milliseconds(SYNC_TIMEOUT_MS)) <
+            ticket) {
+        response->set_success(false);
+        response->set_message("Sync timed out");
+        return Status::OK;
+    }
     response->set_success(true);
     response->set_message("Block written successfully.");
     return Status::OK;
 }
 
+Status BackupServiceImpl::ReplicateBlocks(
+    ServerReaderWriterInterface<WriteAck, WriteBlockRequest>* stream) {
+    if (!ready) {
+        BOOST_LOG_TRIVIAL(fatal) << "File not setup" << std::endl;
+        WriteAck ack;
+        ack.set_success(false);
+        ack.set_message("File not setup");
+        stream->Write(ack);
+        return Status::OK;
+    }
+
+    // seqs written to the image by ticket, acknowledged by a second thread
+    // as the syncs complete. Staged writes are acknowledged with the commit
+    // of their epoch once it is applied.
+    std::mutex lock;
+    std::deque<std::pair<uint64_t, uint64_t>> unsynced;
+    std::deque<std::pair<uint64_t, uint64_t>> commits;  // epoch, seq
+    bool staged = false;
+    bool reading = true;
+    std::string failure;
+    const auto session = journal.begin();
+    std::thread acker([&] {
+        uint64_t synced = 0;
+        uint64_t applied = 0;
+        while (true) {
+            WriteAck ack;
+            bool epochs;
+            bool done;
+            {
+                std::lock_guard guard(lock);
+                if (!failure.empty()) {
+                    ack.set_success(false);
+                    ack.set_message(failure);
+                    stream->Write(ack);
+                    return;
+                }
+                if (!reading && unsynced.empty() && commits.empty()) {
+                    return;
+                }
+                epochs = staged;
+                done = !reading;
+            }
+            if (epochs) {
+                applied = journal.wait(applied, std::chrono::milliseconds(100));
+            } else {
+                synced = commit.wait(synced, std::chrono::milliseconds(100));
+            }
+            {
+                std::lock_guard guard(lock);
+                while (!unsynced.empty() && unsynced.front().first <= synced) {
+                    ack.set_seq(unsynced.front().second);
+                    unsynced.pop_front();
+                }
+                while (!commits.empty() && commits.front().first <= applied) {
+                    ack.set_seq(commits.front().second);
+                    commits.pop_front();
+                }
+            }
+            ack.set_success(true);
+            if (ack.seq() > 0 && !stream->Write(ack)) {
+                return;
+            }
+            // the other streams of the client will not commit any more
+            if (epochs && done) {
+                return;
+            }
+        }
+    });
+
+    const auto extents = volume.size / volume.extent_size;
+    WriteBlockRequest request;
+    while (stream->Read(&request)) {
+        if (request.commit() != 0) {
+            const bool ok = request.stream() < request.streams() &&
+                            journal.commit(session, request.stream(),
+                                           request.streams(), request.commit());
+            std::lock_guard guard(lock);
+            if (!ok) {
+                failure = "Cannot commit epoch";
+                break;
+            }
+            staged = true;
+            commits.emplace_back(request.commit(), request.seq());
+            continue;
+        }
+        if (request.staged()) {
+            const auto size = request.data().size();
+            const bool ok = size > 0 &&
+                            request.offset() + size <= volume.extent_size &&
+                            request.block_no() < extents &&
+                            journal.stage(session, request.stream(),
+                                          request.block_no(),
+                                          request.data().data(),
+                                          request.offset(),
+                                          static_cast<uint32_t>(size));
+            std::lock_guard guard(lock);
+            if (!ok) {
+                failure = "Cannot stage write";
+                break;
+            }
+            staged = true;
+            continue;
+        }
+        if (std::string message;
+            !write_extent(request.block_no(), request.data().data(),
+                          request.offset(), request.data().size(), message)) {
+            std::lock_guard guard(lock);
+            failure = message;
+            break;
+        }
+        const auto ticket = commit.wrote(request.data().size());
+        std::lock_guard guard(lock);
+        unsynced.emplace_back(ticket, request.seq());
+    }
+    {
+        std::lock_guard guard(lock);
+        reading = false;
+    }
+    acker.join();
+    // whatever is not applied yet is resent by the client
+    journal.end(session);
+    return Status::OK;
+}
+
 Status BackupServiceImpl::ReadBlock(
-    ServerContext* context,
-    ServerReaderWriter<ReadBlockResponse, ReadBlockRequest>* stream) {
+    ServerReaderWriterInterface<ReadBlockResponse, ReadBlockRequest>*
+        stream) {
     ReadBlockRequest request;
     ReadBlockResponse response;
 
-    if (encrypted_fd == -1) {
+    if (!ready) {
         BOOST_LOG_TRIVIAL(fatal) << "File not setup" << std::endl;
         response.set_success(false);
         response.set_message("File not setup");
@@ -165,28 +627,122 @@ Status BackupServiceImpl::ReadBlock(
         return Status::OK;
     }
 
+    // a sequential stream gets READAHEAD_BYTES hinted ahead of it
+    const auto window =
+        std::max<uint64_t>(1, READAHEAD_BYTES / volume.extent_size);
+    uint64_t next = 0;
+    uint64_t run = 0;
+    uint64_t hinted = 0;  // extents before it were hinted
+
+    // the response keeps its data buffer, a mapped extent is copied into it
+    // straight from the page cache
+    auto& data = *response.mutable_data();
     while (stream->Read(&request)) {
         BOOST_LOG_TRIVIAL(debug)
             << "Reading block " << request.block_no() << std::endl;
 
-        auto offset = request.block_no() * BLOCK_SIZE;
-        std::vector<char> buffer(BLOCK_SIZE);
-
-        if (const auto bytes_read =
-                pread(encrypted_fd, buffer.data(), BLOCK_SIZE,
-                      static_cast<long>(offset));
-            bytes_read < 0) {
-            BOOST_LOG_TRIVIAL(error) << "Read failed" << std::endl;
-            response.set_success(false);
-            response.set_message("Read failed");
-            stream->Write(response);
-            return Status::OK;
+        const auto block_no = request.block_no();
+        if (block_no != next) {
+            run = 0;
+            hinted = 0;
+        }
+        run++;
+        next = block_no + 1;
+        if (run >= READAHEAD_AFTER && next + window / 2 >= hinted) {
+            const auto from = std::max(hinted, next);
+            image->will_read(from, next + window - from);
+            hinted = next + window;
+        }
+
+        uint64_t epoch = 0;  // of the snapshot read from
+        if (!request.snapshot().empty()) {
+            data.resize(volume.extent_size);
+            if (!snapshots.read(*image, request.snapshot(), block_no,
+                                data.data(), &epoch)) {
+                BOOST_LOG_TRIVIAL(error) << "Snapshot read failed" << std::endl;
+                response.set_success(false);
+                response.set_message("Snapshot read failed");
+                stream->Write(response);
+                return Status::OK;
+            }
+        } else if (const char* mapped = image->map(block_no)) {
+            data.assign(mapped, volume.extent_size);
+        } else {
+            data.resize(volume.extent_size);
+            if (!image->read(block_no, data.data())) {
+                BOOST_LOG_TRIVIAL(error) << "Read failed" << std::endl;
+                response.set_success(false);
+                response.set_message("Read failed");
+                stream->Write(response);
+                return Status::OK;
+            }
         }
 
-        response.set_data(buffer.data(), BLOCK_SIZE);
         response.set_success(true);
+        response.set_epoch(epoch);
         stream->Write(response);
     }
 
     return Status::OK;
 }
+
+Status BackupServiceImpl::CreateSnapshot(ServerContext* context,
+                                         const CreateSnapshotRequest* request,
+                                         CreateSnapshotResponse* response) {
+    auto name = request->name();
+    if (name.empty()) {
+        name = absl::StrFormat("auto-%d", time(nullptr));
+    }
+
+    if (!ready) {
+        response->set_success(false);
+        response->set_message("File not setup");
+        return Status::OK;
+    }
+    // between epochs, so the snapshot is crash consistent. The shard servers
+    // of a volume name their snapshots on their own, the client only decodes
+    // shards of snapshots taken at the same epoch
+    const auto held = journal.hold();
+    const auto epoch = journal.last_applied();
+    if (volume.data_shards > 0 && epoch == 0) {
+        response->set_success(false);
+        response->set_message("No epoch applied yet, cannot snapshot shard");
+        return Status::OK;
+    }
+    if (!snapshots.create(name, epoch)) {
+        response->set_success(false);
+        response->set_message("Cannot create snapshot " + name);
+        return Status::OK;
+    }
+    if (snapshot_retention > 0) {
+        snapshots.enforce_retention(snapshot_retention);
+    }
+
+    response->set_success(true);
+    response->set_name(name);
+    return Status::OK;
+}
+
+Status BackupServiceImpl::ListSnapshots(ServerContext* context,
+                                        const ListSnapshotsRequest* request,
+                                        ListSnapshotsResponse* response) {
+    for (const auto& snapshot : snapshots.list()) {
+        auto info = response->add_snapshots();
+        info->set_name(snapshot.name);
+        info->set_created(snapshot.created);
+        info->set_epoch(snapshot.epoch);
+    }
+    return Status::OK;
+}
+
+Status BackupServiceImpl::DeleteSnapshot(ServerContext* context,
+                                         const DeleteSnapshotRequest* request,
+                                         DeleteSnapshotResponse* response) {
+    if (!snapshots.remove(request->name())) {
+        response->set_success(false);
+        response->set_message("No such snapshot " + request->name());
+        return Status::OK;
+    }
+    response->set_success(true);
+    return Status::OK;
+}
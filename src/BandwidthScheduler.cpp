@@ -0,0 +1,174 @@
+#include "BandwidthScheduler.h"
+
+#include <boost/log/trivial.hpp>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+
+namespace {
+constexpr uint64_t MB = 1024 * 1024;
+}
+
+void BandwidthScheduler::Bucket::refill(Clock::time_point now) {
+    const std::chrono::duration<double> elapsed = now - refilled;
+    refilled = now;
+    if (rate == 0) {
+        return;
+    }
+    // a second of rate is the largest burst
+    tokens = std::min<double>(tokens + elapsed.count() * rate, rate);
+}
+
+bool BandwidthScheduler::Bucket::ready() const {
+    return rate == 0 || tokens >= 0;
+}
+
+BandwidthScheduler::Clock::duration BandwidthScheduler::Bucket::wait_for()
+    const {
+    if (ready()) {
+        return Clock::duration::zero();
+    }
+    return std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(-tokens / rate));
+}
+
+BandwidthScheduler::BandwidthScheduler(const Config &config) {
+    for (int i = 0; i < N_TRAFFIC_CLASSES; i++) {
+        set_rate(static_cast<TrafficClass>(i), config.rates[i]);
+    }
+    set_link_rate(config.link_rate);
+}
+
+bool BandwidthScheduler::higher_waiting(TrafficClass traffic) const {
+    for (int i = 0; i < traffic; i++) {
+        if (waiting[i] > 0) return true;
+    }
+    return false;
+}
+
+void BandwidthScheduler::acquire(TrafficClass traffic, uint64_t bytes) {
+    std::unique_lock guard(lock);
+    auto &bucket = classes[traffic];
+    bool on_link = false;  // counted in waiting
+    while (true) {
+        const auto now = Clock::now();
+        bucket.refill(now);
+        link.refill(now);
+        // a bucket with tokens left lets a request through and goes into
+        // debt, so requests larger than the burst still pass
+        if (bucket.ready() && !on_link) {
+            // only waiting for the link holds back lower classes
+            waiting[traffic]++;
+            on_link = true;
+        }
+        if (bucket.ready() && link.ready() && !higher_waiting(traffic)) {
+            break;
+        }
+        if (!bucket.ready() && on_link) {
+            waiting[traffic]--;
+            on_link = false;
+        }
+        auto wait = std::max(bucket.wait_for(), link.wait_for());
+        if (wait == Clock::duration::zero()) {
+            // held back by a higher class, woken when it sends
+            wait = std::chrono::milliseconds(10);
+        }
+        released.wait_for(guard, wait);
+    }
+    waiting[traffic]--;
+    if (bucket.rate != 0) bucket.tokens -= bytes;
+    if (link.rate != 0) link.tokens -= bytes;
+    released.notify_all();
+}
+
+void BandwidthScheduler::set_rate(TrafficClass traffic,
+                                  uint64_t bytes_per_sec) {
+    std::lock_guard guard(lock);
+    // the time before counts at the old rate
+    classes[traffic].refill(Clock::now());
+    classes[traffic].rate = bytes_per_sec;
+    classes[traffic].tokens = std::min<double>(classes[traffic].tokens, 0);
+    released.notify_all();
+}
+
+void BandwidthScheduler::set_link_rate(uint64_t bytes_per_sec) {
+    std::lock_guard guard(lock);
+    link.refill(Clock::now());
+    link.rate = bytes_per_sec;
+    link.tokens = std::min<double>(link.tokens, 0);
+    released.notify_all();
+}
+
+bool BandwidthScheduler::load_rates(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        BOOST_LOG_TRIVIAL(warning)
+            << "Cannot read rate file " << path << std::endl;
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        const auto eq = line.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        const auto key = line.substr(0, eq);
+        const auto value = line.substr(eq + 1);
+        char *end;
+        const auto rate = std::strtoull(value.c_str(), &end, 10) * MB;
+        if (value.empty() || *end != '\0') {
+            BOOST_LOG_TRIVIAL(warning)
+                << "Bad rate in " << path << ": " << line << std::endl;
+            continue;
+        }
+        if (key == "link") {
+            set_link_rate(rate);
+        } else if (const auto traffic = parse_traffic_class(key)) {
+            set_rate(*traffic, rate);
+        } else {
+            BOOST_LOG_TRIVIAL(warning)
+                << "Unknown rate in " << path << ": " << line << std::endl;
+            continue;
+        }
+        BOOST_LOG_TRIVIAL(info)
+            << "Rate limit " << key << " set to " << rate / MB << " MB/s"
+            << std::endl;
+    }
+    return true;
+}
+
+RateFileWatcher::RateFileWatcher(BandwidthScheduler &scheduler,
+                                 std::string path)
+    : scheduler(scheduler), path(std::move(path)) {
+    // the caller loaded the file as it is now
+    std::error_code err;
+    loaded = std::filesystem::last_write_time(this->path, err);
+    thread = std::thread([this] { run(); });
+}
+
+RateFileWatcher::~RateFileWatcher() { stop(); }
+
+void RateFileWatcher::stop() {
+    {
+        std::lock_guard guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void RateFileWatcher::run() {
+    std::error_code err;
+    std::unique_lock guard(lock);
+    while (!wake.wait_for(guard, std::chrono::seconds(RATE_FILE_POLL_S),
+                          [this] { return stopping; })) {
+        const auto modified = std::filesystem::last_write_time(path, err);
+        if (!err && modified != loaded) {
+            loaded = modified;
+            scheduler.load_rates(path);
+        }
+    }
+}
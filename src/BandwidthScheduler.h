@@ -0,0 +1,73 @@
+#ifndef BANDWIDTH_SCHEDULER_H
+#define BANDWIDTH_SCHEDULER_H
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "types.h"
+
+// Token buckets shared by everything that sends to the backup server. Each
+// traffic class has its own rate and all of them share the link rate, a rate
+// of 0 is unlimited. While a class waits for link tokens, lower priority
+// classes do not take any, so a rebuild never starves live replication.
+class BandwidthScheduler {
+    typedef std::chrono::steady_clock Clock;
+
+    struct Bucket {
+        uint64_t rate = 0;  // bytes per second
+        double tokens = 0;
+        Clock::time_point refilled = Clock::now();
+
+        void refill(Clock::time_point now);
+        bool ready() const;
+        // time until the bucket is out of debt
+        Clock::duration wait_for() const;
+    };
+
+    std::mutex lock;
+    std::condition_variable released;
+    std::array<Bucket, N_TRAFFIC_CLASSES> classes;
+    Bucket link;
+    std::array<int, N_TRAFFIC_CLASSES> waiting{};  // for link tokens
+
+    bool higher_waiting(TrafficClass traffic) const;
+
+   public:
+    explicit BandwidthScheduler(const Config &config);
+    // block until `bytes` of traffic may be sent
+    void acquire(TrafficClass traffic, uint64_t bytes);
+    // a new rate starts without a burst
+    void set_rate(TrafficClass traffic, uint64_t bytes_per_sec);
+    void set_link_rate(uint64_t bytes_per_sec);
+    // apply the rates in a key=value file (live, verify, bulk, link in MB/s),
+    // false if it cannot be read
+    bool load_rates(const std::string &path);
+};
+
+// Reloads the rates of a scheduler whenever the rate file changes, polled
+// every RATE_FILE_POLL_S until stopped
+class RateFileWatcher {
+    BandwidthScheduler &scheduler;
+    std::string path;
+    std::filesystem::file_time_type loaded;  // of the rates last applied
+
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread thread;
+
+    void run();
+
+   public:
+    RateFileWatcher(BandwidthScheduler &scheduler, std::string path);
+    ~RateFileWatcher();
+    void stop();
+};
+
+#endif
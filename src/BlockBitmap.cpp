@@ -0,0 +1,82 @@
+#include "BlockBitmap.h"
+
+#include <bit>
+
+BlockBitmap::BlockBitmap(uint64_t n_bits)
+    : words((n_bits + 63) / 64), n_bits(n_bits) {}
+
+void BlockBitmap::set(uint64_t bit) {
+    const auto mask = 1ULL << (bit % 64);
+    if (!(words[bit / 64].fetch_or(mask) & mask)) {
+        n_set++;
+    }
+}
+
+void BlockBitmap::set_range(uint64_t start, uint64_t end) {
+    for (auto bit = start; bit <= end && bit < n_bits; bit++) {
+        set(bit);
+    }
+}
+
+bool BlockBitmap::test(uint64_t bit) const {
+    return words[bit / 64].load() & (1ULL << (bit % 64));
+}
+
+bool BlockBitmap::clear(uint64_t bit) {
+    const auto mask = 1ULL << (bit % 64);
+    if (words[bit / 64].fetch_and(~mask) & mask) {
+        n_set--;
+        return true;
+    }
+    return false;
+}
+
+std::optional<std::pair<uint64_t, uint64_t>> BlockBitmap::pop_range(
+    uint64_t max_len) {
+    if (words.empty() || n_set.load() == 0) {
+        return std::nullopt;
+    }
+
+    // scan from the cursor to the end and wrap around once
+    const auto n_words = words.size();
+    for (uint64_t i = 0; i <= n_words; i++) {
+        const auto word_idx = (cursor / 64 + i) % n_words;
+        auto word = words[word_idx].load();
+        if (i == 0) {
+            word &= ~0ULL << (cursor % 64);
+        }
+        if (word == 0) {
+            continue;
+        }
+
+        const uint64_t start = word_idx * 64 + std::countr_zero(word);
+        auto end = start;
+        clear(start);
+        while (end + 1 < n_bits && end + 1 - start < max_len &&
+               clear(end + 1)) {
+            end++;
+        }
+        cursor = (end + 1) % n_bits;
+        return std::make_pair(start, end);
+    }
+    return std::nullopt;
+}
+
+std::vector<uint64_t> BlockBitmap::dump() const {
+    std::vector<uint64_t> saved(words.size());
+    for (size_t i = 0; i < words.size(); i++) {
+        saved[i] = words[i].load();
+    }
+    return saved;
+}
+
+void BlockBitmap::load(const std::vector<uint64_t> &saved) {
+    for (size_t i = 0; i < saved.size() && i < words.size(); i++) {
+        for (auto word = saved[i]; word != 0; word &= word - 1) {
+            const auto bit = i * 64 + std::countr_zero(word);
+            if (bit < n_bits) {
+                set(bit);
+            }
+        }
+    }
+}
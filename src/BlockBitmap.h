@@ -0,0 +1,37 @@
+#ifndef BLOCK_BITMAP_H
+#define BLOCK_BITMAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+// Thread safe bitmap with one bit per block. Setting bits never blocks, so it
+// can be used from the NBD thread to record blocks that still need work.
+class BlockBitmap {
+    std::vector<std::atomic<uint64_t>> words;
+    uint64_t n_bits;
+    std::atomic<uint64_t> n_set{0};
+    uint64_t cursor = 0;  // only touched by the consumer
+
+   public:
+    explicit BlockBitmap(uint64_t n_bits);
+    void set(uint64_t bit);
+    // set all bits in [start, end]
+    void set_range(uint64_t start, uint64_t end);
+    bool test(uint64_t bit) const;
+    // clear a bit, returns whether it was set
+    bool clear(uint64_t bit);
+    // find the next run of set bits starting from the internal cursor, clear
+    // at most max_len of them and return the inclusive range
+    std::optional<std::pair<uint64_t, uint64_t>> pop_range(uint64_t max_len);
+    uint64_t count() const { return n_set.load(); }
+    // the bits as words, for saving them
+    std::vector<uint64_t> dump() const;
+    // set the bits of words that dump() returned
+    void load(const std::vector<uint64_t> &saved);
+    uint64_t size() const { return n_bits; }
+};
+
+#endif
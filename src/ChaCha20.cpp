@@ -0,0 +1,130 @@
+#include "ChaCha20.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+namespace {
+constexpr int LANES = 8;  // 64 byte blocks computed side by side
+constexpr size_t CHACHA_BLOCK = 64;
+
+inline uint32_t load32(const uint8_t* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24;
+}
+
+typedef uint32_t lanes_t __attribute__((vector_size(LANES * 4)));
+
+#define ROTL(v, c) ((v) << (c) | (v) >> (32 - (c)))
+
+// one vector per state word holds that word for all lanes, so the rounds run
+// on whole registers on any SIMD width the compiler targets
+#define CHACHA_QR(a, b, c, d) \
+    x[a] += x[b];             \
+    x[d] ^= x[a];             \
+    x[d] = ROTL(x[d], 16);    \
+    x[c] += x[d];             \
+    x[b] ^= x[c];             \
+    x[b] = ROTL(x[b], 12);    \
+    x[a] += x[b];             \
+    x[d] ^= x[a];             \
+    x[d] = ROTL(x[d], 8);     \
+    x[c] += x[d];             \
+    x[b] ^= x[c];             \
+    x[b] = ROTL(x[b], 7);
+
+#if defined(__x86_64__)
+#define CHACHA_TARGETS \
+    __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define CHACHA_TARGETS
+#endif
+
+// key stream of LANES consecutive blocks, lane l at counter + l
+CHACHA_TARGETS void chacha20_blocks(const uint32_t* key_words,
+                                    const uint32_t* nonce_words,
+                                    uint64_t counter, uint8_t* stream) {
+    lanes_t init[16];
+    // "expand 32-byte k"
+    init[0] = lanes_t{} + 0x61707865;
+    init[1] = lanes_t{} + 0x3320646e;
+    init[2] = lanes_t{} + 0x79622d32;
+    init[3] = lanes_t{} + 0x6b206574;
+    for (int i = 0; i < 8; i++) {
+        init[4 + i] = lanes_t{} + key_words[i];
+    }
+    for (int l = 0; l < LANES; l++) {
+        init[12][l] = static_cast<uint32_t>(counter + l);
+        init[13][l] = static_cast<uint32_t>((counter + l) >> 32);
+    }
+    init[14] = lanes_t{} + nonce_words[0];
+    init[15] = lanes_t{} + nonce_words[1];
+
+    lanes_t x[16];
+    for (int i = 0; i < 16; i++) {
+        x[i] = init[i];
+    }
+    for (int round = 0; round < 10; round++) {
+        CHACHA_QR(0, 4, 8, 12)
+        CHACHA_QR(1, 5, 9, 13)
+        CHACHA_QR(2, 6, 10, 14)
+        CHACHA_QR(3, 7, 11, 15)
+        CHACHA_QR(0, 5, 10, 15)
+        CHACHA_QR(1, 6, 11, 12)
+        CHACHA_QR(2, 7, 8, 13)
+        CHACHA_QR(3, 4, 9, 14)
+    }
+
+    // transpose into the little endian byte stream of each block
+    for (int i = 0; i < 16; i++) {
+        x[i] += init[i];
+        for (int l = 0; l < LANES; l++) {
+            uint8_t* p = stream + l * CHACHA_BLOCK + i * 4;
+            if constexpr (std::endian::native == std::endian::little) {
+                const uint32_t word = x[i][l];
+                memcpy(p, &word, sizeof(word));
+            } else {
+                p[0] = x[i][l];
+                p[1] = x[i][l] >> 8;
+                p[2] = x[i][l] >> 16;
+                p[3] = x[i][l] >> 24;
+            }
+        }
+    }
+}
+#undef CHACHA_QR
+#undef ROTL
+}  // namespace
+
+void chacha20_xor(const std::array<uint8_t, KEY_SIZE>& key,
+                  const std::array<uint8_t, USER_IV_SIZE>& nonce,
+                  uint64_t counter, const uint8_t* in, uint8_t* out,
+                  size_t len) {
+    uint32_t key_words[8];
+    for (int i = 0; i < 8; i++) {
+        key_words[i] = load32(key.data() + i * 4);
+    }
+    const uint32_t nonce_words[2] = {load32(nonce.data()),
+                                     load32(nonce.data() + 4)};
+
+    uint8_t stream[LANES * CHACHA_BLOCK];
+    for (size_t done = 0; done < len; done += sizeof(stream)) {
+        chacha20_blocks(key_words, nonce_words, counter, stream);
+        counter += LANES;
+        const auto n = std::min(sizeof(stream), len - done);
+        if (n == sizeof(stream)) {
+            // full chunk, xor by fixed size words so the loop vectorizes
+            uint64_t data[sizeof(stream) / 8];
+            uint64_t key_stream[sizeof(stream) / 8];
+            memcpy(data, in + done, sizeof(data));
+            memcpy(key_stream, stream, sizeof(key_stream));
+            for (size_t i = 0; i < sizeof(data) / 8; i++) {
+                data[i] ^= key_stream[i];
+            }
+            memcpy(out + done, data, sizeof(data));
+            continue;
+        }
+        for (size_t i = 0; i < n; i++) {
+            out[done + i] = in[done + i] ^ stream[i];
+        }
+    }
+}
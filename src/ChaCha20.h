@@ -0,0 +1,17 @@
+#ifndef CHACHA20_H
+#define CHACHA20_H
+
+#include <array>
+#include <cstdint>
+
+#include "consts.h"
+
+// ChaCha20 with a 64 bit block counter and a 64 bit nonce (the original
+// Bernstein layout). xor the key stream starting at 64 byte block `counter`
+// into in, writing len bytes to out. in may equal out
+void chacha20_xor(const std::array<uint8_t, KEY_SIZE>& key,
+                  const std::array<uint8_t, USER_IV_SIZE>& nonce,
+                  uint64_t counter, const uint8_t* in, uint8_t* out,
+                  size_t len);
+
+#endif
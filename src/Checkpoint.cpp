@@ -0,0 +1,78 @@
+#include "Checkpoint.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/log/trivial.hpp>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+
+bool Checkpoint::load(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        const auto eq = line.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        const auto key = line.substr(0, eq);
+        const auto value = line.substr(eq + 1);
+        if (key == "op") {
+            op = value;
+        } else if (key == "snapshot") {
+            snapshot = value;
+        } else if (key == "size" || key == "extent_size" || key == "next") {
+            char *end;
+            const auto number = std::strtoull(value.c_str(), &end, 10);
+            if (value.empty() || *end != '\0') {
+                BOOST_LOG_TRIVIAL(error)
+                    << "Bad checkpoint " << key << " in " << path << ": "
+                    << value << std::endl;
+                return false;
+            }
+            (key == "size" ? size : key == "next" ? next : extent_size) =
+                number;
+        }
+    }
+    return true;
+}
+
+bool Checkpoint::save(const std::string &path) const {
+    // write a new file and rename it, a crash never leaves half a file
+    const auto tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        file << "op=" << op << "\n";
+        file << "size=" << size << "\n";
+        file << "extent_size=" << extent_size << "\n";
+        file << "snapshot=" << snapshot << "\n";
+        file << "next=" << next << "\n";
+        if (!file.good()) {
+            BOOST_LOG_TRIVIAL(error)
+                << "Cannot write checkpoint " << path << std::endl;
+            return false;
+        }
+    }
+    // durable before it replaces the old one
+    const int fd = open(tmp_path.c_str(), O_RDONLY);
+    const bool synced = fd != -1 && fdatasync(fd) == 0;
+    if (fd != -1) close(fd);
+    if (!synced) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Cannot sync checkpoint " << path << std::endl;
+        return false;
+    }
+    std::error_code err;
+    std::filesystem::rename(tmp_path, path, err);
+    if (err) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Cannot replace checkpoint " << path << std::endl;
+        return false;
+    }
+    return true;
+}
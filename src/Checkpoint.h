@@ -0,0 +1,32 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <string>
+
+// Progress of a rebuild or recovery, kept as key=value lines next to the
+// local file. Extents before `next` are acknowledged by the server (rebuild)
+// or synced to the local file (recover), an interrupted run of the same
+// operation on the same volume resumes there. A lazy recovery keeps the
+// extents it restored in a bitmap instead, see LazyRecovery.
+struct Checkpoint {
+    std::string op;  // rebuild | recover | lazy
+    uint64_t size = 0;
+    uint64_t extent_size = 0;
+    std::string snapshot;
+    uint64_t next = 0;
+
+    static std::string path_for(const std::string &image_path) {
+        return image_path + ".checkpoint";
+    }
+    // whether other checkpoints the same run
+    bool same_run(const Checkpoint &other) const {
+        return op == other.op && size == other.size &&
+               extent_size == other.extent_size && snapshot == other.snapshot;
+    }
+    // false if the file is missing or malformed
+    bool load(const std::string &path);
+    bool save(const std::string &path) const;
+};
+
+#endif
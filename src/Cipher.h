@@ -0,0 +1,58 @@
+#ifndef CIPHER_H
+#define CIPHER_H
+
+#include <array>
+#include <variant>
+
+#include "AesCtrKernel.h"
+#include "ChaCha20.h"
+#include "consts.h"
+#include "types.h"
+
+// Cipher policies for EncryptionManager. A policy xors an independent key
+// stream per block number into whole blocks, so encryption and decryption are
+// the same call. Adding a cipher means adding a policy and a CipherType.
+
+struct AesCtrCipher {
+    static constexpr CipherType type = CipherType::AES_256_CTR;
+    AesCtrKernel kernel;
+
+    AesCtrCipher(const std::array<uint8_t, KEY_SIZE>& key,
+                 const std::array<uint8_t, USER_IV_SIZE>& nonce,
+                 AesCtrKernel::Impl impl = AesCtrKernel::detect())
+        : kernel(key, nonce, impl) {}
+    void crypt(const uint8_t* const* in, uint8_t* const* out,
+               const uint64_t* block_nos, size_t n) const {
+        kernel.crypt(in, out, block_nos, n);
+    }
+    const char* kernel_name() const {
+        return AesCtrKernel::name(kernel.get_impl());
+    }
+};
+
+// counter of block b starts at b * BLOCK_SIZE / 64, like the AES-CTR layout
+struct ChaCha20Cipher {
+    static constexpr CipherType type = CipherType::CHACHA20;
+    std::array<uint8_t, KEY_SIZE> key;
+    std::array<uint8_t, USER_IV_SIZE> nonce;
+
+    void crypt(const uint8_t* const* in, uint8_t* const* out,
+               const uint64_t* block_nos, size_t n) const {
+        // consecutive blocks of one extent are one key stream
+        for (size_t b = 0, run = 1; b < n; b += run) {
+            for (run = 1; b + run < n && block_nos[b + run] ==
+                                             block_nos[b] + run &&
+                          in[b + run] == in[b] + run * BLOCK_SIZE &&
+                          out[b + run] == out[b] + run * BLOCK_SIZE;
+                 run++) {
+            }
+            chacha20_xor(key, nonce, block_nos[b] * BLOCK_SIZE / 64, in[b],
+                         out[b], run * BLOCK_SIZE);
+        }
+    }
+    const char* kernel_name() const { return "vectorized"; }
+};
+
+typedef std::variant<AesCtrCipher, ChaCha20Cipher> AnyCipher;
+
+#endif
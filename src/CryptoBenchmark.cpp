@@ -0,0 +1,218 @@
+#include <boost/log/trivial.hpp>
+#include <boost/log/utility/setup.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "EncryptionManager.h"
+#include "Topology.h"
+#include "consts.h"
+
+// Encryption throughput of every cipher on this host, one block per call like
+// the daemon's single writes and CRYPTO_BATCH blocks per call like rebuild.
+// With placement, the throughput of a front end, daemon and sender pipeline
+// for each placement of the three stages on cores and NUMA nodes.
+// Usage: CryptoBenchmark [placement] [MB per run, default 256]
+
+namespace {
+const std::array<uint8_t, KEY_SIZE> key = {1, 2, 3, 4, 5, 6, 7, 8};
+const std::array<uint8_t, USER_IV_SIZE> iv = {0, 1, 2, 3, 4, 5, 6, 7};
+
+double run(EncryptionManager &emgr, uint64_t n_blocks, size_t batch) {
+    std::vector<std::array<uint8_t, BLOCK_SIZE>> blocks(batch);
+    std::vector<uint64_t> block_nos(batch);
+    for (size_t i = 0; i < batch; i++) {
+        blocks[i].fill(static_cast<uint8_t>(i));
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    for (uint64_t block_no = 0; block_no < n_blocks; block_no += batch) {
+        for (size_t i = 0; i < batch; i++) {
+            block_nos[i] = block_no + i;
+        }
+        emgr.crypt_blocks(blocks, block_nos);
+    }
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return n_blocks * BLOCK_SIZE / elapsed.count() / (1024 * 1024);
+}
+
+// bounded queue between two pipeline stages
+template <typename T>
+class Handoff {
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<T> items;
+
+   public:
+    void push(T item) {
+        std::unique_lock guard(lock);
+        changed.wait(guard, [&] { return items.size() < SPSC_SIZE; });
+        items.push_back(std::move(item));
+        changed.notify_all();
+    }
+    T pop() {
+        std::unique_lock guard(lock);
+        changed.wait(guard, [&] { return !items.empty(); });
+        auto item = std::move(items.front());
+        items.pop_front();
+        changed.notify_all();
+        return item;
+    }
+};
+
+struct Placement {
+    std::string name;
+    int front = -1;  // cores, -1 is not pinned
+    int daemon = -1;
+    int sender = -1;
+};
+
+// the front end writes blocks into a file stand in, the daemon copies them
+// into batches it allocates and encrypts, the sender serializes them
+double run_pipeline(EncryptionManager &emgr, uint64_t n_blocks,
+                    const Placement &placement) {
+    using Block = std::array<uint8_t, BLOCK_SIZE>;
+    using Batch = std::unique_ptr<std::vector<Block>>;
+    constexpr uint64_t file_blocks = 16 * 1024;
+    constexpr auto done = UINT64_MAX;
+    // not touched yet, so its pages land on the node of the front end
+    const std::unique_ptr<Block[]> file(new Block[file_blocks]);
+    Handoff<uint64_t> written;
+    Handoff<std::pair<uint64_t, Batch>> encrypted;
+    const auto core = [](int cpu) {
+        return cpu < 0 ? std::vector<int>{} : std::vector<int>{cpu};
+    };
+
+    const auto start = std::chrono::steady_clock::now();
+    std::thread front([&] {
+        Topology::pin(core(placement.front));
+        for (uint64_t block_no = 0; block_no < n_blocks;
+             block_no += CRYPTO_BATCH) {
+            for (size_t i = 0; i < CRYPTO_BATCH; i++) {
+                file[(block_no + i) % file_blocks].fill(
+                    static_cast<uint8_t>(block_no + i));
+            }
+            written.push(block_no);
+        }
+        written.push(done);
+    });
+    std::thread daemon([&] {
+        Topology::pin(core(placement.daemon));
+        std::vector<uint64_t> block_nos(CRYPTO_BATCH);
+        for (auto block_no = written.pop(); block_no != done;
+             block_no = written.pop()) {
+            auto batch = std::make_unique<std::vector<Block>>(CRYPTO_BATCH);
+            for (size_t i = 0; i < CRYPTO_BATCH; i++) {
+                (*batch)[i] = file[(block_no + i) % file_blocks];
+                block_nos[i] = block_no + i;
+            }
+            emgr.crypt_blocks(*batch, block_nos);
+            encrypted.push({block_no, std::move(batch)});
+        }
+        encrypted.push({done, nullptr});
+    });
+    volatile uint8_t sent = 0;  // keeps the copy
+    std::thread sender([&] {
+        Topology::pin(core(placement.sender));
+        std::string message;
+        for (auto batch = encrypted.pop(); batch.first != done;
+             batch = encrypted.pop()) {
+            message.assign(reinterpret_cast<const char *>(batch.second->data()),
+                           CRYPTO_BATCH * BLOCK_SIZE);
+            sent = static_cast<uint8_t>(message.back());
+        }
+    });
+    front.join();
+    daemon.join();
+    sender.join();
+    const std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return n_blocks * BLOCK_SIZE / elapsed.count() / (1024 * 1024);
+}
+
+// placements of the stages that the cores of this host allow
+std::vector<Placement> placements() {
+    std::map<int, std::vector<int>> nodes;
+    for (const auto cpu : Topology::allowed_cpus()) {
+        nodes[Topology::node_of(cpu)].push_back(cpu);
+    }
+    const auto &first = nodes.begin()->second;
+    std::vector<Placement> found = {
+        {"unpinned"}, {"one core", first[0], first[0], first[0]}};
+    if (first.size() >= 3) {
+        found.push_back({"one node", first[0], first[1], first[2]});
+    }
+    if (nodes.size() >= 2) {
+        const auto &second = std::next(nodes.begin())->second;
+        found.push_back(
+            {"daemon on other node", first[0], second[0], first.back()});
+        found.push_back(
+            {"front on other node", first[0], second[0], second.back()});
+    }
+    return found;
+}
+
+void report_placements(uint64_t n_blocks) {
+    const std::array<uint8_t, KEY_SIZE> key = {1, 2, 3, 4, 5, 6, 7, 8};
+    const std::array<uint8_t, USER_IV_SIZE> iv = {0, 1, 2, 3, 4, 5, 6, 7};
+    EncryptionManager emgr(key, iv, CipherType::AES_256_CTR);
+    std::printf("%-24s %6s %6s %6s %15s\n", "placement", "front", "daemon",
+                "sender", "throughput");
+    for (const auto &placement : placements()) {
+        run_pipeline(emgr, n_blocks / 16, placement);  // warm up
+        std::printf("%-24s %6d %6d %6d %10.1f MB/s\n", placement.name.c_str(),
+                    placement.front, placement.daemon, placement.sender,
+                    run_pipeline(emgr, n_blocks, placement));
+    }
+}
+
+void report(const std::string &name, EncryptionManager &emgr,
+            uint64_t n_blocks) {
+    run(emgr, n_blocks / 16, CRYPTO_BATCH);  // warm up
+    const auto single = run(emgr, n_blocks, 1);
+    const auto batched = run(emgr, n_blocks, CRYPTO_BATCH);
+    std::printf("%-28s %10.1f MB/s %10.1f MB/s\n", name.c_str(), single,
+                batched);
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    boost::log::core::get()->set_filter(boost::log::trivial::severity >=
+                                        boost::log::trivial::warning);
+
+    const bool placement = argc > 1 && std::strcmp(argv[1], "placement") == 0;
+    const uint64_t mb = argc > 1 + placement ? std::stoull(argv[1 + placement])
+                                             : 256;
+    const auto n_blocks = mb * 1024 * 1024 / BLOCK_SIZE / CRYPTO_BATCH *
+                          CRYPTO_BATCH;
+    if (placement) {
+        report_placements(n_blocks);
+        return 0;
+    }
+
+    std::printf("%-28s %15s %15s\n", "cipher", "single block",
+                ("batch of " + std::to_string(CRYPTO_BATCH)).c_str());
+    for (const auto impl :
+         {AesCtrKernel::PORTABLE, AesCtrKernel::AESNI, AesCtrKernel::VAES}) {
+        if (!AesCtrKernel::supported(impl)) {
+            continue;
+        }
+        EncryptionManager emgr(key, iv, impl);
+        report(std::string(cipher_name(CipherType::AES_256_CTR)) + " (" +
+                   AesCtrKernel::name(impl) + ")",
+               emgr, n_blocks);
+    }
+    EncryptionManager chacha(key, iv, CipherType::CHACHA20);
+    report(std::string(cipher_name(CipherType::CHACHA20)) + " (" +
+               chacha.kernel_name() + ")",
+           chacha, n_blocks);
+}
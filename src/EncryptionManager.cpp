@@ -1,7 +1,5 @@
 #include "EncryptionManager.h"
 
-#include <openssl/evp.h>
-
 #include <boost/format.hpp>
 #include <boost/log/trivial.hpp>
 #include <fstream>
@@ -9,117 +7,72 @@
 
 #include "consts.h"
 
+AnyCipher EncryptionManager::make_cipher(
+    CipherType type, const std::array<uint8_t, KEY_SIZE>& key,
+    const std::array<uint8_t, USER_IV_SIZE>& iv) {
+    switch (type) {
+        case CipherType::CHACHA20:
+            return ChaCha20Cipher{.key = key, .nonce = iv};
+        case CipherType::AES_256_CTR:
+        default:
+            return AesCtrCipher(key, iv);
+    }
+}
+
 EncryptionManager::EncryptionManager(std::array<uint8_t, KEY_SIZE> key,
-                                     std::array<uint8_t, USER_IV_SIZE> iv)
-    : key(key), user_iv(iv) {}
+                                     std::array<uint8_t, USER_IV_SIZE> iv,
+                                     CipherType type)
+    : key(key), user_iv(iv), cipher(make_cipher(type, key, iv)) {}
+
+EncryptionManager::EncryptionManager(std::array<uint8_t, KEY_SIZE> key,
+                                     std::array<uint8_t, USER_IV_SIZE> iv,
+                                     AesCtrKernel::Impl impl)
+    : key(key), user_iv(iv), cipher(AesCtrCipher(key, iv, impl)) {}
 
 std::array<uint8_t, BLOCK_SIZE> EncryptionManager::encrypt_block(
     const std::array<uint8_t, BLOCK_SIZE>& block, uint64_t block_no) {
-    BOOST_ASSERT_MSG(block.size() == BLOCK_SIZE,
-                     "Block size must be equal to BLOCK_SIZE");
     BOOST_LOG_TRIVIAL(debug) << "Encrypting block " << block_no << std::endl;
 
-    auto ctx = EVP_CIPHER_CTX_new();
-    if (ctx == nullptr) {
-        BOOST_LOG_TRIVIAL(error)
-            << "Failed to create cipher context" << std::endl;
-        throw std::runtime_error("Failed to create cipher context");
-    }
-
-    auto block_iv = gen_iv_from_block_no(block_no);
-
-    if (1 !=
-        EVP_EncryptInit(ctx, EVP_aes_256_ctr(), key.data(), block_iv.data())) {
-        BOOST_LOG_TRIVIAL(error)
-            << "Failed to initialize encryption" << std::endl;
-        throw std::runtime_error("Failed to initialize encryption");
-    }
-
     std::array<uint8_t, BLOCK_SIZE> encrypted_block{};
-    int out_len1;
-    if (1 != EVP_EncryptUpdate(ctx, encrypted_block.data(), &out_len1,
-                               block.data(), (int)block.size())) {
-        BOOST_LOG_TRIVIAL(error) << "Failed to encrypt update" << std::endl;
-    }
-    BOOST_ASSERT_MSG(out_len1 == BLOCK_SIZE,
-                     "Encrypted block size must be equal to BLOCK_SIZE");
-
-    int out_len2 = int(encrypted_block.size()) - out_len1;
-    if (1 !=
-        EVP_EncryptFinal(ctx, encrypted_block.data() + out_len1, &out_len2)) {
-        BOOST_LOG_TRIVIAL(error)
-            << "Failed to finalize encryption" << std::endl;
-    }
-    BOOST_ASSERT_MSG(out_len2 == 0,
-                     "Encrypted block finish size must be equal to 0");
-
-    EVP_CIPHER_CTX_free(ctx);
-
+    const uint8_t* in = block.data();
+    uint8_t* out = encrypted_block.data();
+    std::visit([&](const auto& c) { c.crypt(&in, &out, &block_no, 1); },
+               cipher);
     return encrypted_block;
 }
 
 std::array<uint8_t, BLOCK_SIZE> EncryptionManager::decrypt_block(
     const std::array<uint8_t, BLOCK_SIZE>& block, uint64_t block_no) {
-    BOOST_ASSERT_MSG(block.size() == BLOCK_SIZE,
-                     "Block size must be equal to BLOCK_SIZE");
     BOOST_LOG_TRIVIAL(debug) << "Decrypting block " << block_no << std::endl;
 
-    auto ctx = EVP_CIPHER_CTX_new();
-    if (ctx == nullptr) {
-        BOOST_LOG_TRIVIAL(error)
-            << "Failed to create cipher context" << std::endl;
-        throw std::runtime_error("Failed to create cipher context");
-    }
-
-    auto block_iv = gen_iv_from_block_no(block_no);
-
-    if (1 !=
-        EVP_DecryptInit(ctx, EVP_aes_256_ctr(), key.data(), block_iv.data())) {
-        BOOST_LOG_TRIVIAL(error)
-            << "Failed to initialize decryption" << std::endl;
-        throw std::runtime_error("Failed to initialize decryption");
-    }
-
+    // both ciphers are stream ciphers, decryption is the same key stream xor
     std::array<uint8_t, BLOCK_SIZE> decrypted_block{};
-    int out_len1 = (int)decrypted_block.size();
-
-    if (1 != EVP_DecryptUpdate(ctx, decrypted_block.data(), &out_len1,
-                               block.data(), (int)block.size())) {
-        BOOST_LOG_TRIVIAL(error) << "Failed to decrypt update" << std::endl;
-    }
-    BOOST_ASSERT_MSG(out_len1 == BLOCK_SIZE,
-                     "Decrypted block size must be equal to BLOCK_SIZE");
-
-    int out_len2 = int(decrypted_block.size()) - out_len1;
-    if (1 !=
-        EVP_DecryptFinal(ctx, decrypted_block.data() + out_len1, &out_len2)) {
-        BOOST_LOG_TRIVIAL(error)
-            << "Failed to finalize decryption" << std::endl;
-    }
-    BOOST_ASSERT_MSG(out_len2 == 0,
-                     "Decrypted block finish size must be equal to 0");
-
-    EVP_CIPHER_CTX_free(ctx);
-
+    const uint8_t* in = block.data();
+    uint8_t* out = decrypted_block.data();
+    std::visit([&](const auto& c) { c.crypt(&in, &out, &block_no, 1); },
+               cipher);
     return decrypted_block;
 }
 
-std::vector<uint8_t> EncryptionManager::gen_iv_from_block_no(
-    uint64_t block_no) {
-    auto augmented_block_no = block_no * BLOCK_SIZE / 16;
-
-    std::vector<uint8_t> new_iv(user_iv.begin(), user_iv.end());
-    for (int i = 0; i < sizeof(augmented_block_no); i++) {
-        new_iv.push_back(augmented_block_no >> (i * 8) & 0xFF);
-    }
-
-    std::reverse(new_iv.end() - sizeof(augmented_block_no), new_iv.end());
-    return new_iv;
+void EncryptionManager::crypt(uint8_t* const* data, const uint64_t* block_nos,
+                              size_t n) {
+    std::visit([&](const auto& c) { c.crypt(data, data, block_nos, n); },
+               cipher);
 }
 
-EncryptionManager::EncryptionManager(std::string password)
-    : key{}, user_iv({0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07}) {
+std::array<uint8_t, KEY_SIZE> EncryptionManager::key_from_password(
+    const std::string& password) {
+    std::array<uint8_t, KEY_SIZE> key{};
     for (int i = 0; i < password.size() && i < key.size(); i++) {
         key[i] = password[i];
     }
+    return key;
+}
+
+EncryptionManager::EncryptionManager(std::string password, CipherType type)
+    : key(key_from_password(password)),
+      user_iv({0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07}),
+      cipher(make_cipher(type, key, user_iv)) {
+    BOOST_LOG_TRIVIAL(info) << "Using " << cipher_name(type) << " with "
+                            << kernel_name() << " kernel" << std::endl;
 }
@@ -1,26 +1,96 @@
 #ifndef ENCRYPTION_MANAGER_H
 #define ENCRYPTION_MANAGER_H
+#include <boost/assert.hpp>
 #include <string>
 #include <vector>
 
+#include "Cipher.h"
 #include "consts.h"
 #include "openssl/base.h"
+#include "types.h"
 
 class EncryptionManager final {
    private:
     std::array<uint8_t, KEY_SIZE> key;
     std::array<uint8_t, USER_IV_SIZE> user_iv{};
+    // the policies are plain types, the variant is visited once per call so
+    // the per block loops are compiled for one concrete cipher
+    AnyCipher cipher;
 
-    std::vector<uint8_t> gen_iv_from_block_no(uint64_t block_no);
+    // data[i] is block block_nos[i], encrypted or decrypted in place
+    void crypt(uint8_t* const* data, const uint64_t* block_nos, size_t n);
+
+    static AnyCipher make_cipher(CipherType type,
+                                 const std::array<uint8_t, KEY_SIZE>& key,
+                                 const std::array<uint8_t, USER_IV_SIZE>& iv);
+
+    static std::array<uint8_t, KEY_SIZE> key_from_password(
+        const std::string& password);
 
    public:
-    explicit EncryptionManager(std::string password);
+    explicit EncryptionManager(
+        std::string password, CipherType type = CipherType::AES_256_CTR);
+    explicit EncryptionManager(std::array<uint8_t, KEY_SIZE> key,
+                               std::array<uint8_t, USER_IV_SIZE> iv,
+                               CipherType type = CipherType::AES_256_CTR);
+    // AES-256-CTR with a fixed kernel instead of the fastest one
     explicit EncryptionManager(std::array<uint8_t, KEY_SIZE> key,
-                               std::array<uint8_t, USER_IV_SIZE> iv);
+                               std::array<uint8_t, USER_IV_SIZE> iv,
+                               AesCtrKernel::Impl impl);
     std::array<uint8_t, BLOCK_SIZE> encrypt_block(
         const std::array<uint8_t, BLOCK_SIZE>& block, uint64_t block_no);
     std::array<uint8_t, BLOCK_SIZE> decrypt_block(
         const std::array<uint8_t, BLOCK_SIZE>& block, uint64_t block_no);
+    // encrypt or decrypt blocks[i] as block_nos[i] in place, a batch shares
+    // one key schedule and keeps the SIMD kernel busy across blocks
+    void crypt_blocks(std::vector<std::array<uint8_t, BLOCK_SIZE>>& blocks,
+                      const std::vector<uint64_t>& block_nos) {
+        crypt_extents(blocks, block_nos);
+    }
+    // same for extents of SIZE bytes numbered by extent, the key stream of an
+    // extent is the one of its blocks back to back
+    template <size_t SIZE>
+    void crypt_extents(std::vector<std::array<uint8_t, SIZE>>& extents,
+                       const std::vector<uint64_t>& extent_nos) {
+        BOOST_ASSERT_MSG(extents.size() == extent_nos.size(),
+                         "Every extent needs an extent number");
+        constexpr auto blocks = SIZE / BLOCK_SIZE;
+        std::vector<uint8_t*> data(extents.size() * blocks);
+        std::vector<uint64_t> block_nos(data.size());
+        for (size_t i = 0; i < extents.size(); i++) {
+            for (size_t j = 0; j < blocks; j++) {
+                data[i * blocks + j] = extents[i].data() + j * BLOCK_SIZE;
+                block_nos[i * blocks + j] = extent_nos[i] * blocks + j;
+            }
+        }
+        crypt(data.data(), block_nos.data(), data.size());
+    }
+    // same for only the blocks of an extent that length bytes at offset
+    // fall into, every block has its own key stream so they come out as
+    // they would within the whole extent
+    template <size_t SIZE>
+    void crypt_range(std::array<uint8_t, SIZE>& extent, uint64_t extent_no,
+                     size_t offset, size_t length) {
+        BOOST_ASSERT_MSG(length > 0 && offset + length <= SIZE,
+                         "The range must be within the extent");
+        constexpr auto blocks = SIZE / BLOCK_SIZE;
+        const auto first = offset / BLOCK_SIZE;
+        const auto n = (offset + length - 1) / BLOCK_SIZE - first + 1;
+        std::vector<uint8_t*> data(n);
+        std::vector<uint64_t> block_nos(n);
+        for (size_t j = 0; j < n; j++) {
+            data[j] = extent.data() + (first + j) * BLOCK_SIZE;
+            block_nos[j] = extent_no * blocks + first + j;
+        }
+        crypt(data.data(), block_nos.data(), n);
+    }
+    CipherType cipher_type() const {
+        return std::visit([](const auto& c) { return c.type; }, cipher);
+    }
+    const char* kernel_name() const {
+        return std::visit([](const auto& c) { return c.kernel_name(); },
+                          cipher);
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
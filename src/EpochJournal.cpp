@@ -0,0 +1,468 @@
+#include "EpochJournal.h"
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/log/trivial.hpp>
+#include <cstring>
+#include <filesystem>
+
+namespace {
+
+constexpr uint32_t STAGE_MAGIC = 0x47545345;  // "ESTG"
+constexpr uint32_t COMMIT_MAGIC = 0x4d435345;  // "ESCM"
+
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t stream;  // of the client
+    uint64_t session;
+    uint64_t value;  // extent number of a staged write, epoch of a commit
+    uint32_t length;  // of the data, 0 for a commit
+    // streams of the client for a commit, offset of the data in the extent
+    // for a staged write
+    uint32_t arg;
+    uint64_t checksum;  // of the fields above and the data
+};
+
+// catches torn records at the tail of the journal, not an integrity check
+uint64_t checksum(const RecordHeader &header, const char *data, size_t len) {
+    const uint64_t fields[] = {
+        header.magic | static_cast<uint64_t>(header.stream) << 32,
+        header.session, header.value,
+        header.length | static_cast<uint64_t>(header.arg) << 32};
+    uint64_t h = 0x9e3779b97f4a7c15;
+    for (const auto word : fields) {
+        h = (h ^ word) * 0x100000001b3;
+        h ^= h >> 29;
+    }
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0x100000001b3;
+        h ^= h >> 29;
+    }
+    for (; i < len; i++) {
+        h = (h ^ static_cast<uint8_t>(data[i])) * 0x100000001b3;
+    }
+    return h;
+}
+
+bool sync_dir(const std::string &dir) {
+    const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return false;
+    }
+    const bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+}  // namespace
+
+EpochJournal::EpochJournal(std::string dir, Writer write,
+                           std::function<bool()> sync, uint64_t segment_bytes)
+    : dir(std::move(dir)),
+      write(std::move(write)),
+      sync(std::move(sync)),
+      segment_bytes(segment_bytes) {}
+
+EpochJournal::~EpochJournal() {
+    for (const auto &[id, segment] : segments) {
+        close(segment.fd);
+    }
+}
+
+std::string EpochJournal::segment_path(uint32_t segment) const {
+    return (boost::format("%1%/segment-%2$08d") % dir % segment).str();
+}
+
+bool EpochJournal::open_segment(uint32_t segment, bool create) {
+    const auto path = segment_path(segment);
+    const int fd =
+        ::open(path.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR,
+               0666);
+    if (fd == -1 || (create && !sync_dir(dir))) {
+        BOOST_LOG_TRIVIAL(error) << "Cannot open " << path << std::endl;
+        if (fd != -1) close(fd);
+        return false;
+    }
+    segments[segment] = {.fd = fd,
+                         .bytes = create ? 0 : static_cast<uint64_t>(
+                                                   lseek(fd, 0, SEEK_END))};
+    tail = std::max(tail, segment);
+    return true;
+}
+
+bool EpochJournal::open(uint64_t extent_size) {
+    std::lock_guard guard(lock);
+    clear();
+    this->extent_size = extent_size;
+    std::error_code error;
+    if (std::filesystem::exists(dir, error)) {
+        for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+            const auto name = entry.path().filename().string();
+            if (name.starts_with("segment-") &&
+                !open_segment(std::stoul(name.substr(8)), false)) {
+                return false;
+            }
+        }
+    }
+    // nothing after a torn record was acknowledged
+    uint64_t newest = 0;
+    for (const auto &[id, segment] : segments) {
+        if (!replay(id, newest)) {
+            break;
+        }
+    }
+    if (!apply()) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Cannot redo the epochs in " << dir << std::endl;
+        return false;
+    }
+    if (applied > 0) {
+        BOOST_LOG_TRIVIAL(info)
+            << "Redid staged writes up to epoch " << applied << std::endl;
+    }
+    clear();
+    std::filesystem::create_directories(dir, error);
+    return open_segment(1, true);
+}
+
+bool EpochJournal::reset(uint64_t extent_size) {
+    std::lock_guard guard(lock);
+    clear();
+    this->extent_size = extent_size;
+    applied = 0;  // the epochs of the old volume say nothing about the new
+    std::error_code error;
+    std::filesystem::create_directories(dir, error);
+    return open_segment(1, true);
+}
+
+void EpochJournal::clear() {
+    for (const auto &[id, segment] : segments) {
+        close(segment.fd);
+        unlink(segment_path(id).c_str());
+    }
+    if (!segments.empty()) {
+        sync_dir(dir);
+    }
+    segments.clear();
+    tail = 0;
+    sessions.clear();
+    latest.clear();
+}
+
+bool EpochJournal::replay(uint32_t segment, uint64_t &newest) {
+    const auto &seg = segments[segment];
+    std::vector<char> data(extent_size);
+    uint64_t offset = 0;
+    while (offset < seg.bytes) {
+        RecordHeader header{};
+        if (offset + sizeof header > seg.bytes ||
+            pread(seg.fd, &header, sizeof header, static_cast<long>(offset)) !=
+                sizeof header ||
+            !((header.magic == COMMIT_MAGIC && header.length == 0) ||
+              (header.magic == STAGE_MAGIC && header.length > 0 &&
+               header.arg + uint64_t{header.length} <= extent_size)) ||
+            offset + sizeof header + header.length > seg.bytes ||
+            pread(seg.fd, data.data(), header.length,
+                  static_cast<long>(offset + sizeof header)) !=
+                static_cast<ssize_t>(header.length) ||
+            checksum(header, data.data(), header.length) != header.checksum) {
+            BOOST_LOG_TRIVIAL(info)
+                << "Dropping the journal from segment " << segment << " at "
+                << offset << std::endl;
+            return false;
+        }
+        auto &session = sessions[header.session];
+        session.stream = header.stream;
+        latest[header.stream] =
+            std::max(latest[header.stream], header.session);
+        segments[segment].unresolved++;
+        if (header.magic == STAGE_MAGIC) {
+            session.open.push_back(
+                {header.value, {.segment = segment, .offset = offset},
+                 header.arg, header.length});
+        } else {
+            session.committed.push_back(
+                {header.value, std::move(session.open), segment});
+            session.open.clear();
+            if (header.value >= newest) {
+                newest = header.value;
+                streams = header.arg;
+            }
+        }
+        offset += sizeof header + header.length;
+    }
+    return true;
+}
+
+bool EpochJournal::append(uint64_t session, uint32_t stream, uint64_t value,
+                          uint32_t arg, const char *data, uint32_t length,
+                          Location &at) {
+    if (segments[tail].bytes >= segment_bytes &&
+        !open_segment(tail + 1, true)) {
+        return false;
+    }
+    auto &seg = segments[tail];
+    RecordHeader header{.magic = length > 0 ? STAGE_MAGIC : COMMIT_MAGIC,
+                        .stream = stream,
+                        .session = session,
+                        .value = value,
+                        .length = length,
+                        .arg = arg};
+    header.checksum = checksum(header, data, length);
+    const iovec iov[] = {{&header, sizeof header},
+                         {const_cast<char *>(data), length}};
+    const auto bytes = sizeof header + length;
+    if (pwritev(seg.fd, iov, length > 0 ? 2 : 1,
+                static_cast<long>(seg.bytes)) != static_cast<ssize_t>(bytes)) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Cannot append to segment " << tail << std::endl;
+        return false;
+    }
+    at = {.segment = tail, .offset = seg.bytes};
+    seg.bytes += bytes;
+    seg.unresolved++;
+    seg.dirty = true;
+    return true;
+}
+
+EpochJournal::Session *EpochJournal::bind(uint64_t session, uint32_t stream) {
+    const auto it = sessions.find(session);
+    if (it == sessions.end()) {
+        return nullptr;
+    }
+    if (it->second.stream == -1) {
+        // the client reconnected, it resends whatever the old session holds
+        if (const auto old = latest.find(stream);
+            old != latest.end() && old->second != session) {
+            drop(old->second);
+        }
+        it->second.stream = stream;
+        latest[stream] = session;
+    } else if (it->second.stream != stream) {
+        return nullptr;
+    }
+    return &it->second;
+}
+
+uint64_t EpochJournal::begin() {
+    std::lock_guard guard(lock);
+    sessions[next_session] = {};
+    return next_session++;
+}
+
+bool EpochJournal::stage(uint64_t session, uint32_t stream, uint64_t extent_no,
+                         const char *data, uint32_t offset, uint32_t length) {
+    std::lock_guard guard(lock);
+    if (length == 0) {
+        length = static_cast<uint32_t>(extent_size);
+    }
+    if (offset + uint64_t{length} > extent_size) {
+        return false;
+    }
+    auto *s = bind(session, stream);
+    Location at;
+    if (s == nullptr ||
+        !append(session, stream, extent_no, offset, data, length, at)) {
+        return false;
+    }
+    s->open.push_back({extent_no, at, offset, length});
+    return true;
+}
+
+bool EpochJournal::commit(uint64_t session, uint32_t stream, uint32_t streams,
+                          uint64_t epoch) {
+    std::lock_guard guard(lock);
+    auto *s = bind(session, stream);
+    Location at;
+    if (s == nullptr ||
+        !append(session, stream, epoch, streams, nullptr, 0, at)) {
+        return false;
+    }
+    for (auto &[id, segment] : segments) {
+        if (segment.dirty) {
+            if (fdatasync(segment.fd) != 0) {
+                BOOST_LOG_TRIVIAL(error)
+                    << "Cannot sync segment " << id << std::endl;
+                return false;
+            }
+            segment.dirty = false;
+        }
+    }
+    s->committed.push_back({epoch, std::move(s->open), at.segment});
+    s->open.clear();
+    this->streams = streams;
+    return apply();
+}
+
+bool EpochJournal::apply() {
+    std::vector<Session *> heads;
+    for (uint32_t stream = 0; stream < streams; stream++) {
+        const auto it = latest.find(stream);
+        if (it == latest.end() || sessions[it->second].committed.empty()) {
+            return true;
+        }
+        heads.push_back(&sessions[it->second]);
+    }
+    // a stream that was catching up skipped the epochs in between
+    uint64_t epoch = 0;
+    for (auto e = heads[0]->committed.rbegin();
+         e != heads[0]->committed.rend() && epoch == 0; e++) {
+        if (std::all_of(heads.begin() + 1, heads.end(), [&](Session *head) {
+                return std::any_of(
+                    head->committed.begin(), head->committed.end(),
+                    [&](const Epoch &other) {
+                        return other.epoch == e->epoch;
+                    });
+            })) {
+            epoch = e->epoch;
+        }
+    }
+    if (epoch == 0) {
+        return true;
+    }
+
+    // the latest whole write of every extent and the partial ones after
+    // it, in extent order. An extent always comes through the same stream,
+    // so its writes are in order
+    std::map<uint64_t, std::vector<Staged>> writes;
+    for (const auto *head : heads) {
+        for (const auto &e : head->committed) {
+            if (e.epoch > epoch) {
+                break;
+            }
+            for (const auto &staged : e.writes) {
+                auto &extent = writes[staged.extent_no];
+                if (staged.length == extent_size) {
+                    extent.clear();
+                }
+                extent.push_back(staged);
+            }
+        }
+    }
+    // partial writes are merged into a whole one, or patched in on their own
+    std::vector<char> data(extent_size);
+    const auto apply_extent = [&](uint64_t extent_no,
+                                  const std::vector<Staged> &staged) {
+        const bool whole = staged.front().length == extent_size;
+        for (const auto &w : staged) {
+            if (pread(segments[w.at.segment].fd, data.data() + w.offset,
+                      w.length,
+                      static_cast<long>(w.at.offset + sizeof(RecordHeader))) !=
+                    static_cast<ssize_t>(w.length) ||
+                (!whole &&
+                 !write(extent_no, data.data() + w.offset, w.offset,
+                        w.length))) {
+                return false;
+            }
+        }
+        return !whole ||
+               write(extent_no, data.data(), 0,
+                     static_cast<uint32_t>(extent_size));
+    };
+    for (const auto &[extent_no, staged] : writes) {
+        if (!apply_extent(extent_no, staged)) {
+            BOOST_LOG_TRIVIAL(error)
+                << "Cannot apply extent " << extent_no << " of epoch "
+                << epoch << std::endl;
+            return false;
+        }
+    }
+    if (!sync()) {
+        return false;
+    }
+
+    for (auto *head : heads) {
+        while (!head->committed.empty() &&
+               head->committed.front().epoch <= epoch) {
+            for (const auto &staged : head->committed.front().writes) {
+                resolve(staged.at.segment);
+            }
+            resolve(head->committed.front().segment);
+            head->committed.pop_front();
+        }
+    }
+    BOOST_LOG_TRIVIAL(debug)
+        << boost::format("Applied epoch %1%, %2% extents") % epoch %
+               writes.size()
+        << std::endl;
+    applied = std::max(applied, epoch);
+    applied_changed.notify_all();
+    release();
+    return true;
+}
+
+void EpochJournal::resolve(uint32_t segment) {
+    segments[segment].unresolved--;
+}
+
+void EpochJournal::drop(uint64_t session) {
+    const auto it = sessions.find(session);
+    if (it == sessions.end()) {
+        return;
+    }
+    for (const auto &staged : it->second.open) {
+        resolve(staged.at.segment);
+    }
+    for (const auto &e : it->second.committed) {
+        for (const auto &staged : e.writes) {
+            resolve(staged.at.segment);
+        }
+        resolve(e.segment);
+    }
+    if (it->second.stream >= 0) {
+        const auto stream = static_cast<uint32_t>(it->second.stream);
+        if (latest[stream] == session) {
+            latest.erase(stream);
+        }
+    }
+    sessions.erase(it);
+    release();
+}
+
+void EpochJournal::release() {
+    // oldest first, so what a crash leaves is never older than the image
+    bool deleted = false;
+    while (segments.size() > 1 && segments.begin()->second.unresolved == 0) {
+        close(segments.begin()->second.fd);
+        unlink(segment_path(segments.begin()->first).c_str());
+        segments.erase(segments.begin());
+        deleted = true;
+    }
+    if (deleted) {
+        sync_dir(dir);
+    }
+    auto &seg = segments[tail];
+    if (segments.size() == 1 && seg.unresolved == 0 && seg.bytes > 0) {
+        if (ftruncate(seg.fd, 0) != 0) {
+            BOOST_LOG_TRIVIAL(error)
+                << "Cannot truncate segment " << tail << std::endl;
+            return;
+        }
+        seg.bytes = 0;
+        seg.dirty = false;
+    }
+}
+
+void EpochJournal::end(uint64_t session) {
+    std::lock_guard guard(lock);
+    drop(session);
+}
+
+uint64_t EpochJournal::wait(uint64_t after,
+                            std::chrono::milliseconds timeout) {
+    std::unique_lock guard(lock);
+    applied_changed.wait_for(guard, timeout, [&] { return applied > after; });
+    return applied;
+}
+
+size_t EpochJournal::n_segments() {
+    std::lock_guard guard(lock);
+    return segments.size();
+}
@@ -0,0 +1,130 @@
+#ifndef EPOCH_JOURNAL_H
+#define EPOCH_JOURNAL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "consts.h"
+
+// Holds the staged writes of ReplicateBlocks sessions back until every stream
+// of the client committed their epoch, then applies them to the image at
+// once, so the image only moves from one client flush to the next. Staged
+// writes and commits are appended to segment files in a directory, which are
+// synced at every commit. Only the latest write of every extent in the epochs
+// applied together reaches the image, with the partial writes after it
+// merged in. A new session of a client stream drops
+// what the old one staged and did not get applied, the client resends it as
+// it was never acknowledged. Opening redoes the newest epoch every stream
+// committed before a crash and drops the rest.
+class EpochJournal {
+   public:
+    // write length bytes at offset of an extent to the image
+    typedef std::function<bool(uint64_t extent_no, const char *data,
+                               uint32_t offset, uint32_t length)>
+        Writer;
+
+   private:
+    struct Location {
+        uint32_t segment = 0;
+        uint64_t offset = 0;  // of the record
+    };
+    struct Staged {
+        uint64_t extent_no;
+        Location at;
+        uint32_t offset;  // of the data in the extent
+        uint32_t length;
+    };
+    struct Epoch {
+        uint64_t epoch;
+        std::vector<Staged> writes;
+        uint32_t segment;  // of the commit
+    };
+    struct Session {
+        int64_t stream = -1;  // of the client, -1 until the first record
+        std::vector<Staged> open;  // not committed yet
+        std::deque<Epoch> committed;  // not applied yet, oldest first
+    };
+    struct Segment {
+        int fd = -1;
+        uint64_t bytes = 0;
+        uint64_t unresolved = 0;  // records neither applied nor dropped
+        bool dirty = false;  // appended to since the last sync
+    };
+
+    std::string dir;
+    Writer write;
+    std::function<bool()> sync;
+    uint64_t segment_bytes;
+    uint64_t extent_size = BLOCK_SIZE;
+
+    std::mutex lock;  // also held while applying
+    std::condition_variable applied_changed;
+    std::map<uint32_t, Segment> segments;
+    uint32_t tail = 0;  // the segment appended to
+    std::map<uint64_t, Session> sessions;
+    uint64_t next_session = 1;
+    std::map<uint32_t, uint64_t> latest;  // session of every client stream
+    uint32_t streams = 1;  // of the client, as of the last commit
+    uint64_t applied = 0;  // last epoch in the image
+
+    std::string segment_path(uint32_t segment) const;
+    bool open_segment(uint32_t segment, bool create);
+    bool append(uint64_t session, uint32_t stream, uint64_t value,
+                uint32_t arg, const char *data, uint32_t length,
+                Location &at);
+    // the session of a client stream, nullptr if a newer one took over
+    Session *bind(uint64_t session, uint32_t stream);
+    // read the records of a segment into sessions, false at a torn record,
+    // the client streams are taken from the newest commit
+    bool replay(uint32_t segment, uint64_t &newest);
+    // apply the newest epoch every stream committed and everything before
+    bool apply();
+    void resolve(uint32_t segment);
+    void drop(uint64_t session);
+    // delete the segments nothing refers to any more
+    void release();
+    void clear();
+
+   public:
+    EpochJournal(std::string dir, Writer write, std::function<bool()> sync,
+                 uint64_t segment_bytes = EPOCH_SEGMENT_BYTES);
+    ~EpochJournal();
+    EpochJournal(const EpochJournal &) = delete;
+    EpochJournal &operator=(const EpochJournal &) = delete;
+
+    // redo the complete epochs a crash left behind, then start empty
+    bool open(uint64_t extent_size);
+    // start empty for a new volume
+    bool reset(uint64_t extent_size);
+
+    uint64_t begin();
+    // stage length bytes at offset of an extent, the whole extent if length
+    // is 0. False if the write cannot be staged or a newer session of the
+    // stream took over
+    bool stage(uint64_t session, uint32_t stream, uint64_t extent_no,
+               const char *data, uint32_t offset = 0, uint32_t length = 0);
+    // durably end the epoch of the session's staged writes, and apply what
+    // every stream committed, false on errors
+    bool commit(uint64_t session, uint32_t stream, uint32_t streams,
+                uint64_t epoch);
+    // drop what the session staged and is not applied yet
+    void end(uint64_t session);
+    // wait until an epoch after after is applied or timeout, returns the
+    // last applied epoch
+    uint64_t wait(uint64_t after, std::chrono::milliseconds timeout);
+    // keeps epochs from being applied, so a snapshot never sees half of one
+    std::unique_lock<std::mutex> hold() { return std::unique_lock(lock); }
+    // the last epoch in the image, 0 if none was applied since opening. Call
+    // with hold()
+    uint64_t last_applied() const { return applied; }
+    size_t n_segments();
+};
+
+#endif
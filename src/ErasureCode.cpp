@@ -0,0 +1,279 @@
+#include "ErasureCode.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 and generator 2
+struct Field {
+    std::array<uint8_t, 512> exp{};
+    std::array<int, 256> log{};
+
+    Field() {
+        int x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = exp[i + 255] = static_cast<uint8_t>(x);
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= 0x11d;
+            }
+        }
+    }
+    uint8_t mul(uint8_t a, uint8_t b) const {
+        return a == 0 || b == 0 ? 0 : exp[log[a] + log[b]];
+    }
+    uint8_t inv(uint8_t a) const { return exp[255 - log[a]]; }
+};
+
+const Field &field() {
+    static const Field f;
+    return f;
+}
+
+// products of c with every low nibble, then with every high nibble
+void nibble_tables(uint8_t c, uint8_t *tables) {
+    for (int x = 0; x < 16; x++) {
+        tables[x] = field().mul(c, static_cast<uint8_t>(x));
+        tables[16 + x] = field().mul(c, static_cast<uint8_t>(x << 4));
+    }
+}
+
+void dot_portable(const uint8_t *tables, int n, const uint8_t *const *in,
+                  uint8_t *out, size_t start, size_t len) {
+    std::memset(out + start, 0, len - start);
+    for (int j = 0; j < n; j++) {
+        const auto lo = tables + j * 32;
+        const auto hi = lo + 16;
+        for (auto pos = start; pos < len; pos++) {
+            out[pos] ^= lo[in[j][pos] & 0x0f] ^ hi[in[j][pos] >> 4];
+        }
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3"))) void dot_ssse3(const uint8_t *tables, int n,
+                                                const uint8_t *const *in,
+                                                uint8_t *out, size_t len) {
+    const auto mask = _mm_set1_epi8(0x0f);
+    size_t pos = 0;
+    for (; pos + 16 <= len; pos += 16) {
+        auto acc = _mm_setzero_si128();
+        for (int j = 0; j < n; j++) {
+            const auto lo = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(tables + j * 32));
+            const auto hi = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(tables + j * 32 + 16));
+            const auto v =
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(in[j] + pos));
+            acc = _mm_xor_si128(
+                acc, _mm_xor_si128(
+                         _mm_shuffle_epi8(lo, _mm_and_si128(v, mask)),
+                         _mm_shuffle_epi8(
+                             hi, _mm_and_si128(_mm_srli_epi64(v, 4), mask))));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + pos), acc);
+    }
+    dot_portable(tables, n, in, out, pos, len);
+}
+
+// two registers of output in flight per pass over the inputs
+__attribute__((target("avx2"))) void dot_avx2(const uint8_t *tables, int n,
+                                              const uint8_t *const *in,
+                                              uint8_t *out, size_t len) {
+    const auto mask = _mm256_set1_epi8(0x0f);
+    size_t pos = 0;
+    for (; pos + 64 <= len; pos += 64) {
+        auto acc0 = _mm256_setzero_si256();
+        auto acc1 = _mm256_setzero_si256();
+        for (int j = 0; j < n; j++) {
+            const auto lo = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(tables + j * 32)));
+            const auto hi = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(tables + j * 32 + 16)));
+            const auto src = reinterpret_cast<const __m256i *>(in[j] + pos);
+            const auto v0 = _mm256_loadu_si256(src);
+            const auto v1 = _mm256_loadu_si256(src + 1);
+            acc0 = _mm256_xor_si256(
+                acc0,
+                _mm256_xor_si256(
+                    _mm256_shuffle_epi8(lo, _mm256_and_si256(v0, mask)),
+                    _mm256_shuffle_epi8(
+                        hi, _mm256_and_si256(_mm256_srli_epi64(v0, 4), mask))));
+            acc1 = _mm256_xor_si256(
+                acc1,
+                _mm256_xor_si256(
+                    _mm256_shuffle_epi8(lo, _mm256_and_si256(v1, mask)),
+                    _mm256_shuffle_epi8(
+                        hi, _mm256_and_si256(_mm256_srli_epi64(v1, 4), mask))));
+        }
+        const auto dst = reinterpret_cast<__m256i *>(out + pos);
+        _mm256_storeu_si256(dst, acc0);
+        _mm256_storeu_si256(dst + 1, acc1);
+    }
+    dot_portable(tables, n, in, out, pos, len);
+}
+#endif
+
+// invert the n x n matrix a in place by Gauss-Jordan elimination, false if
+// it is singular
+bool invert(std::vector<uint8_t> &a, int n) {
+    std::vector<uint8_t> inv(n * n, 0);
+    for (int i = 0; i < n; i++) {
+        inv[i * n + i] = 1;
+    }
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (pivot < n && a[pivot * n + col] == 0) {
+            pivot++;
+        }
+        if (pivot == n) {
+            return false;
+        }
+        for (int j = 0; j < n; j++) {
+            std::swap(a[pivot * n + j], a[col * n + j]);
+            std::swap(inv[pivot * n + j], inv[col * n + j]);
+        }
+        const auto scale = field().inv(a[col * n + col]);
+        for (int j = 0; j < n; j++) {
+            a[col * n + j] = field().mul(a[col * n + j], scale);
+            inv[col * n + j] = field().mul(inv[col * n + j], scale);
+        }
+        for (int row = 0; row < n; row++) {
+            const auto factor = a[row * n + col];
+            if (row == col || factor == 0) {
+                continue;
+            }
+            for (int j = 0; j < n; j++) {
+                a[row * n + j] ^= field().mul(factor, a[col * n + j]);
+                inv[row * n + j] ^= field().mul(factor, inv[col * n + j]);
+            }
+        }
+    }
+    a = std::move(inv);
+    return true;
+}
+}  // namespace
+
+ErasureCode::ErasureCode(int data_shards, int parity_shards, Impl impl)
+    : k(data_shards), m(parity_shards), impl(impl) {
+    if (k < 1 || m < 0 || k + m > 256) {
+        throw std::invalid_argument("Unsupported erasure code shard counts");
+    }
+    if (!supported(impl)) {
+        this->impl = PORTABLE;
+    }
+
+    matrix.assign((k + m) * k, 0);
+    for (int i = 0; i < k; i++) {
+        matrix[i * k + i] = 1;
+    }
+    // Cauchy rows 1 / (x_i + y_j) with x_i = k + i and y_j = j
+    parity_tables.resize(m * k * 32);
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < k; j++) {
+            const auto c = field().inv(static_cast<uint8_t>((k + i) ^ j));
+            matrix[(k + i) * k + j] = c;
+            nibble_tables(c, parity_tables.data() + (i * k + j) * 32);
+        }
+    }
+}
+
+void ErasureCode::dot(const uint8_t *tables, int n, const uint8_t *const *in,
+                      uint8_t *out, size_t len) const {
+#if defined(__x86_64__)
+    switch (impl) {
+        case AVX2:
+            dot_avx2(tables, n, in, out, len);
+            return;
+        case SSSE3:
+            dot_ssse3(tables, n, in, out, len);
+            return;
+        case PORTABLE:
+            break;
+    }
+#endif
+    dot_portable(tables, n, in, out, 0, len);
+}
+
+void ErasureCode::encode(const uint8_t *const *data, uint8_t *const *parity,
+                         size_t len) const {
+    for (int i = 0; i < m; i++) {
+        dot(parity_tables.data() + i * k * 32, k, data, parity[i], len);
+    }
+}
+
+bool ErasureCode::decode(const std::vector<int> &ids,
+                         const uint8_t *const *shards, uint8_t *const *data,
+                         size_t len) const {
+    if (ids.size() != static_cast<size_t>(k)) {
+        return false;
+    }
+    std::vector<uint8_t> rows(k * k);
+    for (int i = 0; i < k; i++) {
+        if (ids[i] < 0 || ids[i] >= k + m) {
+            return false;
+        }
+        std::copy_n(matrix.begin() + ids[i] * k, k, rows.begin() + i * k);
+    }
+    // a repeated id leaves the rows singular
+    if (!invert(rows, k)) {
+        return false;
+    }
+
+    std::vector<uint8_t> tables(k * 32);
+    for (int d = 0; d < k; d++) {
+        if (const auto it = std::find(ids.begin(), ids.end(), d);
+            it != ids.end()) {
+            const auto src = shards[it - ids.begin()];
+            if (src != data[d]) {
+                std::memcpy(data[d], src, len);
+            }
+            continue;
+        }
+        for (int j = 0; j < k; j++) {
+            nibble_tables(rows[d * k + j], tables.data() + j * 32);
+        }
+        dot(tables.data(), k, shards, data[d], len);
+    }
+    return true;
+}
+
+ErasureCode::Impl ErasureCode::detect() {
+    if (supported(AVX2)) return AVX2;
+    if (supported(SSSE3)) return SSSE3;
+    return PORTABLE;
+}
+
+bool ErasureCode::supported(Impl impl) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    switch (impl) {
+        case AVX2:
+            return __builtin_cpu_supports("avx2");
+        case SSSE3:
+            return __builtin_cpu_supports("ssse3");
+        case PORTABLE:
+            return true;
+    }
+#endif
+    return impl == PORTABLE;
+}
+
+const char *ErasureCode::name(Impl impl) {
+    switch (impl) {
+        case AVX2:
+            return "AVX2";
+        case SSSE3:
+            return "SSSE3";
+        case PORTABLE:
+            return "portable";
+    }
+    return "unknown";
+}
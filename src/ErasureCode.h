@@ -0,0 +1,47 @@
+#ifndef ERASURE_CODE_H
+#define ERASURE_CODE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Systematic Reed-Solomon code over GF(2^8) with k data and m parity shards.
+// The parity rows form a Cauchy matrix, so any k of the k + m shards recover
+// the data. Multiplying by a constant uses two 16 entry nibble tables, looked
+// up 16 or 32 bytes at a time with pshufb.
+class ErasureCode {
+   public:
+    enum Impl { PORTABLE, SSSE3, AVX2 };
+
+   private:
+    int k;
+    int m;
+    Impl impl;
+    std::vector<uint8_t> matrix;  // (k + m) x k generator, identity on top
+    std::vector<uint8_t> parity_tables;  // 32 bytes per parity coefficient
+
+    // out = sum of coefficient j * in[j], with the nibble tables of the
+    // coefficients
+    void dot(const uint8_t *tables, int n, const uint8_t *const *in,
+             uint8_t *out, size_t len) const;
+
+   public:
+    ErasureCode(int data_shards, int parity_shards, Impl impl = detect());
+    int data_shards() const { return k; }
+    int parity_shards() const { return m; }
+    // compute the m parity shards of the k data shards, each len bytes
+    void encode(const uint8_t *const *data, uint8_t *const *parity,
+                size_t len) const;
+    // recover the k data shards from any k shards, ids[i] is the index of
+    // shards[i] with data shards first. False if ids do not name k shards
+    bool decode(const std::vector<int> &ids, const uint8_t *const *shards,
+                uint8_t *const *data, size_t len) const;
+    Impl get_impl() const { return impl; }
+
+    // fastest implementation supported by this CPU
+    static Impl detect();
+    static bool supported(Impl impl);
+    static const char *name(Impl impl);
+};
+
+#endif
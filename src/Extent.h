@@ -0,0 +1,54 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include "consts.h"
+
+// A volume replicates in extents of extent_size bytes, a multiple of the NBD
+// BLOCK_SIZE fixed at setup. An extent is the unit of encryption calls, RPC
+// messages and server I/O. The key stream only depends on the byte offset, so
+// the encrypted image is the same for every extent size.
+template <uint64_t SIZE>
+struct Extent {
+    static_assert(SIZE % BLOCK_SIZE == 0 && SIZE <= MAX_EXTENT_SIZE);
+    static constexpr uint64_t size = SIZE;
+    static constexpr uint64_t blocks = SIZE / BLOCK_SIZE;
+    // extents read and encrypted together, CRYPTO_BATCH blocks or one extent
+    static constexpr uint64_t batch =
+        std::max<uint64_t>(1, CRYPTO_BATCH / blocks);
+    typedef std::array<uint8_t, SIZE> Data;
+};
+
+inline bool valid_extent_size(uint64_t size) {
+    return size == 4 * 1024 || size == 16 * 1024 || size == 64 * 1024 ||
+           size == 256 * 1024 || size == 1024 * 1024;
+}
+
+// erasure coded volumes keep one shard of every extent on each server, in
+// server extents of any whole number of blocks
+inline bool valid_shard_size(uint64_t size) {
+    return size > 0 && size % BLOCK_SIZE == 0 && size <= MAX_EXTENT_SIZE;
+}
+
+// call f(Extent<extent_size>{}), so the per extent loops are compiled for
+// each supported size instead of using a run time size
+template <typename F>
+auto with_extent(uint64_t extent_size, F &&f) {
+    switch (extent_size) {
+        case 16 * 1024:
+            return f(Extent<16 * 1024>{});
+        case 64 * 1024:
+            return f(Extent<64 * 1024>{});
+        case 256 * 1024:
+            return f(Extent<256 * 1024>{});
+        case 1024 * 1024:
+            return f(Extent<1024 * 1024>{});
+        default:
+            return f(Extent<BLOCK_SIZE>{});
+    }
+}
+
+#endif
@@ -0,0 +1,256 @@
+#include "ExtentStream.h"
+
+#include <boost/format.hpp>
+#include <boost/log/trivial.hpp>
+#include <map>
+
+using grpc::ClientContext;
+using grpc::Status;
+
+ExtentReader::ExtentReader(
+    const std::vector<std::unique_ptr<Transport>> &stubs,
+    const Config &config)
+    : extent_size(config.extent_size) {
+    if (config.data_shards > 0) {
+        code.emplace(config.data_shards, config.parity_shards);
+    }
+    // full replicas are all read from the first server
+    const auto n = code ? stubs.size() : 1;
+    for (size_t i = 0; i < n; i++) {
+        Server server;
+        server.context = std::make_unique<ClientContext>();
+        server.stream = stubs[i]->ReadBlock(server.context.get());
+        servers.push_back(std::move(server));
+    }
+}
+
+ExtentReader::~ExtentReader() { finish(); }
+
+bool ExtentReader::read(uint64_t extent_no, const std::string &snapshot,
+                        uint8_t *extent, BandwidthScheduler *scheduler,
+                        TrafficClass traffic) {
+    if (scheduler != nullptr) {
+        scheduler->acquire(traffic, extent_size);
+    }
+    if (code) {
+        return read_shards(extent_no, snapshot, extent);
+    }
+
+    auto &server = servers.front();
+    ReadBlockRequest req;
+    ReadBlockResponse resp;
+    req.set_block_no(extent_no);
+    req.set_snapshot(snapshot);
+    if (!server.ok || !server.stream->Write(req) ||
+        !server.stream->Read(&resp)) {
+        server.ok = false;
+        BOOST_LOG_TRIVIAL(error) << "RPC stream closed" << std::endl;
+        return false;
+    }
+
+    if (!resp.success()) {
+        BOOST_LOG_TRIVIAL(warning)
+            << "RPC Read Block Failed: " << resp.message() << std::endl;
+        return false;
+    }
+    if (resp.data().size() != extent_size) {
+        BOOST_LOG_TRIVIAL(warning)
+            << "RPC Read Block returned " << resp.data().size()
+            << " bytes, expected " << extent_size << std::endl;
+        return false;
+    }
+    std::copy(resp.data().begin(), resp.data().end(), extent);
+    return true;
+}
+
+bool ExtentReader::read_shards(uint64_t extent_no,
+                               const std::string &snapshot, uint8_t *extent) {
+    const auto k = static_cast<size_t>(code->data_shards());
+    const auto shard_size = extent_size / k;
+    const auto n = servers.size();
+
+    // ask k servers at once, starting at a different one for every extent,
+    // and the next ones for whatever they could not deliver. Every server
+    // names its snapshots on its own, so shards of a snapshot only decode
+    // together if they were taken at the same epoch
+    struct Shards {
+        std::vector<int> ids;
+        std::vector<ReadBlockResponse> responses;
+    };
+    std::map<uint64_t, Shards> by_epoch;
+    const Shards *best = nullptr;
+    const auto have = [&] { return best == nullptr ? 0 : best->ids.size(); };
+    std::vector<size_t> pending;
+    size_t tried = 0;
+    while (have() < k) {
+        while (have() + pending.size() < k && tried < n) {
+            const auto i = (extent_no + tried++) % n;
+            if (!servers[i].ok) {
+                continue;
+            }
+            ReadBlockRequest req;
+            req.set_block_no(extent_no);
+            req.set_snapshot(snapshot);
+            if (!servers[i].stream->Write(req)) {
+                servers[i].ok = false;
+                continue;
+            }
+            pending.push_back(i);
+        }
+        if (pending.empty()) {
+            break;
+        }
+        for (const auto i : pending) {
+            ReadBlockResponse resp;
+            if (!servers[i].stream->Read(&resp)) {
+                servers[i].ok = false;
+                BOOST_LOG_TRIVIAL(warning)
+                    << "RPC stream to shard " << i << " closed" << std::endl;
+                continue;
+            }
+            if (!resp.success() || resp.data().size() != shard_size) {
+                BOOST_LOG_TRIVIAL(warning)
+                    << boost::format("RPC Read Block of shard %1% of extent "
+                                     "%2% failed: %3%") %
+                           i % extent_no % resp.message()
+                    << std::endl;
+                continue;
+            }
+            if (!snapshot.empty() && resp.epoch() == 0) {
+                BOOST_LOG_TRIVIAL(warning)
+                    << boost::format("Shard %1% of snapshot %2% has no "
+                                     "epoch to match") %
+                           i % snapshot
+                    << std::endl;
+                continue;
+            }
+            auto &shards = by_epoch[resp.epoch()];
+            shards.ids.push_back(static_cast<int>(i));
+            shards.responses.push_back(std::move(resp));
+            if (shards.ids.size() > have()) {
+                best = &shards;
+            }
+        }
+        pending.clear();
+    }
+    if (have() < k) {
+        BOOST_LOG_TRIVIAL(error)
+            << boost::format("Only %1% of %2% shards of extent %3% readable") %
+                   have() % k % extent_no
+            << std::endl;
+        if (by_epoch.size() > 1) {
+            BOOST_LOG_TRIVIAL(error)
+                << boost::format("Shards of snapshot %1% were taken at %2% "
+                                 "different epochs") %
+                       snapshot % by_epoch.size()
+                << std::endl;
+        }
+        return false;
+    }
+
+    std::vector<const uint8_t *> in;
+    for (const auto &shard : best->responses) {
+        in.push_back(reinterpret_cast<const uint8_t *>(shard.data().data()));
+    }
+    std::vector<uint8_t *> out;
+    for (size_t d = 0; d < k; d++) {
+        out.push_back(extent + d * shard_size);
+    }
+    return code->decode(best->ids, in.data(), out.data(), shard_size);
+}
+
+bool ExtentReader::finish() {
+    bool ok = true;
+    for (auto &server : servers) {
+        if (!server.stream) {
+            continue;
+        }
+        server.stream->WritesDone();
+        if (Status status = server.stream->Finish(); !status.ok()) {
+            // a server lost while reading was already reported
+            if (server.ok) {
+                BOOST_LOG_TRIVIAL(error)
+                    << "RPC read block stream close failed: "
+                    << status.error_message() << std::endl;
+            }
+            // the other shards covered for a lost erasure coded server
+            ok = ok && code.has_value();
+        }
+        server.stream.reset();
+    }
+    return ok;
+}
+
+ExtentWriter::ExtentWriter(
+    const std::vector<std::unique_ptr<Transport>> &stubs,
+    const Config &config)
+    : extent_size(config.extent_size) {
+    if (config.data_shards > 0) {
+        code.emplace(config.data_shards, config.parity_shards);
+        parity.resize(extent_size / config.data_shards *
+                      config.parity_shards);
+    }
+    for (const auto &stub : stubs) {
+        Server server;
+        server.context = std::make_unique<ClientContext>();
+        server.resp = std::make_unique<WriteBlockResponse>();
+        server.writer =
+            stub->WriteBlock(server.context.get(), server.resp.get());
+        servers.push_back(std::move(server));
+    }
+}
+
+bool ExtentWriter::write(uint64_t extent_no, const uint8_t *extent,
+                         BandwidthScheduler *scheduler, TrafficClass traffic) {
+    auto size = extent_size;
+    if (code) {
+        size = extent_size / code->data_shards();
+        std::vector<const uint8_t *> data;
+        for (int d = 0; d < code->data_shards(); d++) {
+            data.push_back(extent + d * size);
+        }
+        std::vector<uint8_t *> out;
+        for (int p = 0; p < code->parity_shards(); p++) {
+            out.push_back(parity.data() + p * size);
+        }
+        code->encode(data.data(), out.data(), size);
+    }
+
+    for (size_t i = 0; i < servers.size(); i++) {
+        const uint8_t *data = extent;
+        if (code) {
+            const auto k = static_cast<size_t>(code->data_shards());
+            data = i < k ? extent + i * size : parity.data() + (i - k) * size;
+        }
+        if (scheduler != nullptr) {
+            scheduler->acquire(traffic, size);
+        }
+        WriteBlockRequest req;
+        req.set_block_no(extent_no);
+        req.set_data(data, size);
+        // a failed write shows up as the status of Finish
+        if (!servers[i].writer->Write(req)) {
+            BOOST_LOG_TRIVIAL(error) << "RPC stream closed" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ExtentWriter::finish() {
+    bool ok = true;
+    for (auto &server : servers) {
+        server.writer->WritesDone();
+        if (Status status = server.writer->Finish(); !status.ok()) {
+            BOOST_LOG_TRIVIAL(error)
+                << "RPC write block stream close failed: "
+                << status.error_message() << std::endl;
+            ok = false;
+        } else if (!server.resp->success()) {
+            BOOST_LOG_TRIVIAL(warning) << "RPC Write Block Failed: "
+                                       << server.resp->message() << std::endl;
+            ok = false;
+        }
+    }
+    return ok;
+}
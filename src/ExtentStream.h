@@ -0,0 +1,68 @@
+#ifndef EXTENT_STREAM_H
+#define EXTENT_STREAM_H
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "BandwidthScheduler.h"
+#include "ErasureCode.h"
+#include "Transport.h"
+#include "types.h"
+
+// Encrypted extents of the remote volume. Full replicas are read from the
+// first server and written to all of them. An erasure coded volume keeps
+// shard i of every extent on server i, reads take any data_shards of them
+// and writes send every server its shard.
+
+class ExtentReader {
+    struct Server {
+        std::unique_ptr<grpc::ClientContext> context;
+        std::unique_ptr<Transport::ReadStream> stream;
+        bool ok = true;
+    };
+
+    std::vector<Server> servers;
+    uint64_t extent_size;
+    std::optional<ErasureCode> code;
+
+    bool read_shards(uint64_t extent_no, const std::string &snapshot,
+                     uint8_t *extent);
+
+   public:
+    ExtentReader(const std::vector<std::unique_ptr<Transport>> &stubs,
+                 const Config &config);
+    ~ExtentReader();
+    // read extent extent_no of the backup or a snapshot, still encrypted
+    bool read(uint64_t extent_no, const std::string &snapshot,
+              uint8_t *extent, BandwidthScheduler *scheduler,
+              TrafficClass traffic);
+    // close the streams, false if one of them failed
+    bool finish();
+};
+
+class ExtentWriter {
+    struct Server {
+        std::unique_ptr<grpc::ClientContext> context;
+        std::unique_ptr<WriteBlockResponse> resp;
+        std::unique_ptr<Transport::WriteStream> writer;
+    };
+
+    std::vector<Server> servers;
+    uint64_t extent_size;
+    std::optional<ErasureCode> code;
+    std::vector<uint8_t> parity;
+
+   public:
+    ExtentWriter(const std::vector<std::unique_ptr<Transport>> &stubs,
+                 const Config &config);
+    // write encrypted extent extent_no, false once a stream closed
+    bool write(uint64_t extent_no, const uint8_t *extent,
+               BandwidthScheduler *scheduler, TrafficClass traffic);
+    // close the streams, true if every server acknowledged its writes
+    bool finish();
+};
+
+#endif
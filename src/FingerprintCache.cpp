@@ -0,0 +1,140 @@
+#include "FingerprintCache.h"
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+namespace {
+constexpr uint64_t P1 = 11400714785074694791ULL;
+constexpr uint64_t P2 = 14029467366897019727ULL;
+constexpr uint64_t P3 = 1609587929392839161ULL;
+constexpr uint64_t P4 = 9650029242287828579ULL;
+constexpr uint64_t P5 = 2870177450012600261ULL;
+
+uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t xx_round(uint64_t acc, uint64_t input) {
+    acc += input * P2;
+    acc = std::rotl(acc, 31);
+    return acc * P1;
+}
+
+uint64_t merge(uint64_t acc, uint64_t val) {
+    acc ^= xx_round(0, val);
+    return acc * P1 + P4;
+}
+}  // namespace
+
+uint64_t xxhash64(const uint8_t* data, size_t len, uint64_t seed) {
+    const uint8_t* p = data;
+    const uint8_t* const end = data + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + P1 + P2;
+        uint64_t v2 = seed + P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - P1;
+        do {
+            v1 = xx_round(v1, read64(p));
+            v2 = xx_round(v2, read64(p + 8));
+            v3 = xx_round(v3, read64(p + 16));
+            v4 = xx_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) +
+            std::rotl(v4, 18);
+        h = merge(h, v1);
+        h = merge(h, v2);
+        h = merge(h, v3);
+        h = merge(h, v4);
+    } else {
+        h = seed + P5;
+    }
+
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xx_round(0, read64(p));
+        h = std::rotl(h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        h ^= read32(p) * P1;
+        h = std::rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h = std::rotl(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+FingerprintCache::FingerprintCache(FingerprintMode mode, uint64_t n_extents)
+    : mode(mode), hashes(n_extents, 0) {
+    if (mode == FingerprintMode::CONFIRM) {
+        digests.resize(n_extents);
+    }
+}
+
+Fingerprint FingerprintCache::compute(const uint8_t* data, size_t len) const {
+    Fingerprint fp{};
+    fp.hash = xxhash64(data, len);
+    if (fp.hash == 0) {
+        fp.hash = 1;  // 0 is reserved for unknown extents
+    }
+    if (mode == FingerprintMode::CONFIRM) {
+        std::array<uint8_t, SHA256_DIGEST_LENGTH> digest{};
+        SHA256(data, len, digest.data());
+        std::copy_n(digest.begin(), CONFIRM_DIGEST_SIZE, fp.digest.begin());
+    }
+    return fp;
+}
+
+bool FingerprintCache::matches(uint64_t extent_no, const Fingerprint& fp) {
+    if (extent_no >= hashes.size()) {
+        return false;
+    }
+    n_checked++;
+    if (hashes[extent_no] != fp.hash) {
+        return false;
+    }
+    if (mode == FingerprintMode::CONFIRM && digests[extent_no] != fp.digest) {
+        return false;
+    }
+    n_skipped++;
+    return true;
+}
+
+void FingerprintCache::store(uint64_t extent_no, const Fingerprint& fp) {
+    if (extent_no >= hashes.size()) {
+        return;
+    }
+    hashes[extent_no] = fp.hash;
+    if (mode == FingerprintMode::CONFIRM) {
+        digests[extent_no] = fp.digest;
+    }
+}
+
+void FingerprintCache::invalidate(uint64_t extent_no) {
+    if (extent_no < hashes.size()) {
+        hashes[extent_no] = 0;
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef FINGERPRINT_CACHE_H
+#define FINGERPRINT_CACHE_H
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "consts.h"
+#include "types.h"
+
+struct Fingerprint {
+    uint64_t hash;
+    std::array<uint8_t, CONFIRM_DIGEST_SIZE> digest;  // only in confirm mode
+};
+
+// Remembers a fingerprint of the plaintext last replicated for every extent so
+// the daemon can skip rewrites of identical content. The fast mode trusts a
+// 64 bit xxHash, the confirm mode also requires a SHA-256 prefix to match.
+class FingerprintCache {
+    FingerprintMode mode;
+    std::vector<uint64_t> hashes;  // 0 means unknown
+    std::vector<std::array<uint8_t, CONFIRM_DIGEST_SIZE>> digests;
+    uint64_t n_skipped = 0;
+    uint64_t n_checked = 0;
+
+   public:
+    FingerprintCache(FingerprintMode mode, uint64_t n_extents);
+    template <size_t SIZE>
+    Fingerprint compute(const std::array<uint8_t, SIZE>& extent) const {
+        return compute(extent.data(), SIZE);
+    }
+    Fingerprint compute(const uint8_t* data, size_t len) const;
+    // whether the extent is known to hold exactly this content on the server
+    bool matches(uint64_t extent_no, const Fingerprint& fp);
+    void store(uint64_t extent_no, const Fingerprint& fp);
+    void invalidate(uint64_t extent_no);
+    uint64_t skipped() const { return n_skipped; }
+    uint64_t checked() const { return n_checked; }
+};
+
+uint64_t xxhash64(const uint8_t* data, size_t len, uint64_t seed = 0);
+
+#endif
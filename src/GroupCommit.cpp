@@ -0,0 +1,71 @@
+#include "GroupCommit.h"
+
+#include <boost/log/trivial.hpp>
+
+GroupCommit::GroupCommit(std::function<bool()> sync,
+                         std::chrono::milliseconds interval,
+                         uint64_t sync_bytes)
+    : sync(std::move(sync)), interval(interval), sync_bytes(sync_bytes) {
+    thread = std::thread([this] { run(); });
+}
+
+GroupCommit::~GroupCommit() {
+    {
+        std::lock_guard guard(lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+}
+
+uint64_t GroupCommit::wrote(uint64_t bytes) {
+    std::lock_guard guard(lock);
+    const bool first = pending_bytes == 0;
+    if (first) {
+        first_pending = std::chrono::steady_clock::now();
+    }
+    pending_bytes += bytes;
+    if (first || (sync_bytes > 0 && pending_bytes >= sync_bytes)) {
+        wake.notify_one();
+    }
+    return ++written;
+}
+
+uint64_t GroupCommit::wait(uint64_t after,
+                           std::chrono::milliseconds timeout) {
+    std::unique_lock guard(lock);
+    done.wait_for(guard, timeout, [&] { return synced > after; });
+    return synced;
+}
+
+void GroupCommit::run() {
+    std::unique_lock guard(lock);
+    while (true) {
+        wake.wait(guard, [&] { return stopping || written > synced; });
+        // more writes join the sync until it is due
+        wake.wait_until(guard, first_pending + interval, [&] {
+            return stopping || (sync_bytes > 0 && pending_bytes >= sync_bytes);
+        });
+        // only woken without writes to stop
+        if (written == synced) {
+            return;
+        }
+        const auto target = written;
+        pending_bytes = 0;
+
+        guard.unlock();
+        const bool ok = sync();
+        guard.lock();
+        if (ok) {
+            synced = target;
+            done.notify_all();
+        } else {
+            // the writes stay unacknowledged until a later sync succeeds
+            BOOST_LOG_TRIVIAL(error) << "Syncing the image failed" << std::endl;
+            if (stopping) {
+                return;
+            }
+            wake.wait_for(guard, interval, [&] { return stopping; });
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef GROUP_COMMIT_H
+#define GROUP_COMMIT_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Batches the syncs of the backup image over all write streams. Every write
+// takes a ticket, and a ticket is durable once a sync that started after the
+// write completed. A sync starts sync_bytes after the last one, or at the
+// latest sync_interval after the first write it covers.
+class GroupCommit {
+    std::function<bool()> sync;
+    std::chrono::milliseconds interval;
+    uint64_t sync_bytes;  // 0 to only sync by time
+
+    std::mutex lock;
+    std::condition_variable wake;  // the sync thread
+    std::condition_variable done;  // waiters for a ticket
+    uint64_t written = 0;  // last ticket handed out
+    uint64_t synced = 0;  // every ticket up to it is durable
+    uint64_t pending_bytes = 0;  // written since the last sync started
+    std::chrono::steady_clock::time_point first_pending;
+    bool stopping = false;
+    std::thread thread;
+
+    void run();
+
+   public:
+    GroupCommit(std::function<bool()> sync, std::chrono::milliseconds interval,
+                uint64_t sync_bytes);
+    ~GroupCommit();
+    // a write of bytes reached the image, returns its ticket
+    uint64_t wrote(uint64_t bytes);
+    // wait until a ticket after after is durable or timeout, returns the
+    // last durable ticket
+    uint64_t wait(uint64_t after, std::chrono::milliseconds timeout);
+};
+
+#endif
@@ -0,0 +1,52 @@
+#include "Histogram.h"
+
+#include <algorithm>
+
+size_t Histogram::bucket(uint64_t ns) {
+    if (ns < 16) {
+        return ns;
+    }
+    const auto msb = 63 - __builtin_clzll(ns);
+    return (msb - 3) * 16 + ((ns >> (msb - 4)) & 15);
+}
+
+uint64_t Histogram::lower_bound(size_t bucket) {
+    if (bucket < 16) {
+        return bucket;
+    }
+    return (16 + bucket % 16) << (bucket / 16 - 1);
+}
+
+uint64_t Histogram::drain(Histogram &total) {
+    uint64_t n = 0;
+    for (size_t i = 0; i < N_BUCKETS; i++) {
+        const auto count = counts[i].exchange(0);
+        total.counts[i] += count;
+        n += count;
+    }
+    return n;
+}
+
+uint64_t Histogram::count() const {
+    uint64_t n = 0;
+    for (const auto &count : counts) {
+        n += count.load();
+    }
+    return n;
+}
+
+double Histogram::percentile(double p) const {
+    const auto n = count();
+    if (n == 0) {
+        return 0;
+    }
+    const auto target = std::min(n - 1, static_cast<uint64_t>(p / 100 * n));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < N_BUCKETS; i++) {
+        seen += counts[i].load();
+        if (seen > target) {
+            return lower_bound(i) / 1000.0;
+        }
+    }
+    return 0;
+}
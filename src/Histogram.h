@@ -0,0 +1,29 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Latencies in ns, recorded from any thread, 16 buckets per power of two so
+// percentiles are within about 6%
+class Histogram {
+    static constexpr size_t N_BUCKETS = 61 * 16;
+    std::array<std::atomic<uint64_t>, N_BUCKETS> counts{};
+
+    static size_t bucket(uint64_t ns);
+    static uint64_t lower_bound(size_t bucket);
+
+   public:
+    void record(uint64_t ns) {
+        counts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    }
+    // move the counts into total, returns how many there were
+    uint64_t drain(Histogram &total);
+    uint64_t count() const;
+    // in us
+    double percentile(double p) const;
+};
+
+#endif
@@ -0,0 +1,322 @@
+#include "LazyRecovery.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/log/trivial.hpp>
+#include <chrono>
+#include <filesystem>
+#include <thread>
+
+#include "Checkpoint.h"
+#include "utils.h"
+
+// a reader of the backup, reopened on the next fetch after a failure
+class LazyRecovery::Fetcher {
+    const std::vector<std::unique_ptr<Transport>> &stubs;
+    const Config &config;
+    std::unique_ptr<ExtentReader> reader;
+
+   public:
+    Fetcher(const std::vector<std::unique_ptr<Transport>> &stubs,
+            const Config &config)
+        : stubs(stubs), config(config) {}
+
+    ExtentReader &get() {
+        if (!reader) {
+            reader = std::make_unique<ExtentReader>(stubs, config);
+        }
+        return *reader;
+    }
+
+    void close() { reader.reset(); }
+};
+
+LazyRecovery::LazyRecovery(
+    int img_fd, EncryptionManager &emgr,
+    const std::vector<std::unique_ptr<Transport>> &stubs,
+    const Config &config, FingerprintCache *fingerprints,
+    BandwidthScheduler *scheduler)
+    : img_fd(img_fd),
+      emgr(emgr),
+      stubs(stubs),
+      config(config),
+      fingerprints(fingerprints),
+      scheduler(scheduler),
+      n_extents(config.size / config.extent_size),
+      present(n_extents),
+      on_demand(std::make_unique<Fetcher>(stubs, config)) {}
+
+std::unique_ptr<LazyRecovery> LazyRecovery::create(
+    int img_fd, EncryptionManager &emgr,
+    const std::vector<std::unique_ptr<Transport>> &stubs,
+    const Config &config, FingerprintCache *fingerprints,
+    BandwidthScheduler *scheduler) {
+    std::unique_ptr<LazyRecovery> recovery(new LazyRecovery(
+        img_fd, emgr, stubs, config, fingerprints, scheduler));
+    if (!recovery->open_progress()) {
+        return nullptr;
+    }
+    return recovery;
+}
+
+bool LazyRecovery::open_progress() {
+    const Checkpoint run{.op = "lazy",
+                         .size = config.size,
+                         .extent_size = config.extent_size,
+                         .snapshot = config.snapshot};
+    // the bitmap is saved before the checkpoint points at it
+    if (Checkpoint saved; !config.restart &&
+                          saved.load(Checkpoint::path_for(config.file)) &&
+                          run.same_run(saved) && load_present()) {
+        BOOST_LOG_TRIVIAL(info)
+            << boost::format("Resuming lazy recovery, %1%/%2% extents "
+                             "present") %
+                   present.count() % n_extents
+            << std::endl;
+        return true;
+    }
+    return save_present() && run.save(Checkpoint::path_for(config.file));
+}
+
+LazyRecovery::~LazyRecovery() { close(img_fd); }
+
+bool LazyRecovery::load_present() {
+    std::vector<uint64_t> words((n_extents + 63) / 64);
+    const auto bytes = static_cast<ssize_t>(words.size() * sizeof(uint64_t));
+    const int fd = open(bitmap_path(config.file).c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    const bool ok = ::read(fd, words.data(), bytes) == bytes;
+    close(fd);
+    if (ok) {
+        present.load(words);
+    }
+    return ok;
+}
+
+bool LazyRecovery::save_present() {
+    // extents are marked present after they are written, so the ones in the
+    // bitmap are durable once the file is synced
+    const auto words = present.dump();
+    const auto bytes = static_cast<ssize_t>(words.size() * sizeof(uint64_t));
+    const auto path = bitmap_path(config.file);
+    const auto tmp_path = path + ".tmp";
+    if (fdatasync(img_fd) != 0) {
+        BOOST_LOG_TRIVIAL(error) << "Recovery: fdatasync failed" << std::endl;
+        return false;
+    }
+    const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    bool ok = fd != -1 && ::write(fd, words.data(), bytes) == bytes &&
+              fdatasync(fd) == 0;
+    if (fd != -1) close(fd);
+    std::error_code err;
+    if (ok) {
+        std::filesystem::rename(tmp_path, path, err);
+        ok = !err;
+    }
+    if (!ok) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Cannot save lazy recovery progress to " << path << std::endl;
+    }
+    return ok;
+}
+
+bool LazyRecovery::claim(uint64_t extent_no) {
+    std::lock_guard guard(lock);
+    if (present.test(extent_no) || fetching.count(extent_no)) {
+        return false;
+    }
+    fetching.insert(extent_no);
+    return true;
+}
+
+void LazyRecovery::release(uint64_t extent_no, bool ok) {
+    std::lock_guard guard(lock);
+    fetching.erase(extent_no);
+    if (ok) {
+        present.set(extent_no);
+    }
+    fetched.notify_all();
+}
+
+bool LazyRecovery::fetch(uint64_t extent_no) {
+    {
+        std::unique_lock guard(lock);
+        // the fill may be fetching it already
+        fetched.wait(guard, [&] { return !fetching.count(extent_no); });
+        if (present.test(extent_no)) {
+            return true;
+        }
+        fetching.insert(extent_no);
+
+        // accesses tend to be sequential, prefetch what follows the miss
+        const auto n =
+            std::max<uint64_t>(1, LAZY_PREFETCH_BYTES / config.extent_size);
+        for (auto next = extent_no + 1;
+             next <= extent_no + n && next < n_extents; next++) {
+            hints.push_back(next);
+        }
+        while (hints.size() > LAZY_MAX_HINTS) {
+            hints.pop_front();
+        }
+    }
+
+    BOOST_LOG_TRIVIAL(debug)
+        << "Extent " << extent_no << " not recovered yet, fetching"
+        << std::endl;
+    // a second try on fresh streams
+    bool ok = false;
+    for (int attempt = 0; !ok && attempt < 2; attempt++) {
+        ok = utils::fetch_extent(on_demand->get(), img_fd, emgr, config,
+                                 extent_no, fingerprints, scheduler,
+                                 TrafficClass::LIVE);
+        if (!ok) {
+            on_demand->close();
+        }
+    }
+    if (!ok) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Cannot fetch extent " << extent_no << std::endl;
+    }
+    release(extent_no, ok);
+    return ok;
+}
+
+uint64_t LazyRecovery::next_missing(uint64_t &cursor) {
+    {
+        std::lock_guard guard(lock);
+        while (!hints.empty()) {
+            const auto extent_no = hints.front();
+            hints.pop_front();
+            if (!present.test(extent_no) && !fetching.count(extent_no)) {
+                return extent_no;
+            }
+        }
+    }
+    for (uint64_t i = 0; i < n_extents; i++) {
+        const auto extent_no = cursor;
+        cursor = (cursor + 1) % n_extents;
+        if (!present.test(extent_no)) {
+            return extent_no;
+        }
+    }
+    return n_extents;
+}
+
+bool LazyRecovery::ensure(uint64_t offset, uint64_t len, bool write) {
+    const auto first = offset / config.extent_size;
+    const auto end =
+        std::min((offset + len - 1) / config.extent_size + 1, n_extents);
+    const auto whole = [&](uint64_t extent_no) {
+        return write && offset <= extent_no * config.extent_size &&
+               (extent_no + 1) * config.extent_size <= offset + len;
+    };
+    // fetch the partial extents before holding any, so nothing stays held
+    // when one cannot be fetched
+    for (auto extent_no = first; extent_no < end; extent_no++) {
+        if (!present.test(extent_no) && !whole(extent_no) &&
+            !fetch(extent_no)) {
+            return false;
+        }
+    }
+    for (auto extent_no = first; extent_no < end; extent_no++) {
+        if (!whole(extent_no)) {
+            continue;
+        }
+        // the fill must not fetch it over the write
+        std::unique_lock guard(lock);
+        fetched.wait(guard, [&] { return !fetching.count(extent_no); });
+        if (!present.test(extent_no)) {
+            fetching.insert(extent_no);
+        }
+    }
+    return true;
+}
+
+void LazyRecovery::wrote(uint64_t offset, uint64_t len, bool ok) {
+    const auto first = (offset + config.extent_size - 1) / config.extent_size;
+    const auto end = (offset + len) / config.extent_size;
+    for (auto extent_no = first; extent_no < end && extent_no < n_extents;
+         extent_no++) {
+        std::unique_lock guard(lock);
+        if (!fetching.count(extent_no)) {
+            continue;
+        }
+        guard.unlock();
+        release(extent_no, ok);
+    }
+}
+
+void LazyRecovery::fill(const StopFlag &stop) {
+    BOOST_LOG_TRIVIAL(info)
+        << "Lazy recovery starts, " << n_extents << " extents to restore"
+        << std::endl;
+
+    Fetcher background(stubs, config);
+    uint64_t cursor = 0;
+    auto delay = std::chrono::milliseconds(BULK_RETRY_DELAY_MS);
+    auto reported = std::chrono::steady_clock::now();
+    while (!stop.load() && !complete()) {
+        const auto extent_no = next_missing(cursor);
+        if (extent_no == n_extents || !claim(extent_no)) {
+            // what is left is being fetched on demand
+            std::unique_lock guard(lock);
+            fetched.wait_for(guard, std::chrono::milliseconds(10));
+            continue;
+        }
+
+        const bool ok = utils::fetch_extent(background.get(), img_fd, emgr,
+                                            config, extent_no, fingerprints,
+                                            scheduler, TrafficClass::BULK);
+        release(extent_no, ok);
+        if (!ok) {
+            background.close();
+            cursor = extent_no;
+            BOOST_LOG_TRIVIAL(warning)
+                << boost::format("Lazy recovery retrying in %1% ms") %
+                       delay.count()
+                << std::endl;
+            std::this_thread::sleep_for(delay);
+            delay = std::min(
+                delay * 2,
+                std::chrono::milliseconds(BULK_RETRY_DELAY_MS << BULK_RETRIES));
+            continue;
+        }
+        delay = std::chrono::milliseconds(BULK_RETRY_DELAY_MS);
+
+        if (const auto now = std::chrono::steady_clock::now();
+            now - reported >= std::chrono::seconds(PROGRESS_INTERVAL_S)) {
+            reported = now;
+            save_present();
+            BOOST_LOG_TRIVIAL(info)
+                << boost::format("Lazy recovery: %1%/%2% extents present") %
+                       present.count() % n_extents
+                << std::endl;
+        }
+    }
+    background.close();
+
+    if (!complete()) {
+        save_present();
+        BOOST_LOG_TRIVIAL(warning)
+            << boost::format("Lazy recovery stopped with %1%/%2% extents "
+                             "present, run recover_local --lazy again to "
+                             "resume") %
+                   present.count() % n_extents
+            << std::endl;
+        return;
+    }
+    if (fdatasync(img_fd) != 0) {
+        BOOST_LOG_TRIVIAL(error) << "Recovery: fdatasync failed" << std::endl;
+        return;
+    }
+    // the file is whole, other modes may start on it
+    std::error_code err;
+    std::filesystem::remove(Checkpoint::path_for(config.file), err);
+    std::filesystem::remove(bitmap_path(config.file), err);
+    BOOST_LOG_TRIVIAL(info) << "Lazy recovery complete" << std::endl;
+}
@@ -0,0 +1,83 @@
+#ifndef LAZY_RECOVERY_H
+#define LAZY_RECOVERY_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+
+#include "BackupDaemon.h"
+#include "BandwidthScheduler.h"
+#include "BlockBitmap.h"
+#include "EncryptionManager.h"
+#include "FingerprintCache.h"
+#include "types.h"
+
+// Recovers the local file while the NBD device is already served. An access
+// to an extent that is not present yet fetches it synchronously as live
+// traffic, while fill() restores the rest in order as bulk traffic, starting
+// with the extents after recent misses. The present extents are saved next
+// to the file with a lazy checkpoint, which an interrupted recovery resumes
+// from and which keeps other modes from starting on the partial file.
+class LazyRecovery {
+    class Fetcher;
+
+    int img_fd;
+    EncryptionManager &emgr;
+    const std::vector<std::unique_ptr<Transport>> &stubs;
+    const Config &config;
+    FingerprintCache *fingerprints;
+    BandwidthScheduler *scheduler;
+    uint64_t n_extents;
+
+    BlockBitmap present;
+    std::mutex lock;
+    std::condition_variable fetched;
+    std::unordered_set<uint64_t> fetching;
+    std::deque<uint64_t> hints;  // extents to prefetch next
+    std::unique_ptr<Fetcher> on_demand;
+
+    // mark extent_no as being fetched, false if it is present or in flight
+    bool claim(uint64_t extent_no);
+    void release(uint64_t extent_no, bool ok);
+    bool fetch(uint64_t extent_no);
+    uint64_t next_missing(uint64_t &cursor);
+    bool load_present();
+    // sync the file, then save the extents present before
+    bool save_present();
+    // resume the progress of an interrupted recovery or save a new one
+    bool open_progress();
+
+    LazyRecovery(int img_fd, EncryptionManager &emgr,
+                 const std::vector<std::unique_ptr<Transport>> &stubs,
+                 const Config &config, FingerprintCache *fingerprints,
+                 BandwidthScheduler *scheduler);
+
+   public:
+    // img_fd is closed with the recovery, resumes an interrupted one unless
+    // config.restart, nullptr if the progress cannot be saved
+    static std::unique_ptr<LazyRecovery> create(
+        int img_fd, EncryptionManager &emgr,
+        const std::vector<std::unique_ptr<Transport>> &stubs,
+        const Config &config, FingerprintCache *fingerprints,
+        BandwidthScheduler *scheduler);
+    ~LazyRecovery();
+    // make the extents covering [offset, offset + len) present, false if one
+    // cannot be fetched. A write does not fetch the extents it covers whole,
+    // it holds them until wrote(), or none of them if ensure() failed
+    bool ensure(uint64_t offset, uint64_t len, bool write = false);
+    // the write ensure() was called for is in the file, if ok
+    void wrote(uint64_t offset, uint64_t len, bool ok);
+    // restore every missing extent, returns once all are present or on stop
+    void fill(const StopFlag &stop);
+    bool complete() const { return present.count() == n_extents; }
+
+    static std::string bitmap_path(const std::string &image_path) {
+        return image_path + ".lazy";
+    }
+};
+
+#endif
@@ -0,0 +1,548 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <boost/log/trivial.hpp>
+#include <boost/log/utility/setup.hpp>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Histogram.h"
+#include "Transport.h"
+#include "consts.h"
+#include "types.h"
+
+// Puts one backup server under the load of many clients at once to find
+// how many it can absorb. Every client has its own connection and extents
+// of the volume, writers send batches of synthetic ciphertext on WriteBlock
+// streams and wait for them to be durable, readers keep a ReadBlock stream
+// open. Clients are started all at once or step by step, every step ends
+// with its throughput, latencies and the server's CPU, and the first step
+// that did not keep up is the saturation point. The volume of the server is
+// set up anew, so only point it at a scratch server.
+// Usage: LoadTester [options] --server host:port
+
+namespace po = boost::program_options;
+
+namespace {
+
+struct Load {
+    std::string server = BACKUP_SERVER_ADDR;
+    size_t clients = 100;
+    size_t ramp_step = 0;  // clients added per step, 0 starts all at once
+    uint64_t step_s = 5;  // per step when ramping
+    uint64_t duration_s = 10;  // without ramping
+    uint64_t report_s = 1;
+    uint64_t read_percent = 0;  // of the clients
+    uint64_t write_rate = 0;  // bytes/s per writer, 0 as fast as it can
+    uint64_t read_rate = 0;  // bytes/s per reader, 0 as fast as it can
+    uint64_t batch = 16;  // extents per WriteBlock stream
+    uint64_t extent_size = BLOCK_SIZE;
+    uint64_t extents = 256;  // per client
+    std::optional<pid_t> server_pid;  // for its CPU time
+    uint64_t seed = 1;
+};
+
+struct Counters {
+    Histogram batches;  // from opening a WriteBlock stream to durable
+    Histogram reads;  // from a ReadBlock request to its response
+    std::atomic<uint64_t> written{0};  // durable bytes
+    std::atomic<uint64_t> read{0};
+    std::atomic<uint64_t> errors{0};
+
+    // move everything into total
+    void drain(Counters &total) {
+        batches.drain(total.batches);
+        reads.drain(total.reads);
+        total.written += written.exchange(0);
+        total.read += read.exchange(0);
+        total.errors += errors.exchange(0);
+    }
+};
+
+struct Step {
+    size_t writers;
+    size_t readers;
+    double seconds;
+    uint64_t written;
+    uint64_t read;
+    double batch_p99_ms;
+    double read_p99_ms;
+    std::optional<double> server_cpu;  // seconds
+};
+
+Load parse_load(int argc, char *argv[], bool &verbose) {
+    po::options_description desc("Usage: LoadTester [options]");
+    desc.add_options()("help", "produce help message");
+    desc.add_options()("verbose,v", "verbose");
+    desc.add_options()("server", po::value<std::string>(),
+                       "backup server address, any transport of "
+                       "--backup_server, its volume is set up anew");
+    desc.add_options()("clients", po::value<size_t>(),
+                       "concurrent clients, each with its own connection");
+    desc.add_options()("ramp_step", po::value<size_t>(),
+                       "clients added every step, 0 starts all at once");
+    desc.add_options()("step", po::value<uint64_t>(),
+                       "seconds per step when ramping");
+    desc.add_options()("duration", po::value<uint64_t>(),
+                       "seconds to run when not ramping");
+    desc.add_options()("report", po::value<uint64_t>(),
+                       "seconds between reports");
+    desc.add_options()("read_percent", po::value<uint64_t>(),
+                       "clients that read instead of write");
+    desc.add_options()("write_rate", po::value<uint64_t>(),
+                       "KB/s each writer sends, 0 as fast as it can");
+    desc.add_options()("read_rate", po::value<uint64_t>(),
+                       "KB/s each reader reads, 0 as fast as it can");
+    desc.add_options()("batch", po::value<uint64_t>(),
+                       "extents per WriteBlock stream, durable together");
+    desc.add_options()("extent_size", po::value<uint64_t>(),
+                       "bytes(in KB) per extent");
+    desc.add_options()("extents", po::value<uint64_t>(),
+                       "extents of the volume per client");
+    desc.add_options()("server_pid", po::value<pid_t>(),
+                       "process of a server on this host, to report its CPU "
+                       "time");
+    desc.add_options()("seed", po::value<uint64_t>(), "of the extent numbers");
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        std::cout << desc << "\n";
+        exit(0);
+    }
+
+    Load load;
+    verbose = vm.count("verbose") > 0;
+    if (vm.count("server")) {
+        load.server = vm["server"].as<std::string>();
+    }
+    if (vm.count("clients")) {
+        load.clients = std::max<size_t>(1, vm["clients"].as<size_t>());
+    }
+    if (vm.count("ramp_step")) {
+        load.ramp_step = vm["ramp_step"].as<size_t>();
+    }
+    if (vm.count("step")) {
+        load.step_s = std::max<uint64_t>(1, vm["step"].as<uint64_t>());
+    }
+    if (vm.count("duration")) {
+        load.duration_s = std::max<uint64_t>(1, vm["duration"].as<uint64_t>());
+    }
+    if (vm.count("report")) {
+        load.report_s = std::max<uint64_t>(1, vm["report"].as<uint64_t>());
+    }
+    if (vm.count("read_percent")) {
+        load.read_percent = vm["read_percent"].as<uint64_t>();
+        if (load.read_percent > 100) {
+            throw std::invalid_argument("read_percent must be <= 100");
+        }
+    }
+    if (vm.count("write_rate")) {
+        load.write_rate = vm["write_rate"].as<uint64_t>() * 1024;
+    }
+    if (vm.count("read_rate")) {
+        load.read_rate = vm["read_rate"].as<uint64_t>() * 1024;
+    }
+    if (vm.count("batch")) {
+        load.batch = std::max<uint64_t>(1, vm["batch"].as<uint64_t>());
+    }
+    if (vm.count("extent_size")) {
+        load.extent_size = vm["extent_size"].as<uint64_t>() * 1024;
+        if (load.extent_size == 0 || load.extent_size % BLOCK_SIZE != 0 ||
+            load.extent_size > MAX_EXTENT_SIZE) {
+            throw std::invalid_argument(
+                "extent_size must be a multiple of the block size up to " +
+                std::to_string(MAX_EXTENT_SIZE / 1024) + " KB");
+        }
+    }
+    if (vm.count("extents")) {
+        load.extents = std::max<uint64_t>(1, vm["extents"].as<uint64_t>());
+    }
+    if (vm.count("server_pid")) {
+        load.server_pid = vm["server_pid"].as<pid_t>();
+    }
+    if (vm.count("seed")) {
+        load.seed = vm["seed"].as<uint64_t>();
+    }
+    return load;
+}
+
+// user and system CPU seconds of a process so far, nullopt if unknown
+std::optional<double> cpu_seconds(pid_t pid) {
+    std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat;
+    if (!std::getline(file, stat)) {
+        return std::nullopt;
+    }
+    // the name in parentheses may hold spaces, utime and stime are the 12th
+    // and 13th fields after it
+    const auto end = stat.rfind(')');
+    if (end == std::string::npos) {
+        return std::nullopt;
+    }
+    std::istringstream fields(stat.substr(end + 1));
+    std::string field;
+    uint64_t ticks = 0;
+    for (int i = 0; i < 13 && fields >> field; i++) {
+        if (i >= 11) {
+            ticks += std::stoull(field);
+        }
+    }
+    return static_cast<double>(ticks) / sysconf(_SC_CLK_TCK);
+}
+
+// sleep until next, then move it on by interval, false once stopped
+bool pace(std::chrono::steady_clock::time_point &next,
+          std::chrono::nanoseconds interval, const StopFlag &stop) {
+    if (interval.count() == 0) {
+        return !stop.load();
+    }
+    while (!stop.load() && std::chrono::steady_clock::now() < next) {
+        std::this_thread::sleep_until(
+            std::min(next, std::chrono::steady_clock::now() +
+                               std::chrono::milliseconds(100)));
+    }
+    // a client that fell behind does not make up for it in a burst
+    next = std::max(next, std::chrono::steady_clock::now() - interval) +
+           interval;
+    return !stop.load();
+}
+
+uint64_t since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+void run_writer(Transport &transport, const Load &load,
+                const std::vector<std::string> &ciphertext, size_t client,
+                Counters &counters, const StopFlag &stop) {
+    std::mt19937_64 rng(load.seed * 1000003 + client);
+    const auto first = client * load.extents;
+    const auto batch_bytes = load.batch * load.extent_size;
+    const std::chrono::nanoseconds interval(
+        load.write_rate == 0 ? 0 : batch_bytes * 1000000000 / load.write_rate);
+    auto next = std::chrono::steady_clock::now();
+    size_t data = rng() % ciphertext.size();
+    while (pace(next, interval, stop)) {
+        grpc::ClientContext context;
+        WriteBlockResponse response;
+        const auto start = std::chrono::steady_clock::now();
+        const auto writer = transport.WriteBlock(&context, &response);
+        bool ok = true;
+        for (uint64_t i = 0; ok && i < load.batch; i++) {
+            WriteBlockRequest request;
+            request.set_block_no(first + rng() % load.extents);
+            request.set_data(ciphertext[data++ % ciphertext.size()]);
+            ok = writer->Write(request);
+        }
+        ok = writer->WritesDone() && ok;
+        const auto status = writer->Finish();
+        if (ok && status.ok() && response.success()) {
+            counters.batches.record(since(start));
+            counters.written += batch_bytes;
+            continue;
+        }
+        counters.errors++;
+        BOOST_LOG_TRIVIAL(debug)
+            << "Client " << client << " write failed: "
+            << (status.ok() ? response.message() : status.error_message())
+            << std::endl;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+}
+
+void run_reader(Transport &transport, const Load &load, size_t client,
+                Counters &counters, const StopFlag &stop) {
+    std::mt19937_64 rng(load.seed * 1000003 + client);
+    const auto first = client * load.extents;
+    const std::chrono::nanoseconds interval(
+        load.read_rate == 0 ? 0
+                            : load.extent_size * 1000000000 / load.read_rate);
+    auto next = std::chrono::steady_clock::now();
+    while (!stop.load()) {
+        grpc::ClientContext context;
+        const auto stream = transport.ReadBlock(&context);
+        ReadBlockRequest request;
+        ReadBlockResponse response;
+        while (pace(next, interval, stop)) {
+            request.set_block_no(first + rng() % load.extents);
+            const auto start = std::chrono::steady_clock::now();
+            if (!stream->Write(request) || !stream->Read(&response)) {
+                counters.errors++;
+                break;
+            }
+            if (!response.success()) {
+                counters.errors++;
+                continue;
+            }
+            counters.reads.record(since(start));
+            counters.read += response.data().size();
+        }
+        stream->WritesDone();
+        stream->Finish();
+        if (!stop.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+}
+
+void print_header() {
+    std::printf("%6s %7s %9s %9s %8s %8s %8s %8s %8s %7s %8s\n", "time",
+                "clients", "write MB", "read MB", "batch/s", "p50 ms",
+                "p99 ms", "read/s", "p99 ms", "errors", "srv cpu");
+}
+
+void print_step_header() {
+    std::printf("\n%7s %7s %10s %10s %12s %12s %10s %10s\n", "writers",
+                "readers", "write MB/s", "read MB/s", "batch p99 ms",
+                "read p99 ms", "srv cpu %", "cpu s/GB");
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    bool verbose = false;
+    const auto load = parse_load(argc, argv, verbose);
+    if (!verbose) {
+        boost::log::core::get()->set_filter(boost::log::trivial::severity >=
+                                            boost::log::trivial::warning);
+    }
+
+    // every client on a connection of its own, like separate hosts
+    std::vector<std::unique_ptr<Transport>> transports;
+    for (size_t i = 0; i < load.clients; i++) {
+        auto transport = Transport::connect(load.server);
+        if (transport == nullptr) {
+            BOOST_LOG_TRIVIAL(fatal)
+                << "Cannot connect to backup server " << load.server
+                << std::endl;
+            return EXIT_FAILURE;
+        }
+        transports.push_back(std::move(transport));
+    }
+    {
+        SetupRequest request;
+        SetupResponse response;
+        grpc::ClientContext context;
+        request.set_size(load.clients * load.extents * load.extent_size);
+        request.set_extent_size(load.extent_size);
+        if (const auto status =
+                transports[0]->Setup(&context, request, &response);
+            !status.ok() || !response.success()) {
+            BOOST_LOG_TRIVIAL(fatal)
+                << "Cannot set up the volume: "
+                << (status.ok() ? response.message() : status.error_message())
+                << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // random, so nothing on the way can compress it, like real ciphertext
+    std::vector<std::string> ciphertext(64);
+    {
+        std::mt19937_64 rng(load.seed);
+        for (auto &data : ciphertext) {
+            data.resize(load.extent_size);
+            for (size_t i = 0; i + sizeof(uint64_t) <= data.size();
+                 i += sizeof(uint64_t)) {
+                const uint64_t word = rng();
+                std::memcpy(&data[i], &word, sizeof(word));
+            }
+        }
+    }
+
+    StopFlag stop_flag(false);
+    Counters interval;
+    Counters step_counters;
+    Counters total;
+    std::vector<std::thread> clients;
+    size_t writers = 0;
+    size_t readers = 0;
+    // spread the readers over the clients
+    auto start_client = [&] {
+        const auto client = clients.size();
+        const bool reads = (client + 1) * load.read_percent / 100 >
+                           client * load.read_percent / 100;
+        auto *transport = transports[client].get();
+        if (reads) {
+            readers++;
+            clients.emplace_back([&, transport, client] {
+                run_reader(*transport, load, client, interval, stop_flag);
+            });
+        } else {
+            writers++;
+            clients.emplace_back([&, transport, client] {
+                run_writer(*transport, load, ciphertext, client, interval,
+                           stop_flag);
+            });
+        }
+    };
+
+    const auto ramp_step = load.ramp_step == 0 ? load.clients : load.ramp_step;
+    const auto step_s = load.ramp_step == 0 ? load.duration_s : load.step_s;
+    const auto server_cpu = [&]() -> std::optional<double> {
+        if (!load.server_pid) {
+            return std::nullopt;
+        }
+        return cpu_seconds(*load.server_pid);
+    };
+    const auto start = std::chrono::steady_clock::now();
+    const auto self_cpu_start = cpu_seconds(getpid());
+    const auto server_cpu_start = server_cpu();
+    std::vector<Step> steps;
+    print_header();
+    while (clients.size() < load.clients) {
+        const auto target = std::min(load.clients, clients.size() + ramp_step);
+        while (clients.size() < target) {
+            start_client();
+        }
+
+        const auto step_start = std::chrono::steady_clock::now();
+        const auto step_cpu = server_cpu();
+        auto report_cpu = step_cpu;
+        for (uint64_t t = 0; t < step_s; t += load.report_s) {
+            const auto report_start = std::chrono::steady_clock::now();
+            std::this_thread::sleep_for(std::chrono::seconds(
+                std::min<uint64_t>(load.report_s, step_s - t)));
+            const std::chrono::duration<double> took =
+                std::chrono::steady_clock::now() - report_start;
+            const auto seconds = took.count();
+
+            Counters report;
+            interval.drain(report);
+            const auto cpu = server_cpu();
+            char cpu_text[16] = "-";
+            if (cpu && report_cpu) {
+                std::snprintf(cpu_text, sizeof(cpu_text), "%.0f%%",
+                              (*cpu - *report_cpu) / seconds * 100);
+            }
+            report_cpu = cpu;
+            std::printf(
+                "%6.0f %7zu %9.1f %9.1f %8.0f %8.2f %8.2f %8.0f %8.2f %7lu "
+                "%8s\n",
+                std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start)
+                    .count(),
+                clients.size(), report.written.load() / seconds / 1e6,
+                report.read.load() / seconds / 1e6,
+                report.batches.count() / seconds,
+                report.batches.percentile(50) / 1000,
+                report.batches.percentile(99) / 1000,
+                report.reads.count() / seconds,
+                report.reads.percentile(99) / 1000, report.errors.load(),
+                cpu_text);
+            std::fflush(stdout);
+            report.drain(step_counters);
+        }
+
+        const std::chrono::duration<double> took =
+            std::chrono::steady_clock::now() - step_start;
+        const auto cpu = server_cpu();
+        steps.push_back(
+            {writers, readers, took.count(), step_counters.written.load(),
+             step_counters.read.load(),
+             step_counters.batches.percentile(99) / 1000,
+             step_counters.reads.percentile(99) / 1000,
+             cpu && step_cpu ? std::optional(*cpu - *step_cpu)
+                             : std::nullopt});
+        step_counters.drain(total);
+    }
+    stop_flag.store(true);
+    for (auto &client : clients) {
+        client.join();
+    }
+    interval.drain(total);
+    const std::chrono::duration<double> ran =
+        std::chrono::steady_clock::now() - start;
+
+    // the first step short of what its clients offered, or without 5% more
+    // than the step before when they send as fast as they can
+    std::optional<size_t> saturated;
+    print_step_header();
+    for (size_t i = 0; i < steps.size(); i++) {
+        const auto &step = steps[i];
+        const auto bytes = step.written + step.read;
+        const double offered = step.writers * load.write_rate +
+                               step.readers * load.read_rate;
+        const bool unlimited = (step.writers > 0 && load.write_rate == 0) ||
+                               (step.readers > 0 && load.read_rate == 0);
+        if (!saturated && i > 0 && unlimited) {
+            const auto &before = steps[i - 1];
+            if (bytes / step.seconds * 100 <
+                (before.written + before.read) / before.seconds *
+                    (100 + LOAD_GROWTH_PERCENT)) {
+                saturated = i;
+            }
+        } else if (!saturated && !unlimited &&
+                   bytes / step.seconds * 100 <
+                       offered * LOAD_KEPT_UP_PERCENT) {
+            saturated = i;
+        }
+        char cpu_text[16] = "-";
+        char per_gb_text[16] = "-";
+        if (step.server_cpu) {
+            std::snprintf(cpu_text, sizeof(cpu_text), "%.0f",
+                          *step.server_cpu / step.seconds * 100);
+            if (step.written > 0) {
+                std::snprintf(per_gb_text, sizeof(per_gb_text), "%.2f",
+                              *step.server_cpu / (step.written / 1e9));
+            }
+        }
+        std::printf("%7zu %7zu %10.1f %10.1f %12.2f %12.2f %10s %10s%s\n",
+                    step.writers, step.readers,
+                    step.written / step.seconds / 1e6,
+                    step.read / step.seconds / 1e6, step.batch_p99_ms,
+                    step.read_p99_ms, cpu_text, per_gb_text,
+                    saturated == i ? "  <- saturated" : "");
+    }
+
+    std::printf("\n%-6s %10s %10s %10s %10s %10s %10s\n", "op", "count",
+                "per s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+    for (const auto &[name, histogram] :
+         {std::pair{"batch", &total.batches}, {"read", &total.reads}}) {
+        const auto n = histogram->count();
+        if (n == 0) {
+            continue;
+        }
+        std::printf("%-6s %10lu %10.0f %10.2f %10.2f %10.2f %10.2f\n", name,
+                    n, n / ran.count(), histogram->percentile(50) / 1000,
+                    histogram->percentile(99) / 1000,
+                    histogram->percentile(99.9) / 1000,
+                    histogram->percentile(100) / 1000);
+    }
+    const auto gb = total.written.load() / 1e9;
+    std::printf("\ningested %.2f GB at %.1f MB/s, read %.2f GB, %lu errors\n",
+                gb, gb * 1000 / ran.count(), total.read.load() / 1e9,
+                total.errors.load());
+    if (const auto cpu = server_cpu(); cpu && server_cpu_start && gb > 0) {
+        std::printf("server cpu %.1f s, %.2f s per GB ingested\n",
+                    *cpu - *server_cpu_start,
+                    (*cpu - *server_cpu_start) / gb);
+    }
+    if (const auto cpu = cpu_seconds(getpid()); cpu && self_cpu_start) {
+        std::printf("load tester cpu %.1f s\n", *cpu - *self_cpu_start);
+    }
+    if (saturated) {
+        const auto &step = steps[*saturated];
+        std::printf("saturated at %zu clients, %.1f MB/s\n",
+                    step.writers + step.readers,
+                    (step.written + step.read) / step.seconds / 1e6);
+    } else if (steps.size() > 1) {
+        std::printf("kept up with every step\n");
+    }
+    return total.errors.load() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,19 +1,35 @@
 #include "LocalBlockDriver.h"
 
+#include <arpa/inet.h>
+
 #include <boost/format.hpp>
 #include <boost/log/trivial.hpp>
 
+#include "BUSE/buse.h"
+#include "Trace.h"
+
 namespace LocalBlockDriver {
 
 int read(void *buf, const uint32_t len, const uint64_t offset, void *userdata) {
     BOOST_LOG_TRIVIAL(debug)
         << "Read block len: " << len << ", offset: " << offset << std::endl;
 
+    Trace::Span span(Trace::NBD_READ, buse_request_handle(),
+                     offset / BLOCK_SIZE, (len + BLOCK_SIZE - 1) / BLOCK_SIZE);
     const auto ctx = static_cast<Context *>(userdata);
+    if (ctx->lazy != nullptr && !ctx->lazy->ensure(offset, len)) {
+        return htonl(EIO);
+    }
 
-    if (const auto bytes_read =
-            pread(ctx->fd, buf, len, static_cast<long>(offset));
-        bytes_read < 0) {
+    ssize_t bytes_read;
+    if (ctx->io != nullptr) {
+        const auto op = ctx->io->read(buf, len, offset);
+        ctx->io->submit();
+        bytes_read = ctx->io->result(op);
+    } else {
+        bytes_read = pread(ctx->fd, buf, len, static_cast<long>(offset));
+    }
+    if (bytes_read < 0) {
         BOOST_LOG_TRIVIAL(error) << "Read failed" << std::endl;
     } else {
         BOOST_LOG_TRIVIAL(debug)
@@ -28,30 +44,102 @@ int write(const void *buf, const uint32_t len, uint64_t offset,
     BOOST_LOG_TRIVIAL(debug)
         << "Write block len: " << len << ", offset: " << offset << std::endl;
 
+    Trace::Span span(Trace::NBD_WRITE, buse_request_handle(),
+                     offset / BLOCK_SIZE, (len + BLOCK_SIZE - 1) / BLOCK_SIZE);
     const auto ctx = static_cast<Context *>(userdata);
+    // the fill must not overwrite a partial write later, extents the write
+    // covers whole are not fetched
+    if (ctx->lazy != nullptr && !ctx->lazy->ensure(offset, len, true)) {
+        return htonl(EIO);
+    }
 
-    if (const auto bytes_write =
-            pwrite(ctx->fd, buf, len, static_cast<long>(offset));
-        bytes_write < 0) {
-        BOOST_LOG_TRIVIAL(error) << "Write failed" << std::endl;
+    ssize_t bytes_write;
+    if (ctx->io != nullptr) {
+        const auto op = ctx->io->write(buf, len, offset);
+        ctx->io->submit();
+        bytes_write = ctx->io->result(op);
     } else {
-        BOOST_LOG_TRIVIAL(debug) << "Write success" << std::endl;
+        bytes_write = pwrite(ctx->fd, buf, len, static_cast<long>(offset));
+    }
+    if (ctx->lazy != nullptr) {
+        ctx->lazy->wrote(offset, len, bytes_write == len);
     }
+    // nothing of a failed write is replicated
+    if (bytes_write != len) {
+        BOOST_LOG_TRIVIAL(error)
+            << boost::format("Write failed, %1% of %2% bytes written") %
+                   bytes_write % len
+            << std::endl;
+        return htonl(EIO);
+    }
+    BOOST_LOG_TRIVIAL(debug) << "Write success" << std::endl;
 
     uint64_t block_no_start = offset / BLOCK_SIZE;
     uint64_t block_no_end = (offset + len - 1) / BLOCK_SIZE;
 
-    ctx->queue->push(
-        std::make_shared<WriteOperation>(block_no_start, block_no_end));
+    auto op = std::make_shared<WriteOperation>(block_no_start, block_no_end);
+    op->offset = offset;
+    op->length = len;
+    if (Trace::on()) {
+        op->trace_id = buse_request_handle();
+        op->queued = Trace::now();
+    }
+    // a volume that is never flushed still gets restore points. The epoch
+    // is only cut while the daemon is idle, before this write is queued, so
+    // the writer never waits for a backlog
+    if (ctx->epoch_interval.count() > 0 &&
+        std::chrono::steady_clock::now() - ctx->last_barrier >=
+            ctx->epoch_interval &&
+        ctx->queue->idle()) {
+        barrier(ctx);
+    }
+    ctx->queue->push(op);
     return 0;
 }
 
+void barrier(Context *ctx) {
+    auto op = std::make_shared<WriteOperation>(0, 0);
+    op->barrier = true;
+    ctx->queue->push(op);
+    ctx->queue->wait_idle();
+    ctx->last_barrier = std::chrono::steady_clock::now();
+}
+
+bool settle(Context *ctx, size_t quorum,
+            std::chrono::milliseconds timeout) {
+    barrier(ctx);
+    // a replica that was catching up commits at a later barrier
+    const auto seq = ctx->replicas->last_seq();
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (!ctx->replicas->wait_quorum(seq, quorum,
+                                       std::chrono::milliseconds(100))) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        barrier(ctx);
+    }
+    return true;
+}
+
 int flush(void *userdata) {
     BOOST_LOG_TRIVIAL(debug) << "Flush" << std::endl;
 
-    //    const auto ctx = static_cast<Context *>(userdata);
+    Trace::Span span(Trace::NBD_FLUSH, buse_request_handle(), 0, 0);
+    const auto ctx = static_cast<Context *>(userdata);
     //    fsync(ctx->fd);
 
+    // the backup applies the writes before the flush as one epoch
+    if (ctx->replicas == nullptr || ctx->write_quorum == 0) {
+        barrier(ctx);
+        return 0;
+    }
+    if (!settle(ctx, ctx->write_quorum,
+                std::chrono::milliseconds(QUORUM_TIMEOUT_MS))) {
+        BOOST_LOG_TRIVIAL(error) << "Flush not acknowledged by "
+                                 << ctx->write_quorum << " replicas"
+                                 << std::endl;
+        return htonl(EIO);
+    }
     return 0;
 }
 
@@ -1,18 +1,34 @@
 #ifndef LOCAL_BLOCK_DRIVER_H
 #define LOCAL_BLOCK_DRIVER_H
 
+#include <chrono>
 #include <cstdint>
 
 #include "AsyncOperationQueue.h"
 #include "BackupDaemon.h"
+#include "LazyRecovery.h"
+#include "UringFile.h"
 
 namespace LocalBlockDriver {
 
 struct Context {
     std::shared_ptr<AsyncOperationQueue> queue;
     int fd{};
+    UringFile *io = nullptr;  // fd through io_uring, nullptr for pread/pwrite
+    LazyRecovery *lazy = nullptr;  // set while recover_local is lazy
+    ReplicaSet *replicas = nullptr;
+    size_t write_quorum = 0;  // replicas a flush waits for, 0 does not wait
+    // a write ends the epoch if no flush did for this long, 0 never does
+    std::chrono::milliseconds epoch_interval{0};
+    std::chrono::steady_clock::time_point last_barrier;
 };
 
+// end the epoch of the writes so far, returns once the daemon read them, so
+// no later write can change what it replicates for the epoch
+void barrier(Context *ctx);
+// end the epoch and wait until quorum replicas applied it, false on timeout
+bool settle(Context *ctx, size_t quorum, std::chrono::milliseconds timeout);
+
 int read(void *buf, uint32_t len, uint64_t offset, void *userdata);
 
 int write(const void *buf, uint32_t len, uint64_t offset, void *userdata);
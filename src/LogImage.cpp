@@ -0,0 +1,499 @@
+#include "LogImage.h"
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <boost/format.hpp>
+#include <boost/log/trivial.hpp>
+#include <cstring>
+#include <filesystem>
+
+namespace {
+
+constexpr uint32_t RECORD_MAGIC = 0x4c434553;  // "SECL"
+constexpr uint64_t INDEX_MAGIC = 0x58444e49474f4c53;  // "SLOGINDX"
+
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t length;
+    uint64_t extent_no;
+    uint64_t checksum;  // of the fields above and the data
+};
+
+struct IndexHeader {
+    uint64_t magic;
+    uint64_t size;
+    uint64_t extent_size;
+    uint64_t segment;  // replay starts here
+    uint64_t offset;
+};
+
+// catches torn records at the tail of the log, not an integrity check
+uint64_t checksum(const RecordHeader &header, const char *data, size_t len) {
+    uint64_t h = 0x9e3779b97f4a7c15 ^ header.extent_no ^
+                 (static_cast<uint64_t>(header.length) << 32);
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0x100000001b3;
+        h ^= h >> 29;
+    }
+    for (; i < len; i++) {
+        h = (h ^ static_cast<uint8_t>(data[i])) * 0x100000001b3;
+    }
+    return h;
+}
+
+bool sync_dir(const std::string &dir) {
+    const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return false;
+    }
+    const bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+}  // namespace
+
+LogImage::LogImage(std::string dir, uint64_t segment_bytes)
+    : dir(std::move(dir)), segment_bytes(segment_bytes) {
+    thread = std::thread([this] { run(); });
+}
+
+LogImage::~LogImage() {
+    {
+        std::lock_guard guard(wake_lock);
+        stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+    for (const auto &[id, segment] : segments) {
+        close(segment.fd);
+    }
+}
+
+std::string LogImage::segment_path(uint32_t segment) const {
+    return (boost::format("%1%/segment-%2$08d") % dir % segment).str();
+}
+
+uint64_t LogImage::record_bytes() const {
+    return sizeof(RecordHeader) + extent_size;
+}
+
+bool LogImage::open_segment(uint32_t segment, bool create) {
+    const auto path = segment_path(segment);
+    const int fd =
+        ::open(path.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR,
+               0666);
+    if (fd == -1 || (create && !sync_dir(dir))) {
+        BOOST_LOG_TRIVIAL(error) << "Cannot open " << path << std::endl;
+        if (fd != -1) close(fd);
+        return false;
+    }
+    segments[segment] = {.fd = fd,
+                         .bytes = create ? 0 : static_cast<uint64_t>(
+                                                   lseek(fd, 0, SEEK_END))};
+    return true;
+}
+
+bool LogImage::open(uint64_t extent_size) {
+    std::lock_guard checkpointing(checkpoint_lock);
+    std::unique_lock guard(lock);
+    const int fd = ::open((dir + "/index").c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    IndexHeader header{};
+    bool ok = ::read(fd, &header, sizeof header) == sizeof header &&
+              header.magic == INDEX_MAGIC && header.extent_size > 0;
+    if (ok) {
+        index.resize(header.size / header.extent_size);
+        const auto bytes = index.size() * sizeof(Location);
+        ok = ::read(fd, index.data(), bytes) == static_cast<ssize_t>(bytes);
+    }
+    close(fd);
+    if (!ok || header.extent_size != extent_size) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Bad log index in " << dir << std::endl;
+        index.clear();
+        return false;
+    }
+    image_size = header.size;
+    this->extent_size = header.extent_size;
+
+    for (const auto &entry : std::filesystem::directory_iterator(dir)) {
+        const auto name = entry.path().filename().string();
+        if (name.starts_with("segment-") &&
+            !open_segment(std::stoul(name.substr(8)), false)) {
+            return false;
+        }
+    }
+    if (segments.empty() && !open_segment(header.segment, true)) {
+        return false;
+    }
+    for (auto it = segments.lower_bound(header.segment); it != segments.end();
+         it++) {
+        const auto from = it->first == header.segment ? header.offset : 0;
+        if (!replay(it->first, from) && std::next(it) != segments.end()) {
+            BOOST_LOG_TRIVIAL(error)
+                << "Corrupted record in sealed segment " << it->first
+                << std::endl;
+        }
+    }
+    tail = segments.rbegin()->first;
+    count_live();
+    BOOST_LOG_TRIVIAL(info)
+        << "Opened log image with " << segments.size() << " segments"
+        << std::endl;
+    return true;
+}
+
+bool LogImage::replay(uint32_t segment, uint64_t offset) {
+    auto &seg = segments[segment];
+    std::vector<char> data(extent_size);
+    while (offset < seg.bytes) {
+        RecordHeader header{};
+        if (offset + record_bytes() > seg.bytes ||
+            pread(seg.fd, &header, sizeof header, static_cast<long>(offset)) !=
+                sizeof header ||
+            header.magic != RECORD_MAGIC || header.length != extent_size ||
+            header.extent_no >= index.size() ||
+            pread(seg.fd, data.data(), extent_size,
+                  static_cast<long>(offset + sizeof header)) !=
+                static_cast<ssize_t>(extent_size) ||
+            checksum(header, data.data(), extent_size) != header.checksum) {
+            // a write the crash interrupted, never acknowledged
+            BOOST_LOG_TRIVIAL(info)
+                << "Truncating segment " << segment << " at " << offset
+                << std::endl;
+            seg.bytes = offset;
+            if (ftruncate(seg.fd, static_cast<long>(offset)) != 0) {
+                BOOST_LOG_TRIVIAL(error)
+                    << "Cannot truncate segment " << segment << std::endl;
+            }
+            return false;
+        }
+        index[header.extent_no] = {.segment = segment, .offset = offset};
+        offset += record_bytes();
+    }
+    return true;
+}
+
+void LogImage::count_live() {
+    for (auto &[id, segment] : segments) {
+        segment.live = 0;
+    }
+    for (auto &location : index) {
+        if (location.segment == 0) {
+            continue;
+        }
+        const auto it = segments.find(location.segment);
+        if (it == segments.end()) {
+            BOOST_LOG_TRIVIAL(error)
+                << "Log index points to missing segment " << location.segment
+                << std::endl;
+            location = {};
+            continue;
+        }
+        it->second.live += record_bytes();
+    }
+}
+
+void LogImage::clear() {
+    for (const auto &[id, segment] : segments) {
+        close(segment.fd);
+    }
+    segments.clear();
+    index.clear();
+    tail = 0;
+    std::error_code error;
+    std::filesystem::remove_all(dir, error);
+}
+
+bool LogImage::setup(uint64_t size, uint64_t extent_size) {
+    {
+        std::lock_guard checkpointing(checkpoint_lock);
+        std::unique_lock guard(lock);
+        if (tail == 0 || extent_size != this->extent_size) {
+            // records of another extent size cannot be kept
+            clear();
+            std::error_code error;
+            std::filesystem::create_directories(dir, error);
+            this->extent_size = extent_size;
+            index.resize(size / extent_size);
+            if (error || !open_segment(1, true)) {
+                BOOST_LOG_TRIVIAL(fatal)
+                    << "Cannot create log image " << dir << std::endl;
+                return false;
+            }
+            tail = 1;
+        } else {
+            for (auto i = size / extent_size; i < index.size(); i++) {
+                if (index[i].segment != 0) {
+                    segments[index[i].segment].live -= record_bytes();
+                }
+            }
+            index.resize(size / extent_size);
+        }
+        image_size = size;
+    }
+    return checkpoint();
+}
+
+bool LogImage::append(uint64_t extent_no, const char *buf) {
+    auto *seg = &segments[tail];
+    if (seg->bytes > 0 && seg->bytes + record_bytes() > segment_bytes) {
+        // a sync only covers the tail, seal the segment before moving on
+        if (fdatasync(seg->fd) != 0 || !open_segment(tail + 1, true)) {
+            BOOST_LOG_TRIVIAL(error)
+                << "Cannot start log segment " << tail + 1 << std::endl;
+            return false;
+        }
+        seg = &segments[++tail];
+    }
+
+    RecordHeader header{.magic = RECORD_MAGIC,
+                        .length = static_cast<uint32_t>(extent_size),
+                        .extent_no = extent_no};
+    header.checksum = checksum(header, buf, extent_size);
+    iovec iov[2] = {{&header, sizeof header},
+                    {const_cast<char *>(buf), extent_size}};
+    if (pwritev(seg->fd, iov, 2, static_cast<long>(seg->bytes)) !=
+        static_cast<ssize_t>(record_bytes())) {
+        BOOST_LOG_TRIVIAL(error) << "Log append failed" << std::endl;
+        return false;
+    }
+
+    auto &location = index[extent_no];
+    if (location.segment != 0) {
+        segments[location.segment].live -= record_bytes();
+    }
+    location = {.segment = tail, .offset = seg->bytes};
+    seg->bytes += record_bytes();
+    seg->live += record_bytes();
+    since_checkpoint += record_bytes();
+    return true;
+}
+
+bool LogImage::write(uint64_t extent_no, const char *buf) {
+    bool checkpoint_due;
+    {
+        std::unique_lock guard(lock);
+        if (extent_no >= index.size() || !append(extent_no, buf)) {
+            return false;
+        }
+        checkpoint_due = since_checkpoint >= LOG_CHECKPOINT_BYTES;
+    }
+    if (checkpoint_due) {
+        wake.notify_one();
+    }
+    return true;
+}
+
+bool LogImage::patch(uint64_t extent_no, const char *buf, uint32_t offset,
+                     uint32_t length) {
+    std::vector<char> extent(extent_size);
+    bool checkpoint_due;
+    {
+        // a write in between would be lost
+        std::unique_lock guard(lock);
+        if (extent_no >= index.size() || offset + length > extent_size ||
+            !load(extent_no, extent.data())) {
+            return false;
+        }
+        memcpy(extent.data() + offset, buf, length);
+        if (!append(extent_no, extent.data())) {
+            return false;
+        }
+        checkpoint_due = since_checkpoint >= LOG_CHECKPOINT_BYTES;
+    }
+    if (checkpoint_due) {
+        wake.notify_one();
+    }
+    return true;
+}
+
+bool LogImage::read(uint64_t extent_no, char *buf) const {
+    std::shared_lock guard(lock);
+    return extent_no < index.size() && load(extent_no, buf);
+}
+
+bool LogImage::load(uint64_t extent_no, char *buf) const {
+    const auto location = index[extent_no];
+    if (location.segment == 0) {
+        memset(buf, 0, extent_size);
+        return true;
+    }
+    return pread(segments.at(location.segment).fd, buf, extent_size,
+                 static_cast<long>(location.offset + sizeof(RecordHeader))) ==
+           static_cast<ssize_t>(extent_size);
+}
+
+bool LogImage::sync() {
+    int fd;
+    {
+        std::shared_lock guard(lock);
+        fd = segments.at(tail).fd;
+    }
+    return fdatasync(fd) == 0;
+}
+
+bool LogImage::checkpoint() {
+    std::lock_guard checkpointing(checkpoint_lock);
+    std::vector<Location> saved;
+    IndexHeader header{.magic = INDEX_MAGIC};
+    std::vector<uint32_t> empty;
+    int tail_fd;
+    {
+        std::unique_lock guard(lock);
+        if (tail == 0) {
+            return true;
+        }
+        saved = index;
+        header.size = image_size;
+        header.extent_size = extent_size;
+        header.segment = tail;
+        header.offset = segments[tail].bytes;
+        for (const auto &[id, segment] : segments) {
+            if (id < tail && segment.live == 0) {
+                empty.push_back(id);
+            }
+        }
+        tail_fd = segments[tail].fd;
+        since_checkpoint = 0;
+    }
+
+    // the index may only point to synced records
+    const auto path = dir + "/index";
+    const auto tmp_path = path + ".tmp";
+    const int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    const auto bytes = saved.size() * sizeof(Location);
+    const bool ok =
+        fdatasync(tail_fd) == 0 && fd != -1 &&
+        ::write(fd, &header, sizeof header) == sizeof header &&
+        ::write(fd, saved.data(), bytes) == static_cast<ssize_t>(bytes) &&
+        fdatasync(fd) == 0;
+    if (fd != -1) close(fd);
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0 || !sync_dir(dir)) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Cannot checkpoint log index " << path << std::endl;
+        return false;
+    }
+
+    // no record of them is needed anymore, appends only go to the tail
+    std::unique_lock guard(lock);
+    for (const auto id : empty) {
+        close(segments[id].fd);
+        unlink(segment_path(id).c_str());
+        segments.erase(id);
+    }
+    if (!empty.empty()) {
+        BOOST_LOG_TRIVIAL(debug)
+            << "Deleted " << empty.size() << " log segments" << std::endl;
+    }
+    return true;
+}
+
+bool LogImage::copy_live(uint32_t segment) {
+    std::vector<char> data;
+    for (uint64_t offset = 0;; offset += record_bytes()) {
+        RecordHeader header{};
+        {
+            std::shared_lock guard(lock);
+            const auto it = segments.find(segment);
+            if (it == segments.end() || it->second.live == 0) {
+                return true;
+            }
+            if (offset >= it->second.bytes) {
+                return true;
+            }
+            if (pread(it->second.fd, &header, sizeof header,
+                      static_cast<long>(offset)) != sizeof header ||
+                header.magic != RECORD_MAGIC ||
+                header.extent_no >= index.size()) {
+                BOOST_LOG_TRIVIAL(error)
+                    << "Cannot compact segment " << segment << std::endl;
+                return false;
+            }
+            const auto location = index[header.extent_no];
+            if (location.segment != segment || location.offset != offset) {
+                continue;
+            }
+            data.resize(extent_size);
+            if (pread(it->second.fd, data.data(), extent_size,
+                      static_cast<long>(offset + sizeof header)) !=
+                static_cast<ssize_t>(extent_size)) {
+                return false;
+            }
+        }
+        // only if no write replaced it in between
+        std::unique_lock guard(lock);
+        const auto location = index[header.extent_no];
+        if (location.segment == segment && location.offset == offset &&
+            !append(header.extent_no, data.data())) {
+            return false;
+        }
+    }
+}
+
+size_t LogImage::compact() {
+    std::vector<uint32_t> candidates;
+    bool reclaimable = false;
+    {
+        std::shared_lock guard(lock);
+        for (const auto &[id, segment] : segments) {
+            if (id >= tail) {
+                continue;
+            }
+            reclaimable |= segment.live == 0;
+            if (segment.live > 0 &&
+                segment.live * 100 < segment.bytes * LOG_COMPACT_LIVE) {
+                candidates.push_back(id);
+            }
+        }
+    }
+
+    size_t emptied = 0;
+    for (const auto id : candidates) {
+        if (copy_live(id)) {
+            emptied++;
+        }
+    }
+    if (emptied > 0 || reclaimable) {
+        checkpoint();
+    }
+    if (emptied > 0) {
+        BOOST_LOG_TRIVIAL(info)
+            << "Compacted " << emptied << " log segments" << std::endl;
+    }
+    return emptied;
+}
+
+size_t LogImage::n_segments() const {
+    std::shared_lock guard(lock);
+    return segments.size();
+}
+
+void LogImage::run() {
+    std::unique_lock guard(wake_lock);
+    while (!stopping) {
+        wake.wait_for(guard, std::chrono::seconds(LOG_COMPACT_INTERVAL_S));
+        if (stopping) {
+            return;
+        }
+        guard.unlock();
+        bool checkpoint_due;
+        {
+            std::shared_lock image_guard(lock);
+            checkpoint_due = since_checkpoint >= LOG_CHECKPOINT_BYTES;
+        }
+        if (checkpoint_due) {
+            checkpoint();
+        }
+        compact();
+        guard.lock();
+    }
+}
@@ -0,0 +1,89 @@
+#ifndef LOG_IMAGE_H
+#define LOG_IMAGE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BackupImage.h"
+#include "consts.h"
+
+// A log structured image for backup tiers where random writes are slow.
+// Writes append records to segment files in a directory, an in-memory index
+// maps every extent to its latest record. The index is checkpointed every
+// LOG_CHECKPOINT_BYTES and opening replays the records written after the
+// checkpoint. A background thread copies the live records out of segments
+// that are mostly overwritten and deletes them after the next checkpoint.
+class LogImage : public BackupImage {
+    struct Location {
+        uint32_t segment = 0;  // 0 if never written
+        uint64_t offset = 0;  // of the record
+    };
+    struct Segment {
+        int fd = -1;
+        uint64_t bytes = 0;
+        uint64_t live = 0;  // bytes of records the index points to
+    };
+
+    std::string dir;
+    uint64_t segment_bytes;
+    uint64_t image_size = 0;
+    uint64_t extent_size = BLOCK_SIZE;
+
+    // writers hold it exclusive, readers shared
+    mutable std::shared_mutex lock;
+    std::vector<Location> index;
+    std::map<uint32_t, Segment> segments;
+    uint32_t tail = 0;  // the segment appended to
+    uint64_t since_checkpoint = 0;  // bytes appended
+
+    std::mutex checkpoint_lock;
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread thread;
+
+    std::string segment_path(uint32_t segment) const;
+    uint64_t record_bytes() const;
+    bool open_segment(uint32_t segment, bool create);
+    // append a record for extent_no, caller holds lock exclusive
+    bool append(uint64_t extent_no, const char *buf);
+    // read the latest record of extent_no, caller holds lock
+    bool load(uint64_t extent_no, char *buf) const;
+    // read the records after offset into the index, false at a torn record
+    bool replay(uint32_t segment, uint64_t offset);
+    void count_live();
+    bool copy_live(uint32_t segment);
+    void clear();
+    void run();
+
+   public:
+    explicit LogImage(std::string dir,
+                      uint64_t segment_bytes = LOG_SEGMENT_BYTES);
+    ~LogImage() override;
+    bool open(uint64_t extent_size) override;
+    bool setup(uint64_t size, uint64_t extent_size) override;
+    uint64_t size() const override { return image_size; }
+    bool read(uint64_t extent_no, char *buf) const override;
+    bool write(uint64_t extent_no, const char *buf) override;
+    // records are whole extents, so the extent is read and written back
+    // under the exclusive lock
+    bool patch(uint64_t extent_no, const char *buf, uint32_t offset,
+               uint32_t length) override;
+    bool sync() override;
+
+    // save the index and delete segments without live records, run by the
+    // background thread
+    bool checkpoint();
+    // copy the live records out of sealed segments below LOG_COMPACT_LIVE
+    // percent live, returns the number of segments emptied
+    size_t compact();
+    size_t n_segments() const;
+};
+
+#endif
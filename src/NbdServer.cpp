@@ -0,0 +1,518 @@
+#include "NbdServer.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/log/trivial.hpp>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "consts.h"
+
+namespace {
+constexpr uint64_t NBDMAGIC = 0x4e42444d41474943;
+constexpr uint64_t IHAVEOPT = 0x49484156454f5054;
+constexpr uint64_t OPTION_REPLY_MAGIC = 0x3e889045565a9;
+constexpr uint32_t REQUEST_MAGIC = 0x25609513;
+constexpr uint32_t SIMPLE_REPLY_MAGIC = 0x67446698;
+constexpr uint32_t STRUCTURED_REPLY_MAGIC = 0x668e33ef;
+constexpr uint32_t MAX_OPTION_LENGTH = 4096;
+
+// handshake flags of the server and the client
+constexpr uint16_t FLAG_FIXED_NEWSTYLE = 1 << 0;
+constexpr uint16_t FLAG_NO_ZEROES = 1 << 1;
+
+enum Option : uint32_t {
+    OPT_EXPORT_NAME = 1,
+    OPT_ABORT = 2,
+    OPT_LIST = 3,
+    OPT_INFO = 6,
+    OPT_GO = 7,
+    OPT_STRUCTURED_REPLY = 8,
+};
+
+enum OptionReply : uint32_t {
+    REP_ACK = 1,
+    REP_SERVER = 2,
+    REP_INFO = 3,
+    REP_ERR_UNSUP = 0x80000001,
+    REP_ERR_INVALID = 0x80000003,
+};
+
+constexpr uint16_t INFO_EXPORT = 0;
+constexpr uint16_t INFO_BLOCK_SIZE = 3;
+
+// transmission flags, flushes cover the writes of every connection
+constexpr uint16_t TRANSMISSION_FLAGS = 1 << 0 |  // has flags
+                                        1 << 2 |  // send flush
+                                        1 << 3 |  // send fua
+                                        1 << 5 |  // send trim
+                                        1 << 8;   // can multi conn
+
+enum Command : uint16_t {
+    CMD_READ = 0,
+    CMD_WRITE = 1,
+    CMD_DISC = 2,
+    CMD_FLUSH = 3,
+    CMD_TRIM = 4,
+};
+
+constexpr uint16_t CMD_FLAG_FUA = 1 << 0;
+constexpr uint16_t REPLY_FLAG_DONE = 1 << 0;
+constexpr uint16_t REPLY_TYPE_OFFSET_DATA = 1;
+constexpr uint16_t REPLY_TYPE_ERROR = 0x8001;
+
+// big endian fields of the protocol
+template <typename T>
+void put(std::string &out, T value) {
+    for (int i = sizeof(T) - 1; i >= 0; i--) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+template <typename T>
+T get(const char *in) {
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        value = static_cast<T>(value << 8 | static_cast<uint8_t>(in[i]));
+    }
+    return value;
+}
+
+bool recv_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        const auto n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool send_all(int fd, const char *buf, size_t len, int flags = 0) {
+    while (len > 0) {
+        const auto n = send(fd, buf, len, flags | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool send_all(int fd, const std::string &buf, int flags = 0) {
+    return send_all(fd, buf.data(), buf.size(), flags);
+}
+}  // namespace
+
+NbdServer::NbdServer(const buse_operations &ops, void *userdata)
+    : ops(ops),
+      userdata(userdata),
+      size(ops.size != 0 ? ops.size
+                         : static_cast<uint64_t>(ops.blksize) *
+                               ops.size_blocks) {}
+
+NbdServer::~NbdServer() {
+    if (listen_fd != -1) {
+        close(listen_fd);
+    }
+    if (!socket_path.empty()) {
+        unlink(socket_path.c_str());
+    }
+}
+
+bool NbdServer::listen(const std::string &address) {
+    if (address.rfind("unix:", 0) == 0) {
+        sockaddr_un addr{.sun_family = AF_UNIX};
+        const auto path = address.substr(5);
+        if (path.empty() || path.size() >= sizeof addr.sun_path) {
+            BOOST_LOG_TRIVIAL(error)
+                << "Invalid socket path " << path << std::endl;
+            return false;
+        }
+        strcpy(addr.sun_path, path.c_str());
+        // a socket left behind by an earlier run
+        unlink(path.c_str());
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd == -1 ||
+            bind(listen_fd, reinterpret_cast<sockaddr *>(&addr),
+                 sizeof addr) != 0) {
+            BOOST_LOG_TRIVIAL(error) << "Cannot bind " << address << ": "
+                                     << strerror(errno) << std::endl;
+            return false;
+        }
+        socket_path = path;
+    } else {
+        const auto colon = address.rfind(':');
+        if (colon == std::string::npos) {
+            BOOST_LOG_TRIVIAL(error)
+                << "NBD address must be host:port or unix:path" << std::endl;
+            return false;
+        }
+        auto host = address.substr(0, colon);
+        if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+        const auto port = address.substr(colon + 1);
+        addrinfo hints{.ai_flags = AI_PASSIVE,
+                       .ai_family = AF_UNSPEC,
+                       .ai_socktype = SOCK_STREAM};
+        addrinfo *found = nullptr;
+        if (const auto err =
+                getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                            port.c_str(), &hints, &found);
+            err != 0) {
+            BOOST_LOG_TRIVIAL(error) << "Cannot resolve " << address << ": "
+                                     << gai_strerror(err) << std::endl;
+            return false;
+        }
+        for (auto ai = found; ai != nullptr; ai = ai->ai_next) {
+            listen_fd =
+                socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, 0);
+            const int one = 1;
+            if (listen_fd != -1 &&
+                setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one,
+                           sizeof one) == 0 &&
+                bind(listen_fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                break;
+            }
+            if (listen_fd != -1) {
+                close(listen_fd);
+                listen_fd = -1;
+            }
+        }
+        freeaddrinfo(found);
+        if (listen_fd == -1) {
+            BOOST_LOG_TRIVIAL(error) << "Cannot bind " << address << ": "
+                                     << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    if (::listen(listen_fd, SOMAXCONN) != 0) {
+        BOOST_LOG_TRIVIAL(error) << "Cannot listen on " << address << ": "
+                                 << strerror(errno) << std::endl;
+        return false;
+    }
+    BOOST_LOG_TRIVIAL(info) << "NBD server listening on " << address
+                            << std::endl;
+    return true;
+}
+
+int NbdServer::serve() {
+    while (!stopping.load()) {
+        const int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (!stopping.load()) {
+                BOOST_LOG_TRIVIAL(error)
+                    << "NBD accept failed: " << strerror(errno) << std::endl;
+            }
+            break;
+        }
+        // fails on Unix sockets, which do not need it
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+        std::lock_guard guard(connections_lock);
+        // reap the threads of finished connections
+        for (auto it = connections.begin(); it != connections.end();) {
+            if (it->done) {
+                it->thread.join();
+                it = connections.erase(it);
+            } else {
+                it++;
+            }
+        }
+        auto &conn = connections.emplace_back();
+        conn.fd = fd;
+        conn.thread = std::thread(&NbdServer::serve_connection, this, &conn);
+    }
+
+    {
+        std::lock_guard guard(connections_lock);
+        for (auto &conn : connections) {
+            if (!conn.done) {
+                shutdown(conn.fd, SHUT_RDWR);
+            }
+        }
+    }
+    // no new connections, the list is only read by the threads now
+    for (auto &conn : connections) {
+        conn.thread.join();
+    }
+    connections.clear();
+    if (ops.disc != nullptr) {
+        ops.disc(userdata);
+    }
+    return stopping.load() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void NbdServer::stop() {
+    stopping = true;
+    if (listen_fd != -1) {
+        shutdown(listen_fd, SHUT_RDWR);
+    }
+}
+
+void NbdServer::serve_connection(Connection *conn) {
+    bool structured = false;
+    if (handshake(conn->fd, structured)) {
+        BOOST_LOG_TRIVIAL(info)
+            << "NBD client connected"
+            << (structured ? " with structured replies" : "") << std::endl;
+        transmit(conn->fd, structured);
+        BOOST_LOG_TRIVIAL(info) << "NBD client disconnected" << std::endl;
+    }
+    std::lock_guard guard(connections_lock);
+    close(conn->fd);
+    conn->done = true;
+}
+
+bool NbdServer::handshake(int fd, bool &structured) {
+    std::string hello;
+    put(hello, NBDMAGIC);
+    put(hello, IHAVEOPT);
+    put<uint16_t>(hello, FLAG_FIXED_NEWSTYLE | FLAG_NO_ZEROES);
+    char client_flags[4];
+    if (!send_all(fd, hello) ||
+        !recv_all(fd, client_flags, sizeof client_flags)) {
+        return false;
+    }
+    const bool no_zeroes = get<uint32_t>(client_flags) & FLAG_NO_ZEROES;
+
+    while (true) {
+        char header[16];
+        if (!recv_all(fd, header, sizeof header) ||
+            get<uint64_t>(header) != IHAVEOPT) {
+            return false;
+        }
+        const auto option = get<uint32_t>(header + 8);
+        const auto length = get<uint32_t>(header + 12);
+        if (length > MAX_OPTION_LENGTH) {
+            BOOST_LOG_TRIVIAL(error)
+                << "NBD option of " << length << " bytes" << std::endl;
+            return false;
+        }
+        std::string data(length, '\0');
+        if (!recv_all(fd, data.data(), length)) {
+            return false;
+        }
+        const auto reply = [&](uint32_t type, const std::string &payload) {
+            std::string out;
+            put(out, OPTION_REPLY_MAGIC);
+            put(out, option);
+            put(out, type);
+            put<uint32_t>(out, payload.size());
+            return send_all(fd, out + payload);
+        };
+
+        switch (option) {
+            case OPT_EXPORT_NAME: {
+                // no reply to this one, and no way to refuse
+                std::string out;
+                put(out, size);
+                put(out, TRANSMISSION_FLAGS);
+                if (!no_zeroes) {
+                    out.append(124, '\0');
+                }
+                return send_all(fd, out);
+            }
+            case OPT_ABORT:
+                reply(REP_ACK, "");
+                return false;
+            case OPT_LIST: {
+                std::string server;
+                put<uint32_t>(server, strlen(NBD_EXPORT_NAME));
+                server += NBD_EXPORT_NAME;
+                if (!reply(REP_SERVER, server) || !reply(REP_ACK, "")) {
+                    return false;
+                }
+                break;
+            }
+            case OPT_STRUCTURED_REPLY:
+                if (length != 0) {
+                    if (!reply(REP_ERR_INVALID, "")) return false;
+                    break;
+                }
+                structured = true;
+                if (!reply(REP_ACK, "")) return false;
+                break;
+            case OPT_INFO:
+            case OPT_GO: {
+                // name length, name, number of info requests, requests
+                const uint64_t name_length =
+                    length >= 4 ? get<uint32_t>(data.data()) : length;
+                if (length < 6 || 6 + name_length > length ||
+                    6 + name_length +
+                            2 * get<uint16_t>(&data[4 + name_length]) !=
+                        length) {
+                    if (!reply(REP_ERR_INVALID, "")) return false;
+                    break;
+                }
+                std::string info;
+                put(info, INFO_EXPORT);
+                put(info, size);
+                put(info, TRANSMISSION_FLAGS);
+                if (!reply(REP_INFO, info)) return false;
+                for (auto i = 6 + name_length; i < length; i += 2) {
+                    if (get<uint16_t>(&data[i]) != INFO_BLOCK_SIZE) {
+                        continue;
+                    }
+                    // any alignment works, blocks are the fastest
+                    std::string sizes;
+                    put(sizes, INFO_BLOCK_SIZE);
+                    put<uint32_t>(sizes, 1);
+                    put<uint32_t>(sizes, BLOCK_SIZE);
+                    put<uint32_t>(sizes, NBD_MAX_REQUEST);
+                    if (!reply(REP_INFO, sizes)) return false;
+                }
+                if (!reply(REP_ACK, "")) return false;
+                if (option == OPT_GO) {
+                    return true;
+                }
+                break;
+            }
+            default:
+                if (!reply(REP_ERR_UNSUP, "")) return false;
+        }
+    }
+}
+
+void NbdServer::transmit(int fd, bool structured) {
+    std::vector<char> buf;
+    char request[28];
+    while (recv_all(fd, request, sizeof request)) {
+        if (get<uint32_t>(request) != REQUEST_MAGIC) {
+            BOOST_LOG_TRIVIAL(error) << "Bad NBD request magic" << std::endl;
+            return;
+        }
+        const auto flags = get<uint16_t>(request + 4);
+        const auto type = get<uint16_t>(request + 6);
+        const char *handle = request + 8;  // echoed as is
+        const auto offset = get<uint64_t>(request + 16);
+        const auto length = get<uint32_t>(request + 24);
+        const bool in_range = offset <= size && length <= size - offset;
+
+        // the operations return errors in network byte order
+        const auto call = [&](auto op) {
+            std::lock_guard guard(ops_lock);
+            u_int64_t id;
+            memcpy(&id, handle, sizeof id);
+            buse_set_request_handle(id);
+            return ntohl(static_cast<uint32_t>(op()));
+        };
+
+        uint32_t error = 0;
+        switch (type) {
+            case CMD_READ:
+                if (length > NBD_MAX_REQUEST) {
+                    BOOST_LOG_TRIVIAL(error)
+                        << "NBD read of " << length << " bytes" << std::endl;
+                    return;
+                }
+                buf.resize(length);
+                if (!in_range) {
+                    error = EINVAL;
+                } else if (ops.read == nullptr) {
+                    error = EPERM;
+                } else {
+                    error = call([&] {
+                        return ops.read(buf.data(), length, offset, userdata);
+                    });
+                }
+                break;
+            case CMD_WRITE:
+                if (length > NBD_MAX_REQUEST) {
+                    BOOST_LOG_TRIVIAL(error)
+                        << "NBD write of " << length << " bytes" << std::endl;
+                    return;
+                }
+                buf.resize(length);
+                if (!recv_all(fd, buf.data(), length)) {
+                    return;
+                }
+                if (!in_range) {
+                    error = ENOSPC;
+                } else if (ops.write == nullptr) {
+                    error = EPERM;
+                } else {
+                    error = call([&] {
+                        return ops.write(buf.data(), length, offset,
+                                         userdata);
+                    });
+                }
+                if (error == 0 && flags & CMD_FLAG_FUA &&
+                    ops.flush != nullptr) {
+                    error = call([&] { return ops.flush(userdata); });
+                }
+                break;
+            case CMD_DISC:
+                return;
+            case CMD_FLUSH:
+                if (ops.flush != nullptr) {
+                    error = call([&] { return ops.flush(userdata); });
+                }
+                break;
+            case CMD_TRIM:
+                if (!in_range) {
+                    error = EINVAL;
+                } else if (ops.trim != nullptr) {
+                    error = call([&] {
+                        return ops.trim(offset, length, userdata);
+                    });
+                }
+                break;
+            default:
+                error = EINVAL;
+        }
+
+        std::string reply;
+        bool sent;
+        if (type == CMD_READ && structured) {
+            put(reply, STRUCTURED_REPLY_MAGIC);
+            put(reply, REPLY_FLAG_DONE);
+            put(reply, error != 0 ? REPLY_TYPE_ERROR : REPLY_TYPE_OFFSET_DATA);
+            reply.append(handle, 8);
+            if (error != 0) {
+                put<uint32_t>(reply, 6);
+                put(reply, error);
+                put<uint16_t>(reply, 0);  // no message
+                sent = send_all(fd, reply);
+            } else {
+                put<uint32_t>(reply, 8 + length);
+                put(reply, offset);
+                sent = send_all(fd, reply, MSG_MORE) &&
+                       send_all(fd, buf.data(), length);
+            }
+        } else {
+            put(reply, SIMPLE_REPLY_MAGIC);
+            put(reply, error);
+            reply.append(handle, 8);
+            // a simple read reply always carries the data, even on errors
+            sent = type == CMD_READ
+                       ? send_all(fd, reply, MSG_MORE) &&
+                             send_all(fd, buf.data(), length)
+                       : send_all(fd, reply);
+        }
+        if (!sent) {
+            return;
+        }
+    }
+}
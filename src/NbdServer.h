@@ -0,0 +1,57 @@
+#ifndef NBD_SERVER_H
+#define NBD_SERVER_H
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "BUSE/buse.h"
+
+// Serves the buse operations as an NBD export over TCP or a Unix socket, as
+// an alternative to attaching /dev/nbd0 with buse_main. Speaks the fixed
+// newstyle handshake, including NBD_OPT_GO and structured replies, to any
+// number of connections with one thread each. The operations are called
+// under one lock since they are not thread safe, the connections only
+// overlap on the network. Every export name is accepted.
+class NbdServer {
+    struct Connection {
+        int fd = -1;
+        std::thread thread;
+        bool done = false;  // the thread can be joined
+    };
+
+    const buse_operations &ops;
+    void *userdata;
+    uint64_t size;
+    int listen_fd = -1;
+    std::string socket_path;  // removed again for Unix sockets
+    std::atomic<bool> stopping{false};
+
+    std::mutex ops_lock;
+    std::mutex connections_lock;
+    std::list<Connection> connections;
+
+    // option haggling, false if the client went away or aborted
+    bool handshake(int fd, bool &structured);
+    // requests until the client disconnects
+    void transmit(int fd, bool structured);
+    void serve_connection(Connection *conn);
+
+   public:
+    NbdServer(const buse_operations &ops, void *userdata);
+    ~NbdServer();
+    NbdServer(const NbdServer &) = delete;
+    NbdServer &operator=(const NbdServer &) = delete;
+
+    // host:port or unix:path, false if it cannot be bound
+    bool listen(const std::string &address);
+    // accept connections until stop(), then disconnect the operations
+    int serve();
+    // async signal safe
+    void stop();
+};
+
+#endif
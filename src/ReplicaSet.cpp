@@ -0,0 +1,567 @@
+#include "ReplicaSet.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/log/trivial.hpp>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <random>
+
+#include "BlockBitmap.h"
+#include "Extent.h"
+#include "Topology.h"
+#include "Trace.h"
+#include "utils.h"
+
+using grpc::ClientContext;
+
+typedef Transport::ReplicateStream WriteStream;
+
+class ReplicaSet::Replica {
+    ReplicaSet &set;
+    Transport &stub;
+    const std::string address;
+    const uint64_t extent_size;
+    const ErasureCode *code;  // null for a full replica
+    const size_t shard;  // of every extent this replica keeps
+    const uint64_t shard_size;
+    const size_t stream;  // of the server, takes every streams-th stripe
+    const size_t streams;
+    const uint64_t stripe_extents;
+    EncryptionManager &emgr;
+    BandwidthScheduler *scheduler;
+    int img_fd;  // for catching up, closed with the replica
+
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<ReplicaBatch> queue;
+    BlockBitmap dirty;  // extents to resend from the local file
+    uint64_t handed = 0;  // seq of the last batch handed over
+    bool failed = false;  // stream closed
+    bool acks_ended = false;  // the server ended the current stream
+    bool catching_up = false;
+    uint64_t sent = 0;  // seq of the last write on the stream
+    uint64_t durable = 0;  // seq the server acknowledged
+    // writes the server may still lose, by seq
+    std::deque<std::pair<uint64_t, uint64_t>> unsynced;
+    // batches acknowledged once the writes up to a seq are durable
+    std::deque<std::pair<uint64_t, uint64_t>> marks;
+
+    bool mine(uint64_t extent_no) const {
+        return extent_no / stripe_extents % streams == stream;
+    }
+
+    // the whole shard, or length bytes at offset of a full replica's extent
+    bool write(WriteStream &stream, uint64_t extent_no, const uint8_t *data,
+               uint32_t offset = 0, uint32_t length = 0);
+    bool commit(WriteStream &stream, uint64_t epoch);
+    // what this replica keeps of extent i of the batch
+    const uint8_t *shard_of(const ReplicaBatch &batch, size_t i) const;
+    bool send(WriteStream &stream,
+              const ReplicaBatch &batch);
+    bool catch_up(WriteStream &stream, uint64_t first,
+                  uint64_t last);
+    void advance();
+    void settle();
+    void read_acks(WriteStream &stream);
+    // replicate on stream until stop, false once the stream failed
+    bool replicate(WriteStream &stream, const StopFlag &stop,
+                   bool &progressed);
+
+   public:
+    std::atomic<uint64_t> acked{0};
+
+    Replica(ReplicaSet &set, Transport &stub, const std::string &server,
+            size_t shard, size_t stream, int img_fd, const Config &config,
+            EncryptionManager &emgr, BandwidthScheduler *scheduler)
+        : set(set),
+          stub(stub),
+          address(config.streams > 1
+                      ? server + " stream " + std::to_string(stream)
+                      : server),
+          extent_size(config.extent_size),
+          code(set.code ? &*set.code : nullptr),
+          shard(shard),
+          shard_size(code ? extent_size / code->data_shards() : extent_size),
+          stream(stream),
+          streams(config.streams),
+          stripe_extents(std::max<uint64_t>(1, STRIPE_BYTES / extent_size)),
+          emgr(emgr),
+          scheduler(scheduler),
+          img_fd(img_fd),
+          dirty(config.size / config.extent_size) {}
+    ~Replica() { close(img_fd); }
+
+    void push(const ReplicaBatch &batch);
+    void run(const StopFlag &stop);
+    void log_status();
+};
+
+void ReplicaSet::Replica::push(const ReplicaBatch &batch) {
+    std::lock_guard guard(lock);
+    handed = batch.seq;
+    if (batch.epoch != 0) {
+        // what a catch up sent may be newer than the epoch, the next barrier
+        // after it commits it
+        if (!failed && !catching_up && dirty.count() == 0) {
+            queue.push_back(batch);
+        }
+        ready.notify_one();
+        return;
+    }
+    // once behind, stay on the dirty bitmap until caught up, so queued
+    // batches are never older than what the bitmap sends
+    if (failed || dirty.count() > 0 || queue.size() >= REPLICA_QUEUE_BATCHES) {
+        if (!failed && !catching_up) {
+            catching_up = true;
+            BOOST_LOG_TRIVIAL(warning)
+                << boost::format(
+                       "Replica %1% is %2% batches behind, catching up from "
+                       "dirty extents") %
+                       address % (batch.seq - acked.load())
+                << std::endl;
+        }
+        for (const auto extent_no : batch.extent_nos) {
+            if (mine(extent_no)) {
+                dirty.set(extent_no);
+            }
+        }
+    } else if (std::any_of(
+                   batch.extent_nos.begin(), batch.extent_nos.end(),
+                   [&](uint64_t extent_no) { return mine(extent_no); })) {
+        queue.push_back(batch);
+    } else {
+        // only acknowledged in order, without holding on to the data
+        queue.push_back({.seq = batch.seq});
+    }
+    ready.notify_one();
+}
+
+bool ReplicaSet::Replica::write(WriteStream &stream, uint64_t extent_no,
+                                const uint8_t *data, uint32_t offset,
+                                uint32_t length) {
+    const auto size = length > 0 ? length : shard_size;
+    WriteBlockRequest req;
+    req.set_block_no(extent_no);
+    req.set_data(data + offset, size);
+    req.set_offset(offset);
+    req.set_staged(true);
+    req.set_stream(this->stream);
+    {
+        std::lock_guard guard(lock);
+        req.set_seq(++sent);
+        unsynced.emplace_back(sent, extent_no);
+    }
+    if (scheduler != nullptr) {
+        scheduler->acquire(TrafficClass::LIVE, size);
+    }
+    return stream.Write(req);
+}
+
+bool ReplicaSet::Replica::commit(WriteStream &stream, uint64_t epoch) {
+    WriteBlockRequest req;
+    req.set_commit(epoch);
+    req.set_stream(this->stream);
+    req.set_streams(streams);
+    {
+        std::lock_guard guard(lock);
+        req.set_seq(++sent);
+    }
+    return stream.Write(req);
+}
+
+const uint8_t *ReplicaSet::Replica::shard_of(const ReplicaBatch &batch,
+                                             size_t i) const {
+    if (code == nullptr) {
+        return batch.data + i * extent_size;
+    }
+    const auto k = static_cast<size_t>(code->data_shards());
+    if (shard < k) {
+        return batch.data + i * extent_size + shard * shard_size;
+    }
+    return batch.parity->data() +
+           (i * code->parity_shards() + shard - k) * shard_size;
+}
+
+bool ReplicaSet::Replica::send(WriteStream &stream,
+                               const ReplicaBatch &batch) {
+    if (batch.epoch != 0) {
+        return commit(stream, batch.epoch);
+    }
+    const auto blocks = extent_size / BLOCK_SIZE;
+    const auto first = batch.extent_nos.empty() ? 0 : batch.extent_nos[0];
+    Trace::Span span(Trace::SEND, batch.trace_id, first * blocks,
+                     batch.extent_nos.size() * blocks);
+    for (size_t i = 0; i < batch.extent_nos.size(); i++) {
+        if (mine(batch.extent_nos[i]) &&
+            !write(stream, batch.extent_nos[i], shard_of(batch, i),
+                   batch.offset, batch.length)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ReplicaSet::Replica::catch_up(WriteStream &stream,
+                                   uint64_t first, uint64_t last) {
+    return with_extent(extent_size, [&](auto extent) {
+        typedef decltype(extent) E;
+        for (auto batch_start = first; batch_start <= last;
+             batch_start += E::batch) {
+            const auto n =
+                std::min<uint64_t>(E::batch, last - batch_start + 1);
+            std::vector<typename E::Data> extents(n);
+            if (const auto err =
+                    pread(img_fd, extents.data(), n * E::size,
+                          static_cast<long int>(batch_start * E::size));
+                err < 0) {
+                BOOST_LOG_TRIVIAL(error)
+                    << "Replica pread failed" << std::endl;
+                return false;
+            }
+            std::vector<uint64_t> extent_nos(n);
+            for (uint64_t i = 0; i < n; i++) {
+                extent_nos[i] = batch_start + i;
+            }
+            emgr.crypt_extents(extents, extent_nos);
+            ReplicaBatch batch{.data = extents[0].data()};
+            if (code != nullptr &&
+                shard >= static_cast<size_t>(code->data_shards())) {
+                batch.parity = set.encode(batch.data, n);
+            }
+            for (uint64_t i = 0; i < n; i++) {
+                if (!write(stream, extent_nos[i], shard_of(batch, i))) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    });
+}
+
+// everything before the first queued batch has been sent once nothing is
+// left in the bitmap, and is acknowledged once the server synced it
+void ReplicaSet::Replica::advance() {
+    {
+        std::lock_guard guard(lock);
+        if (failed || dirty.count() > 0) {
+            return;
+        }
+        if (catching_up) {
+            catching_up = false;
+            BOOST_LOG_TRIVIAL(info)
+                << "Replica " << address << " caught up" << std::endl;
+        }
+        const auto batch = queue.empty() ? handed : queue.front().seq - 1;
+        if (!marks.empty() && marks.back().first == sent) {
+            marks.back().second = batch;
+        } else {
+            marks.emplace_back(sent, batch);
+        }
+        settle();
+    }
+    set.notify_acked();
+}
+
+void ReplicaSet::Replica::settle() {
+    while (!unsynced.empty() && unsynced.front().first <= durable) {
+        unsynced.pop_front();
+    }
+    while (!marks.empty() && marks.front().first <= durable) {
+        acked = marks.front().second;
+        marks.pop_front();
+    }
+}
+
+void ReplicaSet::Replica::read_acks(WriteStream &stream) {
+    WriteAck ack;
+    while (stream.Read(&ack)) {
+        if (!ack.success()) {
+            BOOST_LOG_TRIVIAL(error)
+                << "Replica " << address
+                << " stopped acknowledging: " << ack.message() << std::endl;
+            return;
+        }
+        {
+            std::lock_guard guard(lock);
+            durable = ack.seq();
+            settle();
+        }
+        set.notify_acked();
+    }
+    // a stream that fails while idle is noticed without another write
+    std::lock_guard guard(lock);
+    acks_ended = true;
+    ready.notify_one();
+}
+
+void ReplicaSet::Replica::run(const StopFlag &stop) {
+    std::mt19937 rng(std::random_device{}());
+    auto delay = std::chrono::milliseconds(RECONNECT_DELAY_MS);
+    while (true) {
+        ClientContext context;
+        std::unique_ptr<WriteStream> stream(stub.ReplicateBlocks(&context));
+        {
+            std::lock_guard guard(lock);
+            acks_ended = false;
+        }
+        std::thread acks([&] { read_acks(*stream); });
+        bool progressed = false;
+        const bool stopped = replicate(*stream, stop, progressed);
+        // the server acknowledges the rest before it ends the stream
+        stream->WritesDone();
+        acks.join();
+        stream->Finish();
+        if (stopped) {
+            return;
+        }
+
+        // wait between half and all of the backoff, so the replicas of a
+        // restarted server do not all come back at once
+        if (progressed) {
+            delay = std::chrono::milliseconds(RECONNECT_DELAY_MS);
+        }
+        const auto wait = std::chrono::milliseconds(
+            std::uniform_int_distribution<long>(delay.count() / 2,
+                                                delay.count())(rng));
+        BOOST_LOG_TRIVIAL(info)
+            << boost::format("Replica %1% reconnecting in %2% ms") % address %
+                   wait.count()
+            << std::endl;
+        const auto until = std::chrono::steady_clock::now() + wait;
+        while (!stop.load() && std::chrono::steady_clock::now() < until) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(
+                std::min<long>(100, wait.count())));
+        }
+        if (stop.load()) {
+            return;
+        }
+        delay = std::min(delay * 2,
+                         std::chrono::milliseconds(RECONNECT_MAX_DELAY_MS));
+
+        // resend the dirty extents on the new stream
+        std::lock_guard guard(lock);
+        failed = false;
+    }
+}
+
+bool ReplicaSet::Replica::replicate(WriteStream &stream, const StopFlag &stop,
+                                    bool &progressed) {
+    while (!stop.load()) {
+        std::optional<ReplicaBatch> batch;
+        std::optional<std::pair<uint64_t, uint64_t>> range;
+        bool ended;
+        {
+            std::unique_lock guard(lock);
+            ready.wait_for(guard, std::chrono::seconds(1), [&] {
+                return !queue.empty() || (!failed && dirty.count() > 0) ||
+                       acks_ended;
+            });
+            // fail the stream without taking anything once it ended
+            ended = acks_ended;
+            if (!ended && !queue.empty()) {
+                batch = std::move(queue.front());
+                queue.pop_front();
+            } else if (!ended && !failed) {
+                range = dirty.pop_range(SPILL_RANGE_MAX);
+            }
+        }
+        if (!ended && !batch && !range) {
+            continue;
+        }
+
+        if (!ended && (batch ? send(stream, *batch)
+                             : catch_up(stream, range->first, range->second))) {
+            advance();
+            progressed = true;
+            continue;
+        }
+
+        // keep everything not sent for a later catch up
+        std::lock_guard guard(lock);
+        if (batch) {
+            for (const auto extent_no : batch->extent_nos) {
+                if (mine(extent_no)) {
+                    dirty.set(extent_no);
+                }
+            }
+        } else if (range) {
+            dirty.set_range(range->first, range->second);
+        }
+        for (const auto &queued : queue) {
+            for (const auto extent_no : queued.extent_nos) {
+                if (mine(extent_no)) {
+                    dirty.set(extent_no);
+                }
+            }
+        }
+        queue.clear();
+        // the server may have lost whatever it did not acknowledge
+        for (const auto &write : unsynced) {
+            dirty.set(write.second);
+        }
+        unsynced.clear();
+        marks.clear();
+        failed = true;
+        catching_up = true;
+        BOOST_LOG_TRIVIAL(error)
+            << "Replica " << address
+            << " RPC stream closed, recording writes as dirty" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void ReplicaSet::Replica::log_status() {
+    std::lock_guard guard(lock);
+    BOOST_LOG_TRIVIAL(info)
+        << boost::format(
+               "Replica %1%: %2% of %3% batches acknowledged, %4% extents "
+               "dirty%5%") %
+               address % acked.load() % handed % dirty.count() %
+               (failed ? ", stream closed" : "")
+        << std::endl;
+}
+
+ReplicaSet::ReplicaSet(const Config &config)
+    : extent_size(config.extent_size),
+      streams(config.streams),
+      cpus(config.sender_cpus),
+      epoch(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch())
+                .count()) {
+    if (config.data_shards > 0) {
+        code.emplace(config.data_shards, config.parity_shards);
+    }
+}
+
+std::unique_ptr<ReplicaSet> ReplicaSet::create(
+    const std::vector<std::unique_ptr<Transport>> &stubs,
+    const Config &config, EncryptionManager &emgr,
+    BandwidthScheduler *scheduler) {
+    std::unique_ptr<ReplicaSet> set(new ReplicaSet(config));
+    for (size_t i = 0; i < stubs.size(); i++) {
+        const auto &server = config.backup_servers[i];
+        for (size_t stream = 0; stream < set->streams; stream++) {
+            auto *stub = stubs[i].get();
+            // the first stream shares the connection of the bulk runs
+            if (stream > 0) {
+                set->channels.push_back(Transport::connect(server));
+                stub = set->channels.back().get();
+            }
+            if (stub == nullptr) {
+                BOOST_LOG_TRIVIAL(error)
+                    << "Cannot connect to backup server " << server
+                    << std::endl;
+                return nullptr;
+            }
+            const int img_fd = open(config.file.c_str(), O_RDONLY);
+            if (img_fd < 0) {
+                BOOST_LOG_TRIVIAL(error)
+                    << "Cannot open img file" << std::endl;
+                return nullptr;
+            }
+            set->replicas.push_back(
+                std::make_unique<Replica>(*set, *stub, server, i, stream,
+                                          img_fd, config, emgr, scheduler));
+        }
+    }
+    return set;
+}
+
+ReplicaSet::~ReplicaSet() = default;
+
+void ReplicaSet::start(const StopFlag &stop) {
+    for (size_t i = 0; i < replicas.size(); i++) {
+        std::vector<int> core;
+        if (!cpus.empty()) {
+            core.push_back(cpus[i % cpus.size()]);
+        }
+        threads.emplace_back([&replica = replicas[i], &stop, core] {
+            Topology::pin(core);
+            replica->run(stop);
+        });
+    }
+}
+
+void ReplicaSet::join() {
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+    for (auto &replica : replicas) {
+        replica->log_status();
+    }
+}
+
+std::shared_ptr<const std::vector<uint8_t>> ReplicaSet::encode(
+    const uint8_t *extents, size_t n) const {
+    const auto k = code->data_shards();
+    const auto m = code->parity_shards();
+    const auto shard_size = extent_size / k;
+    auto parity = std::make_shared<std::vector<uint8_t>>(n * m * shard_size);
+    std::vector<const uint8_t *> data(k);
+    std::vector<uint8_t *> out(m);
+    for (size_t i = 0; i < n; i++) {
+        for (int d = 0; d < k; d++) {
+            data[d] = extents + i * extent_size + d * shard_size;
+        }
+        for (int p = 0; p < m; p++) {
+            out[p] = parity->data() + (i * m + p) * shard_size;
+        }
+        code->encode(data.data(), out.data(), shard_size);
+    }
+    return parity;
+}
+
+void ReplicaSet::send(ReplicaBatch batch) {
+    batch.seq = seq.load() + 1;
+    if (code && code->parity_shards() > 0 && !batch.extent_nos.empty()) {
+        batch.parity = encode(batch.data, batch.extent_nos.size());
+    }
+    for (auto &replica : replicas) {
+        replica->push(batch);
+    }
+    seq = batch.seq;
+}
+
+void ReplicaSet::barrier() {
+    send({.epoch = ++epoch});
+}
+
+void ReplicaSet::notify_acked() {
+    { std::lock_guard guard(lock); }
+    acks.notify_all();
+}
+
+uint64_t ReplicaSet::acked_seq(size_t quorum) const {
+    if (quorum == 0) {
+        return seq.load();
+    }
+    // a server acknowledged what all of its streams did
+    std::vector<uint64_t> servers;
+    for (auto first = replicas.begin(); first != replicas.end();
+         first += streams) {
+        auto acked = UINT64_MAX;
+        for (auto replica = first; replica != first + streams; replica++) {
+            acked = std::min(acked, (*replica)->acked.load());
+        }
+        servers.push_back(acked);
+    }
+    if (quorum > servers.size()) {
+        return 0;
+    }
+    std::nth_element(servers.begin(), servers.begin() + quorum - 1,
+                     servers.end(), std::greater<>());
+    return servers[quorum - 1];
+}
+
+bool ReplicaSet::wait_quorum(uint64_t seq, size_t quorum,
+                             std::chrono::milliseconds timeout) {
+    std::unique_lock guard(lock);
+    return acks.wait_for(guard, timeout,
+                         [&] { return acked_seq(quorum) >= seq; });
+}
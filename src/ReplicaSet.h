@@ -0,0 +1,99 @@
+#ifndef REPLICA_SET_H
+#define REPLICA_SET_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include "BandwidthScheduler.h"
+#include "EncryptionManager.h"
+#include "ErasureCode.h"
+#include "Transport.h"
+#include "types.h"
+
+// Encrypted extents of one daemon batch, shared by all replicas
+struct ReplicaBatch {
+    uint64_t seq = 0;
+    std::vector<uint64_t> extent_nos;
+    const uint8_t *data = nullptr;  // the extents back to back
+    std::shared_ptr<const void> owner;  // keeps data alive
+    // parity shards of each extent back to back, if erasure coded
+    std::shared_ptr<const std::vector<uint8_t>> parity;
+    uint64_t trace_id = 0;  // NBD request, while tracing
+    uint64_t epoch = 0;  // set for a barrier, which ends the epoch
+    // set if only these bytes of the only extent changed and are encrypted
+    uint32_t offset = 0;
+    uint32_t length = 0;
+};
+
+// Replicates to every backup server in parallel. Each replica has its own
+// queue and stream, so a slow one does not hold back the others. With
+// config.streams > 1 a backup server gets several replicas, each on its own
+// connection and taking the extents of every streams-th STRIPE_BYTES range,
+// so an extent always goes through the same stream. A replica more than
+// REPLICA_QUEUE_BATCHES behind, or whose stream closed, records the extents
+// in its own dirty bitmap instead and catches up from the local file. A
+// closed stream is reopened with exponential backoff.
+// A replica acknowledges a batch once the server synced it and every batch
+// before it, a server once all of its streams did. On an erasure coded
+// volume the replicas of server i only receive shard i of every extent.
+// The server stages the writes and applies them an epoch at a time once all
+// streams committed it at a barrier. A replica catching up drops barriers,
+// since it sends extents newer than the epoch, and commits at the first one
+// after it caught up. A batch with part of an extent is sent as such, the
+// dirty bitmap and catching up always resend whole extents.
+class ReplicaSet {
+    class Replica;
+
+    uint64_t extent_size;
+    std::optional<ErasureCode> code;
+    // the extra connections of every server
+    std::vector<std::unique_ptr<Transport>> channels;
+    size_t streams;
+    std::vector<int> cpus;  // one for each replica in turn
+    std::vector<std::unique_ptr<Replica>> replicas;  // streams per server
+    std::vector<std::thread> threads;
+    std::atomic<uint64_t> seq{0};  // of the last batch sent
+    uint64_t epoch;  // of the last barrier, increasing across restarts
+    std::mutex lock;
+    std::condition_variable acks;
+
+    explicit ReplicaSet(const Config &config);
+    void notify_acked();
+    // parity shards of n encrypted extents
+    std::shared_ptr<const std::vector<uint8_t>> encode(const uint8_t *extents,
+                                                       size_t n) const;
+
+   public:
+    // stubs[i] is the backup server at config.backup_servers[i], nullptr if
+    // a connection or the img file cannot be opened
+    static std::unique_ptr<ReplicaSet> create(
+        const std::vector<std::unique_ptr<Transport>> &stubs,
+        const Config &config, EncryptionManager &emgr,
+        BandwidthScheduler *scheduler);
+    ~ReplicaSet();
+    void start(const StopFlag &stop);
+    void join();
+    // hand a batch to every replica, only called by the daemon
+    void send(ReplicaBatch batch);
+    // whether batches may carry part of an extent, parity needs all of it
+    bool partial() const { return !code; }
+    // end the epoch of the batches sent so far, only called by the daemon
+    void barrier();
+    uint64_t last_seq() const { return seq.load(); }
+    // the last seq that quorum servers acknowledged with every batch before
+    uint64_t acked_seq(size_t quorum) const;
+    // wait until quorum servers acknowledged every batch up to seq, false on
+    // timeout
+    bool wait_quorum(uint64_t seq, size_t quorum,
+                     std::chrono::milliseconds timeout);
+    size_t size() const { return replicas.size() / streams; }
+};
+
+#endif
@@ -5,20 +5,35 @@
 #include <boost/log/sources/severity_logger.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/log/utility/setup.hpp>
+#include <algorithm>
 #include <boost/thread/thread.hpp>
+#include <csignal>
 #include <iostream>
+#include <optional>
 #include <thread>
 
 #include "BUSE/buse.h"
 #include "BackupDaemon.h"
+#include "Checkpoint.h"
 #include "EncryptionManager.h"
+#include "FingerprintCache.h"
+#include "LazyRecovery.h"
 #include "LocalBlockDriver.h"
+#include "NbdServer.h"
 #include "PasswordManager.h"
+#include "Topology.h"
+#include "Trace.h"
 #include "grpcpp/security/credentials.h"
 #include "utils.h"
 
 using grpc::Channel;
 
+namespace {
+NbdServer *nbd_server = nullptr;
+
+void stop_nbd_server(int) { nbd_server->stop(); }
+}  // namespace
+
 int main(int argc, char* argv[]) {
     boost::log::add_console_log(std::cout,
                                 boost::log::keywords::format = ">> %Message%");
@@ -29,6 +44,9 @@ int main(int argc, char* argv[]) {
         boost::log::core::get()->set_filter(boost::log::trivial::severity >=
                                             boost::log::trivial::info);
     }
+    if (!config.trace_file.empty()) {
+        Trace::control_by_signals(config.trace_file);
+    }
 
     // check password
     PasswordManager pm(PASSWORD_FILE);
@@ -40,17 +58,17 @@ int main(int argc, char* argv[]) {
         return EXIT_FAILURE;
     }
 
-    EncryptionManager emgr(pm.get_password());
-
-    // connect to back up server
-    const auto channel =
-        CreateChannel(config.backup_server, grpc::InsecureChannelCredentials());
-    if (channel == nullptr) {
-        BOOST_LOG_TRIVIAL(fatal)
-            << "Cannot connect to backup server" << std::endl;
-        return EXIT_FAILURE;
+    // connect to back up servers
+    std::vector<std::unique_ptr<Transport>> stubs;
+    for (const auto &server : config.backup_servers) {
+        auto stub = Transport::connect(server);
+        if (stub == nullptr) {
+            BOOST_LOG_TRIVIAL(fatal)
+                << "Cannot connect to backup server " << server << std::endl;
+            return EXIT_FAILURE;
+        }
+        stubs.push_back(std::move(stub));
     }
-    const auto client_stub = Backup::NewStub(channel);
 
     // open the storage file
     const int fd = open(config.file.c_str(), O_RDWR | O_CREAT, 0666);
@@ -66,17 +84,77 @@ int main(int argc, char* argv[]) {
     }
     BOOST_LOG_TRIVIAL(info)
         << "Storage file opened, size: " << config.size << std::endl;
+    // the extents an interrupted lazy recovery did not restore read as
+    // zeros, only recovery or a new setup may start on the file
+    if (Checkpoint lazy; config.mode != Mode::RECOVER_LOCAL &&
+                         config.mode != Mode::SETUP &&
+                         lazy.load(Checkpoint::path_for(config.file)) &&
+                         lazy.op == "lazy") {
+        BOOST_LOG_TRIVIAL(fatal)
+            << "Lazy recovery of " << config.file
+            << " is incomplete, run recover_local --lazy to resume it"
+            << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // cipher, extent size and erasure code are fixed at setup, recovery
+    // takes them from the remote volume
+    const auto meta_path = VolumeMetadata::path_for(config.file);
+    if (VolumeMetadata volume; config.mode == Mode::RECOVER_LOCAL) {
+        if (!std::any_of(stubs.begin(), stubs.end(), [&](const auto &stub) {
+                return utils::get_volume(stub, volume);
+            })) {
+            BOOST_LOG_TRIVIAL(fatal)
+                << "Cannot get remote volume metadata" << std::endl;
+            return EXIT_FAILURE;
+        }
+        config.cipher = volume.cipher;
+        config.extent_size = volume.extent_size;
+        config.data_shards = volume.data_shards;
+        config.parity_shards = volume.parity_shards;
+    } else if (config.mode != Mode::SETUP && volume.load(meta_path)) {
+        config.cipher = volume.cipher;
+        config.extent_size = volume.extent_size;
+        config.data_shards = volume.data_shards;
+        config.parity_shards = volume.parity_shards;
+    }
+    if (config.size % config.extent_size != 0) {
+        BOOST_LOG_TRIVIAL(fatal)
+            << "Storage file size is not a multiple of the extent size "
+            << config.extent_size << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (config.mode != Mode::SETUP && !utils::check_servers(stubs, config)) {
+        return EXIT_FAILURE;
+    }
+    EncryptionManager emgr(pm.get_password(), config.cipher);
+
+    // bandwidth limits, the rate file can change them while we run
+    BandwidthScheduler scheduler(config);
+    std::optional<RateFileWatcher> rate_watcher;
+    if (!config.rate_file.empty()) {
+        scheduler.load_rates(config.rate_file);
+        rate_watcher.emplace(scheduler, config.rate_file);
+    }
+
+    std::unique_ptr<FingerprintCache> fingerprints;
+    if (config.fingerprint != FingerprintMode::OFF) {
+        fingerprints = std::make_unique<FingerprintCache>(
+            config.fingerprint, config.size / config.extent_size);
+    }
 
     // initialize
     if (config.mode == Mode::SETUP) {
         BOOST_LOG_TRIVIAL(info)
             << "Setting up SeCloud, size: " << config.size << std::endl;
-        if (!utils::rebuild_remote(fd, emgr, client_stub, config)) {
+        if (!utils::rebuild_remote(fd, emgr, stubs, config,
+                                   fingerprints.get(), &scheduler)) {
             BOOST_LOG_TRIVIAL(fatal) << "Failed to setup remote" << std::endl;
             return EXIT_FAILURE;
         }
     } else if (config.check &&
-               !utils::consistency_check(fd, emgr, client_stub, config) &&
+               !utils::consistency_check(fd, emgr, stubs, config,
+                                         &scheduler) &&
                config.mode == Mode::NORMAL) {
         BOOST_LOG_TRIVIAL(fatal)
             << "Storage file is not consistent. Please specify recovery "
@@ -84,31 +162,92 @@ int main(int argc, char* argv[]) {
             << std::endl;
         exit(EXIT_FAILURE);
     } else if (config.mode == Mode::REBUILD_BACKUP) {
-        if (!utils::rebuild_remote(fd, emgr, client_stub, config)) {
-            BOOST_LOG_TRIVIAL(fatal) << "Failed to rebuild remote" << std::endl;
+        if (!utils::rebuild_remote(fd, emgr, stubs, config,
+                                   fingerprints.get(), &scheduler)) {
+            BOOST_LOG_TRIVIAL(fatal)
+                << "Failed to rebuild remote" << std::endl;
             return EXIT_FAILURE;
         }
-    } else if (config.mode == Mode::RECOVER_LOCAL) {
-        if (!utils::recover_local(fd, emgr, client_stub, config)) {
+    } else if (config.mode == Mode::RECOVER_LOCAL && !config.lazy) {
+        if (!utils::recover_local(fd, emgr, stubs, config,
+                                  fingerprints.get(), &scheduler)) {
             BOOST_LOG_TRIVIAL(fatal) << "Failed to recover local" << std::endl;
             return EXIT_FAILURE;
         }
     }
 
+    if (config.mode != Mode::NORMAL &&
+        !VolumeMetadata{.size = config.size,
+                        .cipher = config.cipher,
+                        .extent_size = config.extent_size,
+                        .data_shards = config.data_shards,
+                        .parity_shards = config.parity_shards}
+             .save(meta_path)) {
+        BOOST_LOG_TRIVIAL(fatal)
+            << "Cannot save volume metadata" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // resumes an interrupted lazy recovery or saves that one started
+    std::unique_ptr<LazyRecovery> lazy;
+    if (config.mode == Mode::RECOVER_LOCAL && config.lazy) {
+        const auto lazy_fd = open(config.file.c_str(), O_RDWR);
+        if (lazy_fd < 0) {
+            BOOST_LOG_TRIVIAL(fatal) << "Cannot open img file" << std::endl;
+            return EXIT_FAILURE;
+        }
+        lazy = LazyRecovery::create(lazy_fd, emgr, stubs, config,
+                                    fingerprints.get(), &scheduler);
+        if (!lazy) {
+            BOOST_LOG_TRIVIAL(fatal)
+                << "Cannot save lazy recovery progress" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
     // start backup daemon
-    const auto queue = std::make_shared<AsyncOperationQueue>(config.queue_size);
+    const auto queue = std::make_shared<AsyncOperationQueue>(config);
     StopFlag stop_flag(false);
     auto daemon_fd = open(config.file.c_str(), O_RDONLY);
     if (daemon_fd < 0) {
         BOOST_LOG_TRIVIAL(fatal) << "Cannot open img file" << std::endl;
         return EXIT_FAILURE;
     }
+    const auto replica_set =
+        ReplicaSet::create(stubs, config, emgr, &scheduler);
+    if (!replica_set) {
+        BOOST_LOG_TRIVIAL(fatal) << "Cannot start replication" << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto &replicas = *replica_set;
+    replicas.start(stop_flag);
     std::thread daemon([&] {
-        BackupDaemon::start(queue, daemon_fd, emgr, client_stub, stop_flag);
+        Topology::pin(config.daemon_cpus);
+        BackupDaemon::start(queue, daemon_fd, emgr, replicas,
+                            config.extent_size, fingerprints.get(), stop_flag,
+                            config.io_engine);
     });  // start the daemon
 
-    // configure buse
-    LocalBlockDriver::Context ctx = {.queue = queue, .fd = fd};
+    // lazy recovery fills the file in the background while buse serves it
+    std::thread filler;
+    if (lazy) {
+        filler = std::thread([&] { lazy->fill(stop_flag); });
+    }
+
+    // configure buse, its requests are served by one thread
+    std::optional<UringFile> io;
+    if (config.io_engine == IoEngine::IO_URING) {
+        io.emplace(fd);
+    }
+    LocalBlockDriver::Context ctx = {
+        .queue = queue,
+        .fd = fd,
+        .io = io ? &*io : nullptr,
+        .lazy = lazy.get(),
+        .replicas = &replicas,
+        .write_quorum = config.write_quorum,
+        .epoch_interval = std::chrono::milliseconds(config.epoch_interval_ms),
+        .last_barrier = std::chrono::steady_clock::now()};
     const buse_operations bop = {
         .read = LocalBlockDriver::read,
         .write = LocalBlockDriver::write,
@@ -120,12 +259,42 @@ int main(int argc, char* argv[]) {
     };
 
     BOOST_LOG_TRIVIAL(info) << "SeCloud starts!" << std::endl;
-    if (buse_main(BLOCK_DEV, &bop, &ctx) != EXIT_SUCCESS) {
+    // the front end runs here, the threads of the NBD server inherit it
+    Topology::pin(config.nbd_cpus);
+    if (!config.nbd_listen.empty()) {
+        NbdServer server(bop, &ctx);
+        if (!server.listen(config.nbd_listen)) {
+            BOOST_LOG_TRIVIAL(fatal) << "Cannot start NBD server" << std::endl;
+        } else {
+            nbd_server = &server;
+            std::signal(SIGINT, stop_nbd_server);
+            std::signal(SIGTERM, stop_nbd_server);
+            server.serve();
+            std::signal(SIGINT, SIG_DFL);
+            std::signal(SIGTERM, SIG_DFL);
+            nbd_server = nullptr;
+            BOOST_LOG_TRIVIAL(info) << "NBD server stopped" << std::endl;
+        }
+    } else if (buse_main(BLOCK_DEV, &bop, &ctx) != EXIT_SUCCESS) {
         BOOST_LOG_TRIVIAL(fatal) << "Buse returns error" << std::endl;
     } else {
         BOOST_LOG_TRIVIAL(info) << "Buse exits normally" << std::endl;
     }
 
+    // the writes after the last flush form a final epoch
+    if (!LocalBlockDriver::settle(
+            &ctx, replicas.size(),
+            std::chrono::milliseconds(QUORUM_TIMEOUT_MS))) {
+        BOOST_LOG_TRIVIAL(warning)
+            << "Not every backup server applied the last epoch" << std::endl;
+    }
     stop_flag.store(true);
     daemon.join();
+    replicas.join();
+    if (filler.joinable()) {
+        filler.join();
+    }
+    if (rate_watcher) {
+        rate_watcher->stop();
+    }
 }
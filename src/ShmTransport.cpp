@@ -0,0 +1,492 @@
+#include "ShmTransport.h"
+
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/log/trivial.hpp>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+struct ShmChannel::Ring {
+    alignas(64) std::atomic<uint64_t> head;  // bytes written, by the producer
+    alignas(64) std::atomic<uint64_t> tail;  // bytes read, by the consumer
+    alignas(64) std::atomic<uint32_t> wake;  // futex, bumped to wake sleepers
+    std::atomic<uint32_t> sleepers;
+    std::atomic<uint32_t> closed;  // the producer ended its side
+
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+};
+
+namespace {
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(SHM_RING_BYTES % 64 == 0);
+
+typedef ShmChannel::Ring Ring;
+
+constexpr uint32_t SHM_MAGIC = 0x53484d31;  // "SHM1"
+constexpr size_t REGION_BYTES = 2 * (sizeof(Ring) + SHM_RING_BYTES);
+
+enum FrameKind : uint32_t { MESSAGE, WRITES_DONE, STATUS };
+
+struct Frame {
+    uint32_t length;  // of the payload that follows
+    uint32_t kind;
+};
+
+struct Hello {
+    uint32_t magic;
+    uint32_t method;
+};
+
+Ring *ring(char *region, int i) {
+    return reinterpret_cast<Ring *>(region +
+                                    i * (sizeof(Ring) + SHM_RING_BYTES));
+}
+
+void notify(Ring &ring) {
+    if (ring.sleepers.load() > 0) {
+        ring.wake.fetch_add(1);
+        syscall(SYS_futex, reinterpret_cast<uint32_t *>(&ring.wake),
+                FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+}
+
+grpc::Status decode_status(std::string_view payload) {
+    int32_t code = grpc::StatusCode::INTERNAL;
+    if (payload.size() < sizeof(code)) {
+        return {grpc::StatusCode::INTERNAL, "Corrupt status"};
+    }
+    std::memcpy(&code, payload.data(), sizeof(code));
+    return {static_cast<grpc::StatusCode>(code),
+            std::string(payload.substr(sizeof(code)))};
+}
+
+void copy_in(Ring &ring, uint64_t at, const char *from, size_t n) {
+    const auto offset = at % SHM_RING_BYTES;
+    const auto first = std::min<size_t>(n, SHM_RING_BYTES - offset);
+    std::memcpy(ring.data() + offset, from, first);
+    std::memcpy(ring.data(), from + first, n - first);
+}
+
+void copy_out(Ring &ring, uint64_t at, char *to, size_t n) {
+    const auto offset = at % SHM_RING_BYTES;
+    const auto first = std::min<size_t>(n, SHM_RING_BYTES - offset);
+    std::memcpy(to, ring.data() + offset, first);
+    std::memcpy(to + first, ring.data(), n - first);
+}
+
+}  // namespace
+
+ShmChannel::ShmChannel(int socket, char *region, bool client)
+    : socket(socket),
+      region(region),
+      out(ring(region, client ? 0 : 1)),
+      in(ring(region, client ? 1 : 0)) {}
+
+ShmChannel::~ShmChannel() {
+    out->closed.store(1);
+    notify(*out);
+    notify(*in);
+    munmap(region, REGION_BYTES);
+    close(socket);
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::connect(const std::string &path,
+                                                ShmMethod method) {
+    sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (path.size() >= sizeof(addr.sun_path)) {
+        BOOST_LOG_TRIVIAL(error) << "Socket path too long: " << path
+                                 << std::endl;
+        return nullptr;
+    }
+    std::strcpy(addr.sun_path, path.c_str());
+    const int fd = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 ||
+        ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        BOOST_LOG_TRIVIAL(warning) << "Cannot connect to " << path << ": "
+                                   << std::strerror(errno) << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return nullptr;
+    }
+
+    // the rings start zeroed, which is empty
+    const int mem = memfd_create("secloud-shm", MFD_CLOEXEC);
+    void *region = MAP_FAILED;
+    if (mem >= 0 && ftruncate(mem, REGION_BYTES) == 0) {
+        region = mmap(nullptr, REGION_BYTES, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, mem, 0);
+    }
+    bool sent = false;
+    if (region != MAP_FAILED) {
+        Hello hello = {SHM_MAGIC, static_cast<uint32_t>(method)};
+        iovec iov = {&hello, sizeof(hello)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        const auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &mem, sizeof(int));
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL) == sizeof(hello);
+    }
+    const int error = errno;
+    if (mem >= 0) {
+        close(mem);
+    }
+    if (!sent) {
+        BOOST_LOG_TRIVIAL(warning) << "Cannot start a call on " << path
+                                   << ": " << std::strerror(error)
+                                   << std::endl;
+        if (region != MAP_FAILED) {
+            munmap(region, REGION_BYTES);
+        }
+        close(fd);
+        return nullptr;
+    }
+    return std::unique_ptr<ShmChannel>(
+        new ShmChannel(fd, static_cast<char *>(region), true));
+}
+
+std::unique_ptr<ShmChannel> ShmChannel::accept(int socket,
+                                               ShmMethod &method) {
+    Hello hello = {};
+    iovec iov = {&hello, sizeof(hello)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int mem = -1;
+    if (recvmsg(socket, &msg, MSG_CMSG_CLOEXEC) == sizeof(hello)) {
+        const auto cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&mem, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    void *region = MAP_FAILED;
+    struct stat st;
+    if (mem >= 0 && hello.magic == SHM_MAGIC && fstat(mem, &st) == 0 &&
+        static_cast<size_t>(st.st_size) >= REGION_BYTES) {
+        region = mmap(nullptr, REGION_BYTES, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, mem, 0);
+    }
+    if (mem >= 0) {
+        close(mem);
+    }
+    if (region == MAP_FAILED) {
+        BOOST_LOG_TRIVIAL(warning)
+            << "Dropping a shared memory call without a valid region"
+            << std::endl;
+        close(socket);
+        return nullptr;
+    }
+    method = static_cast<ShmMethod>(hello.method);
+    return std::unique_ptr<ShmChannel>(
+        new ShmChannel(socket, static_cast<char *>(region), false));
+}
+
+bool ShmChannel::alive() {
+    // the peer never writes to the socket, so anything readable is the end
+    pollfd fd = {.fd = socket, .events = POLLIN};
+    return poll(&fd, 1, 0) <= 0;
+}
+
+bool ShmChannel::wait(Ring &ring, const std::function<bool()> &ready) {
+    while (!ready()) {
+        if (in->closed.load()) {
+            return ready();
+        }
+        const auto wake = ring.wake.load();
+        ring.sleepers.fetch_add(1);
+        bool timed_out = false;
+        // a producer that moves on after this check also bumps wake
+        if (!ready() && !in->closed.load()) {
+            const timespec timeout = {
+                0, static_cast<long>(SHM_POLL_MS * 1000 * 1000)};
+            timed_out = syscall(SYS_futex,
+                                reinterpret_cast<uint32_t *>(&ring.wake),
+                                FUTEX_WAIT, wake, &timeout, nullptr, 0) < 0 &&
+                        errno == ETIMEDOUT;
+        }
+        ring.sleepers.fetch_sub(1);
+        if (timed_out && !ready() && !alive()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ShmChannel::send(uint32_t kind,
+                      const google::protobuf::MessageLite *message,
+                      const std::string *raw) {
+    if (in->closed.load()) {
+        return false;
+    }
+    const size_t length = message != nullptr ? message->ByteSizeLong()
+                          : raw != nullptr   ? raw->size()
+                                             : 0;
+    const uint64_t bytes = sizeof(Frame) + length;
+    if (bytes > SHM_RING_BYTES) {
+        BOOST_LOG_TRIVIAL(error) << "Message of " << length
+                                 << " bytes does not fit the ring"
+                                 << std::endl;
+        return false;
+    }
+    const auto head = out->head.load(std::memory_order_relaxed);
+    if (!wait(*out, [&] {
+            return head + bytes - out->tail.load() <= SHM_RING_BYTES;
+        })) {
+        return false;
+    }
+
+    const Frame frame = {static_cast<uint32_t>(length), kind};
+    copy_in(*out, head, reinterpret_cast<const char *>(&frame),
+            sizeof(frame));
+    const auto at = (head + sizeof(frame)) % SHM_RING_BYTES;
+    if (message != nullptr && at + length <= SHM_RING_BYTES) {
+        message->SerializeWithCachedSizesToArray(
+            reinterpret_cast<uint8_t *>(out->data() + at));
+    } else if (message != nullptr) {
+        send_scratch.resize(length);
+        message->SerializeWithCachedSizesToArray(
+            reinterpret_cast<uint8_t *>(send_scratch.data()));
+        copy_in(*out, head + sizeof(frame), send_scratch.data(), length);
+    } else if (raw != nullptr) {
+        copy_in(*out, head + sizeof(frame), raw->data(), length);
+    }
+    out->head.store(head + bytes);
+    notify(*out);
+    return true;
+}
+
+bool ShmChannel::next(uint32_t &kind, std::string_view &payload) {
+    const auto tail = in->tail.load(std::memory_order_relaxed);
+    if (!wait(*in, [&] { return in->head.load() != tail; })) {
+        return false;
+    }
+    Frame frame;
+    copy_out(*in, tail, reinterpret_cast<char *>(&frame), sizeof(frame));
+    if (frame.length > SHM_RING_BYTES - sizeof(frame)) {
+        BOOST_LOG_TRIVIAL(error) << "Corrupt shared memory frame" << std::endl;
+        return false;
+    }
+    const auto at = (tail + sizeof(frame)) % SHM_RING_BYTES;
+    if (at + frame.length <= SHM_RING_BYTES) {
+        payload = {in->data() + at, frame.length};
+    } else {
+        receive_scratch.resize(frame.length);
+        copy_out(*in, tail + sizeof(frame), receive_scratch.data(),
+                 frame.length);
+        payload = receive_scratch;
+    }
+    kind = frame.kind;
+    return true;
+}
+
+void ShmChannel::consume(size_t length) {
+    in->tail.store(in->tail.load(std::memory_order_relaxed) + sizeof(Frame) +
+                   length);
+    notify(*in);
+}
+
+bool ShmChannel::send(const google::protobuf::MessageLite &message) {
+    return send(MESSAGE, &message, nullptr);
+}
+
+bool ShmChannel::send_writes_done() {
+    return send(WRITES_DONE, nullptr, nullptr);
+}
+
+bool ShmChannel::send_status(const grpc::Status &status) {
+    const int32_t code = status.error_code();
+    std::string raw(reinterpret_cast<const char *>(&code), sizeof(code));
+    raw += status.error_message();
+    return send(STATUS, nullptr, &raw);
+}
+
+bool ShmChannel::receive(google::protobuf::MessageLite &message) {
+    if (ended) {
+        return false;
+    }
+    uint32_t kind;
+    std::string_view payload;
+    if (!next(kind, payload)) {
+        ended = true;
+        status = grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                              "The other side went away");
+        return false;
+    }
+    if (kind == MESSAGE) {
+        const bool ok = message.ParseFromArray(payload.data(), payload.size());
+        consume(payload.size());
+        return ok;
+    }
+    ended = true;
+    if (kind == STATUS) {
+        status = decode_status(payload);
+    }
+    consume(payload.size());
+    return false;
+}
+
+grpc::Status ShmChannel::finish() {
+    while (!status) {
+        uint32_t kind;
+        std::string_view payload;
+        if (!next(kind, payload)) {
+            status = grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                                  "The other side went away");
+            break;
+        }
+        if (kind == STATUS) {
+            status = decode_status(payload);
+        }
+        consume(payload.size());
+    }
+    return *status;
+}
+
+ShmTransport::ShmTransport(std::string path) : path(std::move(path)) {}
+
+template <class Request, class Response>
+grpc::Status ShmTransport::call(ShmMethod method, const Request &request,
+                                Response *response) {
+    const auto channel = ShmChannel::connect(path, method);
+    if (channel == nullptr) {
+        return {grpc::StatusCode::UNAVAILABLE, "Cannot connect to " + path};
+    }
+    if (channel->send(request)) {
+        channel->receive(*response);
+    }
+    return channel->finish();
+}
+
+grpc::Status ShmTransport::Setup(grpc::ClientContext *context,
+                                 const SetupRequest &request,
+                                 SetupResponse *response) {
+    return call(ShmMethod::SETUP, request, response);
+}
+
+grpc::Status ShmTransport::GetVolume(grpc::ClientContext *context,
+                                     const GetVolumeRequest &request,
+                                     GetVolumeResponse *response) {
+    return call(ShmMethod::GET_VOLUME, request, response);
+}
+
+std::unique_ptr<Transport::WriteStream> ShmTransport::WriteBlock(
+    grpc::ClientContext *context, WriteBlockResponse *response) {
+    return std::make_unique<
+        ShmClientWriter<WriteBlockRequest, WriteBlockResponse>>(
+        ShmChannel::connect(path, ShmMethod::WRITE_BLOCK), response);
+}
+
+std::unique_ptr<Transport::ReplicateStream> ShmTransport::ReplicateBlocks(
+    grpc::ClientContext *context) {
+    return std::make_unique<ShmClientStream<WriteBlockRequest, WriteAck>>(
+        ShmChannel::connect(path, ShmMethod::REPLICATE_BLOCKS));
+}
+
+std::unique_ptr<Transport::ReadStream> ShmTransport::ReadBlock(
+    grpc::ClientContext *context) {
+    return std::make_unique<
+        ShmClientStream<ReadBlockRequest, ReadBlockResponse>>(
+        ShmChannel::connect(path, ShmMethod::READ_BLOCK));
+}
+
+grpc::Status ShmTransport::CreateSnapshot(
+    grpc::ClientContext *context, const CreateSnapshotRequest &request,
+    CreateSnapshotResponse *response) {
+    return call(ShmMethod::CREATE_SNAPSHOT, request, response);
+}
+
+grpc::Status ShmTransport::ListSnapshots(grpc::ClientContext *context,
+                                         const ListSnapshotsRequest &request,
+                                         ListSnapshotsResponse *response) {
+    return call(ShmMethod::LIST_SNAPSHOTS, request, response);
+}
+
+grpc::Status ShmTransport::DeleteSnapshot(
+    grpc::ClientContext *context, const DeleteSnapshotRequest &request,
+    DeleteSnapshotResponse *response) {
+    return call(ShmMethod::DELETE_SNAPSHOT, request, response);
+}
+
+ShmServer::ShmServer(std::string path) : path(std::move(path)) {
+    sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (this->path.size() >= sizeof(addr.sun_path)) {
+        throw std::invalid_argument("Socket path too long: " + this->path);
+    }
+    std::strcpy(addr.sun_path, this->path.c_str());
+    listener = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    unlink(this->path.c_str());
+    if (listener < 0 ||
+        bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) <
+            0 ||
+        listen(listener, SOMAXCONN) < 0) {
+        const auto error = std::string(std::strerror(errno));
+        if (listener >= 0) {
+            close(listener);
+        }
+        throw std::runtime_error("Cannot listen on " + this->path + ": " +
+                                 error);
+    }
+}
+
+ShmServer::~ShmServer() {
+    stop();
+    close(listener);
+    unlink(path.c_str());
+}
+
+void ShmServer::stop() {
+    stopped.store(true);
+    // wakes up accept, closing the socket would not
+    shutdown(listener, SHUT_RDWR);
+}
+
+void ShmServer::run() {
+    while (true) {
+        const int socket = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        if (socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (stopped.load()) {
+                return;
+            }
+            BOOST_LOG_TRIVIAL(error) << "Cannot accept on " << path << ": "
+                                     << std::strerror(errno) << std::endl;
+            return;
+        }
+        std::thread([this, socket] {
+            ShmMethod method;
+            const auto channel = ShmChannel::accept(socket, method);
+            if (channel == nullptr) {
+                return;
+            }
+            const auto handler = handlers.find(method);
+            channel->send_status(
+                handler == handlers.end()
+                    ? grpc::Status(grpc::StatusCode::UNIMPLEMENTED, "")
+                    : handler->second(*channel));
+        }).detach();
+    }
+}
@@ -0,0 +1,282 @@
+#ifndef SHM_TRANSPORT_H
+#define SHM_TRANSPORT_H
+
+#include <google/protobuf/message_lite.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "Transport.h"
+#include "consts.h"
+
+// The backup service to a server on the same host without TCP and HTTP/2.
+// Every call connects to the server's Unix socket and passes it a memfd
+// with two rings, one per direction, that both processes map. Messages are
+// framed protobufs written straight into the rings, a side that waits for
+// data or room sleeps on a futex in the ring. The socket carries nothing
+// after that, it only tells either side that the other went away.
+
+enum class ShmMethod : uint32_t {
+    SETUP,
+    GET_VOLUME,
+    WRITE_BLOCK,
+    REPLICATE_BLOCKS,
+    READ_BLOCK,
+    CREATE_SNAPSHOT,
+    LIST_SNAPSHOTS,
+    DELETE_SNAPSHOT,
+};
+
+// one call, either side of it
+class ShmChannel {
+   public:
+    struct Ring;
+
+   private:
+    int socket;
+    char *region;
+    Ring *out;
+    Ring *in;
+    bool ended = false;  // the peer sent writes done or the status
+    std::optional<grpc::Status> status;  // the peer sent
+    // frames that wrap around the end of a ring, sending and receiving may
+    // be on different threads
+    std::string send_scratch;
+    std::string receive_scratch;
+
+    ShmChannel(int socket, char *region, bool client);
+
+    // false once the peer process went away, costs a system call
+    bool alive();
+    // until ready() or the peer went away, false then
+    bool wait(Ring &ring, const std::function<bool()> &ready);
+    bool send(uint32_t kind, const google::protobuf::MessageLite *message,
+              const std::string *raw);
+    // the next frame into frame, false once the peer went away
+    bool next(uint32_t &kind, std::string_view &frame);
+    void consume(size_t length);
+
+   public:
+    ~ShmChannel();
+    ShmChannel(const ShmChannel &) = delete;
+    ShmChannel &operator=(const ShmChannel &) = delete;
+
+    // start a call on the server listening at path, nullptr on errors
+    static std::unique_ptr<ShmChannel> connect(const std::string &path,
+                                               ShmMethod method);
+    // take the call on an accepted connection, nullptr on errors
+    static std::unique_ptr<ShmChannel> accept(int socket, ShmMethod &method);
+
+    // false once the peer ended the call or went away
+    bool send(const google::protobuf::MessageLite &message);
+    bool send_writes_done();
+    bool send_status(const grpc::Status &status);
+    // the next message, false once the peer is done sending or went away
+    bool receive(google::protobuf::MessageLite &message);
+    // skip to the status the peer ends the call with
+    grpc::Status finish();
+};
+
+template <class W, class R>
+class ShmClientStream : public grpc::ClientReaderWriterInterface<W, R> {
+    std::unique_ptr<ShmChannel> channel;
+
+   public:
+    explicit ShmClientStream(std::unique_ptr<ShmChannel> channel)
+        : channel(std::move(channel)) {}
+
+    void WaitForInitialMetadata() override {}
+    bool NextMessageSize(uint32_t *sz) override {
+        *sz = SHM_RING_BYTES;
+        return channel != nullptr;
+    }
+    bool Read(R *msg) override { return channel && channel->receive(*msg); }
+    bool Write(const W &msg, grpc::WriteOptions) override {
+        return channel && channel->send(msg);
+    }
+    bool WritesDone() override {
+        return channel && channel->send_writes_done();
+    }
+    grpc::Status Finish() override {
+        if (channel == nullptr) {
+            return {grpc::StatusCode::UNAVAILABLE, "Cannot connect"};
+        }
+        return channel->finish();
+    }
+};
+
+template <class W, class Response>
+class ShmClientWriter : public grpc::ClientWriterInterface<W> {
+    std::unique_ptr<ShmChannel> channel;
+    Response *response;
+    bool done = false;
+
+   public:
+    ShmClientWriter(std::unique_ptr<ShmChannel> channel, Response *response)
+        : channel(std::move(channel)), response(response) {}
+
+    bool Write(const W &msg, grpc::WriteOptions) override {
+        return channel && channel->send(msg);
+    }
+    bool WritesDone() override {
+        done = true;
+        return channel && channel->send_writes_done();
+    }
+    grpc::Status Finish() override {
+        if (channel == nullptr) {
+            return {grpc::StatusCode::UNAVAILABLE, "Cannot connect"};
+        }
+        if (!done) {
+            WritesDone();
+        }
+        channel->receive(*response);
+        return channel->finish();
+    }
+};
+
+template <class W, class R>
+class ShmServerStream : public grpc::ServerReaderWriterInterface<W, R> {
+    ShmChannel &channel;
+
+   public:
+    explicit ShmServerStream(ShmChannel &channel) : channel(channel) {}
+
+    void SendInitialMetadata() override {}
+    bool NextMessageSize(uint32_t *sz) override {
+        *sz = SHM_RING_BYTES;
+        return true;
+    }
+    bool Read(R *msg) override { return channel.receive(*msg); }
+    bool Write(const W &msg, grpc::WriteOptions) override {
+        return channel.send(msg);
+    }
+};
+
+template <class R>
+class ShmServerReader : public grpc::ServerReaderInterface<R> {
+    ShmChannel &channel;
+
+   public:
+    explicit ShmServerReader(ShmChannel &channel) : channel(channel) {}
+
+    void SendInitialMetadata() override {}
+    bool NextMessageSize(uint32_t *sz) override {
+        *sz = SHM_RING_BYTES;
+        return true;
+    }
+    bool Read(R *msg) override { return channel.receive(*msg); }
+};
+
+class ShmTransport : public Transport {
+    const std::string path;
+
+    template <class Request, class Response>
+    grpc::Status call(ShmMethod method, const Request &request,
+                      Response *response);
+
+   public:
+    // path is the Unix socket of the server
+    explicit ShmTransport(std::string path);
+
+    grpc::Status Setup(grpc::ClientContext *context,
+                       const SetupRequest &request,
+                       SetupResponse *response) override;
+    grpc::Status GetVolume(grpc::ClientContext *context,
+                           const GetVolumeRequest &request,
+                           GetVolumeResponse *response) override;
+    std::unique_ptr<WriteStream> WriteBlock(
+        grpc::ClientContext *context, WriteBlockResponse *response) override;
+    std::unique_ptr<ReplicateStream> ReplicateBlocks(
+        grpc::ClientContext *context) override;
+    std::unique_ptr<ReadStream> ReadBlock(
+        grpc::ClientContext *context) override;
+    grpc::Status CreateSnapshot(grpc::ClientContext *context,
+                                const CreateSnapshotRequest &request,
+                                CreateSnapshotResponse *response) override;
+    grpc::Status ListSnapshots(grpc::ClientContext *context,
+                               const ListSnapshotsRequest &request,
+                               ListSnapshotsResponse *response) override;
+    grpc::Status DeleteSnapshot(grpc::ClientContext *context,
+                                const DeleteSnapshotRequest &request,
+                                DeleteSnapshotResponse *response) override;
+};
+
+// Takes ShmTransport calls on a Unix socket, every call on its own thread.
+// The handlers get the streams as the gRPC interfaces, so one service
+// implementation can serve both.
+class ShmServer {
+   public:
+    typedef std::function<grpc::Status(ShmChannel &)> Handler;
+
+   private:
+    const std::string path;
+    int listener = -1;
+    std::atomic<bool> stopped = false;
+    std::map<ShmMethod, Handler> handlers;
+
+   public:
+    // listens at path, replacing a stale socket, throws on errors
+    explicit ShmServer(std::string path);
+    ~ShmServer();
+    ShmServer(const ShmServer &) = delete;
+    ShmServer &operator=(const ShmServer &) = delete;
+
+    void handle(ShmMethod method, Handler handler) {
+        handlers[method] = std::move(handler);
+    }
+    template <class Request, class Response>
+    void unary(ShmMethod method,
+               std::function<grpc::Status(const Request *, Response *)> f) {
+        handle(method, [f](ShmChannel &channel) {
+            Request request;
+            Response response;
+            if (!channel.receive(request)) {
+                return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT,
+                                    "No request");
+            }
+            const auto status = f(&request, &response);
+            if (status.ok()) {
+                channel.send(response);
+            }
+            return status;
+        });
+    }
+    template <class Request, class Response>
+    void client_stream(
+        ShmMethod method,
+        std::function<grpc::Status(grpc::ServerReaderInterface<Request> *,
+                                   Response *)>
+            f) {
+        handle(method, [f](ShmChannel &channel) {
+            ShmServerReader<Request> reader(channel);
+            Response response;
+            const auto status = f(&reader, &response);
+            if (status.ok()) {
+                channel.send(response);
+            }
+            return status;
+        });
+    }
+    template <class W, class R>
+    void bidi_stream(
+        ShmMethod method,
+        std::function<grpc::Status(grpc::ServerReaderWriterInterface<W, R> *)>
+            f) {
+        handle(method, [f](ShmChannel &channel) {
+            ShmServerStream<W, R> stream(channel);
+            return f(&stream);
+        });
+    }
+
+    // take calls until stopped or the socket fails
+    void run();
+    // makes run return, calls already taken go on
+    void stop();
+};
+
+#endif
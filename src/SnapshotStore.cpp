@@ -0,0 +1,323 @@
+#include "SnapshotStore.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/format.hpp>
+#include <boost/log/trivial.hpp>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
+
+namespace {
+bool sync_dir(const std::string &dir) {
+    const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        return false;
+    }
+    const bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+}  // namespace
+
+SnapshotStore::SnapshotStore(const std::string &image_path)
+    : data_path(image_path + ".snapshots"),
+      journal_path(image_path + ".snapshots.journal") {
+    data_fd = open(data_path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (data_fd == -1) {
+        BOOST_LOG_TRIVIAL(fatal)
+            << "Cannot open snapshot data file" << std::endl;
+        throw std::runtime_error("Cannot open snapshot data file");
+    }
+    if (!replay_journal()) {
+        throw std::runtime_error("Cannot replay snapshot journal");
+    }
+    journal_fd =
+        open(journal_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666);
+    if (journal_fd == -1) {
+        BOOST_LOG_TRIVIAL(fatal)
+            << "Cannot open snapshot journal" << std::endl;
+        throw std::runtime_error("Cannot open snapshot journal");
+    }
+    // the files created above survive a crash
+    const auto dir = std::filesystem::path(journal_path).parent_path();
+    if (!sync_dir(dir.empty() ? "." : dir.string())) {
+        throw std::runtime_error("Cannot sync snapshot directory");
+    }
+    BOOST_LOG_TRIVIAL(info)
+        << "Loaded " << snapshots.size() << " snapshots" << std::endl;
+}
+
+SnapshotStore::~SnapshotStore() {
+    if (data_fd != -1) close(data_fd);
+    if (journal_fd != -1) close(journal_fd);
+}
+
+bool SnapshotStore::replay_journal() {
+    // journal records:
+    //   S <id> <created> <name>    snapshot taken
+    //   E <id> <epoch>             client epoch the snapshot was taken at
+    //   B <id> <block_no> <slot>   block preserved for snapshot
+    std::ifstream journal(journal_path);
+    std::string line;
+    while (std::getline(journal, line)) {
+        std::istringstream record(line);
+        char type;
+        uint64_t id;
+        record >> type >> id;
+        if (type == 'S') {
+            Snapshot snapshot{.id = id};
+            record >> snapshot.created;
+            record.ignore(1);
+            std::getline(record, snapshot.name);
+            names[snapshot.name] = id;
+            snapshots[id] = std::move(snapshot);
+            next_id = std::max(next_id, id + 1);
+        } else if (type == 'E' && snapshots.contains(id)) {
+            record >> snapshots[id].epoch;
+        } else if (type == 'B' && snapshots.contains(id)) {
+            uint64_t block_no, slot;
+            record >> block_no >> slot;
+            snapshots[id].blocks[block_no] = slot;
+            next_slot = std::max(next_slot, slot + 1);
+        } else {
+            BOOST_LOG_TRIVIAL(error)
+                << "Corrupted snapshot journal record: " << line << std::endl;
+            return false;
+        }
+    }
+
+    std::unordered_set<uint64_t> used;
+    for (const auto &[id, snapshot] : snapshots) {
+        for (const auto &[block_no, slot] : snapshot.blocks) {
+            used.insert(slot);
+        }
+    }
+    for (uint64_t slot = 0; slot < next_slot; slot++) {
+        if (!used.contains(slot)) free_slots.push_back(slot);
+    }
+    return true;
+}
+
+bool SnapshotStore::append_journal(const std::string &record) {
+    if (write(journal_fd, record.data(), record.size()) !=
+            static_cast<ssize_t>(record.size()) ||
+        fdatasync(journal_fd) != 0) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Snapshot journal write failed" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool SnapshotStore::rewrite_journal() {
+    const auto tmp_path = journal_path + ".tmp";
+    std::ostringstream journal;
+    for (const auto &[id, snapshot] : snapshots) {
+        journal << "S " << id << " " << snapshot.created << " "
+                << snapshot.name << "\n";
+        if (snapshot.epoch > 0) {
+            journal << "E " << id << " " << snapshot.epoch << "\n";
+        }
+    }
+    for (const auto &[id, snapshot] : snapshots) {
+        for (const auto &[block_no, slot] : snapshot.blocks) {
+            journal << "B " << id << " " << block_no << " " << slot << "\n";
+        }
+    }
+    // the new journal is durable before it replaces the old one, and the
+    // rename before anything relies on it
+    const auto records = journal.str();
+    const int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    const bool written =
+        fd != -1 &&
+        write(fd, records.data(), records.size()) ==
+            static_cast<ssize_t>(records.size()) &&
+        fdatasync(fd) == 0;
+    if (fd != -1) close(fd);
+    if (!written) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Cannot write snapshot journal" << std::endl;
+        return false;
+    }
+    const auto dir = std::filesystem::path(journal_path).parent_path();
+    if (fdatasync(data_fd) != 0 ||
+        rename(tmp_path.c_str(), journal_path.c_str()) != 0 ||
+        !sync_dir(dir.empty() ? "." : dir.string())) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Cannot replace snapshot journal" << std::endl;
+        return false;
+    }
+    close(journal_fd);
+    journal_fd =
+        open(journal_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0666);
+    return journal_fd != -1;
+}
+
+bool SnapshotStore::preserve(const BackupImage &image, uint64_t block_no) {
+    if (snapshots.empty()) {
+        return true;
+    }
+
+    auto &latest = snapshots.rbegin()->second;
+    std::lock_guard lock(cow_lock);
+    if (latest.blocks.contains(block_no)) {
+        return true;
+    }
+
+    std::vector<char> buf(extent_size);
+    if (!image.read(block_no, buf.data())) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Snapshot copy-on-write read failed" << std::endl;
+        return false;
+    }
+
+    uint64_t slot;
+    if (!free_slots.empty()) {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    } else {
+        slot = next_slot++;
+    }
+    // the copy and its record are durable before the image is overwritten,
+    // which page cache writeback may do at any time
+    if (pwrite(data_fd, buf.data(), extent_size,
+               static_cast<long>(slot * extent_size)) !=
+            static_cast<ssize_t>(extent_size) ||
+        fdatasync(data_fd) != 0) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Snapshot copy-on-write write failed" << std::endl;
+        free_slots.push_back(slot);
+        return false;
+    }
+    if (!append_journal((boost::format("B %1% %2% %3%\n") % latest.id %
+                         block_no % slot)
+                            .str())) {
+        free_slots.push_back(slot);
+        return false;
+    }
+    latest.blocks[block_no] = slot;
+    return true;
+}
+
+std::optional<Snapshot> SnapshotStore::create(const std::string &name,
+                                              uint64_t epoch) {
+    std::unique_lock lock(snapshot_lock);
+    if (name.empty() || name.find('\n') != std::string::npos ||
+        names.contains(name)) {
+        return std::nullopt;
+    }
+
+    Snapshot snapshot{.id = next_id,
+                      .name = name,
+                      .created = time(nullptr),
+                      .epoch = epoch};
+    auto record = (boost::format("S %1% %2% %3%\n") % snapshot.id %
+                   snapshot.created % name)
+                      .str();
+    if (epoch > 0) {
+        record += (boost::format("E %1% %2%\n") % snapshot.id % epoch).str();
+    }
+    if (!append_journal(record)) {
+        return std::nullopt;
+    }
+    next_id++;
+    names[name] = snapshot.id;
+    snapshots[snapshot.id] = snapshot;
+    BOOST_LOG_TRIVIAL(info) << "Snapshot " << name << " created" << std::endl;
+    return snapshot;
+}
+
+void SnapshotStore::drop(uint64_t id) {
+    const auto it = snapshots.find(id);
+    // the previous snapshot shares blocks that were not rewritten in between,
+    // hand those over instead of freeing them
+    Snapshot *prev =
+        it == snapshots.begin() ? nullptr : &std::prev(it)->second;
+    for (const auto &[block_no, slot] : it->second.blocks) {
+        if (prev != nullptr && !prev->blocks.contains(block_no)) {
+            prev->blocks[block_no] = slot;
+        } else {
+            free_slots.push_back(slot);
+        }
+    }
+    BOOST_LOG_TRIVIAL(info)
+        << "Snapshot " << it->second.name << " deleted" << std::endl;
+    names.erase(it->second.name);
+    snapshots.erase(it);
+}
+
+bool SnapshotStore::remove(const std::string &name) {
+    std::unique_lock lock(snapshot_lock);
+    const auto it = names.find(name);
+    if (it == names.end()) {
+        return false;
+    }
+    drop(it->second);
+    return rewrite_journal();
+}
+
+size_t SnapshotStore::enforce_retention(size_t keep) {
+    std::unique_lock lock(snapshot_lock);
+    size_t deleted = 0;
+    while (snapshots.size() > keep) {
+        drop(snapshots.begin()->first);
+        deleted++;
+    }
+    if (deleted > 0) {
+        rewrite_journal();
+    }
+    return deleted;
+}
+
+bool SnapshotStore::empty() const {
+    std::shared_lock lock(snapshot_lock);
+    return snapshots.empty();
+}
+
+std::vector<Snapshot> SnapshotStore::list() const {
+    std::shared_lock lock(snapshot_lock);
+    std::vector<Snapshot> result;
+    for (const auto &[id, snapshot] : snapshots) {
+        result.push_back({.id = id,
+                          .name = snapshot.name,
+                          .created = snapshot.created,
+                          .epoch = snapshot.epoch});
+    }
+    return result;
+}
+
+bool SnapshotStore::read(const BackupImage &image, const std::string &name,
+                         uint64_t block_no, char *buf,
+                         uint64_t *epoch) const {
+    std::shared_lock lock(snapshot_lock);
+    const auto it = names.find(name);
+    if (it == names.end()) {
+        return false;
+    }
+    if (epoch != nullptr) {
+        *epoch = snapshots.at(it->second).epoch;
+    }
+
+    std::optional<uint64_t> slot;
+    {
+        std::lock_guard cow(cow_lock);
+        for (auto s = snapshots.lower_bound(it->second); s != snapshots.end();
+             s++) {
+            if (const auto b = s->second.blocks.find(block_no);
+                b != s->second.blocks.end()) {
+                slot = b->second;
+                break;
+            }
+        }
+    }
+
+    if (slot) {
+        return pread(data_fd, buf, extent_size,
+                     static_cast<long>(*slot * extent_size)) >= 0;
+    }
+    return image.read(block_no, buf);
+}
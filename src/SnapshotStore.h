@@ -0,0 +1,78 @@
+#ifndef SNAPSHOT_STORE_H
+#define SNAPSHOT_STORE_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "BackupImage.h"
+#include "consts.h"
+
+struct Snapshot {
+    uint64_t id;
+    std::string name;
+    int64_t created;  // unix time
+    uint64_t epoch = 0;  // last client epoch applied before it, 0 if unknown
+    // blocks overwritten after this snapshot was taken -> slot in data file
+    std::unordered_map<uint64_t, uint64_t> blocks;
+};
+
+// Copy-on-write snapshots of the backup image. Taking a snapshot only records
+// its name, the first write to a block after the latest snapshot copies the old
+// contents into the snapshot data file. A block of snapshot s is found in the
+// oldest snapshot >= s that preserved it, or in the live image otherwise.
+class SnapshotStore {
+    std::string data_path;
+    std::string journal_path;
+    int data_fd = -1;
+    int journal_fd = -1;
+    uint64_t extent_size = BLOCK_SIZE;  // bytes per block_no and slot
+
+    // writers hold it shared, creating and deleting snapshots exclusive
+    mutable std::shared_mutex snapshot_lock;
+    mutable std::mutex cow_lock;
+
+    std::map<uint64_t, Snapshot> snapshots;
+    std::unordered_map<std::string, uint64_t> names;
+    std::vector<uint64_t> free_slots;
+    uint64_t next_slot = 0;
+    uint64_t next_id = 1;
+
+    bool replay_journal();
+    bool rewrite_journal();
+    bool append_journal(const std::string &record);
+    void drop(uint64_t id);
+
+   public:
+    explicit SnapshotStore(const std::string &image_path);
+    ~SnapshotStore();
+
+    // the extent size of the volume, slots are kept in extents as well
+    void set_extent_size(uint64_t size) { extent_size = size; }
+    bool empty() const;
+
+    // must be held while writing to the image
+    std::shared_lock<std::shared_mutex> write_guard() const {
+        return std::shared_lock(snapshot_lock);
+    }
+    // copy the current block out of the image if the latest snapshot needs it,
+    // caller holds write_guard()
+    bool preserve(const BackupImage &image, uint64_t block_no);
+
+    std::optional<Snapshot> create(const std::string &name,
+                                   uint64_t epoch = 0);
+    bool remove(const std::string &name);
+    // keep only the newest `keep` snapshots, returns number of deleted ones
+    size_t enforce_retention(size_t keep);
+    std::vector<Snapshot> list() const;
+    // epoch is set to the one the snapshot was taken at
+    bool read(const BackupImage &image, const std::string &name,
+              uint64_t block_no, char *buf, uint64_t *epoch = nullptr) const;
+};
+
+#endif
@@ -0,0 +1,89 @@
+#include "Topology.h"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <boost/log/trivial.hpp>
+#include <cctype>
+#include <cstring>
+#include <filesystem>
+#include <sstream>
+
+namespace Topology {
+
+std::optional<std::vector<int>> parse_cpus(const std::string &list) {
+    std::vector<int> cpus;
+    std::stringstream ranges(list);
+    std::string range;
+    while (std::getline(ranges, range, ',')) {
+        int first, last;
+        char dash;
+        std::stringstream in(range);
+        if (!(in >> first) || first < 0) {
+            return std::nullopt;
+        }
+        last = first;
+        if (in >> dash && (dash != '-' || !(in >> last) || last < first)) {
+            return std::nullopt;
+        }
+        if (!in.eof() || last >= CPU_SETSIZE) {
+            return std::nullopt;
+        }
+        for (auto cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+    // getline drops an empty last range
+    if (cpus.empty() || list.back() == ',') {
+        return std::nullopt;
+    }
+    return cpus;
+}
+
+bool pin(const std::vector<int> &cpus) {
+    if (cpus.empty()) {
+        return true;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const auto cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    if (const auto err =
+            pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+        err != 0) {
+        BOOST_LOG_TRIVIAL(warning)
+            << "Cannot pin thread: " << strerror(err) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+int node_of(int cpu) {
+    const auto dir = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+        const auto name = entry.path().filename().string();
+        if (name.rfind("node", 0) == 0 && name.size() > 4 &&
+            std::isdigit(static_cast<unsigned char>(name[4]))) {
+            return std::stoi(name.substr(4));
+        }
+    }
+    return 0;
+}
+
+std::vector<int> allowed_cpus() {
+    cpu_set_t set;
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof set, &set) != 0) {
+        return cpus;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+}  // namespace Topology
@@ -0,0 +1,29 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <optional>
+#include <string>
+#include <vector>
+
+// Placement of the pipeline stages on cores. A thread pinned before it
+// allocates its buffers gets them on its own NUMA node, since the kernel
+// places pages on the node of the thread that first touches them, so
+// pinning the stages that share buffers to one node keeps them local.
+namespace Topology {
+
+// "0-3,8,10-11", nullopt if malformed
+std::optional<std::vector<int>> parse_cpus(const std::string &list);
+
+// restrict the calling thread to cpus, threads it starts inherit them. Does
+// nothing for an empty list, false if the kernel refused.
+bool pin(const std::vector<int> &cpus);
+
+// NUMA node of a cpu, 0 without NUMA support
+int node_of(int cpu);
+
+// cpus the process may run on
+std::vector<int> allowed_cpus();
+
+}  // namespace Topology
+
+#endif
@@ -0,0 +1,129 @@
+#include "Trace.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <array>
+#include <boost/log/trivial.hpp>
+#include <csignal>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "consts.h"
+
+namespace Trace {
+
+std::atomic<bool> enabled{false};
+
+namespace {
+
+struct Ring {
+    long tid = 0;
+    std::atomic<uint64_t> head{0};  // events ever recorded
+    std::array<Event, TRACE_RING_EVENTS> events;
+};
+
+// rings outlive their threads so a dump still shows them
+std::mutex rings_lock;
+std::vector<std::unique_ptr<Ring>> rings;
+thread_local Ring *ring = nullptr;
+
+const char *stage_name(Stage stage) {
+    switch (stage) {
+        case NBD_READ:
+            return "nbd_read";
+        case NBD_WRITE:
+            return "nbd_write";
+        case NBD_FLUSH:
+            return "nbd_flush";
+        case QUEUED:
+            return "queued";
+        case ENCRYPT:
+            return "encrypt";
+        case SEND:
+            return "send";
+    }
+    return "unknown";
+}
+
+}  // namespace
+
+void record(const Event &event) {
+    if (ring == nullptr) {
+        auto created = std::make_unique<Ring>();
+        created->tid = syscall(SYS_gettid);
+        std::lock_guard guard(rings_lock);
+        ring = created.get();
+        rings.push_back(std::move(created));
+    }
+    const auto head = ring->head.load(std::memory_order_relaxed);
+    ring->events[head % TRACE_RING_EVENTS] = event;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+bool dump(const std::string &path) {
+    std::ofstream out(path, std::ios::trunc);
+    out << "{\"traceEvents\":[";
+    const auto pid = getpid();
+    bool first = true;
+    std::lock_guard guard(rings_lock);
+    for (const auto &r : rings) {
+        const auto head = r->head.load(std::memory_order_acquire);
+        const auto from = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS
+                                                   : 0;
+        std::vector<Event> events(r->events.begin(), r->events.end());
+        // the owner may have overwritten the oldest ones meanwhile
+        const auto after = r->head.load(std::memory_order_acquire);
+        const auto valid = after >= TRACE_RING_EVENTS
+                               ? std::max(from, after - TRACE_RING_EVENTS + 1)
+                               : from;
+        for (auto i = valid; i < head; i++) {
+            const auto &event = events[i % TRACE_RING_EVENTS];
+            out << (first ? "\n" : ",\n") << "{\"name\":\""
+                << stage_name(event.stage)
+                << "\",\"cat\":\"secloud\",\"ph\":\"X\",\"ts\":"
+                << event.start / 1000 << "." << event.start % 1000 / 100
+                << ",\"dur\":" << (event.end - event.start) / 1000 << "."
+                << (event.end - event.start) % 1000 / 100
+                << ",\"pid\":" << pid << ",\"tid\":" << r->tid
+                << ",\"args\":{\"id\":" << event.id
+                << ",\"block\":" << event.block
+                << ",\"blocks\":" << event.n_blocks << "}}";
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+    return out.good();
+}
+
+void control_by_signals(const std::string &path) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::thread([signals, path] {
+        while (true) {
+            int sig;
+            if (sigwait(&signals, &sig) != 0) {
+                continue;
+            }
+            if (sig == SIGUSR1) {
+                enabled = !enabled;
+                BOOST_LOG_TRIVIAL(info)
+                    << "Tracing " << (enabled ? "on" : "off") << std::endl;
+            } else if (dump(path)) {
+                BOOST_LOG_TRIVIAL(info)
+                    << "Trace written to " << path << std::endl;
+            } else {
+                BOOST_LOG_TRIVIAL(error)
+                    << "Cannot write trace to " << path << std::endl;
+            }
+        }
+    }).detach();
+}
+
+}  // namespace Trace
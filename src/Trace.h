@@ -0,0 +1,73 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Binary trace events of requests through the pipeline, for finding out why
+// one request was slow. Every thread appends to its own ring of the last
+// TRACE_RING_EVENTS events without locking, and nothing is recorded unless
+// tracing is on. dump() writes the rings as Chrome trace JSON, which
+// chrome://tracing and Perfetto open.
+namespace Trace {
+
+enum Stage : uint8_t { NBD_READ, NBD_WRITE, NBD_FLUSH, QUEUED, ENCRYPT, SEND };
+
+struct Event {
+    uint64_t start;  // ns of the steady clock
+    uint64_t end;
+    uint64_t id;  // NBD request handle, 0 if unknown
+    uint64_t block;  // first block
+    uint32_t n_blocks;
+    Stage stage;
+};
+
+extern std::atomic<bool> enabled;
+
+inline bool on() { return enabled.load(std::memory_order_relaxed); }
+
+inline uint64_t now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// append to the ring of this thread
+void record(const Event &event);
+
+// records a stage from construction to destruction while tracing is on
+class Span {
+    Event event;
+    bool active;
+
+   public:
+    Span(Stage stage, uint64_t id, uint64_t block, uint32_t n_blocks)
+        : active(on()) {
+        if (active) {
+            event = {.start = now(),
+                     .id = id,
+                     .block = block,
+                     .n_blocks = n_blocks,
+                     .stage = stage};
+        }
+    }
+    ~Span() {
+        if (active) {
+            event.end = now();
+            record(event);
+        }
+    }
+};
+
+// write every ring as Chrome trace JSON, false if the file cannot be written
+bool dump(const std::string &path);
+
+// SIGUSR1 turns tracing on and off, SIGUSR2 dumps to path. Must be called
+// before any other thread starts, they inherit the blocked signals.
+void control_by_signals(const std::string &path);
+
+}  // namespace Trace
+
+#endif
@@ -0,0 +1,74 @@
+#include "Transport.h"
+
+#include <grpcpp/create_channel.h>
+
+#include "ShmTransport.h"
+
+std::unique_ptr<Transport> Transport::connect(const std::string &address) {
+    constexpr char SHM_SCHEME[] = "shm://";
+    if (address.rfind(SHM_SCHEME, 0) == 0) {
+        const auto path = address.substr(sizeof(SHM_SCHEME) - 1);
+        if (path.empty()) {
+            return nullptr;
+        }
+        return std::make_unique<ShmTransport>(path);
+    }
+
+    // channels with the same arguments would share one connection
+    grpc::ChannelArguments args;
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    const auto channel = grpc::CreateCustomChannel(
+        address, grpc::InsecureChannelCredentials(), args);
+    if (channel == nullptr) {
+        return nullptr;
+    }
+    return std::make_unique<GrpcTransport>(Backup::NewStub(channel));
+}
+
+GrpcTransport::GrpcTransport(std::unique_ptr<Backup::Stub> stub)
+    : stub(std::move(stub)) {}
+
+grpc::Status GrpcTransport::Setup(grpc::ClientContext *context,
+                                  const SetupRequest &request,
+                                  SetupResponse *response) {
+    return stub->Setup(context, request, response);
+}
+
+grpc::Status GrpcTransport::GetVolume(grpc::ClientContext *context,
+                                      const GetVolumeRequest &request,
+                                      GetVolumeResponse *response) {
+    return stub->GetVolume(context, request, response);
+}
+
+std::unique_ptr<Transport::WriteStream> GrpcTransport::WriteBlock(
+    grpc::ClientContext *context, WriteBlockResponse *response) {
+    return stub->WriteBlock(context, response);
+}
+
+std::unique_ptr<Transport::ReplicateStream> GrpcTransport::ReplicateBlocks(
+    grpc::ClientContext *context) {
+    return stub->ReplicateBlocks(context);
+}
+
+std::unique_ptr<Transport::ReadStream> GrpcTransport::ReadBlock(
+    grpc::ClientContext *context) {
+    return stub->ReadBlock(context);
+}
+
+grpc::Status GrpcTransport::CreateSnapshot(
+    grpc::ClientContext *context, const CreateSnapshotRequest &request,
+    CreateSnapshotResponse *response) {
+    return stub->CreateSnapshot(context, request, response);
+}
+
+grpc::Status GrpcTransport::ListSnapshots(grpc::ClientContext *context,
+                                          const ListSnapshotsRequest &request,
+                                          ListSnapshotsResponse *response) {
+    return stub->ListSnapshots(context, request, response);
+}
+
+grpc::Status GrpcTransport::DeleteSnapshot(
+    grpc::ClientContext *context, const DeleteSnapshotRequest &request,
+    DeleteSnapshotResponse *response) {
+    return stub->DeleteSnapshot(context, request, response);
+}
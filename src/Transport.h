@@ -0,0 +1,86 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <grpcpp/grpcpp.h>
+
+#include <memory>
+#include <string>
+
+#include "BackupServer.grpc.pb.h"
+
+// The calls of the backup service as the clients make them, whatever carries
+// them to the server. The streams are the gRPC stream interfaces, so code
+// written against Backup::Stub works unchanged.
+class Transport {
+   public:
+    typedef grpc::ClientWriterInterface<WriteBlockRequest> WriteStream;
+    typedef grpc::ClientReaderWriterInterface<WriteBlockRequest, WriteAck>
+        ReplicateStream;
+    typedef grpc::ClientReaderWriterInterface<ReadBlockRequest,
+                                              ReadBlockResponse>
+        ReadStream;
+
+    virtual ~Transport() = default;
+
+    virtual grpc::Status Setup(grpc::ClientContext *context,
+                               const SetupRequest &request,
+                               SetupResponse *response) = 0;
+    virtual grpc::Status GetVolume(grpc::ClientContext *context,
+                                   const GetVolumeRequest &request,
+                                   GetVolumeResponse *response) = 0;
+    virtual std::unique_ptr<WriteStream> WriteBlock(
+        grpc::ClientContext *context, WriteBlockResponse *response) = 0;
+    virtual std::unique_ptr<ReplicateStream> ReplicateBlocks(
+        grpc::ClientContext *context) = 0;
+    virtual std::unique_ptr<ReadStream> ReadBlock(
+        grpc::ClientContext *context) = 0;
+    virtual grpc::Status CreateSnapshot(grpc::ClientContext *context,
+                                        const CreateSnapshotRequest &request,
+                                        CreateSnapshotResponse *response) = 0;
+    virtual grpc::Status ListSnapshots(grpc::ClientContext *context,
+                                       const ListSnapshotsRequest &request,
+                                       ListSnapshotsResponse *response) = 0;
+    virtual grpc::Status DeleteSnapshot(grpc::ClientContext *context,
+                                        const DeleteSnapshotRequest &request,
+                                        DeleteSnapshotResponse *response) = 0;
+
+    // by the scheme of address:
+    //   shm:///path    shared memory to a server on this host, set up over
+    //                  the Unix socket at path, see ShmTransport
+    //   unix:///path   gRPC over a Unix socket
+    //   host:port      gRPC over TCP, or any other gRPC target
+    // nullptr if address is not valid
+    static std::unique_ptr<Transport> connect(const std::string &address);
+};
+
+// gRPC over whatever channel the target names
+class GrpcTransport : public Transport {
+    std::unique_ptr<Backup::Stub> stub;
+
+   public:
+    explicit GrpcTransport(std::unique_ptr<Backup::Stub> stub);
+
+    grpc::Status Setup(grpc::ClientContext *context,
+                       const SetupRequest &request,
+                       SetupResponse *response) override;
+    grpc::Status GetVolume(grpc::ClientContext *context,
+                           const GetVolumeRequest &request,
+                           GetVolumeResponse *response) override;
+    std::unique_ptr<WriteStream> WriteBlock(
+        grpc::ClientContext *context, WriteBlockResponse *response) override;
+    std::unique_ptr<ReplicateStream> ReplicateBlocks(
+        grpc::ClientContext *context) override;
+    std::unique_ptr<ReadStream> ReadBlock(
+        grpc::ClientContext *context) override;
+    grpc::Status CreateSnapshot(grpc::ClientContext *context,
+                                const CreateSnapshotRequest &request,
+                                CreateSnapshotResponse *response) override;
+    grpc::Status ListSnapshots(grpc::ClientContext *context,
+                               const ListSnapshotsRequest &request,
+                               ListSnapshotsResponse *response) override;
+    grpc::Status DeleteSnapshot(grpc::ClientContext *context,
+                                const DeleteSnapshotRequest &request,
+                                DeleteSnapshotResponse *response) override;
+};
+
+#endif
@@ -0,0 +1,178 @@
+#include "UringFile.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <boost/log/trivial.hpp>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+template <typename T>
+T *at(void *ring, uint32_t offset) {
+    return reinterpret_cast<T *>(static_cast<char *>(ring) + offset);
+}
+}  // namespace
+
+UringFile::UringFile(int fd, unsigned entries) : file_fd(fd) {
+    io_uring_params params{};
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd < 0) {
+        ring_fd = -1;
+        BOOST_LOG_TRIVIAL(warning)
+            << "io_uring not available, using pread/pwrite" << std::endl;
+        return;
+    }
+    this->entries = params.sq_entries;
+
+    sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_bytes =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    // newer kernels map both rings at once
+    const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        sq_ring_bytes = cq_ring_bytes = std::max(sq_ring_bytes, cq_ring_bytes);
+    }
+    sq_ring = mmap(nullptr, sq_ring_bytes, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    cq_ring = single ? sq_ring
+                     : mmap(nullptr, cq_ring_bytes, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring_fd,
+                            IORING_OFF_CQ_RING);
+    sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED ||
+        syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_FILES,
+                &file_fd, 1) != 0) {
+        BOOST_LOG_TRIVIAL(warning)
+            << "Cannot set up io_uring, using pread/pwrite" << std::endl;
+        if (sq_ring == MAP_FAILED) sq_ring = nullptr;
+        if (cq_ring == MAP_FAILED) cq_ring = nullptr;
+        if (sqes == MAP_FAILED) sqes = nullptr;
+        close_ring();
+        return;
+    }
+
+    sq_tail = at<unsigned>(sq_ring, params.sq_off.tail);
+    sq_mask = at<unsigned>(sq_ring, params.sq_off.ring_mask);
+    sq_array = at<unsigned>(sq_ring, params.sq_off.array);
+    cq_head = at<unsigned>(cq_ring, params.cq_off.head);
+    cq_tail = at<unsigned>(cq_ring, params.cq_off.tail);
+    cq_mask = at<unsigned>(cq_ring, params.cq_off.ring_mask);
+    cqes = at<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+}
+
+UringFile::~UringFile() { close_ring(); }
+
+void UringFile::close_ring() {
+    if (sqes != nullptr) munmap(sqes, sqes_bytes);
+    if (cq_ring != nullptr && cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_bytes);
+    }
+    if (sq_ring != nullptr) munmap(sq_ring, sq_ring_bytes);
+    if (ring_fd != -1) close(ring_fd);
+    sqes = sq_ring = cq_ring = nullptr;
+    ring_fd = -1;
+}
+
+size_t UringFile::queue(const Op &op) {
+    queued.push_back(op);
+    return queued.size() - 1;
+}
+
+size_t UringFile::read(void *buf, size_t len, uint64_t offset) {
+    return queue({.single = {buf, len}, .offset = offset});
+}
+
+size_t UringFile::readv(const iovec *iov, int iovcnt, uint64_t offset) {
+    return queue({.iov = iov, .iovcnt = iovcnt, .offset = offset});
+}
+
+size_t UringFile::write(const void *buf, size_t len, uint64_t offset) {
+    return queue({.write = true,
+                  .single = {const_cast<void *>(buf), len},
+                  .offset = offset});
+}
+
+bool UringFile::submit() {
+    results.assign(queued.size(), 0);
+    if (uring()) {
+        if (!run_uring()) {
+            BOOST_LOG_TRIVIAL(error)
+                << "io_uring_enter failed: " << strerror(errno) << std::endl;
+        }
+    } else {
+        run_sync();
+    }
+    queued.clear();
+    return std::all_of(results.begin(), results.end(),
+                       [](ssize_t result) { return result >= 0; });
+}
+
+bool UringFile::run_uring() {
+    const auto sq = static_cast<io_uring_sqe *>(sqes);
+    const auto cq = static_cast<io_uring_cqe *>(cqes);
+    // at most a ring full at a time
+    for (size_t base = 0; base < queued.size(); base += entries) {
+        const auto n = std::min<size_t>(entries, queued.size() - base);
+        const auto tail = *sq_tail;
+        for (size_t i = 0; i < n; i++) {
+            const auto &op = queued[base + i];
+            const auto index = (tail + i) & *sq_mask;
+            auto &sqe = sq[index];
+            memset(&sqe, 0, sizeof sqe);
+            sqe.opcode = op.write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe.flags = IOSQE_FIXED_FILE;
+            sqe.fd = 0;  // the registered file
+            sqe.addr = reinterpret_cast<uint64_t>(op.iov ? op.iov : &op.single);
+            sqe.len = op.iov ? op.iovcnt : 1;
+            sqe.off = op.offset;
+            sqe.user_data = base + i;
+            sq_array[index] = index;
+        }
+        std::atomic_ref(*sq_tail).store(tail + n, std::memory_order_release);
+
+        size_t to_submit = n;
+        size_t completed = 0;
+        while (completed < n) {
+            const auto ret =
+                syscall(__NR_io_uring_enter, ring_fd, to_submit,
+                        n - completed, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret < 0 && errno != EINTR) {
+                std::fill(results.begin() + base, results.end(), -1);
+                return false;
+            }
+            to_submit -= std::min<size_t>(to_submit, std::max<long>(ret, 0));
+            auto head = *cq_head;
+            const auto ready =
+                std::atomic_ref(*cq_tail).load(std::memory_order_acquire);
+            for (; head != ready; head++, completed++) {
+                const auto &cqe = cq[head & *cq_mask];
+                results[cqe.user_data] = cqe.res;
+            }
+            std::atomic_ref(*cq_head).store(head, std::memory_order_release);
+        }
+    }
+    return true;
+}
+
+void UringFile::run_sync() {
+    for (size_t i = 0; i < queued.size(); i++) {
+        const auto &op = queued[i];
+        const auto offset = static_cast<long>(op.offset);
+        if (op.write) {
+            results[i] = pwrite(file_fd, op.single.iov_base,
+                                op.single.iov_len, offset);
+        } else if (op.iov == nullptr) {
+            results[i] =
+                pread(file_fd, op.single.iov_base, op.single.iov_len, offset);
+        } else {
+            results[i] = preadv(file_fd, op.iov, op.iovcnt, offset);
+        }
+    }
+}
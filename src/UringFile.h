@@ -0,0 +1,70 @@
+#ifndef URING_FILE_H
+#define URING_FILE_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "consts.h"
+
+// Reads and writes one file through its own io_uring with the file
+// registered. Operations are queued by read(), readv() and write() and go to
+// the kernel together in submit(), which waits for all of them, so a batch
+// costs one system call. Where io_uring is not available submit() runs them
+// one by one with preadv/pwrite instead. Buffers must stay valid until
+// submit() returns. Not thread safe, every thread needs its own.
+class UringFile {
+    struct Op {
+        bool write;
+        iovec single;  // the buffer of read() and write()
+        const iovec *iov;  // nullptr for single
+        int iovcnt;
+        uint64_t offset;
+    };
+
+    int file_fd;
+    int ring_fd = -1;
+    void *sq_ring = nullptr;
+    void *cq_ring = nullptr;
+    size_t sq_ring_bytes = 0;
+    size_t cq_ring_bytes = 0;
+    void *sqes = nullptr;
+    size_t sqes_bytes = 0;
+    unsigned *sq_tail = nullptr;
+    unsigned *sq_mask = nullptr;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned *cq_mask = nullptr;
+    void *cqes = nullptr;
+    unsigned entries = 0;
+
+    std::vector<Op> queued;
+    std::vector<ssize_t> results;
+
+    void close_ring();
+    size_t queue(const Op &op);
+    bool run_uring();
+    void run_sync();
+
+   public:
+    explicit UringFile(int fd, unsigned entries = URING_ENTRIES);
+    ~UringFile();
+    UringFile(const UringFile &) = delete;
+    UringFile &operator=(const UringFile &) = delete;
+
+    // whether operations go through io_uring
+    bool uring() const { return ring_fd != -1; }
+    // queue an operation, returns its index for result()
+    size_t read(void *buf, size_t len, uint64_t offset);
+    size_t readv(const iovec *iov, int iovcnt, uint64_t offset);
+    size_t write(const void *buf, size_t len, uint64_t offset);
+    // run the queued operations, false if any of them failed
+    bool submit();
+    // bytes transferred by an operation of the last submit, < 0 if failed
+    ssize_t result(size_t op) const { return results[op]; }
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include "VolumeMetadata.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/log/trivial.hpp>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+
+#include "Extent.h"
+
+namespace {
+bool sync_file(const std::string &path, int flags) {
+    const int fd = open(path.c_str(), flags);
+    if (fd == -1) {
+        return false;
+    }
+    const bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+}  // namespace
+
+bool VolumeMetadata::load(const std::string &path) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        const auto eq = line.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        const auto key = line.substr(0, eq);
+        const auto value = line.substr(eq + 1);
+        if (key == "size" || key == "extent_size" || key == "data_shards" ||
+            key == "parity_shards" || key == "shard") {
+            char *end;
+            const auto number = std::strtoull(value.c_str(), &end, 10);
+            if (value.empty() || *end != '\0') {
+                BOOST_LOG_TRIVIAL(error)
+                    << "Bad volume " << key << " in " << path << ": " << value
+                    << std::endl;
+                return false;
+            }
+            if (key == "size") {
+                size = number;
+            } else if (key == "extent_size") {
+                extent_size = number;
+            } else if (key == "data_shards") {
+                data_shards = number;
+            } else if (key == "parity_shards") {
+                parity_shards = number;
+            } else {
+                shard = number;
+            }
+        } else if (key == "cipher") {
+            const auto parsed = parse_cipher(value);
+            if (!parsed) {
+                BOOST_LOG_TRIVIAL(error)
+                    << "Unknown cipher in " << path << ": " << value
+                    << std::endl;
+                return false;
+            }
+            cipher = *parsed;
+        }
+    }
+    if (!valid_extent_size(extent_size) &&
+        !(data_shards > 0 && valid_shard_size(extent_size))) {
+        BOOST_LOG_TRIVIAL(error) << "Bad volume extent_size in " << path
+                                 << ": " << extent_size << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool VolumeMetadata::save(const std::string &path) const {
+    // write a new file and rename it, a crash never leaves half a file
+    const auto tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        file << "size=" << size << "\n";
+        file << "cipher=" << cipher_name(cipher) << "\n";
+        file << "extent_size=" << extent_size << "\n";
+        if (data_shards > 0) {
+            file << "data_shards=" << data_shards << "\n";
+            file << "parity_shards=" << parity_shards << "\n";
+            file << "shard=" << shard << "\n";
+        }
+        if (!file.good()) {
+            BOOST_LOG_TRIVIAL(error)
+                << "Cannot write volume metadata " << path << std::endl;
+            return false;
+        }
+    }
+    // durable before it replaces the old one, and the rename once the
+    // directory is synced
+    if (!sync_file(tmp_path, O_RDONLY)) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Cannot sync volume metadata " << path << std::endl;
+        return false;
+    }
+    std::error_code err;
+    std::filesystem::rename(tmp_path, path, err);
+    if (err) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Cannot replace volume metadata " << path << std::endl;
+        return false;
+    }
+    const auto dir = std::filesystem::path(path).parent_path();
+    if (!sync_file(dir.empty() ? "." : dir.string(),
+                   O_RDONLY | O_DIRECTORY)) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Cannot sync the directory of " << path << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,30 @@
+#ifndef VOLUME_METADATA_H
+#define VOLUME_METADATA_H
+
+#include <cstdint>
+#include <string>
+
+#include "consts.h"
+#include "types.h"
+
+// Fixed when a volume is set up, kept as key=value lines next to the local
+// file and the backup image. Volumes without metadata predate it and use
+// AES-256-CTR in 4 KiB extents. On the server of an erasure coded volume,
+// size and extent_size describe the shard image.
+struct VolumeMetadata {
+    uint64_t size = 0;
+    CipherType cipher = CipherType::AES_256_CTR;
+    uint64_t extent_size = BLOCK_SIZE;
+    uint32_t data_shards = 0;  // 0 for full replicas
+    uint32_t parity_shards = 0;
+    uint32_t shard = 0;  // kept by this server
+
+    static std::string path_for(const std::string &image_path) {
+        return image_path + ".meta";
+    }
+    // false if the file is missing or malformed
+    bool load(const std::string &path);
+    bool save(const std::string &path) const;
+};
+
+#endif
@@ -0,0 +1,442 @@
+#include <fcntl.h>
+
+#include <array>
+#include <atomic>
+#include <boost/log/trivial.hpp>
+#include <boost/log/utility/setup.hpp>
+#include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "BUSE/buse.h"
+#include "BackupDaemon.h"
+#include "Histogram.h"
+#include "LocalBlockDriver.h"
+#include "utils.h"
+
+// Drives the buse operations with a synthetic workload while the daemon
+// replicates to the backup servers, like fio on /dev/nbd0 but without root.
+// queue_depth threads issue requests that are served one at a time like
+// buse does, so latency includes the wait for the device. Reports IOPS,
+// throughput, latency percentiles and how far replication is behind every
+// report seconds, and a summary at the end. Options it does not know are
+// SeCloud options, the volume is always set up anew.
+// Usage: WorkloadGenerator [options] --backup_server host:port ...
+
+namespace po = boost::program_options;
+
+namespace {
+
+enum Op { READ, WRITE, FLUSH };
+constexpr int N_OPS = 3;
+const char *const op_names[N_OPS] = {"read", "write", "flush"};
+
+struct Workload {
+    uint64_t duration_s = 10;
+    uint64_t report_s = 1;
+    bool sequential = false;
+    uint64_t read_percent = 30;
+    uint64_t request_bytes = BLOCK_SIZE;
+    size_t queue_depth = 1;
+    uint64_t hot_set = 100;  // percent of the volume
+    uint64_t hot_access = 100;  // percent of the requests going to it
+    uint64_t flush_every = 0;  // writes, 0 never flushes
+    uint64_t seed = 1;
+};
+
+struct Stats {
+    std::array<Histogram, N_OPS> interval;
+    std::array<Histogram, N_OPS> total;
+    std::atomic<uint64_t> bytes{0};  // read and written in the interval
+    std::atomic<uint64_t> writes{0};  // since the start, for flush_every
+};
+
+// seqs handed to the replicas and when, to tell how old the oldest batch
+// not acknowledged by every server is
+class LagMeter {
+    ReplicaSet &replicas;
+    std::deque<std::pair<uint64_t, std::chrono::steady_clock::time_point>>
+        sent;
+
+   public:
+    explicit LagMeter(ReplicaSet &replicas) : replicas(replicas) {}
+    // returns batches and ms behind
+    std::pair<uint64_t, double> sample() {
+        const auto now = std::chrono::steady_clock::now();
+        const auto last = replicas.last_seq();
+        if (sent.empty() || sent.back().first != last) {
+            sent.emplace_back(last, now);
+        }
+        const auto acked = replicas.acked_seq(replicas.size());
+        while (!sent.empty() && sent.front().first <= acked) {
+            sent.pop_front();
+        }
+        if (sent.empty()) {
+            return {last - acked, 0};
+        }
+        const std::chrono::duration<double, std::milli> behind =
+            now - sent.front().second;
+        return {last - acked, behind.count()};
+    }
+};
+
+Workload parse_workload(int argc, char *argv[], Config &config) {
+    po::options_description desc("Workload options");
+    desc.add_options()("help", "produce help message");
+    desc.add_options()("file", po::value<std::string>(),
+                       "storage file path, overwritten");
+    desc.add_options()("duration", po::value<uint64_t>(),
+                       "seconds to run the workload");
+    desc.add_options()("report", po::value<uint64_t>(),
+                       "seconds between reports");
+    desc.add_options()(
+        "pattern",
+        po::value<std::string>()->notifier([](const std::string &value) {
+            if (value != "random" && value != "sequential") {
+                throw po::validation_error(
+                    po::validation_error::invalid_option_value);
+            }
+        }),
+        "offsets of the requests: random | sequential");
+    desc.add_options()("read_percent", po::value<uint64_t>(),
+                       "requests that are reads");
+    desc.add_options()("request_size", po::value<uint64_t>(),
+                       "bytes(in KB) per request, a multiple of 4");
+    desc.add_options()("queue_depth", po::value<size_t>(),
+                       "requests outstanding at once");
+    desc.add_options()("hot_set", po::value<uint64_t>(),
+                       "percent of the volume that is hot");
+    desc.add_options()("hot_access", po::value<uint64_t>(),
+                       "percent of the random requests going to the hot set");
+    desc.add_options()("flush_every", po::value<uint64_t>(),
+                       "writes between flushes, 0 to never flush");
+    desc.add_options()("seed", po::value<uint64_t>(), "of the offsets");
+
+    po::variables_map vm;
+    const auto parsed = po::command_line_parser(argc, argv)
+                            .options(desc)
+                            .allow_unregistered()
+                            .run();
+    po::store(parsed, vm);
+    po::notify(vm);
+
+    // the rest goes to the SeCloud options, which set up a new volume
+    auto args =
+        po::collect_unrecognized(parsed.options, po::include_positional);
+    if (vm.count("help")) {
+        std::cout << desc << "\nand the SeCloud options below\n";
+        args.emplace_back("--help");
+    }
+    args.insert(args.begin(), "--mode=setup");
+    std::vector<char *> secloud_argv{argv[0]};
+    for (auto &arg : args) {
+        secloud_argv.push_back(arg.data());
+    }
+    config = utils::parse_options(static_cast<int>(secloud_argv.size()),
+                                  secloud_argv.data());
+    config.file = vm.count("file") ? vm["file"].as<std::string>()
+                                   : "workload.img";
+
+    Workload workload;
+    if (vm.count("duration")) {
+        workload.duration_s = vm["duration"].as<uint64_t>();
+    }
+    if (vm.count("report")) {
+        workload.report_s = std::max<uint64_t>(1, vm["report"].as<uint64_t>());
+    }
+    if (vm.count("pattern")) {
+        workload.sequential = vm["pattern"].as<std::string>() == "sequential";
+    }
+    if (vm.count("read_percent")) {
+        workload.read_percent = vm["read_percent"].as<uint64_t>();
+        if (workload.read_percent > 100) {
+            throw std::invalid_argument("read_percent must be <= 100");
+        }
+    }
+    if (vm.count("request_size")) {
+        workload.request_bytes = vm["request_size"].as<uint64_t>() * 1024;
+        if (workload.request_bytes == 0 ||
+            workload.request_bytes % BLOCK_SIZE != 0 ||
+            workload.request_bytes > config.size) {
+            throw std::invalid_argument(
+                "request_size must be a multiple of the block size and fit "
+                "the volume");
+        }
+    }
+    if (vm.count("queue_depth")) {
+        workload.queue_depth =
+            std::max<size_t>(1, vm["queue_depth"].as<size_t>());
+    }
+    if (vm.count("hot_set")) {
+        workload.hot_set = vm["hot_set"].as<uint64_t>();
+    }
+    if (vm.count("hot_access")) {
+        workload.hot_access = vm["hot_access"].as<uint64_t>();
+    }
+    if (workload.hot_set == 0 || workload.hot_set > 100 ||
+        workload.hot_access > 100) {
+        throw std::invalid_argument(
+            "hot_set must be in 1..100 and hot_access <= 100");
+    }
+    if (vm.count("flush_every")) {
+        workload.flush_every = vm["flush_every"].as<uint64_t>();
+    }
+    if (vm.count("seed")) {
+        workload.seed = vm["seed"].as<uint64_t>();
+    }
+    return workload;
+}
+
+// issue requests until stop, one buse operation at a time over all workers
+void run_worker(const Workload &workload, const Config &config,
+                const buse_operations &bop, LocalBlockDriver::Context &ctx,
+                std::mutex &device, std::atomic<uint64_t> &cursor,
+                Stats &stats, size_t worker, const StopFlag &stop) {
+    std::mt19937_64 rng(workload.seed * 1000003 + worker);
+    const auto slots = config.size / workload.request_bytes;
+    const auto hot_slots =
+        std::max<uint64_t>(1, slots * workload.hot_set / 100);
+    std::vector<uint64_t> buf(workload.request_bytes / sizeof(uint64_t));
+    auto call = [&](Op op, auto &&operation) {
+        const auto start = std::chrono::steady_clock::now();
+        int err;
+        {
+            std::lock_guard guard(device);
+            err = operation();
+        }
+        stats.interval[op].record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count());
+        if (err != 0) {
+            BOOST_LOG_TRIVIAL(error)
+                << "Workload " << op_names[op] << " failed" << std::endl;
+        }
+    };
+
+    while (!stop.load()) {
+        uint64_t slot;
+        if (workload.sequential) {
+            slot = cursor++ % slots;
+        } else if (rng() % 100 < workload.hot_access) {
+            slot = rng() % hot_slots;
+        } else {
+            slot = hot_slots < slots ? hot_slots + rng() % (slots - hot_slots)
+                                     : rng() % slots;
+        }
+        const auto offset = slot * workload.request_bytes;
+        const auto len = static_cast<uint32_t>(workload.request_bytes);
+
+        if (rng() % 100 < workload.read_percent) {
+            call(READ, [&] { return bop.read(buf.data(), len, offset, &ctx); });
+        } else {
+            for (auto &word : buf) {
+                word = rng();
+            }
+            call(WRITE,
+                 [&] { return bop.write(buf.data(), len, offset, &ctx); });
+            if (workload.flush_every > 0 &&
+                ++stats.writes % workload.flush_every == 0) {
+                call(FLUSH, [&] { return bop.flush(&ctx); });
+            }
+        }
+        stats.bytes += len;
+    }
+}
+
+void print_header() {
+    std::printf("%6s %9s %9s %8s %8s %8s %8s %8s %8s %8s %10s %9s\n", "time",
+                "read/s", "write/s", "MB/s", "rd p50", "rd p99", "wr p50",
+                "wr p99", "wr p999", "fl p99", "lag batch", "lag ms");
+}
+
+void print_totals(const Stats &stats, double seconds) {
+    std::printf("\n%-6s %10s %10s %10s %10s %10s %10s\n", "op", "count",
+                "per s", "p50 us", "p99 us", "p999 us", "max us");
+    for (int op = 0; op < N_OPS; op++) {
+        const auto &histogram = stats.total[op];
+        const auto n = histogram.count();
+        if (n == 0) {
+            continue;
+        }
+        std::printf("%-6s %10lu %10.0f %10.1f %10.1f %10.1f %10.1f\n",
+                    op_names[op], n, n / seconds, histogram.percentile(50),
+                    histogram.percentile(99), histogram.percentile(99.9),
+                    histogram.percentile(100));
+    }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    Config config;
+    const auto workload = parse_workload(argc, argv, config);
+    if (!config.verbose) {
+        boost::log::core::get()->set_filter(boost::log::trivial::severity >=
+                                            boost::log::trivial::warning);
+    }
+
+    std::vector<std::unique_ptr<Transport>> stubs;
+    for (const auto &server : config.backup_servers) {
+        auto stub = Transport::connect(server);
+        if (stub == nullptr) {
+            std::cerr << "Cannot connect to backup server " << server
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+        stubs.push_back(std::move(stub));
+    }
+    const int fd = open(config.file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || ftruncate(fd, static_cast<long>(config.size)) != 0) {
+        std::cerr << "Cannot create " << config.file << std::endl;
+        return EXIT_FAILURE;
+    }
+    EncryptionManager emgr("workload", config.cipher);
+    std::printf("Setting up a %lu MB volume on %zu backup servers\n",
+                config.size / (1024 * 1024), stubs.size());
+    if (!utils::rebuild_remote(fd, emgr, stubs, config)) {
+        std::cerr << "Cannot set up the backup servers" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // the replication stack of SeCloud
+    const auto queue = std::make_shared<AsyncOperationQueue>(config);
+    StopFlag stop_flag(false);
+    const auto replica_set = ReplicaSet::create(stubs, config, emgr, nullptr);
+    if (!replica_set) {
+        std::cerr << "Cannot start replication" << std::endl;
+        return EXIT_FAILURE;
+    }
+    auto &replicas = *replica_set;
+    replicas.start(stop_flag);
+    std::thread daemon([&] {
+        BackupDaemon::start(queue, open(config.file.c_str(), O_RDONLY), emgr,
+                            replicas, config.extent_size, nullptr, stop_flag,
+                            config.io_engine);
+    });
+    std::optional<UringFile> io;
+    if (config.io_engine == IoEngine::IO_URING) {
+        io.emplace(fd);
+    }
+    LocalBlockDriver::Context ctx = {
+        .queue = queue,
+        .fd = fd,
+        .io = io ? &*io : nullptr,
+        .replicas = &replicas,
+        .write_quorum = config.write_quorum,
+        .epoch_interval = std::chrono::milliseconds(config.epoch_interval_ms),
+        .last_barrier = std::chrono::steady_clock::now()};
+    const buse_operations bop = {
+        .read = LocalBlockDriver::read,
+        .write = LocalBlockDriver::write,
+        .disc = LocalBlockDriver::disc,
+        .flush = LocalBlockDriver::flush,
+        .trim = LocalBlockDriver::trim,
+        .blksize = BLOCK_SIZE,
+        .size_blocks = config.n_blocks,
+    };
+
+    Stats stats;
+    StopFlag stop_workers(false);
+    std::mutex device;
+    std::atomic<uint64_t> cursor{0};
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < workload.queue_depth; i++) {
+        workers.emplace_back([&, i] {
+            run_worker(workload, config, bop, ctx, device, cursor, stats, i,
+                       stop_workers);
+        });
+    }
+
+    // the lag is sampled more often than reported, the report has the worst
+    print_header();
+    LagMeter lag(replicas);
+    const auto start = std::chrono::steady_clock::now();
+    const auto report = std::chrono::seconds(workload.report_s);
+    auto next_report = start + report;
+    std::pair<uint64_t, double> worst{};
+    std::pair<uint64_t, double> worst_total{};
+    while (true) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        const auto sample = lag.sample();
+        worst = {std::max(worst.first, sample.first),
+                 std::max(worst.second, sample.second)};
+        const auto now = std::chrono::steady_clock::now();
+        if (now < next_report) {
+            continue;
+        }
+        const std::chrono::duration<double> elapsed = now - start;
+        const auto seconds = static_cast<double>(workload.report_s);
+        std::array<Histogram, N_OPS> interval;
+        std::array<uint64_t, N_OPS> counts{};
+        for (int op = 0; op < N_OPS; op++) {
+            counts[op] = stats.interval[op].drain(interval[op]);
+        }
+        std::printf(
+            "%6.0f %9.0f %9.0f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f "
+            "%10lu %9.0f\n",
+            elapsed.count(), counts[READ] / seconds, counts[WRITE] / seconds,
+            stats.bytes.exchange(0) / seconds / (1024 * 1024),
+            interval[READ].percentile(50), interval[READ].percentile(99),
+            interval[WRITE].percentile(50), interval[WRITE].percentile(99),
+            interval[WRITE].percentile(99.9), interval[FLUSH].percentile(99),
+            worst.first, worst.second);
+        std::fflush(stdout);
+        for (int op = 0; op < N_OPS; op++) {
+            interval[op].drain(stats.total[op]);
+        }
+        worst_total = {std::max(worst_total.first, worst.first),
+                       std::max(worst_total.second, worst.second)};
+        worst = {};
+        next_report += report;
+        if (elapsed.count() >= static_cast<double>(workload.duration_s)) {
+            break;
+        }
+    }
+    stop_workers.store(true);
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    for (int op = 0; op < N_OPS; op++) {
+        stats.interval[op].drain(stats.total[op]);
+    }
+    const std::chrono::duration<double> ran =
+        std::chrono::steady_clock::now() - start;
+
+    // how long every server takes to catch up once the writes stop
+    const auto drain_start = std::chrono::steady_clock::now();
+    const bool drained = LocalBlockDriver::settle(
+        &ctx, replicas.size(), std::chrono::milliseconds(QUORUM_TIMEOUT_MS));
+    const std::chrono::duration<double, std::milli> drain =
+        std::chrono::steady_clock::now() - drain_start;
+    stop_flag.store(true);
+    daemon.join();
+    replicas.join();
+
+    print_totals(stats, ran.count());
+    std::printf("\nmax lag %lu batches, %.0f ms\n", worst_total.first,
+                worst_total.second);
+    if (drained) {
+        std::printf("every server caught up %.0f ms after the writes\n",
+                    drain.count());
+    } else {
+        std::printf("not every server caught up in %lu ms\n",
+                    QUORUM_TIMEOUT_MS);
+    }
+    if (config.check) {
+        std::printf("consistency check: %s\n",
+                    utils::consistency_check(fd, emgr, stubs, config)
+                        ? "passed"
+                        : "FAILED");
+    }
+    close(fd);
+    return drained ? EXIT_SUCCESS : EXIT_FAILURE;
+}
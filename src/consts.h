@@ -1,12 +1,65 @@
 #ifndef CONST_H
 #define CONST_H
 
+#include <cstddef>
+#include <cstdint>
+
 constexpr size_t SPSC_SIZE = 1024 * 64;
 
+constexpr uint64_t OVERFLOW_TIMEOUT_MS = 1000;
+
+constexpr uint64_t THROTTLE_TARGET = 50;  // percent of the queue
+
+constexpr uint64_t THROTTLE_MAX_DELAY_US = 10000;
+
+constexpr uint64_t SPILL_RANGE_MAX = 256;  // blocks per drained operation
+
 constexpr uint64_t BLOCK_SIZE = 4096;
 
+constexpr uint64_t MAX_EXTENT_SIZE = 1024 * 1024;
+
 constexpr uint64_t N_BLOCKS = 1024;
 
+constexpr uint64_t CRYPTO_BATCH = 16;  // blocks encrypted per kernel call
+
+constexpr uint64_t CHECKPOINT_BYTES = 256 * 1024 * 1024;  // per checkpoint
+
+constexpr int BULK_RETRIES = 5;  // stream failures before a bulk run gives up
+
+constexpr uint64_t BULK_RETRY_DELAY_MS = 1000;  // doubled on every retry
+
+constexpr uint64_t PROGRESS_INTERVAL_S = 5;
+
+constexpr uint64_t RATE_FILE_POLL_S = 1;
+
+constexpr size_t REPLICA_QUEUE_BATCHES = 4096;  // per replica
+
+constexpr uint64_t QUORUM_TIMEOUT_MS = 30000;  // for a flush
+
+constexpr uint64_t RECONNECT_DELAY_MS = 250;  // doubled on every failure
+
+constexpr uint64_t RECONNECT_MAX_DELAY_MS = 30000;
+
+constexpr uint64_t STRIPE_BYTES = 1024 * 1024;  // per replication stream
+
+constexpr uint64_t LAZY_PREFETCH_BYTES = 1024 * 1024;  // after each miss
+
+constexpr size_t LAZY_MAX_HINTS = 1024;  // extents queued for prefetching
+
+constexpr unsigned URING_ENTRIES = 64;  // submission queue of a UringFile
+
+constexpr size_t DAEMON_BATCH_OPS = 64;  // queued writes read together
+
+constexpr size_t SHM_RING_BYTES = 4 * 1024 * 1024;  // per direction of a call
+
+constexpr uint64_t SHM_POLL_MS = 100;  // checks that the peer is still there
+
+constexpr uint64_t LOAD_KEPT_UP_PERCENT = 95;  // of the offered load
+
+constexpr uint64_t LOAD_GROWTH_PERCENT = 5;  // more clients must bring
+
+constexpr size_t TRACE_RING_EVENTS = 16384;  // per thread
+
 constexpr uint64_t DEV_SIZE = BLOCK_SIZE * N_BLOCKS;
 
 constexpr char IMG_FILE[] = "img";
@@ -15,14 +68,47 @@ constexpr char ENCRYPTED_IMG[] = "encrypted_backup_img";
 
 constexpr char BLOCK_DEV[] = "/dev/nbd0";
 
+constexpr char NBD_EXPORT_NAME[] = "secloud";  // listed by the NBD server
+
+constexpr uint32_t NBD_MAX_REQUEST = 32 * 1024 * 1024;  // bytes
+
 constexpr char BACKUP_SERVER_ADDR[] = "localhost:8080";
 
+constexpr uint16_t BACKUP_SERVER_PORT = 8080;
+
+constexpr uint64_t SNAPSHOT_RETENTION = 16;
+
+constexpr uint64_t SYNC_INTERVAL_MS = 10;  // group commit of the server
+
+constexpr uint64_t SYNC_BYTES = 8 * 1024 * 1024;
+
+constexpr uint64_t SYNC_TIMEOUT_MS = 30000;  // for a WriteBlock stream
+
+constexpr uint64_t READAHEAD_BYTES = 4 * 1024 * 1024;  // of a ReadBlock stream
+
+constexpr uint64_t READAHEAD_AFTER = 4;  // consecutive extents read
+
+constexpr uint64_t LOG_SEGMENT_BYTES = 64 * 1024 * 1024;  // log image
+
+constexpr uint64_t LOG_CHECKPOINT_BYTES = 256 * 1024 * 1024;  // of the index
+
+constexpr uint64_t LOG_COMPACT_LIVE = 50;  // percent live below which a
+                                           // segment is compacted
+
+constexpr uint64_t LOG_COMPACT_INTERVAL_S = 1;
+
+constexpr uint64_t EPOCH_INTERVAL_MS = 0;  // longest epoch without a flush
+
+constexpr uint64_t EPOCH_SEGMENT_BYTES = 64 * 1024 * 1024;  // staged writes
+
 constexpr size_t USER_IV_SIZE = 8;
 
 constexpr size_t KEY_SIZE = 32;
 
 constexpr size_t SALT_SIZE = 16;
 
+constexpr size_t CONFIRM_DIGEST_SIZE = 16;
+
 constexpr char PASSWORD_FILE[] = "password";
 
 #endif
\ No newline at end of file
@@ -1,11 +1,68 @@
 #ifndef SECLOUD_TYPES_H
 #define SECLOUD_TYPES_H
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <optional>
 #include <string>
+#include <vector>
 
 #include "consts.h"
 
 enum Mode { SETUP, RECOVER_LOCAL, REBUILD_BACKUP, NORMAL };
 
+// What a write does when the replication queue is full
+enum OverflowPolicy { BLOCK, BLOCK_TIMEOUT, SPILL, THROTTLE };
+
+// Cipher of a volume, recorded in the volume metadata
+enum CipherType { AES_256_CTR, CHACHA20 };
+
+inline const char *cipher_name(CipherType cipher) {
+    return cipher == CipherType::CHACHA20 ? "chacha20" : "aes-256-ctr";
+}
+
+inline std::optional<CipherType> parse_cipher(const std::string &name) {
+    if (name == "aes-256-ctr") return CipherType::AES_256_CTR;
+    if (name == "chacha20") return CipherType::CHACHA20;
+    return std::nullopt;
+}
+
+// Traffic to the backup server, in priority order
+enum TrafficClass { LIVE, VERIFY, BULK };
+constexpr int N_TRAFFIC_CLASSES = 3;
+
+inline std::optional<TrafficClass> parse_traffic_class(
+    const std::string &name) {
+    if (name == "live") return TrafficClass::LIVE;
+    if (name == "verify") return TrafficClass::VERIFY;
+    if (name == "bulk") return TrafficClass::BULK;
+    return std::nullopt;
+}
+
+// How a backup server lays out its image
+enum StorageEngine { FLAT_IMAGE, LOG_STRUCTURED };
+
+inline std::optional<StorageEngine> parse_storage_engine(
+    const std::string &name) {
+    if (name == "flat") return StorageEngine::FLAT_IMAGE;
+    if (name == "log") return StorageEngine::LOG_STRUCTURED;
+    return std::nullopt;
+}
+
+// How the device and the daemon access the local file
+enum IoEngine { SYNC_IO, IO_URING };
+
+inline std::optional<IoEngine> parse_io_engine(const std::string &name) {
+    if (name == "sync") return IoEngine::SYNC_IO;
+    if (name == "uring") return IoEngine::IO_URING;
+    return std::nullopt;
+}
+
+// How the daemon recognizes rewrites of unchanged blocks
+enum FingerprintMode { OFF, FAST, CONFIRM };
+
+typedef std::atomic<bool> StopFlag;
+
 struct Config {
     Mode mode = Mode::NORMAL;
     bool check = false;
@@ -13,8 +70,51 @@ struct Config {
     std::string file = IMG_FILE;
     uint64_t n_blocks = N_BLOCKS;
     size_t queue_size = SPSC_SIZE;
+    OverflowPolicy overflow_policy = OverflowPolicy::SPILL;
+    uint64_t overflow_timeout_ms = OVERFLOW_TIMEOUT_MS;
+    uint64_t throttle_target = THROTTLE_TARGET;
+    FingerprintMode fingerprint = FingerprintMode::FAST;
+    CipherType cipher = CipherType::AES_256_CTR;
+    uint64_t extent_size = BLOCK_SIZE;
+    IoEngine io_engine = IoEngine::SYNC_IO;
+    bool verbose = false;
+    // replicated in parallel, the first one serves checks and recovery
+    std::vector<std::string> backup_servers{BACKUP_SERVER_ADDR};
+    size_t write_quorum = 0;  // replicas a flush waits for
+    uint64_t epoch_interval_ms = EPOCH_INTERVAL_MS;  // 0 only ends at flushes
+    size_t streams = 1;  // replication connections per backup server
+    // erasure coded across the backup servers when data_shards > 0, server
+    // i holds shard i of every extent
+    uint32_t data_shards = 0;
+    uint32_t parity_shards = 0;
+    std::string snapshot;  // restore from this snapshot in recover_local
+    bool lazy = false;     // recover_local fetches extents on first access
+    bool restart = false;  // ignore the checkpoint of an interrupted run
+    // bytes per second by TrafficClass and for all of them, 0 is unlimited
+    std::array<uint64_t, N_TRAFFIC_CLASSES> rates{};
+    uint64_t link_rate = 0;
+    std::string rate_file;  // reloaded when it changes
+    std::string trace_file;  // tracing is controlled by signals if set
+    // host:port or unix:path to serve NBD on instead of /dev/nbd0
+    std::string nbd_listen;
+    // cores of the pipeline stages, empty ones are not pinned
+    std::vector<int> nbd_cpus;
+    std::vector<int> daemon_cpus;
+    std::vector<int> sender_cpus;  // one per replica stream in turn
+};
+
+struct ServerConfig {
+    std::string file = ENCRYPTED_IMG;
+    uint16_t port = BACKUP_SERVER_PORT;
+    std::string unix_socket;  // also serves gRPC there if set
+    std::string shm_socket;  // also serves ShmTransport there if set
     bool verbose = false;
-    std::string backup_server = BACKUP_SERVER_ADDR;
+    uint64_t snapshot_interval = 0;  // seconds, 0 disables auto snapshots
+    uint64_t snapshot_retention = SNAPSHOT_RETENTION;
+    uint64_t sync_interval_ms = SYNC_INTERVAL_MS;
+    uint64_t sync_bytes = SYNC_BYTES;  // 0 only syncs by time
+    StorageEngine engine = StorageEngine::FLAT_IMAGE;
+    std::vector<int> io_cpus;  // cores of every server thread
 };
 
 #endif  // SECLOUD_TYPES_H
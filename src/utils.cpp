@@ -1,225 +1,495 @@
 #include "utils.h"
 
-#include <grpcpp/create_channel.h>
-
 #include <boost/format.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/program_options.hpp>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <thread>
 
 #include "BackupServer.grpc.pb.h"
+#include "Checkpoint.h"
+#include "Extent.h"
+#include "ExtentStream.h"
+#include "Topology.h"
 namespace po = boost::program_options;
 
 using grpc::Channel;
 using grpc::ClientContext;
-using grpc::ClientReaderWriter;
-using grpc::ClientWriter;
 using grpc::Status;
 
-namespace utils {
-bool consistency_check(int img_fd, EncryptionManager &emgr,
-                       const std::unique_ptr<Backup::Stub> &client_stub,
-                       const Config &config) {
-    BOOST_LOG_TRIVIAL(info) << "Checking consistency" << std::endl;
-
-    ClientContext context;
-    std::shared_ptr<ClientReaderWriter<ReadBlockRequest, ReadBlockResponse>>
-        stream(client_stub->ReadBlock(&context));
-
-    for (auto block_no = 0; block_no < config.n_blocks; block_no++) {
-        ReadBlockRequest req;
-        ReadBlockResponse resp;
+namespace {
 
-        std::array<uint8_t, BLOCK_SIZE> encrypted_buf{};
-        req.set_block_no(block_no);
-        if (!stream->Write(req)) {
-            BOOST_LOG_TRIVIAL(error) << "RPC stream closed" << std::endl;
-            return false;
-        }
+// read extent extent_no of the backup or a snapshot into extent[0], decrypted
+template <typename E>
+bool read_extent(ExtentReader &reader, EncryptionManager &emgr,
+                 const std::string &snapshot, uint64_t extent_no,
+                 std::vector<typename E::Data> &extent,
+                 BandwidthScheduler *scheduler, TrafficClass traffic) {
+    if (!reader.read(extent_no, snapshot, extent[0].data(), scheduler,
+                     traffic)) {
+        return false;
+    }
+    emgr.crypt_extents(extent, {extent_no});
+    return true;
+}
 
-        if (!stream->Read(&resp)) {
-            BOOST_LOG_TRIVIAL(error) << "RPC stream closed" << std::endl;
-            return false;
+// logs position, throughput and ETA of a bulk run every PROGRESS_INTERVAL_S
+class Progress {
+    const char *what;
+    uint64_t total;
+    uint64_t extent_size;
+    uint64_t start;
+    std::chrono::steady_clock::time_point started =
+        std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point reported = started;
+
+   public:
+    Progress(const char *what, uint64_t total, uint64_t extent_size,
+             uint64_t start)
+        : what(what), total(total), extent_size(extent_size), start(start) {}
+
+    void update(uint64_t done, bool force = false) {
+        const auto now = std::chrono::steady_clock::now();
+        if (!force &&
+            now - reported < std::chrono::seconds(PROGRESS_INTERVAL_S)) {
+            return;
         }
-
-        if (!resp.success()) {
-            BOOST_LOG_TRIVIAL(warning)
-                << "RPC Read Block Failed: " << resp.message() << std::endl;
+        reported = now;
+        const std::chrono::duration<double> elapsed = now - started;
+        const auto rate = (done - start) / std::max(elapsed.count(), 1e-3);
+        const auto eta = rate > 0 ? static_cast<uint64_t>((total - done) / rate)
+                                  : 0;
+        BOOST_LOG_TRIVIAL(info)
+            << boost::format(
+                   "%1% extent %2%/%3% (%4$.1f%%), %5$.1f MB/s, ETA "
+                   "%6%:%7$02d:%8$02d") %
+                   what % done % total % (100.0 * done / total) %
+                   (rate * extent_size / (1024 * 1024)) % (eta / 3600) %
+                   (eta / 60 % 60) % (eta % 60)
+            << std::endl;
+    }
+};
+
+template <typename E>
+bool check_extents(ExtentReader &reader, int img_fd, EncryptionManager &emgr,
+                   uint64_t n_extents, BandwidthScheduler *scheduler,
+                   Progress &progress) {
+    std::vector<typename E::Data> decrypted(1);
+    auto local = std::make_unique<typename E::Data>();
+    for (uint64_t extent_no = 0; extent_no < n_extents; extent_no++) {
+        progress.update(extent_no);
+        if (!read_extent<E>(reader, emgr, "", extent_no, decrypted,
+                            scheduler, TrafficClass::VERIFY)) {
             return false;
         }
-        std::copy(resp.data().begin(), resp.data().end(),
-                  encrypted_buf.begin());
 
-        auto decrypted_buf = emgr.decrypt_block(encrypted_buf, block_no);
-
-        std::array<uint8_t, BLOCK_SIZE> buf{};
         if (const auto err =
-                pread(img_fd, buf.data(), BLOCK_SIZE,
-                      static_cast<long int>(block_no * BLOCK_SIZE));
+                pread(img_fd, local->data(), E::size,
+                      static_cast<long int>(extent_no * E::size));
             err < 0) {
             BOOST_LOG_TRIVIAL(error)
                 << "Consistency check pread failed" << std::endl;
         }
 
         // compare bits
-        if (buf != decrypted_buf) {
+        if (*local != decrypted[0]) {
             BOOST_LOG_TRIVIAL(warning)
-                << "Block " << block_no << " is not consistent" << std::endl;
+                << "Extent " << extent_no << " is not consistent" << std::endl;
             return false;
         }
     }
-    stream->WritesDone();
-    Status status = stream->Finish();
-    if (!status.ok()) {
-        BOOST_LOG_TRIVIAL(error)
-            << "RPC read block stream close failed: " << status.error_message()
-            << std::endl;
-        return false;
-    }
     return true;
 }
 
-bool rebuild_remote(int img_fd, EncryptionManager &emgr,
-                    const std::unique_ptr<Backup::Stub> &client_stub,
-                    const Config &config) {
-    BOOST_LOG_TRIVIAL(info) << "Rebuilding remote backup" << std::endl;
-    // setup
-    SetupRequest setup_req;
-    SetupResponse setup_resp;
-    ClientContext setup_context;
-
-    setup_req.set_size(config.size);
-    if (auto status =
-            client_stub->Setup(&setup_context, setup_req, &setup_resp);
-        !status.ok()) {
-        BOOST_LOG_TRIVIAL(error)
-            << "RPC Setup Failed: " << status.error_message() << std::endl;
-        return false;
-    }
-    if (!setup_resp.success()) {
-        BOOST_LOG_TRIVIAL(error)
-            << "RPC Setup is not successful: " << setup_resp.message()
-            << std::endl;
-        return false;
-    }
-
-    // rebuild
-    WriteBlockResponse resp;
-    ClientContext context;
-    std::unique_ptr<ClientWriter<WriteBlockRequest>> writer(
-        client_stub->WriteBlock(&context, &resp));
-    for (auto block_no = 0; block_no < config.n_blocks; block_no++) {
-        // report progress
-        if (block_no % 10000 == 0) {
-            BOOST_LOG_TRIVIAL(info)
-                << boost::format("Rebuilding block %1%/%2%") % block_no %
-                       config.n_blocks
+// send extents [first, end)
+template <typename E>
+bool rebuild_extents(ExtentWriter &writer, int img_fd,
+                     EncryptionManager &emgr, uint64_t first, uint64_t end,
+                     FingerprintCache *fingerprints,
+                     BandwidthScheduler *scheduler, Progress &progress) {
+    for (uint64_t batch_start = first; batch_start < end;
+         batch_start += E::batch) {
+        progress.update(batch_start);
+
+        const auto n = std::min<uint64_t>(E::batch, end - batch_start);
+        std::vector<typename E::Data> extents(n);
+        std::vector<uint64_t> extent_nos(n);
+        // a hole must not be sent, the checkpoint would move past it
+        if (pread(img_fd, extents.data(), n * E::size,
+                  static_cast<long int>(batch_start * E::size)) !=
+            static_cast<ssize_t>(n * E::size)) {
+            BOOST_LOG_TRIVIAL(error)
+                << "Startup scan pread failed at extent " << batch_start
                 << std::endl;
+            return false;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            extent_nos[i] = batch_start + i;
+            if (fingerprints != nullptr) {
+                fingerprints->store(extent_nos[i],
+                                    fingerprints->compute(extents[i]));
+            }
         }
 
-        WriteBlockRequest req;
+        // encrypt extents in place
+        emgr.crypt_extents(extents, extent_nos);
 
-        std::array<uint8_t, BLOCK_SIZE> buf{};
-        if (const auto err =
-                pread(img_fd, buf.data(), BLOCK_SIZE,
-                      static_cast<long int>(block_no * BLOCK_SIZE));
-            err < 0) {
-            BOOST_LOG_TRIVIAL(error)
-                << "Startup scan pread failed" << std::endl;
+        for (uint64_t i = 0; i < n; i++) {
+            if (!writer.write(extent_nos[i], extents[i].data(), scheduler,
+                              TrafficClass::BULK)) {
+                return false;
+            }
         }
+    }
+    return true;
+}
 
-        // encrypt block
-        auto encrypted_buf = emgr.encrypt_block(buf, block_no);
+// restore extent extent_no of the local file
+template <typename E>
+bool restore_extent(ExtentReader &reader, int img_fd, EncryptionManager &emgr,
+                    const Config &config, uint64_t extent_no,
+                    std::vector<typename E::Data> &decrypted,
+                    FingerprintCache *fingerprints,
+                    BandwidthScheduler *scheduler, TrafficClass traffic) {
+    if (!read_extent<E>(reader, emgr, config.snapshot, extent_no, decrypted,
+                        scheduler, traffic)) {
+        return false;
+    }
 
-        req.set_block_no(block_no);
-        req.set_data(encrypted_buf.data(), BLOCK_SIZE);
+    if (const auto err =
+            pwrite(img_fd, decrypted[0].data(), E::size,
+                   static_cast<long int>(extent_no * E::size));
+        err < 0) {
+        BOOST_LOG_TRIVIAL(error) << "Recovery: pwrite failed" << std::endl;
+        return false;
+    }
+    // a snapshot restore leaves the latest image different from local
+    if (fingerprints != nullptr && config.snapshot.empty()) {
+        fingerprints->store(extent_no, fingerprints->compute(decrypted[0]));
+    }
+    return true;
+}
 
-        if (!writer->Write(req)) {
-            BOOST_LOG_TRIVIAL(error) << "RPC stream closed" << std::endl;
+// restore extents [first, end) of the local file
+template <typename E>
+bool recover_extents(ExtentReader &reader, int img_fd, EncryptionManager &emgr,
+                     const Config &config, uint64_t first, uint64_t end,
+                     FingerprintCache *fingerprints,
+                     BandwidthScheduler *scheduler, Progress &progress) {
+    std::vector<typename E::Data> decrypted(1);
+    for (uint64_t extent_no = first; extent_no < end; extent_no++) {
+        progress.update(extent_no);
+        if (!restore_extent<E>(reader, img_fd, emgr, config, extent_no,
+                               decrypted, fingerprints, scheduler,
+                               TrafficClass::BULK)) {
             return false;
         }
     }
+    return true;
+}
 
-    writer->WritesDone();
-    Status status = writer->Finish();
-    if (!status.ok()) {
-        BOOST_LOG_TRIVIAL(error)
-            << "RPC write block stream close failed: " << status.error_message()
-            << std::endl;
+// one stream per server and segment, the servers acknowledge every extent
+// of it once the streams finish successfully
+bool rebuild_segment(int img_fd, EncryptionManager &emgr,
+                     const std::vector<std::unique_ptr<Transport>> &stubs,
+                     const Config &config, uint64_t first, uint64_t end,
+                     FingerprintCache *fingerprints,
+                     BandwidthScheduler *scheduler, Progress &progress) {
+    ExtentWriter writer(stubs, config);
+    // a failed write shows up as the status of finish
+    with_extent(config.extent_size, [&](auto extent) {
+        return rebuild_extents<decltype(extent)>(writer, img_fd, emgr, first,
+                                                 end, fingerprints, scheduler,
+                                                 progress);
+    });
+    return writer.finish();
+}
+
+bool recover_segment(int img_fd, EncryptionManager &emgr,
+                     const std::vector<std::unique_ptr<Transport>> &stubs,
+                     const Config &config, uint64_t first, uint64_t end,
+                     FingerprintCache *fingerprints,
+                     BandwidthScheduler *scheduler, Progress &progress) {
+    ExtentReader reader(stubs, config);
+    const bool ok = with_extent(config.extent_size, [&](auto extent) {
+        return recover_extents<decltype(extent)>(reader, img_fd, emgr, config,
+                                                 first, end, fingerprints,
+                                                 scheduler, progress);
+    });
+    if (!reader.finish()) {
         return false;
     }
-    if (!resp.success()) {
-        BOOST_LOG_TRIVIAL(warning)
-            << "RPC Write Block Failed: " << resp.message() << std::endl;
+    // the checkpoint may only cover extents that reached the disk
+    if (ok && fdatasync(img_fd) != 0) {
+        BOOST_LOG_TRIVIAL(error) << "Recovery: fdatasync failed" << std::endl;
         return false;
     }
+    return ok;
+}
+
+// run segment(first, end) over [start, n_extents) in CHECKPOINT_BYTES steps,
+// saving the checkpoint after each and retrying failed segments with backoff.
+// A segment whose checkpoint cannot be saved counts as failed
+template <typename Segment>
+bool run_checkpointed(Checkpoint checkpoint, const Config &config,
+                      uint64_t n_extents, Segment &&segment) {
+    const auto path = Checkpoint::path_for(config.file);
+    const auto step =
+        std::max<uint64_t>(1, CHECKPOINT_BYTES / config.extent_size);
+    auto delay = std::chrono::milliseconds(BULK_RETRY_DELAY_MS);
+    for (int failures = 0; checkpoint.next < n_extents;) {
+        const auto end = std::min(n_extents, checkpoint.next + step);
+        auto done = checkpoint;
+        done.next = end;
+        if (segment(checkpoint.next, end) && done.save(path)) {
+            checkpoint = done;
+            failures = 0;
+            delay = std::chrono::milliseconds(BULK_RETRY_DELAY_MS);
+            continue;
+        }
+        if (++failures > BULK_RETRIES) {
+            BOOST_LOG_TRIVIAL(error)
+                << "Giving up at extent " << checkpoint.next
+                << ", run again to resume from there" << std::endl;
+            return false;
+        }
+        BOOST_LOG_TRIVIAL(warning)
+            << boost::format("Retrying from extent %1% in %2% ms (%3%/%4%)") %
+                   checkpoint.next % delay.count() % failures % BULK_RETRIES
+            << std::endl;
+        std::this_thread::sleep_for(delay);
+        delay *= 2;
+    }
+    std::error_code err;
+    std::filesystem::remove(path, err);
     return true;
 }
 
-bool recover_local(int img_fd, EncryptionManager &emgr,
-                   const std::unique_ptr<Backup::Stub> &client_stub,
-                   const Config &config) {
+// the checkpoint to start a bulk run from, next is 0 for a fresh run
+Checkpoint resume_point(const Config &config, const Checkpoint &run) {
+    Checkpoint saved;
+    const auto path = Checkpoint::path_for(config.file);
+    if (config.restart || !saved.load(path) || !run.same_run(saved)) {
+        return run;
+    }
     BOOST_LOG_TRIVIAL(info)
-        << "Recovering local disk with remote backup" << std::endl;
+        << "Resuming " << run.op << " from extent " << saved.next
+        << std::endl;
+    return saved;
+}
+}  // namespace
 
-    ClientContext context;
-    std::shared_ptr<ClientReaderWriter<ReadBlockRequest, ReadBlockResponse>>
-        stream(client_stub->ReadBlock(&context));
-
-    for (auto block_no = 0; block_no < config.n_blocks; block_no++) {
-        // report progress
-        if (block_no % 1000 == 0) {
-            BOOST_LOG_TRIVIAL(info)
-                << boost::format("Recovering local block %1%/%2%") % block_no %
-                       config.n_blocks
-                << std::endl;
-        }
+namespace utils {
+bool consistency_check(int img_fd, EncryptionManager &emgr,
+                       const std::vector<std::unique_ptr<Transport>> &stubs,
+                       const Config &config, BandwidthScheduler *scheduler) {
+    BOOST_LOG_TRIVIAL(info) << "Checking consistency" << std::endl;
 
-        ReadBlockRequest req;
-        ReadBlockResponse resp;
+    ExtentReader reader(stubs, config);
+    const auto n_extents = config.size / config.extent_size;
+    Progress progress("Checking", n_extents, config.extent_size, 0);
+    if (!with_extent(config.extent_size, [&](auto extent) {
+            return check_extents<decltype(extent)>(
+                reader, img_fd, emgr, n_extents, scheduler, progress);
+        })) {
+        return false;
+    }
+    return reader.finish();
+}
 
-        std::array<uint8_t, BLOCK_SIZE> encrypted_buf{};
-        req.set_block_no(block_no);
-        if (!stream->Write(req)) {
-            BOOST_LOG_TRIVIAL(error) << "RPC stream closed" << std::endl;
-            return false;
-        }
+bool rebuild_remote(int img_fd, EncryptionManager &emgr,
+                    const std::vector<std::unique_ptr<Transport>> &stubs,
+                    const Config &config, FingerprintCache *fingerprints,
+                    BandwidthScheduler *scheduler) {
+    BOOST_LOG_TRIVIAL(info) << "Rebuilding remote backup" << std::endl;
+    auto start = resume_point(config, {.op = "rebuild",
+                                       .size = config.size,
+                                       .extent_size = config.extent_size});
+
+    // a resumed run continues on the volume it set up
+    const auto same_volume = [&](const std::unique_ptr<Transport> &stub) {
+        VolumeMetadata volume;
+        return get_volume(stub, volume) && volume.size == config.size &&
+               volume.cipher == config.cipher &&
+               volume.extent_size == config.extent_size &&
+               volume.data_shards == config.data_shards &&
+               volume.parity_shards == config.parity_shards;
+    };
+    if (start.next > 0 &&
+        !std::all_of(stubs.begin(), stubs.end(), same_volume)) {
+        BOOST_LOG_TRIVIAL(warning)
+            << "Remote volume changed, rebuilding from the start" << std::endl;
+        start.next = 0;
+    }
 
-        if (!stream->Read(&resp)) {
-            BOOST_LOG_TRIVIAL(error) << "RPC stream closed" << std::endl;
+    // setup, each server of an erasure coded volume keeps one shard image
+    for (size_t i = 0; start.next == 0 && i < stubs.size(); i++) {
+        SetupRequest setup_req;
+        SetupResponse setup_resp;
+        ClientContext setup_context;
+
+        const auto k = std::max<uint32_t>(1, config.data_shards);
+        setup_req.set_size(config.size / k);
+        setup_req.set_cipher(cipher_name(config.cipher));
+        setup_req.set_extent_size(config.extent_size / k);
+        setup_req.set_data_shards(config.data_shards);
+        setup_req.set_parity_shards(config.parity_shards);
+        setup_req.set_shard(i);
+        if (auto status =
+                stubs[i]->Setup(&setup_context, setup_req, &setup_resp);
+            !status.ok()) {
+            BOOST_LOG_TRIVIAL(error)
+                << "RPC Setup Failed: " << status.error_message() << std::endl;
             return false;
         }
-
-        if (!resp.success()) {
-            BOOST_LOG_TRIVIAL(warning)
-                << "RPC Read Block Failed: " << resp.message() << std::endl;
+        if (!setup_resp.success()) {
+            BOOST_LOG_TRIVIAL(error)
+                << "RPC Setup is not successful: " << setup_resp.message()
+                << std::endl;
             return false;
         }
+    }
 
-        std::copy(resp.data().begin(), resp.data().end(),
-                  encrypted_buf.begin());
+    // rebuild
+    const auto n_extents = config.size / config.extent_size;
+    Progress progress("Rebuilding", n_extents, config.extent_size,
+                      start.next);
+    if (!run_checkpointed(start, config, n_extents,
+                          [&](uint64_t first, uint64_t end) {
+                              return rebuild_segment(
+                                  img_fd, emgr, stubs, config, first, end,
+                                  fingerprints, scheduler, progress);
+                          })) {
+        return false;
+    }
+    progress.update(n_extents, true);
+    return true;
+}
 
-        auto decrypted_buf = emgr.decrypt_block(encrypted_buf, block_no);
+bool recover_local(int img_fd, EncryptionManager &emgr,
+                   const std::vector<std::unique_ptr<Transport>> &stubs,
+                   const Config &config, FingerprintCache *fingerprints,
+                   BandwidthScheduler *scheduler) {
+    if (config.snapshot.empty()) {
+        BOOST_LOG_TRIVIAL(info)
+            << "Recovering local disk with remote backup" << std::endl;
+    } else {
+        BOOST_LOG_TRIVIAL(info)
+            << "Recovering local disk with remote snapshot " << config.snapshot
+            << std::endl;
+    }
+    const auto start = resume_point(config, {.op = "recover",
+                                             .size = config.size,
+                                             .extent_size = config.extent_size,
+                                             .snapshot = config.snapshot});
+
+    const auto n_extents = config.size / config.extent_size;
+    Progress progress("Recovering local", n_extents, config.extent_size,
+                      start.next);
+    if (!run_checkpointed(start, config, n_extents,
+                          [&](uint64_t first, uint64_t end) {
+                              return recover_segment(
+                                  img_fd, emgr, stubs, config, first, end,
+                                  fingerprints, scheduler, progress);
+                          })) {
+        return false;
+    }
+    progress.update(n_extents, true);
+    return true;
+}
 
-        if (block_no == 0)
-            BOOST_LOG_TRIVIAL(debug)
-                << "Recovering block " << decrypted_buf[0] << std::endl;
+bool fetch_extent(ExtentReader &reader, int img_fd, EncryptionManager &emgr,
+                  const Config &config, uint64_t extent_no,
+                  FingerprintCache *fingerprints,
+                  BandwidthScheduler *scheduler, TrafficClass traffic) {
+    return with_extent(config.extent_size, [&](auto extent) {
+        typedef decltype(extent) E;
+        std::vector<typename E::Data> decrypted(1);
+        return restore_extent<E>(reader, img_fd, emgr, config, extent_no,
+                                 decrypted, fingerprints, scheduler, traffic);
+    });
+}
 
-        if (const auto err =
-                pwrite(img_fd, decrypted_buf.data(), BLOCK_SIZE,
-                       static_cast<long int>(block_no * BLOCK_SIZE));
-            err < 0) {
-            BOOST_LOG_TRIVIAL(error) << "Recovery: pwrite failed" << std::endl;
-            return false;
-        }
+bool get_volume(const std::unique_ptr<Transport> &client_stub,
+                VolumeMetadata &volume) {
+    GetVolumeRequest req;
+    GetVolumeResponse resp;
+    ClientContext context;
+    if (auto status = client_stub->GetVolume(&context, req, &resp);
+        !status.ok()) {
+        BOOST_LOG_TRIVIAL(error)
+            << "RPC GetVolume Failed: " << status.error_message() << std::endl;
+        return false;
+    }
+    if (!resp.success()) {
+        BOOST_LOG_TRIVIAL(error)
+            << "RPC GetVolume is not successful: " << resp.message()
+            << std::endl;
+        return false;
+    }
+
+    const auto cipher = parse_cipher(resp.cipher());
+    if (!cipher) {
+        BOOST_LOG_TRIVIAL(error)
+            << "Remote volume has unknown cipher: " << resp.cipher()
+            << std::endl;
+        return false;
     }
-    stream->WritesDone();
-    Status status = stream->Finish();
-    if (!status.ok()) {
+    // servers without extent support replicate in blocks, the servers of an
+    // erasure coded volume keep 1 / data_shards of it
+    const auto k = std::max<uint32_t>(1, resp.data_shards());
+    const auto extent_size =
+        (resp.extent_size() == 0 ? BLOCK_SIZE : resp.extent_size()) * k;
+    if (!valid_extent_size(extent_size)) {
         BOOST_LOG_TRIVIAL(error)
-            << "RPC read block stream close failed: " << status.error_message()
+            << "Remote volume has unsupported extent size: " << extent_size
             << std::endl;
         return false;
     }
+    volume = {.size = resp.size() * k,
+              .cipher = *cipher,
+              .extent_size = extent_size,
+              .data_shards = resp.data_shards(),
+              .parity_shards = resp.parity_shards(),
+              .shard = resp.shard()};
+    return true;
+}
+
+bool check_servers(const std::vector<std::unique_ptr<Transport>> &stubs,
+                   const Config &config) {
+    if (config.data_shards == 0) {
+        return true;
+    }
+    if (stubs.size() != config.data_shards + config.parity_shards) {
+        BOOST_LOG_TRIVIAL(error)
+            << boost::format("Volume is erasure coded across %1% servers, "
+                             "%2% given") %
+                   (config.data_shards + config.parity_shards) % stubs.size()
+            << std::endl;
+        return false;
+    }
+    // an unreachable server is one of the shards the code covers for
+    for (size_t i = 0; i < stubs.size(); i++) {
+        VolumeMetadata volume;
+        if (!get_volume(stubs[i], volume)) {
+            continue;
+        }
+        if (volume.data_shards != config.data_shards ||
+            volume.parity_shards != config.parity_shards ||
+            volume.shard != i) {
+            BOOST_LOG_TRIVIAL(error)
+                << boost::format("Backup server %1% keeps shard %2% of a "
+                                 "%3%+%4% code, expected shard %5% of "
+                                 "%6%+%7%") %
+                       config.backup_servers[i] % volume.shard %
+                       volume.data_shards % volume.parity_shards % i %
+                       config.data_shards % config.parity_shards
+                << std::endl;
+            return false;
+        }
+    }
     return true;
 }
 
@@ -248,9 +518,138 @@ Config parse_options(int argc, char *argv[]) {
     desc.add_options()("size", po::value<uint64_t>(),
                        "storage file size(in MB)");
     desc.add_options()("queue_size", po::value<size_t>(), "queue size");
+    desc.add_options()(
+        "overflow_policy",
+        po::value<std::string>()->notifier([](const std::string &value) {
+            std::vector<std::string> allowed_policies = {"block", "timeout",
+                                                         "spill", "throttle"};
+            if (std::find(allowed_policies.begin(), allowed_policies.end(),
+                          value) == allowed_policies.end()) {
+                throw po::validation_error(
+                    po::validation_error::invalid_option_value);
+            }
+        }),
+        "what writes do when the replication queue is full: "
+        "block | timeout | spill | throttle\n"
+        "block: wait until the daemon frees a slot\n"
+        "timeout: wait up to overflow_timeout, then alert and spill\n"
+        "spill: record the blocks in a dirty bitmap without waiting\n"
+        "throttle: delay writes above throttle_target, spill when full\n");
+    desc.add_options()("overflow_timeout", po::value<uint64_t>(),
+                       "queue full timeout(in ms) for the timeout policy");
+    desc.add_options()("throttle_target", po::value<uint64_t>(),
+                       "queue fill(in percent) where throttling starts");
     desc.add_options()("v", "verbose");
-    desc.add_options()("backup_server", po::value<std::string>(),
-                       "backup server address");
+    desc.add_options()("backup_server",
+                       po::value<std::vector<std::string>>()->composing(),
+                       "backup server address, repeat to replicate to several "
+                       "servers, the first one serves checks and recovery\n"
+                       "host:port: gRPC over TCP\n"
+                       "unix:///path: gRPC over a Unix socket\n"
+                       "shm:///path: shared memory to a server on this host\n");
+    desc.add_options()("write_quorum", po::value<size_t>(),
+                       "replicas that must acknowledge the writes before a "
+                       "flush completes, 0 to not wait");
+    desc.add_options()("epoch_interval", po::value<uint64_t>(),
+                       "longest time(in ms) writes wait for a flush before "
+                       "the backup applies them as an epoch, cut only while "
+                       "replication is idle. 0 (default) to only apply at "
+                       "flushes");
+    desc.add_options()("streams", po::value<size_t>(),
+                       "replication streams per backup server, each on its "
+                       "own connection, taking turns by 1 MB block range");
+    desc.add_options()(
+        "fingerprint",
+        po::value<std::string>()->notifier([](const std::string &value) {
+            std::vector<std::string> allowed_modes = {"off", "fast",
+                                                      "confirm"};
+            if (std::find(allowed_modes.begin(), allowed_modes.end(), value) ==
+                allowed_modes.end()) {
+                throw po::validation_error(
+                    po::validation_error::invalid_option_value);
+            }
+        }),
+        "skip replicating rewrites of unchanged blocks: off | fast | confirm\n"
+        "fast: compare a 64 bit xxHash of the block\n"
+        "confirm: also compare a SHA-256 prefix of the block\n");
+    desc.add_options()(
+        "cipher",
+        po::value<std::string>()->notifier([](const std::string &value) {
+            if (!parse_cipher(value)) {
+                throw po::validation_error(
+                    po::validation_error::invalid_option_value);
+            }
+        }),
+        "cipher of a new volume in setup mode: aes-256-ctr | chacha20\n"
+        "chacha20 is faster on hosts without AES instructions\n");
+    desc.add_options()(
+        "extent_size",
+        po::value<uint64_t>()->notifier([](uint64_t value) {
+            if (!valid_extent_size(value * 1024)) {
+                throw po::validation_error(
+                    po::validation_error::invalid_option_value);
+            }
+        }),
+        "replication extent size(in KB) of a new volume in setup mode: "
+        "4 | 16 | 64 | 256 | 1024\n"
+        "larger extents send fewer messages for sequential writes\n");
+    desc.add_options()(
+        "io_engine",
+        po::value<std::string>()->notifier([](const std::string &value) {
+            if (!parse_io_engine(value)) {
+                throw po::validation_error(
+                    po::validation_error::invalid_option_value);
+            }
+        }),
+        "access to the local file: sync | uring\n"
+        "uring reads the blocks of queued writes in one submission\n");
+    desc.add_options()("erasure", po::value<std::string>(),
+                       "erasure code a new volume in setup mode as k+m: "
+                       "server i of the k + m backup servers keeps shard i of "
+                       "every extent, any k of them restore it\n");
+    desc.add_options()("live_rate", po::value<uint64_t>(),
+                       "limit live replication(in MB/s), 0 for unlimited");
+    desc.add_options()("verify_rate", po::value<uint64_t>(),
+                       "limit consistency checks(in MB/s), 0 for unlimited");
+    desc.add_options()("bulk_rate", po::value<uint64_t>(),
+                       "limit rebuild and recovery(in MB/s), 0 for unlimited");
+    desc.add_options()("link_rate", po::value<uint64_t>(),
+                       "limit all traffic to the backup server(in MB/s), "
+                       "live replication goes first, then checks, then bulk");
+    desc.add_options()("rate_file", po::value<std::string>(),
+                       "file of live=, verify=, bulk=, link= limits(in MB/s), "
+                       "applied again whenever it changes");
+    desc.add_options()("trace_file", po::value<std::string>(),
+                       "SIGUSR1 turns request tracing on and off, SIGUSR2 "
+                       "writes the trace to this file as Chrome trace JSON");
+    desc.add_options()("nbd_listen", po::value<std::string>(),
+                       "serve the volume to NBD clients at host:port or "
+                       "unix:path instead of attaching /dev/nbd0, without "
+                       "root or the nbd module");
+    for (const auto &[stage, help] :
+         {std::pair{"nbd_cpus", "cores serving NBD requests, as in 0-3,8"},
+          std::pair{"daemon_cpus", "cores reading and encrypting writes"},
+          std::pair{"sender_cpus",
+                    "cores of the replication streams, one core each in "
+                    "turn"}}) {
+        desc.add_options()(
+            stage,
+            po::value<std::string>()->notifier([](const std::string &value) {
+                if (!Topology::parse_cpus(value)) {
+                    throw po::validation_error(
+                        po::validation_error::invalid_option_value);
+                }
+            }),
+            help);
+    }
+    desc.add_options()("lazy",
+                       "serve the device at once in recover_local mode and "
+                       "fetch extents from the backup when first accessed");
+    desc.add_options()("restart",
+                       "start rebuild_backup or recover_local from the "
+                       "beginning instead of resuming an interrupted run");
+    desc.add_options()("snapshot", po::value<std::string>(),
+                       "backup snapshot to restore from in recover_local mode");
 
     po::variables_map vm;
     po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
@@ -295,11 +694,147 @@ Config parse_options(int argc, char *argv[]) {
     if (vm.count("queue_size")) {
         config.queue_size = vm["queue_size"].as<size_t>();
     }
+    if (vm.count("overflow_policy")) {
+        const auto policy = vm["overflow_policy"].as<std::string>();
+        if (policy == "block") {
+            config.overflow_policy = OverflowPolicy::BLOCK;
+        } else if (policy == "timeout") {
+            config.overflow_policy = OverflowPolicy::BLOCK_TIMEOUT;
+        } else if (policy == "throttle") {
+            config.overflow_policy = OverflowPolicy::THROTTLE;
+        } else {
+            config.overflow_policy = OverflowPolicy::SPILL;
+        }
+    }
+    if (vm.count("overflow_timeout")) {
+        config.overflow_timeout_ms = vm["overflow_timeout"].as<uint64_t>();
+    }
+    if (vm.count("throttle_target")) {
+        config.throttle_target = vm["throttle_target"].as<uint64_t>();
+        if (config.throttle_target > 100) {
+            throw std::invalid_argument("throttle_target must be <= 100");
+        }
+    }
     if (vm.count("v")) {
         config.verbose = true;
     }
     if (vm.count("backup_server")) {
-        config.backup_server = vm["backup_server"].as<std::string>();
+        config.backup_servers =
+            vm["backup_server"].as<std::vector<std::string>>();
+    }
+    if (vm.count("write_quorum")) {
+        config.write_quorum = vm["write_quorum"].as<size_t>();
+        if (config.write_quorum > config.backup_servers.size()) {
+            throw std::invalid_argument(
+                "write_quorum cannot exceed the number of backup servers");
+        }
+    }
+    if (vm.count("epoch_interval")) {
+        config.epoch_interval_ms = vm["epoch_interval"].as<uint64_t>();
+    }
+    if (vm.count("streams")) {
+        config.streams = vm["streams"].as<size_t>();
+        if (config.streams == 0) {
+            throw std::invalid_argument("streams must be at least 1");
+        }
+    }
+    if (vm.count("fingerprint")) {
+        const auto fingerprint = vm["fingerprint"].as<std::string>();
+        if (fingerprint == "off") {
+            config.fingerprint = FingerprintMode::OFF;
+        } else if (fingerprint == "confirm") {
+            config.fingerprint = FingerprintMode::CONFIRM;
+        } else {
+            config.fingerprint = FingerprintMode::FAST;
+        }
+    }
+    if (vm.count("cipher")) {
+        if (config.mode != Mode::SETUP) {
+            throw std::invalid_argument(
+                "cipher cannot be specified in non-setup mode");
+        }
+        config.cipher = *parse_cipher(vm["cipher"].as<std::string>());
+    }
+    if (vm.count("extent_size")) {
+        if (config.mode != Mode::SETUP) {
+            throw std::invalid_argument(
+                "extent_size cannot be specified in non-setup mode");
+        }
+        config.extent_size = vm["extent_size"].as<uint64_t>() * 1024;
+    }
+    if (vm.count("io_engine")) {
+        config.io_engine = *parse_io_engine(vm["io_engine"].as<std::string>());
+    }
+    if (vm.count("erasure")) {
+        if (config.mode != Mode::SETUP) {
+            throw std::invalid_argument(
+                "erasure cannot be specified in non-setup mode");
+        }
+        const auto code = vm["erasure"].as<std::string>();
+        unsigned k = 0, m = 0;
+        char sep = 0;
+        if (std::sscanf(code.c_str(), "%u%c%u", &k, &sep, &m) != 3 ||
+            sep != '+' || k < 1 || k + m > 256) {
+            throw std::invalid_argument("erasure must be k+m");
+        }
+        if (config.extent_size % (k * BLOCK_SIZE) != 0) {
+            throw std::invalid_argument(
+                "erasure data shards must divide the blocks of an extent");
+        }
+        if (config.backup_servers.size() != k + m) {
+            throw std::invalid_argument(
+                "erasure needs k + m backup servers");
+        }
+        if (config.write_quorum != 0 && config.write_quorum < k) {
+            throw std::invalid_argument(
+                "write_quorum of an erasure coded volume must be at least k");
+        }
+        config.data_shards = k;
+        config.parity_shards = m;
+    }
+    for (const auto traffic : {"live", "verify", "bulk"}) {
+        if (const auto option = std::string(traffic) + "_rate";
+            vm.count(option)) {
+            config.rates[*parse_traffic_class(traffic)] =
+                vm[option].as<uint64_t>() * 1024 * 1024;
+        }
+    }
+    if (vm.count("link_rate")) {
+        config.link_rate = vm["link_rate"].as<uint64_t>() * 1024 * 1024;
+    }
+    if (vm.count("rate_file")) {
+        config.rate_file = vm["rate_file"].as<std::string>();
+    }
+    if (vm.count("trace_file")) {
+        config.trace_file = vm["trace_file"].as<std::string>();
+    }
+    for (const auto &[stage, cpus] :
+         {std::pair{"nbd_cpus", &config.nbd_cpus},
+          std::pair{"daemon_cpus", &config.daemon_cpus},
+          std::pair{"sender_cpus", &config.sender_cpus}}) {
+        if (vm.count(stage)) {
+            *cpus = *Topology::parse_cpus(vm[stage].as<std::string>());
+        }
+    }
+    if (vm.count("nbd_listen")) {
+        config.nbd_listen = vm["nbd_listen"].as<std::string>();
+    }
+    if (vm.count("restart")) {
+        config.restart = true;
+    }
+    if (vm.count("lazy")) {
+        if (config.mode != Mode::RECOVER_LOCAL) {
+            throw std::invalid_argument(
+                "lazy can only be specified in recover_local mode");
+        }
+        config.lazy = true;
+    }
+    if (vm.count("snapshot")) {
+        if (config.mode != Mode::RECOVER_LOCAL) {
+            throw std::invalid_argument(
+                "snapshot can only be specified in recover_local mode");
+        }
+        config.snapshot = vm["snapshot"].as<std::string>();
     }
     return config;
 }
@@ -2,22 +2,52 @@
 #define UTILS_H
 
 #include "BackupServer.grpc.pb.h"
+#include "BandwidthScheduler.h"
 #include "EncryptionManager.h"
+#include "ExtentStream.h"
+#include "FingerprintCache.h"
+#include "VolumeMetadata.h"
 #include "consts.h"
 #include "types.h"
 
 namespace utils {
+// stubs are the backup servers in config order, reads use the first one or
+// any data_shards of an erasure coded volume.
+// a scheduler, if given, paces the check as verify traffic and rebuild and
+// recovery as bulk traffic
 bool consistency_check(int img_fd, EncryptionManager &emgr,
-                       const std::unique_ptr<Backup::Stub> &client_stub,
-                       const Config &config);
+                       const std::vector<std::unique_ptr<Transport>> &stubs,
+                       const Config &config,
+                       BandwidthScheduler *scheduler = nullptr);
 
+// fingerprints, if given, learn what the server holds after the pass
 bool rebuild_remote(int img_fd, EncryptionManager &emgr,
-                    const std::unique_ptr<Backup::Stub> &client_stub,
-                    const Config &config);
+                    const std::vector<std::unique_ptr<Transport>> &stubs,
+                    const Config &config,
+                    FingerprintCache *fingerprints = nullptr,
+                    BandwidthScheduler *scheduler = nullptr);
 
 bool recover_local(int img_fd, EncryptionManager &emgr,
-                   const std::unique_ptr<Backup::Stub> &client_stub,
+                   const std::vector<std::unique_ptr<Transport>> &stubs,
+                   const Config &config,
+                   FingerprintCache *fingerprints = nullptr,
+                   BandwidthScheduler *scheduler = nullptr);
+
+// restore one extent of the local file from the backup or config.snapshot
+bool fetch_extent(ExtentReader &reader, int img_fd, EncryptionManager &emgr,
+                  const Config &config, uint64_t extent_no,
+                  FingerprintCache *fingerprints,
+                  BandwidthScheduler *scheduler, TrafficClass traffic);
+
+// metadata the remote volume was set up with, the size and extent size of
+// the whole volume for a server keeping one shard of it
+bool get_volume(const std::unique_ptr<Transport> &client_stub,
+                VolumeMetadata &volume);
+
+// the servers of an erasure coded volume keep the shards of their position
+bool check_servers(const std::vector<std::unique_ptr<Transport>> &stubs,
                    const Config &config);
+
 Config parse_options(int argc, char *argv[]);
 
 }  // namespace utils
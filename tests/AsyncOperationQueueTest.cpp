@@ -0,0 +1,48 @@
+#include <gtest/gtest.h>
+
+#include "../src/AsyncOperationQueue.h"
+
+TEST(AsyncOperationQueue, SpillWhenFull) {
+    Config config;
+    config.queue_size = 2;
+    config.n_blocks = 128;
+    config.overflow_policy = OverflowPolicy::SPILL;
+    AsyncOperationQueue queue(config);
+
+    queue.push(std::make_shared<WriteOperation>(0, 0));
+    queue.push(std::make_shared<WriteOperation>(1, 1));
+    // the queue is full, these must not block
+    queue.push(std::make_shared<WriteOperation>(10, 12));
+    queue.push(std::make_shared<WriteOperation>(13, 13));
+    queue.push(std::make_shared<WriteOperation>(20, 20));
+    ASSERT_EQ(queue.spilled_blocks(), 5);
+
+    ASSERT_EQ(queue.pop().value()->block_no_start, 0);
+    ASSERT_EQ(queue.pop().value()->block_no_start, 1);
+
+    // adjacent spilled blocks are merged into one operation
+    auto op = queue.pop().value();
+    ASSERT_EQ(op->block_no_start, 10);
+    ASSERT_EQ(op->block_no_end, 13);
+    op = queue.pop().value();
+    ASSERT_EQ(op->block_no_start, 20);
+    ASSERT_EQ(op->block_no_end, 20);
+    ASSERT_EQ(queue.spilled_blocks(), 0);
+}
+
+TEST(BlockBitmap, PopRangeWraps) {
+    BlockBitmap bitmap(200);
+    bitmap.set_range(190, 199);
+    bitmap.set(3);
+    auto range = bitmap.pop_range(4);
+    ASSERT_EQ(range->first, 3);
+    ASSERT_EQ(range->second, 3);
+    range = bitmap.pop_range(4);
+    ASSERT_EQ(range->first, 190);
+    ASSERT_EQ(range->second, 193);
+    range = bitmap.pop_range(100);
+    ASSERT_EQ(range->first, 194);
+    ASSERT_EQ(range->second, 199);
+    ASSERT_FALSE(bitmap.pop_range(100).has_value());
+    ASSERT_EQ(bitmap.count(), 0);
+}
@@ -0,0 +1,103 @@
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "../src/BandwidthScheduler.h"
+
+// A rate starts without a burst when it is set, so the time a limited class
+// takes has an exact lower bound. Waits the tests expect to be cut short are
+// long enough that a slow machine still tells the two apart.
+namespace {
+constexpr uint64_t KB = 1024;
+typedef std::chrono::steady_clock Clock;
+}  // namespace
+
+// a class is held to its rate, other classes and the unlimited default are
+// not
+TEST(BandwidthScheduler, LimitsRate) {
+    Config config;
+    BandwidthScheduler scheduler(config);
+    auto start = Clock::now();
+    scheduler.set_rate(BULK, 100 * KB);
+    for (int i = 0; i < 4; i++) {
+        scheduler.acquire(BULK, 50 * KB);
+    }
+    // the first request goes into debt, the other three wait it off
+    ASSERT_GE(Clock::now() - start, std::chrono::milliseconds(1500));
+
+    // 100 MB at the bulk rate would take over 15 minutes
+    start = Clock::now();
+    for (int i = 0; i < 100; i++) {
+        scheduler.acquire(LIVE, 1024 * KB);
+    }
+    ASSERT_LT(Clock::now() - start, std::chrono::seconds(30));
+
+    // lifting the limit releases a waiter that owes 10 minutes
+    scheduler.acquire(BULK, 60 * 1024 * KB);
+    start = Clock::now();
+    std::thread waiter([&] { scheduler.acquire(BULK, 1); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    scheduler.set_rate(BULK, 0);
+    waiter.join();
+    ASSERT_LT(Clock::now() - start, std::chrono::seconds(60));
+}
+
+// when both wait for the shared link, live traffic goes before bulk traffic
+// that was waiting longer
+TEST(BandwidthScheduler, PrioritizesLive) {
+    Config config;
+    BandwidthScheduler scheduler(config);
+    scheduler.set_link_rate(1024 * KB);
+    scheduler.acquire(BULK, 1024 * KB);  // the link is in debt for a second
+
+    std::mutex lock;
+    std::vector<TrafficClass> order;
+    auto send = [&](TrafficClass traffic) {
+        scheduler.acquire(traffic, 100 * KB);
+        std::lock_guard guard(lock);
+        order.push_back(traffic);
+    };
+    std::thread bulk(send, BULK);
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::thread live(send, LIVE);
+    bulk.join();
+    live.join();
+    ASSERT_EQ(order, (std::vector<TrafficClass>{LIVE, BULK}));
+}
+
+TEST(BandwidthScheduler, LoadsRates) {
+    const auto path =
+        (std::filesystem::temp_directory_path() / "BandwidthSchedulerTest")
+            .string();
+    Config config;
+    BandwidthScheduler scheduler(config);
+    std::filesystem::remove(path);
+    ASSERT_FALSE(scheduler.load_rates(path));
+
+    std::ofstream(path) << "bulk=1\nlive=x\nother=2\n";
+    const auto start = Clock::now();
+    ASSERT_TRUE(scheduler.load_rates(path));
+    // bulk is limited to 1 MB/s, the bad lines are skipped
+    scheduler.acquire(BULK, 1024 * KB);
+    scheduler.acquire(BULK, 1);
+    ASSERT_GE(Clock::now() - start, std::chrono::seconds(1));
+
+    // the watcher picks up a changed file and releases a waiter that owes
+    // 10 minutes
+    scheduler.acquire(BULK, 600 * 1024 * KB);
+    RateFileWatcher watcher(scheduler, path);
+    std::thread waiter([&] { scheduler.acquire(BULK, 1); });
+    std::ofstream(path) << "bulk=0\n";
+    std::filesystem::last_write_time(
+        path, std::filesystem::last_write_time(path) + std::chrono::seconds(1));
+    const auto changed = Clock::now();
+    waiter.join();
+    ASSERT_LT(Clock::now() - changed, std::chrono::seconds(60));
+    watcher.stop();
+    std::filesystem::remove(path);
+}
@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
 
+#include <openssl/evp.h>
+
 #include "../src/EncryptionManager.h"
 
 void print_vector(const std::array<uint8_t, BLOCK_SIZE>& vec) {
@@ -32,4 +34,170 @@ TEST(EncryptionManager, EncryptDecrypt) {
     decrypted_block = emgr.decrypt_block(encrypted_block, 1);
     print_vector(decrypted_block);
     ASSERT_EQ(block, decrypted_block);
-}
\ No newline at end of file
+}
+
+// The ciphertext the original one EVP call per block implementation produced
+std::array<uint8_t, BLOCK_SIZE> reference_encrypt(
+    const std::array<uint8_t, KEY_SIZE>& key,
+    const std::array<uint8_t, USER_IV_SIZE>& user_iv,
+    const std::array<uint8_t, BLOCK_SIZE>& block, uint64_t block_no) {
+    auto augmented_block_no = block_no * BLOCK_SIZE / 16;
+    std::vector<uint8_t> iv(user_iv.begin(), user_iv.end());
+    for (size_t i = 0; i < sizeof(augmented_block_no); i++) {
+        iv.push_back(augmented_block_no >> (i * 8) & 0xFF);
+    }
+    std::reverse(iv.end() - sizeof(augmented_block_no), iv.end());
+
+    std::array<uint8_t, BLOCK_SIZE> encrypted_block{};
+    auto ctx = EVP_CIPHER_CTX_new();
+    int out_len;
+    EVP_EncryptInit(ctx, EVP_aes_256_ctr(), key.data(), iv.data());
+    EVP_EncryptUpdate(ctx, encrypted_block.data(), &out_len, block.data(),
+                      (int)block.size());
+    EVP_CIPHER_CTX_free(ctx);
+    return encrypted_block;
+}
+
+TEST(EncryptionManager, KernelsMatchReference) {
+    std::array<uint8_t, KEY_SIZE> key{};
+    for (size_t i = 0; i < KEY_SIZE; i++) {
+        key[i] = i * 7 + 3;
+    }
+    std::array<uint8_t, USER_IV_SIZE> iv = {0x00, 0x01, 0x02, 0x03,
+                                            0x04, 0x05, 0x06, 0x07};
+    std::vector<uint64_t> block_nos = {0, 1, 2, 255, 256, 1ULL << 40};
+    std::vector<std::array<uint8_t, BLOCK_SIZE>> blocks(block_nos.size());
+    for (size_t b = 0; b < blocks.size(); b++) {
+        for (size_t i = 0; i < BLOCK_SIZE; i++) {
+            blocks[b][i] = (i * 31 + b) & 0xFF;
+        }
+    }
+
+    for (auto impl : {AesCtrKernel::PORTABLE, AesCtrKernel::AESNI,
+                      AesCtrKernel::VAES}) {
+        if (!AesCtrKernel::supported(impl)) {
+            continue;
+        }
+        EncryptionManager emgr(key, iv, impl);
+        auto batch = blocks;
+        emgr.crypt_blocks(batch, block_nos);
+        for (size_t b = 0; b < blocks.size(); b++) {
+            ASSERT_EQ(batch[b],
+                      reference_encrypt(key, iv, blocks[b], block_nos[b]))
+                << AesCtrKernel::name(impl) << " block " << block_nos[b];
+            ASSERT_EQ(emgr.encrypt_block(blocks[b], block_nos[b]), batch[b]);
+        }
+        emgr.crypt_blocks(batch, block_nos);
+        ASSERT_EQ(batch, blocks);
+    }
+}
+
+// RFC 8439 section 2.4.2, its 96 bit nonce 0:0:0x4a is our 64 bit nonce with
+// the top counter word zero
+TEST(ChaCha20, RfcVector) {
+    std::array<uint8_t, KEY_SIZE> key{};
+    for (size_t i = 0; i < KEY_SIZE; i++) {
+        key[i] = i;
+    }
+    const std::array<uint8_t, USER_IV_SIZE> nonce = {0, 0, 0, 0x4a,
+                                                     0, 0, 0, 0};
+    const std::string text =
+        "Ladies and Gentlemen of the class of '99: If I could offer you only "
+        "one tip for the future, sunscreen would be it.";
+    std::vector<uint8_t> out(text.size());
+    chacha20_xor(key, nonce, 1, reinterpret_cast<const uint8_t*>(text.data()),
+                 out.data(), text.size());
+
+    const std::vector<uint8_t> head = {0x6e, 0x2e, 0x35, 0x9a, 0x25, 0x68,
+                                       0xf9, 0x80, 0x41, 0xba, 0x07, 0x28};
+    const std::vector<uint8_t> tail = {0xf2, 0x78, 0x5e, 0x42, 0x87, 0x4d};
+    ASSERT_EQ(std::vector(out.begin(), out.begin() + head.size()), head);
+    ASSERT_EQ(std::vector(out.end() - tail.size(), out.end()), tail);
+}
+
+TEST(EncryptionManager, ChaCha20MatchesOpenSSL) {
+    std::array<uint8_t, KEY_SIZE> key{};
+    for (size_t i = 0; i < KEY_SIZE; i++) {
+        key[i] = i * 7;
+    }
+    const std::array<uint8_t, USER_IV_SIZE> iv = {1, 2, 3, 4, 5, 6, 7, 8};
+    EncryptionManager emgr(key, iv, CipherType::CHACHA20);
+    ASSERT_EQ(emgr.cipher_type(), CipherType::CHACHA20);
+
+    std::array<uint8_t, BLOCK_SIZE> block{};
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        block[i] = i % 251;
+    }
+    for (const uint64_t block_no : {0ULL, 1ULL, 255ULL, 1ULL << 40}) {
+        // EVP_chacha20 takes le64(counter) || nonce as its iv
+        std::array<uint8_t, 16> evp_iv{};
+        const uint64_t counter = block_no * BLOCK_SIZE / 64;
+        for (int i = 0; i < 8; i++) {
+            evp_iv[i] = counter >> (8 * i);
+        }
+        std::copy(iv.begin(), iv.end(), evp_iv.begin() + 8);
+        std::array<uint8_t, BLOCK_SIZE> expected{};
+        int len;
+        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(ctx, EVP_chacha20(), nullptr, key.data(),
+                           evp_iv.data());
+        EVP_EncryptUpdate(ctx, expected.data(), &len, block.data(),
+                          BLOCK_SIZE);
+        EVP_CIPHER_CTX_free(ctx);
+
+        const auto encrypted = emgr.encrypt_block(block, block_no);
+        ASSERT_EQ(encrypted, expected) << "block " << block_no;
+        ASSERT_EQ(emgr.decrypt_block(encrypted, block_no), block);
+    }
+}
+
+// an extent is encrypted exactly like its blocks, so the backup image does
+// not depend on the extent size, and a range of it like the blocks it covers
+TEST(EncryptionManager, ExtentsMatchBlocks) {
+    std::array<uint8_t, KEY_SIZE> key = {0x42};
+    std::array<uint8_t, USER_IV_SIZE> iv = {0x01, 0x02, 0x03, 0x04,
+                                            0x05, 0x06, 0x07, 0x08};
+    constexpr uint64_t EXTENT = 64 * 1024;
+    constexpr auto blocks = EXTENT / BLOCK_SIZE;
+    std::vector<EncryptionManager> emgrs = {
+        EncryptionManager(key, iv, AesCtrKernel::PORTABLE),
+        EncryptionManager(key, iv, AesCtrKernel::detect()),
+        EncryptionManager(key, iv, CipherType::CHACHA20)};
+    for (auto& emgr : emgrs) {
+        std::vector<std::array<uint8_t, EXTENT>> extents(2);
+        for (size_t i = 0; i < EXTENT; i++) {
+            extents[0][i] = i % 253;
+            extents[1][i] = i % 241;
+        }
+        const std::vector<uint64_t> extent_nos = {3, 7};
+        auto range = extents[1];
+        emgr.crypt_range(range, extent_nos[1], BLOCK_SIZE + 100, 1000);
+
+        std::vector<std::array<uint8_t, BLOCK_SIZE>> expected;
+        std::vector<uint64_t> block_nos;
+        for (size_t e = 0; e < extents.size(); e++) {
+            for (size_t b = 0; b < blocks; b++) {
+                expected.emplace_back();
+                std::copy_n(extents[e].begin() + b * BLOCK_SIZE, BLOCK_SIZE,
+                            expected.back().begin());
+                block_nos.push_back(extent_nos[e] * blocks + b);
+            }
+        }
+        emgr.crypt_blocks(expected, block_nos);
+        emgr.crypt_extents(extents, extent_nos);
+
+        for (size_t e = 0; e < extents.size(); e++) {
+            for (size_t b = 0; b < blocks; b++) {
+                ASSERT_TRUE(std::equal(expected[e * blocks + b].begin(),
+                                       expected[e * blocks + b].end(),
+                                       extents[e].begin() + b * BLOCK_SIZE))
+                    << emgr.kernel_name() << " extent " << e << " block "
+                    << b;
+            }
+        }
+        for (size_t i = 0; i < EXTENT; i++) {
+            ASSERT_EQ(range[i], i / BLOCK_SIZE == 1 ? extents[1][i] : i % 241)
+                << emgr.kernel_name() << " byte " << i;
+        }
+    }
+}
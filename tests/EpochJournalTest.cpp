@@ -0,0 +1,130 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <map>
+#include <vector>
+
+#include "../src/EpochJournal.h"
+
+// an epoch reaches the image once every stream committed it, with the latest
+// write of each extent only, and a crash while applying it is redone
+TEST(EpochJournal, AppliesCompleteEpochs) {
+    const auto dir =
+        (std::filesystem::temp_directory_path() / "EpochJournalTest").string();
+    std::filesystem::remove_all(dir);
+    const uint64_t extent_size = 4096;
+    std::map<uint64_t, char> image;
+    int writes = 0;
+    bool failing = false;
+    auto write = [&](uint64_t extent_no, const char *data, uint32_t,
+                     uint32_t) {
+        if (failing) {
+            return false;
+        }
+        image[extent_no] = data[0];
+        writes++;
+        return true;
+    };
+    auto sync = [] { return true; };
+    std::vector<char> buf(extent_size);
+    auto data = [&](char value) {
+        std::fill(buf.begin(), buf.end(), value);
+        return buf.data();
+    };
+
+    {
+        EpochJournal journal(dir, write, sync, 8 * extent_size);
+        ASSERT_TRUE(journal.open(extent_size));
+        const auto a = journal.begin();
+        const auto b = journal.begin();
+        ASSERT_TRUE(journal.stage(a, 0, 0, data(1)));
+        ASSERT_TRUE(journal.stage(a, 0, 0, data(2)));
+        ASSERT_TRUE(journal.commit(a, 0, 2, 10));
+        ASSERT_TRUE(image.empty());
+        ASSERT_TRUE(journal.stage(b, 1, 1, data(3)));
+        ASSERT_TRUE(journal.commit(b, 1, 2, 10));
+        ASSERT_EQ(journal.wait(0, std::chrono::milliseconds(10)), 10);
+        ASSERT_EQ(image[0], 2);
+        ASSERT_EQ(image[1], 3);
+        ASSERT_EQ(writes, 2);
+
+        // stream 1 was catching up and skipped epoch 11
+        ASSERT_TRUE(journal.stage(a, 0, 0, data(4)));
+        ASSERT_TRUE(journal.commit(a, 0, 2, 11));
+        ASSERT_TRUE(journal.stage(b, 1, 1, data(5)));
+        ASSERT_TRUE(journal.commit(b, 1, 2, 12));
+        ASSERT_EQ(image[0], 2);
+        ASSERT_TRUE(journal.commit(a, 0, 2, 12));
+        ASSERT_EQ(image[0], 4);
+        ASSERT_EQ(image[1], 5);
+
+        // a reconnected stream drops what the old session did not apply
+        ASSERT_TRUE(journal.stage(a, 0, 0, data(6)));
+        ASSERT_TRUE(journal.commit(a, 0, 2, 13));
+        const auto c = journal.begin();
+        ASSERT_TRUE(journal.commit(c, 0, 2, 14));
+        ASSERT_FALSE(journal.stage(a, 0, 0, data(7)));
+        ASSERT_TRUE(journal.commit(b, 1, 2, 14));
+        ASSERT_EQ(image[0], 4);
+        ASSERT_EQ(journal.n_segments(), 1);
+
+        // crash while applying epoch 20, epoch 21 is not complete
+        ASSERT_TRUE(journal.stage(c, 0, 0, data(8)));
+        ASSERT_TRUE(journal.commit(c, 0, 2, 20));
+        for (uint64_t i = 2; i < 12; i++) {
+            ASSERT_TRUE(journal.stage(b, 1, i, data(9)));
+        }
+        failing = true;
+        ASSERT_FALSE(journal.commit(b, 1, 2, 20));
+        ASSERT_TRUE(journal.stage(c, 0, 0, data(10)));
+        ASSERT_FALSE(journal.commit(c, 0, 2, 21));
+        ASSERT_GT(journal.n_segments(), 1);
+    }
+
+    failing = false;
+    EpochJournal journal(dir, write, sync, 8 * extent_size);
+    ASSERT_TRUE(journal.open(extent_size));
+    ASSERT_EQ(image[0], 8);
+    ASSERT_EQ(image[11], 9);
+    ASSERT_EQ(journal.n_segments(), 1);
+    std::filesystem::remove_all(dir);
+}
+
+// partial writes are merged into the latest whole write of their extent, or
+// patched into the image on their own
+TEST(EpochJournal, MergesPartialWrites) {
+    const auto dir = (std::filesystem::temp_directory_path() /
+                      "EpochJournalPartialTest")
+                         .string();
+    std::filesystem::remove_all(dir);
+    const uint64_t extent_size = 4096;
+    std::vector<char> image(2 * extent_size);
+    int writes = 0;
+    auto write = [&](uint64_t extent_no, const char *data, uint32_t offset,
+                     uint32_t length) {
+        std::copy_n(data, length,
+                    image.begin() + extent_no * extent_size + offset);
+        writes++;
+        return true;
+    };
+    EpochJournal journal(dir, write, [] { return true; });
+    ASSERT_TRUE(journal.open(extent_size));
+    const auto a = journal.begin();
+    const std::vector<char> whole(extent_size, 1);
+    const std::vector<char> part(100, 2);
+    ASSERT_TRUE(journal.stage(a, 0, 0, whole.data()));
+    ASSERT_TRUE(journal.stage(a, 0, 0, part.data(), 10, part.size()));
+    ASSERT_TRUE(journal.stage(a, 0, 1, part.data(), 3996, part.size()));
+    ASSERT_FALSE(journal.stage(a, 0, 1, part.data(), 4000, part.size()));
+    ASSERT_TRUE(journal.commit(a, 0, 1, 1));
+    ASSERT_EQ(writes, 2);
+    ASSERT_EQ(image[9], 1);
+    ASSERT_EQ(image[10], 2);
+    ASSERT_EQ(image[109], 2);
+    ASSERT_EQ(image[110], 1);
+    ASSERT_EQ(image[extent_size + 3995], 0);
+    ASSERT_EQ(image[extent_size + 3996], 2);
+    ASSERT_EQ(image[2 * extent_size - 1], 2);
+    std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,84 @@
+#include <gtest/gtest.h>
+
+#include <random>
+
+#include "../src/ErasureCode.h"
+
+namespace {
+std::vector<std::vector<uint8_t>> random_shards(int n, size_t len) {
+    std::mt19937 rng(42);
+    std::vector<std::vector<uint8_t>> shards(n, std::vector<uint8_t>(len));
+    for (auto &shard : shards) {
+        for (auto &b : shard) {
+            b = static_cast<uint8_t>(rng());
+        }
+    }
+    return shards;
+}
+
+std::vector<uint8_t *> pointers(std::vector<std::vector<uint8_t>> &shards) {
+    std::vector<uint8_t *> ptrs;
+    for (auto &shard : shards) {
+        ptrs.push_back(shard.data());
+    }
+    return ptrs;
+}
+}  // namespace
+
+// every implementation computes the same parity, and any 4 of 4 + 2 shards
+// give back the data
+TEST(ErasureCode, DecodeAnyK) {
+    constexpr int K = 4, M = 2;
+    constexpr size_t LEN = 4096 + 7;  // covers the scalar tail
+    auto data = random_shards(K, LEN);
+    const auto data_ptrs = pointers(data);
+
+    ErasureCode portable(K, M, ErasureCode::PORTABLE);
+    std::vector<std::vector<uint8_t>> expected(M, std::vector<uint8_t>(LEN));
+    portable.encode(data_ptrs.data(), pointers(expected).data(), LEN);
+
+    for (const auto impl :
+         {ErasureCode::PORTABLE, ErasureCode::SSSE3, ErasureCode::AVX2}) {
+        if (!ErasureCode::supported(impl)) {
+            continue;
+        }
+        ErasureCode code(K, M, impl);
+        std::vector<std::vector<uint8_t>> parity(M,
+                                                 std::vector<uint8_t>(LEN));
+        code.encode(data_ptrs.data(), pointers(parity).data(), LEN);
+        ASSERT_EQ(parity, expected) << ErasureCode::name(impl);
+
+        std::vector<const uint8_t *> all;
+        for (auto &shard : data) all.push_back(shard.data());
+        for (auto &shard : parity) all.push_back(shard.data());
+
+        // drop every pair of shards
+        for (int a = 0; a < K + M; a++) {
+            for (int b = a + 1; b < K + M; b++) {
+                std::vector<int> ids;
+                std::vector<const uint8_t *> shards;
+                for (int i = 0; i < K + M; i++) {
+                    if (i != a && i != b) {
+                        ids.push_back(i);
+                        shards.push_back(all[i]);
+                    }
+                }
+                std::vector<std::vector<uint8_t>> decoded(
+                    K, std::vector<uint8_t>(LEN));
+                ASSERT_TRUE(code.decode(ids, shards.data(),
+                                        pointers(decoded).data(), LEN));
+                ASSERT_EQ(decoded, data) << ErasureCode::name(impl) << " "
+                                         << a << " " << b;
+            }
+        }
+
+        // the same shard twice is not enough
+        const std::vector<int> ids = {0, 0, 1, 2};
+        const std::vector<const uint8_t *> shards = {all[0], all[0], all[1],
+                                                     all[2]};
+        std::vector<std::vector<uint8_t>> decoded(K,
+                                                  std::vector<uint8_t>(LEN));
+        ASSERT_FALSE(code.decode(ids, shards.data(), pointers(decoded).data(),
+                                 LEN));
+    }
+}
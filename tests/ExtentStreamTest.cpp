@@ -0,0 +1,110 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/ErasureCode.h"
+#include "../src/ExtentStream.h"
+#include "../src/ShmTransport.h"
+
+namespace {
+// serves one shard of every extent, as of the snapshot epoch it is set to
+struct ShardServer {
+    ShmServer server;
+    std::thread runner;
+    std::string shard;
+    std::atomic<uint64_t> epoch{0};
+
+    explicit ShardServer(const std::string &path) : server(path) {
+        server.bidi_stream<ReadBlockResponse, ReadBlockRequest>(
+            ShmMethod::READ_BLOCK, [this](auto stream) {
+                ReadBlockRequest request;
+                while (stream->Read(&request)) {
+                    ReadBlockResponse response;
+                    response.set_success(true);
+                    response.set_data(shard);
+                    if (!request.snapshot().empty()) {
+                        response.set_epoch(epoch.load());
+                    }
+                    stream->Write(response);
+                }
+                return grpc::Status::OK;
+            });
+        runner = std::thread([this] { server.run(); });
+    }
+
+    ~ShardServer() {
+        server.stop();
+        runner.join();
+    }
+};
+}  // namespace
+
+// shards of a snapshot are only decoded together if their servers took it at
+// the same epoch, a shard of another epoch or of none is passed over for the
+// next server
+TEST(ExtentReader, MatchesSnapshotEpochs) {
+    const auto dir =
+        std::filesystem::temp_directory_path() / "ExtentStreamTest";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    Config config;
+    config.extent_size = BLOCK_SIZE;
+    config.data_shards = 2;
+    config.parity_shards = 1;
+    const size_t shard_size = BLOCK_SIZE / 2;
+
+    std::vector<uint8_t> extent(BLOCK_SIZE);
+    std::mt19937 rng(1);
+    std::generate(extent.begin(), extent.end(), rng);
+    std::vector<uint8_t> parity(shard_size);
+    const ErasureCode code(2, 1);
+    const uint8_t *data[] = {extent.data(), extent.data() + shard_size};
+    uint8_t *out[] = {parity.data()};
+    code.encode(data, out, shard_size);
+
+    std::vector<std::unique_ptr<ShardServer>> servers;
+    std::vector<std::unique_ptr<Transport>> stubs;
+    for (int i = 0; i < 3; i++) {
+        const auto path = (dir / std::to_string(i)).string();
+        servers.push_back(std::make_unique<ShardServer>(path));
+        const auto *shard = i < 2 ? data[i] : parity.data();
+        servers[i]->shard.assign(reinterpret_cast<const char *>(shard),
+                                 shard_size);
+        stubs.push_back(Transport::connect("shm://" + path));
+    }
+    // a shard of the same snapshot name with other content
+    const auto stale = [&](int i, uint64_t epoch) {
+        servers[i]->epoch = epoch;
+        std::ranges::for_each(servers[i]->shard, [](char &c) { c ^= 1; });
+    };
+    const auto read = [&](const std::string &snapshot) {
+        ExtentReader reader(stubs, config);
+        std::vector<uint8_t> buf(BLOCK_SIZE);
+        return reader.read(0, snapshot, buf.data(), nullptr, LIVE) &&
+               buf == extent;
+    };
+
+    // the latest image has no epoch
+    ASSERT_TRUE(read(""));
+    for (auto &server : servers) {
+        server->epoch = 5;
+    }
+    ASSERT_TRUE(read("s"));
+    stale(1, 6);
+    ASSERT_TRUE(read("s"));
+    servers[0]->epoch = 0;
+    ASSERT_FALSE(read("s"));
+    servers[0]->epoch = 7;
+    ASSERT_FALSE(read("s"));
+
+    stubs.clear();
+    servers.clear();
+    std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,57 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <vector>
+
+#include "../src/FingerprintCache.h"
+
+namespace {
+uint64_t hash(const char *data, uint64_t seed = 0) {
+    return xxhash64(reinterpret_cast<const uint8_t *>(data), strlen(data),
+                    seed);
+}
+}  // namespace
+
+// the reference xxHash64 results, the last input goes through the 32 byte
+// stripes and every tail
+TEST(FingerprintCache, XxHash64Vectors) {
+    ASSERT_EQ(hash(""), 0xEF46DB3751D8E999ULL);
+    ASSERT_EQ(hash("", 2654435761U), 0xAC75FDA2929B17EFULL);
+    ASSERT_EQ(hash("a"), 0xD24EC4F1A98C6E5BULL);
+    ASSERT_EQ(hash("abc"), 0x44BC2CF5AD770999ULL);
+    ASSERT_EQ(hash("Nobody inspects the spammish repetition"),
+              0xFBCEA83C8A378BF1ULL);
+}
+
+// the fast mode only compares the hash, the confirm mode also the digest
+TEST(FingerprintCache, MatchesStoredContent) {
+    std::vector<uint8_t> extent(4096, 'a');
+    for (const auto mode : {FingerprintMode::FAST, FingerprintMode::CONFIRM}) {
+        FingerprintCache cache(mode, 4);
+        const auto fp = cache.compute(extent.data(), extent.size());
+        ASSERT_NE(fp.hash, 0);
+        ASSERT_FALSE(cache.matches(0, fp));
+
+        cache.store(0, fp);
+        ASSERT_TRUE(cache.matches(0, fp));
+        ASSERT_FALSE(cache.matches(1, fp));
+        ASSERT_FALSE(cache.matches(4, fp));
+        cache.store(4, fp);  // out of range is ignored
+
+        extent[100] = 'b';
+        const auto changed = cache.compute(extent.data(), extent.size());
+        extent[100] = 'a';
+        ASSERT_FALSE(cache.matches(0, changed));
+
+        // same hash, different content
+        auto collision = fp;
+        collision.digest[0] ^= 1;
+        ASSERT_EQ(cache.matches(0, collision), mode == FingerprintMode::FAST);
+
+        cache.invalidate(0);
+        cache.invalidate(4);
+        ASSERT_FALSE(cache.matches(0, fp));
+        ASSERT_EQ(cache.checked(), 6);
+        ASSERT_EQ(cache.skipped(), mode == FingerprintMode::FAST ? 2 : 1);
+    }
+}
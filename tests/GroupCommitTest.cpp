@@ -0,0 +1,33 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+
+#include "../src/GroupCommit.h"
+
+// writes that arrive together share a sync, and a ticket is only durable
+// once a sync after it completed
+TEST(GroupCommit, BatchesSyncs) {
+    std::atomic<int> syncs{0};
+    GroupCommit commit(
+        [&] {
+            syncs++;
+            return true;
+        },
+        std::chrono::milliseconds(50), 1024);
+
+    ASSERT_EQ(commit.wait(0, std::chrono::milliseconds(10)), 0);
+    const auto first = commit.wrote(100);
+    const auto last = commit.wrote(100);
+    ASSERT_EQ(commit.wait(0, std::chrono::milliseconds(5)), 0);
+    ASSERT_EQ(commit.wait(0, std::chrono::seconds(5)), last);
+    ASSERT_GT(last, first);
+    ASSERT_EQ(syncs.load(), 1);
+
+    // reaching sync_bytes syncs without waiting for the interval
+    const auto big = commit.wrote(4096);
+    const auto start = std::chrono::steady_clock::now();
+    ASSERT_EQ(commit.wait(last, std::chrono::seconds(5)), big);
+    ASSERT_LT(std::chrono::steady_clock::now() - start,
+              std::chrono::milliseconds(40));
+    ASSERT_EQ(syncs.load(), 2);
+}
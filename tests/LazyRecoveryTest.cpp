@@ -0,0 +1,124 @@
+#include <gtest/gtest.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <filesystem>
+#include <future>
+#include <mutex>
+#include <numeric>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "../src/LazyRecovery.h"
+#include "../src/ShmTransport.h"
+
+// a write whose partial extent cannot be fetched holds none of the extents
+// it covers whole, so reading them later fetches them. Once the write goes
+// through, the extents it covered whole are never fetched
+TEST(LazyRecovery, ReleasesExtentsOfFailedWrite) {
+    const auto dir =
+        std::filesystem::temp_directory_path() / "LazyRecoveryTest";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    const uint64_t n_extents = 8;
+    Config config;
+    config.mode = Mode::RECOVER_LOCAL;
+    config.lazy = true;
+    config.file = (dir / "img").string();
+    config.extent_size = BLOCK_SIZE;
+    config.size = n_extents * BLOCK_SIZE;
+    config.backup_servers = {"shm://" + (dir / "backup").string()};
+
+    std::vector<std::array<uint8_t, BLOCK_SIZE>> image(n_extents);
+    for (uint64_t i = 0; i < n_extents; i++) {
+        image[i].fill(static_cast<uint8_t>('a' + i));
+    }
+    EncryptionManager emgr("password");
+    auto encrypted = image;
+    std::vector<uint64_t> extent_nos(n_extents);
+    std::iota(extent_nos.begin(), extent_nos.end(), 0);
+    emgr.crypt_extents(encrypted, extent_nos);
+
+    // the backup, failing reads of one extent
+    std::mutex lock;
+    std::multiset<uint64_t> reads;
+    std::atomic<uint64_t> failing{3};
+    ShmServer server((dir / "backup").string());
+    server.bidi_stream<ReadBlockResponse, ReadBlockRequest>(
+        ShmMethod::READ_BLOCK, [&](auto stream) {
+            ReadBlockRequest request;
+            while (stream->Read(&request)) {
+                const auto extent_no = request.block_no();
+                ReadBlockResponse response;
+                response.set_success(extent_no != failing.load());
+                if (response.success()) {
+                    std::lock_guard guard(lock);
+                    reads.insert(extent_no);
+                    response.set_data(encrypted[extent_no].data(),
+                                      BLOCK_SIZE);
+                }
+                stream->Write(response);
+            }
+            return grpc::Status::OK;
+        });
+    std::thread runner([&server] { server.run(); });
+    std::vector<std::unique_ptr<Transport>> stubs;
+    stubs.push_back(Transport::connect(config.backup_servers[0]));
+
+    const int fd = open(config.file.c_str(), O_RDWR | O_CREAT, 0666);
+    ASSERT_EQ(ftruncate(fd, static_cast<off_t>(config.size)), 0);
+    const auto recovery =
+        LazyRecovery::create(dup(fd), emgr, stubs, config, nullptr, nullptr);
+    ASSERT_NE(recovery, nullptr);
+    auto &lazy = *recovery;
+    const auto extent = [&](uint64_t extent_no) {
+        std::array<uint8_t, BLOCK_SIZE> data{};
+        EXPECT_EQ(pread(fd, data.data(), BLOCK_SIZE,
+                        static_cast<off_t>(extent_no * BLOCK_SIZE)),
+                  BLOCK_SIZE);
+        return data;
+    };
+
+    // extents 0 and 3 partly, 1 and 2 whole
+    const uint64_t offset = BLOCK_SIZE / 2;
+    const uint64_t len = 3 * BLOCK_SIZE;
+    ASSERT_FALSE(lazy.ensure(offset, len, true));
+    auto read = std::async(std::launch::async,
+                           [&] { return lazy.ensure(BLOCK_SIZE, BLOCK_SIZE); });
+    const auto status = read.wait_for(std::chrono::seconds(5));
+    if (status != std::future_status::ready) {
+        lazy.wrote(offset, len, false);  // let it finish
+    }
+    ASSERT_EQ(status, std::future_status::ready);
+    ASSERT_TRUE(read.get());
+    ASSERT_EQ(extent(0), image[0]);
+    ASSERT_EQ(extent(1), image[1]);
+
+    failing = n_extents;
+    ASSERT_TRUE(lazy.ensure(offset, len, true));
+    ASSERT_EQ(extent(3), image[3]);
+    const std::vector<uint8_t> data(len, 'x');
+    ASSERT_EQ(pwrite(fd, data.data(), len, offset),
+              static_cast<ssize_t>(len));
+    lazy.wrote(offset, len, true);
+    ASSERT_TRUE(lazy.ensure(0, config.size));
+    ASSERT_EQ(reads.count(2), 0);
+    ASSERT_EQ(reads.size(), n_extents - 1);
+    ASSERT_EQ(extent(2)[0], 'x');
+    ASSERT_EQ(extent(3)[BLOCK_SIZE / 2], image[3][0]);
+
+    // progress that cannot be saved fails the start
+    auto unsaved = config;
+    unsaved.file = (dir / "missing" / "img").string();
+    ASSERT_EQ(LazyRecovery::create(dup(fd), emgr, stubs, unsaved, nullptr,
+                                   nullptr),
+              nullptr);
+
+    close(fd);
+    server.stop();
+    runner.join();
+    std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,103 @@
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/LogImage.h"
+
+// overwritten extents read back their latest data after a reopen, and
+// compaction frees the segments they were overwritten in
+TEST(LogImage, ReplaysAndCompacts) {
+    const auto dir =
+        (std::filesystem::temp_directory_path() / "LogImageTest").string();
+    std::filesystem::remove_all(dir);
+    const uint64_t extent_size = 4096;
+    const uint64_t n_extents = 64;
+    std::vector<char> buf(extent_size);
+    auto fill = [&](uint64_t extent_no, int round) {
+        std::fill(buf.begin(), buf.end(),
+                  static_cast<char>(extent_no * 7 + round));
+    };
+
+    {
+        LogImage image(dir, 10 * (extent_size + 64));
+        ASSERT_FALSE(image.open(extent_size));
+        ASSERT_TRUE(image.setup(n_extents * extent_size, extent_size));
+        for (int round = 0; round < 4; round++) {
+            for (uint64_t i = 0; i < n_extents / 2; i++) {
+                fill(i, round);
+                ASSERT_TRUE(image.write(i, buf.data()));
+            }
+        }
+        ASSERT_TRUE(image.sync());
+        ASSERT_FALSE(image.write(n_extents, buf.data()));
+    }
+
+    LogImage image(dir, 10 * (extent_size + 64));
+    ASSERT_TRUE(image.open(extent_size));
+    ASSERT_EQ(image.size(), n_extents * extent_size);
+    std::vector<char> expected(extent_size);
+    for (uint64_t i = 0; i < n_extents; i++) {
+        ASSERT_TRUE(image.read(i, buf.data()));
+        std::fill(expected.begin(), expected.end(),
+                  i < n_extents / 2 ? static_cast<char>(i * 7 + 3) : 0);
+        ASSERT_EQ(buf, expected) << "extent " << i;
+    }
+
+    const auto before = image.n_segments();
+    image.compact();
+    ASSERT_LT(image.n_segments(), before);
+    for (uint64_t i = 0; i < n_extents / 2; i++) {
+        ASSERT_TRUE(image.read(i, buf.data()));
+        ASSERT_EQ(buf[0], static_cast<char>(i * 7 + 3));
+    }
+    std::filesystem::remove_all(dir);
+}
+
+// patches keep the rest of the extent, also while other patches of the same
+// extent run on another thread, and are replayed like writes
+TEST(LogImage, Patches) {
+    const auto dir =
+        (std::filesystem::temp_directory_path() / "LogImagePatchTest")
+            .string();
+    std::filesystem::remove_all(dir);
+    const uint64_t extent_size = 4096;
+    const int rounds = 500;
+    std::vector<char> buf(extent_size);
+    {
+        LogImage image(dir, 64 * (extent_size + 64));
+        ASSERT_TRUE(image.setup(4 * extent_size, extent_size));
+        std::fill(buf.begin(), buf.end(), 1);
+        ASSERT_TRUE(image.write(0, buf.data()));
+        ASSERT_TRUE(image.patch(0, "ab", 10, 2));
+        ASSERT_TRUE(image.patch(1, "cd", 4094, 2));
+        ASSERT_FALSE(image.patch(1, "cd", 4095, 2));
+        ASSERT_FALSE(image.patch(4, "cd", 0, 2));
+
+        auto patcher = [&](uint32_t offset) {
+            for (int i = 1; i <= rounds; i++) {
+                const std::vector<char> part(100, static_cast<char>(i));
+                ASSERT_TRUE(image.patch(2, part.data(), offset, 100));
+            }
+        };
+        std::thread other(patcher, 100);
+        patcher(0);
+        other.join();
+        ASSERT_TRUE(image.sync());
+    }
+
+    LogImage image(dir, 64 * (extent_size + 64));
+    ASSERT_TRUE(image.open(extent_size));
+    ASSERT_TRUE(image.read(0, buf.data()));
+    ASSERT_EQ(std::string(buf.data() + 9, 4), std::string("\1ab\1"));
+    ASSERT_TRUE(image.read(1, buf.data()));
+    ASSERT_EQ(buf[4093], 0);
+    ASSERT_EQ(std::string(buf.data() + 4094, 2), "cd");
+    ASSERT_TRUE(image.read(2, buf.data()));
+    ASSERT_EQ(buf[0], static_cast<char>(rounds));
+    ASSERT_EQ(buf[199], static_cast<char>(rounds));
+    ASSERT_EQ(buf[200], 0);
+    std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,152 @@
+#include <arpa/inet.h>
+#include <gtest/gtest.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/NbdServer.h"
+
+namespace {
+std::vector<char> disk(1 << 20);
+bool disconnected = false;
+
+int disk_read(void *buf, u_int32_t len, u_int64_t offset, void *) {
+    memcpy(buf, &disk[offset], len);
+    return 0;
+}
+
+int disk_write(const void *buf, u_int32_t len, u_int64_t offset, void *) {
+    memcpy(&disk[offset], buf, len);
+    return 0;
+}
+
+int disk_flush(void *) { return htonl(EIO); }
+
+void disk_disc(void *) { disconnected = true; }
+
+template <typename T>
+void put(std::string &out, T value) {
+    for (int i = sizeof(T) - 1; i >= 0; i--) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+template <typename T>
+T get(const std::string &in, size_t at) {
+    T value = 0;
+    for (size_t i = 0; i < sizeof(T); i++) {
+        value = static_cast<T>(value << 8 | static_cast<uint8_t>(in[at + i]));
+    }
+    return value;
+}
+
+std::string recv_n(int fd, size_t n) {
+    std::string buf(n, '\0');
+    for (size_t done = 0; done < n;) {
+        const auto got = recv(fd, &buf[done], n - done, 0);
+        if (got <= 0) {
+            return "";
+        }
+        done += got;
+    }
+    return buf;
+}
+
+std::string request(uint16_t type, uint64_t offset, uint32_t length) {
+    std::string out;
+    put<uint32_t>(out, 0x25609513);
+    put<uint16_t>(out, 0);
+    put<uint16_t>(out, type);
+    put<uint64_t>(out, 42);  // handle
+    put(out, offset);
+    put(out, length);
+    return out;
+}
+}  // namespace
+
+// a client negotiating structured replies with NBD_OPT_GO writes, reads the
+// data back and sees errors of the operations
+TEST(NbdServer, ServesNewstyleClient) {
+    const auto path =
+        (std::filesystem::temp_directory_path() / "NbdServerTest").string();
+    const buse_operations ops = {.read = disk_read,
+                                 .write = disk_write,
+                                 .disc = disk_disc,
+                                 .flush = disk_flush,
+                                 .size = disk.size()};
+    NbdServer server(ops, nullptr);
+    ASSERT_TRUE(server.listen("unix:" + path));
+    std::thread serving([&] { server.serve(); });
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr{.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, path.c_str());
+    ASSERT_EQ(connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof addr),
+              0);
+
+    const auto hello = recv_n(fd, 18);
+    ASSERT_EQ(hello.substr(0, 8), "NBDMAGIC");
+    ASSERT_EQ(hello.substr(8, 8), "IHAVEOPT");
+    std::string options;
+    put<uint32_t>(options, 3);  // fixed newstyle, no zeroes
+    options += "IHAVEOPT";
+    put<uint32_t>(options, 8);  // structured reply
+    put<uint32_t>(options, 0);
+    options += "IHAVEOPT";
+    put<uint32_t>(options, 7);  // go
+    put<uint32_t>(options, 6);
+    put<uint32_t>(options, 0);  // default export
+    put<uint16_t>(options, 0);
+    send(fd, options.data(), options.size(), 0);
+
+    // ack of structured reply, export info, ack of go
+    EXPECT_EQ(get<uint32_t>(recv_n(fd, 20), 12), 1u);
+    const auto info = recv_n(fd, 20 + 12);
+    EXPECT_EQ(get<uint32_t>(info, 12), 3u);
+    EXPECT_EQ(get<uint64_t>(info, 22), disk.size());
+    EXPECT_EQ(get<uint32_t>(recv_n(fd, 20), 12), 1u);
+
+    std::string data(8192, '\0');
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<char>(i * 7);
+    }
+    const auto write = request(1, 4096, data.size()) + data;
+    send(fd, write.data(), write.size(), 0);
+    const auto written = recv_n(fd, 16);
+    EXPECT_EQ(get<uint32_t>(written, 0), 0x67446698u);
+    EXPECT_EQ(get<uint32_t>(written, 4), 0u);
+
+    const auto read = request(0, 4096, data.size());
+    send(fd, read.data(), read.size(), 0);
+    const auto chunk = recv_n(fd, 20);
+    EXPECT_EQ(get<uint32_t>(chunk, 0), 0x668e33efu);
+    EXPECT_EQ(get<uint16_t>(chunk, 6), 1u);  // offset data
+    ASSERT_EQ(get<uint32_t>(chunk, 16), 8 + data.size());
+    EXPECT_EQ(get<uint64_t>(recv_n(fd, 8), 0), 4096u);
+    EXPECT_EQ(recv_n(fd, data.size()), data);
+
+    const auto flush = request(3, 0, 0);
+    send(fd, flush.data(), flush.size(), 0);
+    EXPECT_EQ(get<uint32_t>(recv_n(fd, 16), 4), static_cast<uint32_t>(EIO));
+
+    const auto past_end = request(0, disk.size(), 1);
+    send(fd, past_end.data(), past_end.size(), 0);
+    const auto error = recv_n(fd, 20 + 6);
+    EXPECT_EQ(get<uint16_t>(error, 6), 0x8001u);
+    EXPECT_EQ(get<uint32_t>(error, 20), static_cast<uint32_t>(EINVAL));
+
+    const auto disc = request(2, 0, 0);
+    send(fd, disc.data(), disc.size(), 0);
+    EXPECT_EQ(recv_n(fd, 1), "");
+    close(fd);
+
+    server.stop();
+    serving.join();
+    EXPECT_TRUE(disconnected);
+}
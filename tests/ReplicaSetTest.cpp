@@ -0,0 +1,142 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../src/ReplicaSet.h"
+#include "../src/ShmTransport.h"
+
+namespace {
+// acknowledges every write by seq and keeps the extents it received
+struct TestServer {
+    ShmServer server;
+    std::thread runner;
+    std::mutex lock;
+    std::vector<std::string> extents;
+    int streams = 0;
+    // the first stream fails after this many writes, the last unacknowledged
+    int fail_after = 0;
+    std::atomic<bool> reconnect{true};  // later streams wait for it
+
+    TestServer(const std::string &path, uint64_t n_extents)
+        : server(path), extents(n_extents) {
+        server.bidi_stream<WriteAck, WriteBlockRequest>(
+            ShmMethod::REPLICATE_BLOCKS, [this](auto stream) {
+                int writes = 0;
+                {
+                    std::lock_guard guard(lock);
+                    writes = streams++ == 0 ? fail_after : 0;
+                }
+                while (writes == 0 && !reconnect.load()) {
+                    std::this_thread::sleep_for(
+                        std::chrono::milliseconds(10));
+                }
+                WriteBlockRequest request;
+                while (stream->Read(&request)) {
+                    if (writes > 0 && --writes == 0) {
+                        return grpc::Status(grpc::StatusCode::UNAVAILABLE,
+                                            "");
+                    }
+                    if (!request.data().empty()) {
+                        std::lock_guard guard(lock);
+                        extents[request.block_no()] = request.data();
+                    }
+                    WriteAck ack;
+                    ack.set_success(true);
+                    ack.set_seq(request.seq());
+                    stream->Write(ack);
+                }
+                return grpc::Status::OK;
+            });
+        runner = std::thread([this] { server.run(); });
+    }
+
+    ~TestServer() {
+        server.stop();
+        runner.join();
+    }
+};
+}  // namespace
+
+// a server whose stream fails holds back the quorum of both servers but not
+// of one, and once it reconnects the extents it missed or did not
+// acknowledge are resent from the local file
+TEST(ReplicaSet, CatchesUpAfterFailedStream) {
+    const auto dir = std::filesystem::temp_directory_path() / "ReplicaSetTest";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    const uint64_t n_extents = 64;
+    Config config;
+    config.file = (dir / "img").string();
+    config.extent_size = BLOCK_SIZE;
+    config.size = n_extents * BLOCK_SIZE;
+    config.backup_servers = {"shm://" + (dir / "a").string(),
+                             "shm://" + (dir / "b").string()};
+
+    std::vector<std::array<uint8_t, BLOCK_SIZE>> image(n_extents);
+    std::mt19937 rng(1);
+    for (auto &extent : image) {
+        std::generate(extent.begin(), extent.end(), rng);
+    }
+    std::ofstream(config.file, std::ios::binary)
+        .write(reinterpret_cast<const char *>(image.data()), config.size);
+    EncryptionManager emgr("password");
+    auto encrypted = image;
+    std::vector<uint64_t> extent_nos(n_extents);
+    std::iota(extent_nos.begin(), extent_nos.end(), 0);
+    emgr.crypt_extents(encrypted, extent_nos);
+
+    TestServer a((dir / "a").string(), n_extents);
+    TestServer b((dir / "b").string(), n_extents);
+    b.fail_after = 5;
+    b.reconnect = false;
+    std::vector<std::unique_ptr<Transport>> stubs;
+    for (const auto &server : config.backup_servers) {
+        stubs.push_back(Transport::connect(server));
+    }
+    const auto replica_set = ReplicaSet::create(stubs, config, emgr, nullptr);
+    ASSERT_NE(replica_set, nullptr);
+    auto &replicas = *replica_set;
+    StopFlag stop(false);
+    replicas.start(stop);
+
+    const uint64_t n = 20;
+    for (uint64_t i = 0; i < n; i++) {
+        replicas.send({.extent_nos = {i}, .data = encrypted[i].data()});
+    }
+    const auto last = replicas.last_seq();
+    ASSERT_EQ(last, n);
+    ASSERT_TRUE(replicas.wait_quorum(last, 1, std::chrono::seconds(5)));
+    ASSERT_FALSE(
+        replicas.wait_quorum(last, 2, std::chrono::milliseconds(500)));
+    ASSERT_EQ(replicas.acked_seq(1), last);
+    ASSERT_LE(replicas.acked_seq(2), 4);
+
+    b.reconnect = true;
+    ASSERT_TRUE(replicas.wait_quorum(last, 2, std::chrono::seconds(10)));
+    stop = true;
+    replicas.join();
+
+    ASSERT_EQ(a.streams, 1);
+    ASSERT_EQ(b.streams, 2);
+    for (uint64_t i = 0; i < n_extents; i++) {
+        const std::string expected(
+            reinterpret_cast<const char *>(encrypted[i].data()), BLOCK_SIZE);
+        ASSERT_EQ(a.extents[i], i < n ? expected : "");
+        ASSERT_EQ(b.extents[i], i < n ? expected : "");
+    }
+
+    // no img file to catch up from
+    auto missing = config;
+    missing.file = (dir / "missing").string();
+    ASSERT_EQ(ReplicaSet::create(stubs, missing, emgr, nullptr), nullptr);
+    std::filesystem::remove_all(dir);
+}
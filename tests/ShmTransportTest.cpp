@@ -0,0 +1,79 @@
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <string>
+#include <thread>
+
+#include "../src/ShmTransport.h"
+
+// acks every write by seq while the client keeps writing, with extents
+// large enough for the rings to wrap around and fill up
+TEST(ShmTransport, ReplicatesThroughTheRings) {
+    const auto path =
+        (std::filesystem::temp_directory_path() / "ShmTransportTest.sock")
+            .string();
+    ShmServer server(path);
+    server.bidi_stream<WriteAck, WriteBlockRequest>(
+        ShmMethod::REPLICATE_BLOCKS, [](auto stream) {
+            WriteBlockRequest request;
+            while (stream->Read(&request)) {
+                if (request.data() !=
+                    std::string(request.data().size(),
+                                static_cast<char>(request.seq()))) {
+                    return grpc::Status(grpc::StatusCode::DATA_LOSS, "");
+                }
+                WriteAck ack;
+                ack.set_success(true);
+                ack.set_seq(request.seq());
+                stream->Write(ack);
+            }
+            return grpc::Status::OK;
+        });
+    server.unary<GetVolumeRequest, GetVolumeResponse>(
+        ShmMethod::GET_VOLUME, [](auto, auto response) {
+            response->set_success(true);
+            response->set_size(42);
+            return grpc::Status::OK;
+        });
+    std::thread runner([&server] { server.run(); });
+
+    const auto transport = Transport::connect("shm://" + path);
+    ASSERT_NE(transport, nullptr);
+    GetVolumeRequest volume_request;
+    GetVolumeResponse volume;
+    ASSERT_TRUE(transport->GetVolume(nullptr, volume_request, &volume).ok());
+    ASSERT_EQ(volume.size(), 42);
+    // not served
+    SetupRequest setup_request;
+    SetupResponse setup;
+    ASSERT_EQ(transport->Setup(nullptr, setup_request, &setup).error_code(),
+              grpc::StatusCode::UNIMPLEMENTED);
+
+    const auto stream = transport->ReplicateBlocks(nullptr);
+    const uint64_t n = 64;
+    uint64_t acked = 0;
+    std::thread acks([&] {
+        WriteAck ack;
+        while (stream->Read(&ack)) {
+            acked = ack.seq();
+        }
+    });
+    for (uint64_t seq = 1; seq <= n; seq++) {
+        WriteBlockRequest request;
+        request.set_seq(seq);
+        request.set_data(std::string(MAX_EXTENT_SIZE - seq * 7,
+                                     static_cast<char>(seq)));
+        ASSERT_TRUE(stream->Write(request));
+    }
+    ASSERT_TRUE(stream->WritesDone());
+    acks.join();
+    ASSERT_TRUE(stream->Finish().ok());
+    ASSERT_EQ(acked, n);
+
+    ASSERT_EQ(Transport::connect("shm://" + path + ".missing")
+                  ->GetVolume(nullptr, volume_request, &volume)
+                  .error_code(),
+              grpc::StatusCode::UNAVAILABLE);
+    server.stop();
+    runner.join();
+}
@@ -0,0 +1,88 @@
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "../src/BackupImage.h"
+#include "../src/SnapshotStore.h"
+
+// the first write after a snapshot preserves the old extent, snapshots read
+// through to the image otherwise, and all of it survives a reopen. Retention
+// frees the slots of deleted snapshots for new copies. The epoch a snapshot
+// was taken at survives the reopen and the rewrite of the journal
+TEST(SnapshotStore, PreservesAndReplays) {
+    const auto dir =
+        std::filesystem::temp_directory_path() / "SnapshotStoreTest";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    const auto path = (dir / "img").string();
+    const uint64_t extent_size = 4096;
+    std::vector<char> buf(extent_size);
+    FlatImage image(path);
+    ASSERT_TRUE(image.setup(4 * extent_size, extent_size));
+    auto write = [&](SnapshotStore &store, uint64_t extent_no, char value) {
+        std::fill(buf.begin(), buf.end(), value);
+        const auto guard = store.write_guard();
+        return store.preserve(image, extent_no) &&
+               image.write(extent_no, buf.data());
+    };
+    auto read = [&](const SnapshotStore &store, const std::string &name,
+                    uint64_t extent_no) {
+        std::fill(buf.begin(), buf.end(), 0);
+        return store.read(image, name, extent_no, buf.data()) ? buf[0] : -1;
+    };
+    const auto slots = [&] {
+        return std::filesystem::file_size(path + ".snapshots") / extent_size;
+    };
+
+    {
+        SnapshotStore store(path);
+        store.set_extent_size(extent_size);
+        ASSERT_TRUE(write(store, 0, 'a'));
+        ASSERT_TRUE(write(store, 1, 'b'));
+        ASSERT_EQ(slots(), 0);
+
+        ASSERT_TRUE(store.create("s1"));
+        ASSERT_FALSE(store.create("s1"));
+        ASSERT_TRUE(write(store, 0, 'c'));
+        ASSERT_TRUE(write(store, 0, 'd'));
+        ASSERT_EQ(slots(), 1);
+        ASSERT_TRUE(store.create("s2", 7));
+        ASSERT_TRUE(write(store, 0, 'e'));
+        ASSERT_EQ(read(store, "s1", 0), 'a');
+        ASSERT_EQ(read(store, "s1", 1), 'b');
+        ASSERT_EQ(read(store, "s2", 0), 'd');
+        ASSERT_EQ(read(store, "s3", 0), -1);
+        uint64_t epoch = 1;
+        ASSERT_TRUE(store.read(image, "s1", 0, buf.data(), &epoch));
+        ASSERT_EQ(epoch, 0);
+    }
+
+    {
+        SnapshotStore store(path);
+        store.set_extent_size(extent_size);
+        ASSERT_EQ(store.list().size(), 2);
+        ASSERT_EQ(read(store, "s1", 0), 'a');
+        ASSERT_EQ(read(store, "s2", 0), 'd');
+
+        ASSERT_EQ(store.enforce_retention(1), 1);
+        ASSERT_EQ(read(store, "s1", 0), -1);
+        ASSERT_EQ(read(store, "s2", 0), 'd');
+        // the slot s1 held is reused
+        ASSERT_TRUE(store.create("s3"));
+        ASSERT_TRUE(write(store, 1, 'f'));
+        ASSERT_EQ(slots(), 2);
+        ASSERT_EQ(read(store, "s2", 1), 'b');
+        ASSERT_EQ(read(store, "s3", 1), 'b');
+    }
+
+    SnapshotStore store(path);
+    store.set_extent_size(extent_size);
+    ASSERT_EQ(store.list().size(), 2);
+    ASSERT_EQ(store.list()[0].epoch, 7);
+    ASSERT_EQ(read(store, "s2", 0), 'd');
+    ASSERT_EQ(read(store, "s3", 1), 'b');
+    ASSERT_EQ(read(store, "s3", 0), 'e');
+    std::filesystem::remove_all(dir);
+}
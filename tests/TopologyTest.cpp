@@ -0,0 +1,36 @@
+#include <gtest/gtest.h>
+
+#include <sched.h>
+
+#include <thread>
+
+#include "../src/Topology.h"
+
+TEST(Topology, ParsesCpuLists) {
+    using Topology::parse_cpus;
+    ASSERT_EQ(parse_cpus("0-3,8"), (std::vector<int>{0, 1, 2, 3, 8}));
+    ASSERT_EQ(parse_cpus("5"), (std::vector<int>{5}));
+    ASSERT_EQ(parse_cpus("2-2,0"), (std::vector<int>{2, 0}));
+    ASSERT_EQ(parse_cpus(std::to_string(CPU_SETSIZE - 1)),
+              (std::vector<int>{CPU_SETSIZE - 1}));
+
+    for (const auto *list : {"", "3-", "-3", "1,,2", "1,", ",1", "5-2", "1-2-3",
+                             "1 2", "a", "0-x", "99999999999"}) {
+        ASSERT_EQ(parse_cpus(list), std::nullopt) << list;
+    }
+    ASSERT_EQ(parse_cpus(std::to_string(CPU_SETSIZE)), std::nullopt);
+    ASSERT_EQ(parse_cpus("0-" + std::to_string(CPU_SETSIZE)), std::nullopt);
+}
+
+// a pinned thread only runs on its cpus, an empty list leaves it alone
+TEST(Topology, Pins) {
+    const auto cpus = Topology::allowed_cpus();
+    ASSERT_FALSE(cpus.empty());
+    std::thread([&] {
+        ASSERT_TRUE(Topology::pin({}));
+        ASSERT_EQ(Topology::allowed_cpus(), cpus);
+        ASSERT_TRUE(Topology::pin({cpus.back()}));
+        ASSERT_EQ(Topology::allowed_cpus(), std::vector<int>{cpus.back()});
+    }).join();
+    ASSERT_EQ(Topology::allowed_cpus(), cpus);
+}
@@ -0,0 +1,48 @@
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <vector>
+
+#include "../src/UringFile.h"
+
+// more operations than the ring holds, vectored reads see the writes of an
+// earlier submission
+TEST(UringFile, WritesAndReadsBatches) {
+    const auto path =
+        (std::filesystem::temp_directory_path() / "UringFileTest").string();
+    const int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+    ASSERT_GE(fd, 0);
+    const size_t block = 4096;
+    const size_t n_blocks = 40;
+    std::vector<char> data(block * n_blocks);
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = static_cast<char>(i * 31 / block + i);
+    }
+
+    {
+        UringFile io(fd, 8);
+        for (size_t i = 0; i < n_blocks; i++) {
+            io.write(&data[i * block], block, i * block);
+        }
+        ASSERT_TRUE(io.submit());
+
+        std::vector<char> read(data.size());
+        std::vector<iovec> iovs(n_blocks);
+        for (size_t i = 0; i < n_blocks; i++) {
+            iovs[i] = {&read[i * block], block};
+        }
+        const auto first = io.readv(iovs.data(), n_blocks / 2, 0);
+        const auto second = io.readv(&iovs[n_blocks / 2], n_blocks / 2,
+                                     n_blocks / 2 * block);
+        const auto past_end = io.read(read.data(), block, data.size());
+        ASSERT_TRUE(io.submit());
+        EXPECT_EQ(io.result(first), data.size() / 2);
+        EXPECT_EQ(io.result(second), data.size() / 2);
+        EXPECT_EQ(io.result(past_end), 0);
+        EXPECT_EQ(read, data);
+    }
+    close(fd);
+    std::filesystem::remove(path);
+}